@@ -0,0 +1,1349 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ds_str.h"
+
+#include "rest_test_arena.h"
+#include "rest_test_token.h"
+#include "rest_test_symt.h"
+#include "rest_test.h"
+#include "rest_test_bundle.h"
+#include "rest_test_parse.h"
+#include "rest_test_state.h"
+#include "rest_test_journal.h"
+#include "rest_test_shell.h"
+#include "rest_test_http.h"
+
+/* *****************************************************************************
+ * Benchmarks for the parser. Run with no arguments to run all of them, or with
+ * the names of the benchmarks to run.
+ */
+
+#define CLEANUP(...) \
+do {\
+   ERRORF(__VA_ARGS__);\
+   goto cleanup;\
+} while (0)
+
+
+/* *****************************************************************************
+ * Allocation counting. On glibc the allocator can be replaced by the program;
+ * the replacements count calls and forward to the glibc implementation. The
+ * sanitizers bring their own allocator, so nothing is counted under them. The
+ * parser may allocate from several threads, so the count is updated atomically.
+ */
+static size_t nallocs;
+
+#if defined (__GLIBC__) && !defined (__SANITIZE_ADDRESS__)
+#define COUNT_ALLOCS    1
+#define COUNT()         __atomic_fetch_add (&nallocs, 1, __ATOMIC_RELAXED)
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+void *malloc (size_t size)
+{
+   COUNT ();
+   return __libc_malloc (size);
+}
+
+void *calloc (size_t nmemb, size_t size)
+{
+   COUNT ();
+   return __libc_calloc (nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+   COUNT ();
+   return __libc_realloc (ptr, size);
+}
+
+void free (void *ptr)
+{
+   __libc_free (ptr);
+}
+#else
+#define COUNT_ALLOCS    0
+#endif
+
+static double now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Writes a suite of `ntests` tests to a temporary file, returning the name of
+// the file.
+static char *suite_new (size_t ntests)
+{
+   bool error = true;
+   char *fname = ds_str_dup ("bench_XXXXXX");
+   FILE *outf = NULL;
+   int fd = -1;
+
+   if (!fname || (fd = mkstemp (fname)) < 0) {
+      CLEANUP ("Failed to create temporary file: %m\n");
+   }
+
+   if (!(outf = fdopen (fd, "w"))) {
+      CLEANUP ("Failed to open [%s]: %m\n", fname);
+   }
+   fd = -1;
+
+   fprintf (outf, ".global BASE_URI \"http://localhost:8080\"\n");
+   for (size_t i=0; i<ntests; i++) {
+      fprintf (outf,
+               "# Test number %zu\n"
+               ".test 'Test number %zu'\n"
+               ".uri BASE_URI\n"
+               ".method 'POST'\n"
+               ".http_version 'HTTP/1.1'\n"
+               ".header 'Content-Type' ': application/json'\n"
+               ".header 'Accept' ': */*'\n"
+               ".local ID '%zu'\n"
+               ".local NAME \"name-{{ID}}\"\n"
+               ".body \"{\n"
+               "   \\\"id\\\": {{ID}},\n"
+               "   \\\"name\\\": \\\"{{NAME}}\\\"\n"
+               "}\"\n"
+               "\n", i, i, i);
+   }
+
+   error = false;
+cleanup:
+   if (outf)
+      fclose (outf);
+   if (fd >= 0)
+      close (fd);
+   if (error) {
+      if (fname)
+         remove (fname);
+      free (fname);
+      fname = NULL;
+   }
+   return fname;
+}
+
+struct result_t {
+   double elapsed;
+   size_t nallocs;
+   size_t ntests;
+};
+
+static void result_print (const char *name, const struct result_t *r, size_t nruns)
+{
+   printf ("%-10s %8zu tests %10.3f ms/run", name, r->ntests,
+           r->elapsed * 1000.0 / (double)nruns);
+   if (COUNT_ALLOCS) {
+      printf (" %10zu allocs/run", r->nallocs / nruns);
+   }
+   printf ("\n");
+}
+
+// Parse the suite and delete the results, `nruns` times, using the heap.
+static bool run_heap (const char *fname, size_t nruns, struct result_t *r)
+{
+   memset (r, 0, sizeof *r);
+   for (size_t i=0; i<nruns; i++) {
+      rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 32);
+      size_t before = nallocs;
+      double start = now ();
+
+      rest_test_t **rts = rest_test_parse_file (global, fname);
+      if (!rts) {
+         ERRORF ("Failed to parse [%s]\n", fname);
+         rest_test_symt_del (&global);
+         return false;
+      }
+      size_t ntests = 0;
+      for (ntests=0; rts[ntests]; ntests++) {
+         rest_test_del (&rts[ntests]);
+      }
+      free (rts);
+
+      r->elapsed += now () - start;
+      r->nallocs += nallocs - before;
+      r->ntests = ntests;
+      rest_test_symt_del (&global);
+   }
+   return true;
+}
+
+// Parse the suite into an arena and delete the arena, `nruns` times.
+static bool run_arena (const char *fname, size_t nruns, struct result_t *r)
+{
+   memset (r, 0, sizeof *r);
+   for (size_t i=0; i<nruns; i++) {
+      rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 32);
+      size_t before = nallocs;
+      double start = now ();
+
+      rest_test_arena_t *arena = rest_test_arena_new (0);
+      rest_test_t **rts = rest_test_parse_file_arena (global, fname, arena);
+      if (!rts) {
+         ERRORF ("Failed to parse [%s]\n", fname);
+         rest_test_arena_del (&arena);
+         rest_test_symt_del (&global);
+         return false;
+      }
+      size_t ntests = 0;
+      while (rts[ntests])
+         ntests++;
+      rest_test_arena_del (&arena);
+
+      r->elapsed += now () - start;
+      r->nallocs += nallocs - before;
+      r->ntests = ntests;
+      rest_test_symt_del (&global);
+   }
+   return true;
+}
+
+// Parse-plus-teardown, comparing the heap allocator against a parse arena.
+static int bench_arena (void)
+{
+   int ret = 1;
+   static const size_t sizes[] = { 10, 100, 1000 };
+   static const size_t nruns = 20;
+
+   for (size_t i=0; i<sizeof sizes / sizeof sizes[0]; i++) {
+      struct result_t heap, arena;
+      char *fname = suite_new (sizes[i]);
+      if (!fname) {
+         CLEANUP ("Failed to create suite of %zu tests\n", sizes[i]);
+      }
+      bool ok = run_heap (fname, nruns, &heap) && run_arena (fname, nruns, &arena);
+      remove (fname);
+      free (fname);
+      if (!ok) {
+         CLEANUP ("Failed to run benchmark on suite of %zu tests\n", sizes[i]);
+      }
+      result_print ("heap", &heap, nruns);
+      result_print ("arena", &arena, nruns);
+   }
+
+   ret = 0;
+cleanup:
+   return ret;
+}
+
+// Tokenizes large quoted bodies and shell commands, reporting the throughput.
+static int bench_lexer (void)
+{
+   int ret = 1;
+   static const size_t nstrings = 64;
+   static const size_t line_length = 120;
+   static const size_t nlines = 1024;
+   static const size_t nruns = 10;
+   char *fname = ds_str_dup ("bench_XXXXXX");
+   char *cmd = NULL;
+   FILE *outf = NULL;
+   int fd = -1;
+   size_t nbytes = 0;
+
+   if (!fname || (fd = mkstemp (fname)) < 0) {
+      CLEANUP ("Failed to create temporary file: %m\n");
+   }
+
+   if (!(outf = fdopen (fd, "w"))) {
+      CLEANUP ("Failed to open [%s]: %m\n", fname);
+   }
+   fd = -1;
+
+   for (size_t i=0; i<nstrings; i++) {
+      char delim = i % 2 ? '`' : '"';
+      fprintf (outf, ".body %c", delim);
+      for (size_t j=0; j<nlines; j++) {
+         for (size_t k=0; k<line_length; k++) {
+            fputc ('a' + (int)((j + k) % 26), outf);
+         }
+         fputc ('\n', outf);
+      }
+      fprintf (outf, "%c\n", delim);
+   }
+   nbytes = (size_t)ftell (outf);
+   fclose (outf);
+   outf = NULL;
+
+   double elapsed = 0.0;
+   for (size_t i=0; i<nruns; i++) {
+      double start = now ();
+      rest_test_lexer_t *lexer = rest_test_lexer_new_file (fname);
+      if (!lexer) {
+         CLEANUP ("Failed to open [%s]\n", fname);
+      }
+      rest_test_token_t *token;
+      size_t ntokens = 0;
+      while ((token = rest_test_lexer_next (lexer))) {
+         rest_test_token_del (&token);
+         ntokens++;
+      }
+      rest_test_lexer_del (&lexer);
+      elapsed += now () - start;
+      if (ntokens != nstrings * 2) {
+         CLEANUP ("Expected %zu tokens, got %zu\n", nstrings * 2, ntokens);
+      }
+   }
+
+   printf ("lexer      %8zu bytes %10.3f ms/run %10.1f MB/s\n", nbytes,
+           elapsed * 1000.0 / (double)nruns,
+           (double)(nbytes * nruns) / elapsed / 1e6);
+
+   // The stream wrapper, over the file and over a pipe
+   cmd = ds_str_cat ("cat ", fname, NULL);
+   for (size_t pipe=0; cmd && pipe<2; pipe++) {
+      elapsed = 0.0;
+      for (size_t i=0; i<nruns; i++) {
+         double start = now ();
+         FILE *inf = pipe ? popen (cmd, "r") : fopen (fname, "r");
+         if (!inf) {
+            CLEANUP ("Failed to open [%s]: %m\n", fname);
+         }
+         rest_test_token_t *token;
+         size_t ntokens = 0, line_no = 1;
+         while ((token = rest_test_token_next (inf, fname, &line_no))) {
+            rest_test_token_del (&token);
+            ntokens++;
+         }
+         if (pipe) {
+            pclose (inf);
+         } else {
+            fclose (inf);
+         }
+         elapsed += now () - start;
+         if (ntokens != nstrings * 2) {
+            CLEANUP ("Expected %zu tokens, got %zu\n", nstrings * 2, ntokens);
+         }
+      }
+      printf ("%-10s %8zu bytes %10.3f ms/run %10.1f MB/s\n", pipe ? "pipe" : "stream",
+              nbytes, elapsed * 1000.0 / (double)nruns,
+              (double)(nbytes * nruns) / elapsed / 1e6);
+   }
+
+   // A body of escaped JSON, `{\"k\":1},` repeated, read by the incremental
+   // lexer from a pipe; each escaped quote is a delimiter that the lexer
+   // awaits, so the cost must stay linear in the size of the body
+   static const size_t nrepeats[] = { 2500, 5000, 10000, 20000 };
+   for (size_t i=0; cmd && i<sizeof nrepeats / sizeof nrepeats[0]; i++) {
+      if (!(outf = fopen (fname, "w"))) {
+         CLEANUP ("Failed to open [%s]: %m\n", fname);
+      }
+      fprintf (outf, ".body \"");
+      for (size_t j=0; j<nrepeats[i]; j++) {
+         fprintf (outf, "{\\\"k\\\":1},");
+      }
+      fprintf (outf, "\"\n");
+      nbytes = (size_t)ftell (outf);
+      fclose (outf);
+      outf = NULL;
+
+      elapsed = 0.0;
+      for (size_t j=0; j<nruns; j++) {
+         double start = now ();
+         FILE *inf = popen (cmd, "r");
+         rest_test_lexer_t *lexer = inf ? rest_test_lexer_new_incremental (inf, fname) : NULL;
+         if (!lexer) {
+            if (inf)
+               pclose (inf);
+            CLEANUP ("Failed to open [%s]: %m\n", fname);
+         }
+         rest_test_token_t *token;
+         size_t ntokens = 0;
+         while ((token = rest_test_lexer_next (lexer))) {
+            rest_test_token_del (&token);
+            ntokens++;
+         }
+         rest_test_lexer_del (&lexer);
+         pclose (inf);
+         elapsed += now () - start;
+         if (ntokens != 2) {
+            CLEANUP ("Expected 2 tokens, got %zu\n", ntokens);
+         }
+      }
+      printf ("escaped    %8zu bytes %10.3f ms/run %10.1f MB/s\n", nbytes,
+              elapsed * 1000.0 / (double)nruns,
+              (double)(nbytes * nruns) / elapsed / 1e6);
+   }
+
+   ret = 0;
+cleanup:
+   free (cmd);
+   if (outf)
+      fclose (outf);
+   if (fd >= 0)
+      close (fd);
+   if (fname)
+      remove (fname);
+   free (fname);
+   return ret;
+}
+
+// Parses many files one after another, then on increasing numbers of threads.
+static int bench_parallel (void)
+{
+   int ret = 1;
+   static const size_t nfiles = 32;
+   static const size_t ntests = 500;
+   static const size_t nthreads[] = { 1, 2, 4, 8 };
+   static const size_t nruns = 5;
+   char *fnames[32] = { NULL };
+
+   for (size_t i=0; i<nfiles; i++) {
+      if (!(fnames[i] = suite_new (ntests))) {
+         CLEANUP ("Failed to create suite of %zu tests\n", ntests);
+      }
+   }
+
+   for (size_t i=0; i<sizeof nthreads / sizeof nthreads[0]; i++) {
+      struct result_t r;
+      memset (&r, 0, sizeof r);
+      for (size_t j=0; j<nruns; j++) {
+         rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 32);
+         size_t before = nallocs;
+         double start = now ();
+         rest_test_t **rts = rest_test_parse_files (global, (const char *const *)fnames,
+                                                    nfiles, nthreads[i]);
+         r.elapsed += now () - start;
+         r.nallocs += nallocs - before;
+         if (!rts) {
+            rest_test_symt_del (&global);
+            CLEANUP ("Failed to parse %zu files\n", nfiles);
+         }
+         for (r.ntests=0; rts[r.ntests]; r.ntests++) {
+            rest_test_del (&rts[r.ntests]);
+         }
+         free (rts);
+         rest_test_symt_del (&global);
+      }
+      char name[16];
+      snprintf (name, sizeof name, "%zu threads", nthreads[i]);
+      result_print (name, &r, nruns);
+   }
+
+   ret = 0;
+cleanup:
+   for (size_t i=0; i<nfiles; i++) {
+      if (fnames[i])
+         remove (fnames[i]);
+      free (fnames[i]);
+   }
+   return ret;
+}
+
+// Looks up symbols defined at the root of a deep chain of scopes, from the leaf.
+// Every scope has some symbols of its own, and the leaf reads a few of the
+// globals over and over, as interpolating a suite does.
+static int bench_symt (void)
+{
+   int ret = 1;
+   static const size_t depth = 32;
+   static const size_t leaves[] = { 2, 8, 32 };
+   static const size_t nsymbols = 64;
+   static const size_t nlocals = 8;
+   static const size_t nused = 16;
+   static const size_t nlookups = 1000000;
+   rest_test_symt_t *scopes[32] = { NULL };
+   size_t ids[64];
+   char names[64][32];
+
+   for (size_t i=0; i<depth; i++) {
+      if (!(scopes[i] = rest_test_symt_new ("scope", i ? scopes[i - 1] : NULL, 32))) {
+         CLEANUP ("OOM allocating scope %zu\n", i);
+      }
+      for (size_t j=0; j<nlocals; j++) {
+         char local[48];
+         snprintf (local, sizeof local, "local_%zu_%zu", i, j);
+         rest_test_token_t *token = rest_test_token_new (token_STRING, local, "bench", j);
+         bool ok = token && rest_test_symt_add (scopes[i], local, token);
+         rest_test_token_del (&token);
+         if (!ok) {
+            CLEANUP ("Failed to add [%s]\n", local);
+         }
+      }
+   }
+   for (size_t i=0; i<nsymbols; i++) {
+      snprintf (names[i], sizeof names[i], "symbol_%zu", i);
+      rest_test_token_t *token = rest_test_token_new (token_STRING, names[i], "bench", i);
+      bool ok = token && rest_test_symt_add (scopes[0], names[i], token);
+      rest_test_token_del (&token);
+      if (!ok || (ids[i] = rest_test_symt_id (names[i])) == (size_t)-1) {
+         CLEANUP ("Failed to add [%s]\n", names[i]);
+      }
+   }
+
+   for (size_t l=0; l<sizeof leaves / sizeof leaves[0]; l++) {
+      rest_test_symt_t *leaf = scopes[leaves[l] - 1];
+      for (size_t mode=0; mode<2; mode++) {
+         size_t found = 0;
+         double start = now ();
+         for (size_t i=0; i<nlookups; i++) {
+            const rest_test_token_t *value = mode == 0
+               ? rest_test_symt_value (leaf, names[i % nused])
+               : rest_test_symt_value_id (leaf, ids[i % nused]);
+            found += value != NULL;
+         }
+         double elapsed = now () - start;
+         if (found != nlookups) {
+            CLEANUP ("Found %zu/%zu symbols\n", found, nlookups);
+         }
+         printf ("%-10s %8zu deep %10.1f ns/lookup\n", mode == 0 ? "by name" : "by id",
+                 leaves[l], elapsed * 1e9 / (double)nlookups);
+      }
+   }
+
+   ret = 0;
+cleanup:
+   for (size_t i=depth; i>0; i--) {
+      rest_test_symt_del (&scopes[i - 1]);
+   }
+   return ret;
+}
+
+// Creates and deletes test scopes holding a couple of locals, as expanding a
+// data-driven test does, then forks a populated scope and reads from the fork.
+static int bench_scopes (void)
+{
+   int ret = 1;
+   static const size_t nscopes = 200000;
+   static const size_t nglobals = 64;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 64);
+   rest_test_token_t *token = rest_test_token_new (token_STRING, "value", "bench", 1);
+
+   if (!global || !token) {
+      CLEANUP ("OOM allocating scopes\n");
+   }
+   for (size_t i=0; i<nglobals; i++) {
+      char name[32];
+      snprintf (name, sizeof name, "global_%zu", i);
+      if (!(rest_test_symt_add (global, name, token))) {
+         CLEANUP ("Failed to add [%s]\n", name);
+      }
+   }
+
+   for (size_t mode=0; mode<2; mode++) {
+      size_t before = nallocs;
+      double start = now ();
+      for (size_t i=0; i<nscopes; i++) {
+         rest_test_symt_t *scope = mode == 0
+            ? rest_test_symt_new ("test", global, 0)
+            : rest_test_symt_fork (global);
+         bool ok = scope && (mode == 0
+            ? rest_test_symt_add (scope, "ID", token) && rest_test_symt_add (scope, "NAME", token)
+            : rest_test_symt_value (scope, "global_1") && rest_test_symt_value (scope, "global_2"));
+         rest_test_symt_del (&scope);
+         if (!ok) {
+            CLEANUP ("Failed to populate scope %zu\n", i);
+         }
+      }
+      double elapsed = now () - start;
+      printf ("%-10s %8zu scopes %10.1f ns/scope", mode == 0 ? "new" : "fork",
+              nscopes, elapsed * 1e9 / (double)nscopes);
+      if (COUNT_ALLOCS) {
+         printf (" %6.2f allocs/scope", (double)(nallocs - before) / (double)nscopes);
+      }
+      printf ("\n");
+   }
+
+   ret = 0;
+cleanup:
+   rest_test_token_del (&token);
+   rest_test_symt_del (&global);
+   return ret;
+}
+
+// Startup: parsing the source compared to loading the compiled bundle.
+static int bench_bundle (void)
+{
+   int ret = 1;
+   static const size_t ntests = 1000;
+   static const size_t nruns = 20;
+   char *fname = suite_new (ntests);
+   char *bname = fname ? ds_str_cat (fname, ".rtb", NULL) : NULL;
+   struct result_t results[2];
+
+   if (!fname || !bname) {
+      CLEANUP ("Failed to create suite of %zu tests\n", ntests);
+   }
+   if (!(rest_test_parse_compile (fname, bname))) {
+      CLEANUP ("Failed to compile [%s]\n", fname);
+   }
+
+   for (size_t i=0; i<2; i++) {
+      memset (&results[i], 0, sizeof results[i]);
+      for (size_t j=0; j<nruns; j++) {
+         rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 32);
+         size_t before = nallocs;
+         double start = now ();
+         rest_test_t **rts = i == 0
+            ? rest_test_parse_file (global, fname)
+            : rest_test_parse_bundle (global, bname);
+         results[i].elapsed += now () - start;
+         results[i].nallocs += nallocs - before;
+         if (!rts) {
+            rest_test_symt_del (&global);
+            CLEANUP ("Failed to load [%s]\n", i == 0 ? fname : bname);
+         }
+         for (results[i].ntests=0; rts[results[i].ntests]; results[i].ntests++) {
+            rest_test_del (&rts[results[i].ntests]);
+         }
+         free (rts);
+         rest_test_symt_del (&global);
+      }
+   }
+
+   result_print ("source", &results[0], nruns);
+   result_print ("bundle", &results[1], nruns);
+
+   ret = 0;
+cleanup:
+   if (fname)
+      remove (fname);
+   if (bname)
+      remove (bname);
+   free (fname);
+   free (bname);
+   return ret;
+}
+
+// Restores `nvalues` globals from `.global` lines and from a saved state file.
+static void rts_del (rest_test_t ***rts)
+{
+   for (size_t i=0; *rts && (*rts)[i]; i++) {
+      rest_test_del (&(*rts)[i]);
+   }
+   free (*rts);
+   *rts = NULL;
+}
+
+static int bench_state (void)
+{
+   int ret = 1;
+   static const size_t nvalues = 1000;
+   static const size_t nruns = 50;
+   char *fname = ds_str_dup ("bench_XXXXXX");
+   char *sname = fname ? ds_str_cat (fname, ".rts", NULL) : NULL;
+   rest_test_symt_t *global = NULL;
+   FILE *outf = NULL;
+   struct result_t results[2];
+   int fd = -1;
+
+   if (!fname || !sname || (fd = mkstemp (fname)) < 0 || !(outf = fdopen (fd, "w"))) {
+      CLEANUP ("Failed to create temporary file: %m\n");
+   }
+   fd = -1;
+   for (size_t i=0; i<nvalues; i++) {
+      fprintf (outf, ".global SESSION_%zu \"%016zx-%016zx\"\n", i, i * 7919, i * 104729);
+   }
+   // A file without tests parses to NULL
+   fprintf (outf, ".test 'state'\n");
+   fclose (outf);
+   outf = NULL;
+
+   rest_test_t **rts = NULL;
+   if (!(global = rest_test_symt_new ("global", NULL, 32))
+         || !(rts = rest_test_parse_file (global, fname))
+         || !(rest_test_state_save (&global, 1, sname))) {
+      rts_del (&rts);
+      CLEANUP ("Failed to save the state of [%s]\n", fname);
+   }
+   rts_del (&rts);
+   rest_test_symt_del (&global);
+
+   for (size_t i=0; i<2; i++) {
+      memset (&results[i], 0, sizeof results[i]);
+      for (size_t j=0; j<nruns; j++) {
+         rest_test_symt_t **tables = NULL;
+         size_t before = nallocs;
+         double start = now ();
+         if (i == 0) {
+            global = rest_test_symt_new ("global", NULL, 32);
+            rts = global ? rest_test_parse_file (global, fname) : NULL;
+            rts_del (&rts);
+         } else {
+            tables = rest_test_state_load (sname);
+         }
+         results[i].elapsed += now () - start;
+         results[i].nallocs += nallocs - before;
+         results[i].ntests = rest_test_symt_count (i == 0 ? global : tables ? tables[0] : NULL);
+         rest_test_symt_del (&global);
+         rest_test_state_del (&tables);
+         if (results[i].ntests != nvalues) {
+            CLEANUP ("Restored %zu/%zu values\n", results[i].ntests, nvalues);
+         }
+      }
+   }
+
+   for (size_t i=0; i<2; i++) {
+      printf ("%-10s %8zu values %9.3f ms/run", i == 0 ? "text" : "state",
+              results[i].ntests, results[i].elapsed * 1000.0 / (double)nruns);
+      if (COUNT_ALLOCS) {
+         printf (" %10zu allocs/run", results[i].nallocs / nruns);
+      }
+      printf ("\n");
+   }
+
+   ret = 0;
+cleanup:
+   if (outf)
+      fclose (outf);
+   if (fd >= 0)
+      close (fd);
+   rest_test_symt_del (&global);
+   if (fname)
+      remove (fname);
+   if (sname)
+      remove (sname);
+   free (fname);
+   free (sname);
+   return ret;
+}
+
+// Makes `nwrites` durable writes to a table that already holds `nvalues`, by
+// journaling each and by saving the whole table after each.
+static int bench_journal (void)
+{
+   int ret = 1;
+   static const size_t nvalues = 2000;
+   static const size_t nwrites = 200;
+   char *fname = ds_str_dup ("bench_XXXXXX");
+   char *lname = fname ? ds_str_cat (fname, ".log", NULL) : NULL;
+   rest_test_symt_t *symt = rest_test_symt_new ("global", NULL, 32);
+   rest_test_journal_t *journal = NULL;
+   rest_test_token_t *token = rest_test_token_new (token_STRING, "0123456789abcdef",
+                                                   "bench", 1);
+   double elapsed[2] = { 0.0, 0.0 };
+   char name[32];
+   int fd = -1;
+
+   if (!fname || !lname || !symt || !token || (fd = mkstemp (fname)) < 0) {
+      CLEANUP ("Failed to create temporary file: %m\n");
+   }
+   close (fd);
+   remove (fname);
+
+   for (size_t i=0; i<nvalues; i++) {
+      snprintf (name, sizeof name, "SESSION_%zu", i);
+      if (!(rest_test_symt_add (symt, name, token))) {
+         CLEANUP ("Failed to add [%s]\n", name);
+      }
+   }
+   if (!(journal = rest_test_journal_open (fname, symt))) {
+      CLEANUP ("Failed to open journal [%s]\n", fname);
+   }
+
+   for (size_t i=0; i<2; i++) {
+      double start = now ();
+      for (size_t j=0; j<nwrites; j++) {
+         snprintf (name, sizeof name, "SESSION_%zu", j);
+         // The journal is synced on close, so the saves are too
+         if (!(rest_test_symt_add (symt, name, token))
+               || (i == 1 && !(rest_test_state_save (&symt, 1, fname)))) {
+            CLEANUP ("Failed to write [%s]\n", name);
+         }
+      }
+      if (i == 0) {
+         rest_test_journal_close (&journal);
+      }
+      elapsed[i] = now () - start;
+   }
+
+   printf ("%-10s %8zu writes %9.3f us/write\n", "journal", nwrites,
+           elapsed[0] * 1e6 / (double)nwrites);
+   printf ("%-10s %8zu writes %9.3f us/write\n", "snapshot", nwrites,
+           elapsed[1] * 1e6 / (double)nwrites);
+
+   ret = 0;
+cleanup:
+   rest_test_journal_close (&journal);
+   rest_test_symt_del (&symt);
+   rest_test_token_del (&token);
+   if (fname)
+      remove (fname);
+   if (lname)
+      remove (lname);
+   free (fname);
+   free (lname);
+   return ret;
+}
+
+// Resolves names that only the environment holds, through the snapshot and by
+// calling getenv() as each lookup misses the chain.
+static int bench_environment (void)
+{
+   int ret = 1;
+   static const size_t depth = 8;
+   static const size_t nvars = 100;
+   static const size_t nused = 16;
+   static const size_t nlookups = 1000000;
+   rest_test_symt_t *scopes[8] = { NULL };
+   char names[16][32];
+
+   // A typical environment holds a few dozen variables; the names looked up
+   // are added last, so getenv() scans past the rest
+   for (size_t i=0; i<nvars; i++) {
+      char name[32];
+      snprintf (name, sizeof name, "RT_BENCH_%zu", i);
+      if ((setenv (name, "value", 1)) != 0) {
+         CLEANUP ("Failed to set [%s]: %m\n", name);
+      }
+      if (i >= nvars - nused) {
+         strcpy (names[i - (nvars - nused)], name);
+      }
+   }
+   if (!(rest_test_symt_environment (NULL))) {
+      CLEANUP ("Failed to snapshot the environment\n");
+   }
+   for (size_t i=0; i<depth; i++) {
+      if (!(scopes[i] = rest_test_symt_new ("scope", i ? scopes[i - 1] : NULL, 8))) {
+         CLEANUP ("OOM allocating scope %zu\n", i);
+      }
+   }
+
+   for (size_t mode=0; mode<2; mode++) {
+      size_t found = 0;
+      double start = now ();
+      for (size_t i=0; i<nlookups; i++) {
+         found += mode == 0
+            ? rest_test_symt_value (scopes[depth - 1], names[i % nused]) != NULL
+            : getenv (names[i % nused]) != NULL;
+      }
+      double elapsed = now () - start;
+      if (found != nlookups) {
+         CLEANUP ("Found %zu/%zu variables\n", found, nlookups);
+      }
+      printf ("%-10s %8zu deep %10.1f ns/lookup\n", mode == 0 ? "snapshot" : "getenv",
+              depth, elapsed * 1e9 / (double)nlookups);
+   }
+
+   ret = 0;
+cleanup:
+   for (size_t i=depth; i>0; i--) {
+      rest_test_symt_del (&scopes[i - 1]);
+   }
+   return ret;
+}
+
+// Sets and evaluates a body of `nrefs` references to short values, as the
+// parser and runner do for each test.
+static int bench_interpolate (void)
+{
+   int ret = 1;
+   static const size_t nrefs[] = { 10, 100, 500 };
+   static const size_t nruns = 200;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 32);
+   rest_test_t *rt = global ? rest_test_new ("bench", "bench", 1, global) : NULL;
+   rest_test_token_t *body = NULL;
+   char *text = NULL;
+
+   if (!rt || !(text = malloc (nrefs[2] * 48))) {
+      CLEANUP ("OOM allocating interpolation bench\n");
+   }
+   for (size_t i=0; i<16; i++) {
+      char name[32];
+      snprintf (name, sizeof name, "FIELD_%zu", i);
+      rest_test_token_t *token = rest_test_token_new (token_STRING, name, "bench", i);
+      bool ok = token && rest_test_symt_add (global, name, token);
+      rest_test_token_del (&token);
+      if (!ok) {
+         CLEANUP ("Failed to add [%s]\n", name);
+      }
+   }
+
+   for (size_t n=0; n<sizeof nrefs / sizeof nrefs[0]; n++) {
+      char *end = text;
+      *end = 0;
+      for (size_t i=0; i<nrefs[n]; i++) {
+         end += sprintf (end, "\"key_%zu\": \"{{FIELD_%zu}}\",\n", i, i % 16);
+      }
+      if (!(body = rest_test_token_new (token_STRING, text, "bench", 1))) {
+         CLEANUP ("OOM allocating body\n");
+      }
+
+      size_t before = nallocs;
+      double start = now ();
+      for (size_t i=0; i<nruns; i++) {
+         if (!(rest_test_req_set_body (rt, body)) || !(rest_test_eval_req (rt, NULL))) {
+            CLEANUP ("Failed to evaluate body of %zu references\n", nrefs[n]);
+         }
+      }
+      double elapsed = now () - start;
+      printf ("%-10s %8zu refs %10.1f us/body", "body", nrefs[n],
+              elapsed * 1e6 / (double)nruns);
+      if (COUNT_ALLOCS) {
+         printf (" %10zu allocs/body", (nallocs - before) / nruns);
+      }
+      printf ("\n");
+      rest_test_token_del (&body);
+   }
+
+   ret = 0;
+cleanup:
+   rest_test_token_del (&body);
+   free (text);
+   rest_test_del (&rt);
+   rest_test_symt_del (&global);
+   return ret;
+}
+
+// Evaluates a body of references to constants repeatedly, as a test that is
+// run many times would be, with and without folding the constants first.
+static int bench_fold (void)
+{
+   int ret = 1;
+   static const size_t nrefs = 100;
+   static const size_t nruns = 2000;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 32);
+   rest_test_t *rt = global ? rest_test_new ("bench", "bench", 1, global) : NULL;
+   rest_test_token_t *body = NULL;
+   char *text = NULL;
+
+   if (!rt || !(text = malloc (nrefs * 48))) {
+      CLEANUP ("OOM allocating folding bench\n");
+   }
+   for (size_t i=0; i<16; i++) {
+      char name[32];
+      snprintf (name, sizeof name, "FIELD_%zu", i);
+      rest_test_token_t *token = rest_test_token_new (token_STRING, name, "bench", i);
+      bool ok = token && rest_test_symt_add (global, name, token);
+      rest_test_token_del (&token);
+      if (!ok) {
+         CLEANUP ("Failed to add [%s]\n", name);
+      }
+   }
+   char *end = text;
+   for (size_t i=0; i<nrefs; i++) {
+      end += sprintf (end, "\"key_%zu\": \"{{FIELD_%zu}}\",\n", i, i % 16);
+   }
+   if (!(body = rest_test_token_new (token_STRING, text, "bench", 1))) {
+      CLEANUP ("OOM allocating body\n");
+   }
+
+   for (size_t fold=0; fold<2; fold++) {
+      if (!(rest_test_req_set_body (rt, body)) || (fold && !(rest_test_fold (rt)))) {
+         CLEANUP ("Failed to set body\n");
+      }
+      size_t before = nallocs;
+      double start = now ();
+      for (size_t i=0; i<nruns; i++) {
+         if (!(rest_test_eval_req (rt, NULL))) {
+            CLEANUP ("Failed to evaluate body\n");
+         }
+      }
+      double elapsed = now () - start;
+      printf ("%-10s %8zu refs %10.3f us/eval", fold ? "folded" : "eval", nrefs,
+              elapsed * 1e6 / (double)nruns);
+      if (COUNT_ALLOCS) {
+         printf (" %10zu allocs/eval", (nallocs - before) / nruns);
+      }
+      printf ("\n");
+   }
+
+   ret = 0;
+cleanup:
+   rest_test_token_del (&body);
+   free (text);
+   rest_test_del (&rt);
+   rest_test_symt_del (&global);
+   return ret;
+}
+
+// Runs many small commands and a few with large output, and then evaluates a
+// shell symbol referenced by many tests under each caching policy.
+static int bench_shell (void)
+{
+   int ret = 1;
+   static const size_t nsmall = 500;
+   static const size_t nlarge = 10;
+   static const size_t ntests = 200;
+   static const char *const policies[] = { "always", "test", "run" };
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_t *rt = global ? rest_test_new ("bench", "bench", 1, global) : NULL;
+   rest_test_token_t *token = NULL;
+   char *output = NULL;
+
+   if (!rt) {
+      CLEANUP ("OOM allocating shell bench\n");
+   }
+
+   // A builtin, and a command that the shell has to start
+   static const char *const small[] = { "echo 1700000000", "date +%s" };
+   double start = 0;
+   for (size_t persistent=0; persistent<2; persistent++) {
+      rest_test_shell_set_persistent (persistent);
+      for (size_t c=0; c<sizeof small / sizeof small[0]; c++) {
+         start = now ();
+         for (size_t i=0; i<nsmall; i++) {
+            if (!(rest_test_shell_run (small[c], &output, NULL))) {
+               CLEANUP ("Failed to run small command\n");
+            }
+            free (output);
+         }
+         printf ("%-10s %8zu cmds %10.1f us/cmd [%s]\n",
+                 persistent ? "persistent" : "spawn", nsmall,
+                 (now () - start) * 1e6 / (double)nsmall, small[c]);
+      }
+
+      start = now ();
+      for (size_t i=0; i<nlarge; i++) {
+         if (!(rest_test_shell_run ("head -c 1048576 /dev/zero", &output, NULL))) {
+            CLEANUP ("Failed to run large command\n");
+         }
+         free (output);
+      }
+      printf ("%-10s %8zu cmds %10.1f us/cmd (1 MiB)\n",
+              persistent ? "persistent" : "spawn", nlarge,
+              (now () - start) * 1e6 / (double)nlarge);
+      output = NULL;
+   }
+   rest_test_shell_stop ();
+   rest_test_shell_set_persistent (false);
+
+   // Two references in each test
+   bool ok = (token = rest_test_token_new (token_SHELLCMD, "echo token", "bench", 1))
+          && rest_test_symt_add (global, "TOKEN", token);
+   rest_test_token_del (&token);
+   if (!ok || !(token = rest_test_token_new (token_STRING, "{{TOKEN}}:{{TOKEN}}", "bench", 1))
+         || !(rest_test_req_set_body (rt, token))) {
+      CLEANUP ("Failed to set up shell symbol\n");
+   }
+   for (size_t p=0; p<sizeof policies / sizeof policies[0]; p++) {
+      rest_test_shell_clear ();
+      rest_test_shell_set_policy (policies[p]);
+      start = now ();
+      for (size_t i=0; i<ntests; i++) {
+         if (!(rest_test_eval_req (rt, NULL))) {
+            CLEANUP ("Failed to evaluate shell symbol\n");
+         }
+      }
+      printf ("%-10s %8zu tests %9.1f us/test %6zu run\n", policies[p], ntests,
+              (now () - start) * 1e6 / (double)ntests, rest_test_shell_misses ());
+   }
+
+   ret = 0;
+cleanup:
+   rest_test_shell_set_policy ("always");
+   rest_test_shell_clear ();
+   rest_test_token_del (&token);
+   rest_test_del (&rt);
+   rest_test_symt_del (&global);
+   return ret;
+}
+
+// Evaluates tests that each wait on a slow command, with and without starting
+// the commands of the next few tests while the current one is evaluated
+static int bench_prefetch (void)
+{
+   int ret = 1;
+   static const size_t ntests = 40;
+   static const size_t windows[] = { 0, 1, 4, 8 };
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_t **rts = calloc (ntests, sizeof *rts);
+   rest_test_token_t *token = NULL;
+
+   bool ok = global && rts
+          && (token = rest_test_token_new (token_SHELLCMD, "sleep 0.02; echo {{ID}}",
+                                           "bench", 1))
+          && rest_test_symt_add (global, "SLOW", token)
+          && rest_test_prefetch_symbol ("SLOW");
+   rest_test_token_del (&token);
+   for (size_t i=0; ok && i<ntests; i++) {
+      char id[24];
+      snprintf (id, sizeof id, "%zu", i);
+      ok = (rts[i] = rest_test_new ("bench", "bench", 1, global))
+        && (token = rest_test_token_new (token_STRING, id, "bench", 1))
+        && rest_test_symt_add (rest_test_symt (rts[i]), "ID", token);
+      rest_test_token_del (&token);
+      ok = ok && (token = rest_test_token_new (token_STRING, "id={{SLOW}}", "bench", 1))
+              && rest_test_req_set_body (rts[i], token);
+      rest_test_token_del (&token);
+   }
+   if (!ok) {
+      CLEANUP ("Failed to set up prefetch bench\n");
+   }
+
+   for (size_t w=0; w<sizeof windows / sizeof windows[0]; w++) {
+      rest_test_shell_clear ();
+      double start = now ();
+      size_t next = 0;
+      for (size_t i=0; i<ntests; i++) {
+         // The current test and the `window` after it have been started
+         while (windows[w] && next < ntests && next <= i + windows[w]) {
+            rest_test_prefetch (rts[next++]);
+         }
+         if (!(rest_test_eval_req (rts[i], NULL))) {
+            CLEANUP ("Failed to evaluate test %zu\n", i);
+         }
+      }
+      printf ("window %2zu %8zu tests %9.1f us/test %6zu prefetched\n", windows[w], ntests,
+              (now () - start) * 1e6 / (double)ntests, rest_test_shell_prefetched ());
+   }
+
+   ret = 0;
+cleanup:
+   rest_test_shell_clear ();
+   for (size_t i=0; rts && i<ntests; i++) {
+      rest_test_del (&rts[i]);
+   }
+   free (rts);
+   rest_test_symt_del (&global);
+   return ret;
+}
+
+// Answers every request on a connection with a short response, until the
+// client closes it. A request for /slow is answered after 10ms.
+static void *echo_conn (void *ptr)
+{
+   static const char rsp[] = "HTTP/1.1 200 OK\r\ncontent-length: 2\r\n\r\nok";
+   int fd = (int)(intptr_t)ptr;
+   char buffer[4096];
+   size_t len = 0;
+   ssize_t n;
+   while ((n = recv (fd, &buffer[len], sizeof buffer - len - 1, 0)) > 0) {
+      len += (size_t)n;
+      buffer[len] = 0;
+      char *end;
+      while ((end = strstr (buffer, "\r\n\r\n"))) {
+         if ((strncmp (buffer, "GET /slow ", 10)) == 0)
+            nanosleep (&(struct timespec) { 0, 10000000 }, NULL);
+         if ((send (fd, rsp, sizeof rsp - 1, MSG_NOSIGNAL)) < 0)
+            break;
+         len -= (size_t)(end + 4 - buffer);
+         memmove (buffer, end + 4, len + 1);
+      }
+   }
+   close (fd);
+   return NULL;
+}
+
+static void *echo_server (void *ptr)
+{
+   int listener = *(int *)ptr, fd;
+   while ((fd = accept (listener, NULL, NULL)) >= 0) {
+      pthread_t thread;
+      if ((pthread_create (&thread, NULL, echo_conn, (void *)(intptr_t)fd)) != 0) {
+         close (fd);
+         continue;
+      }
+      pthread_detach (thread);
+   }
+   return NULL;
+}
+
+// Sends sequential requests to a loopback server, opening a connection for
+// each and then reusing one, and then runs slow requests concurrently
+static int bench_http (void)
+{
+   int ret = 1;
+   static const size_t nrequests = 2000;
+   static const size_t nslow = 400;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_t *rt = global ? rest_test_new ("bench", "bench", 1, global) : NULL;
+   rest_test_http_t *http = NULL;
+   rest_test_token_t *token = NULL;
+   rest_test_t **rts = NULL;
+   struct sockaddr_in addr;
+   socklen_t addrlen = sizeof addr;
+   pthread_t server;
+   bool started = false;
+   char uri[64];
+
+   memset (&addr, 0, sizeof addr);
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+   int listener = socket (AF_INET, SOCK_STREAM, 0);
+   if (listener < 0 || (bind (listener, (struct sockaddr *)&addr, sizeof addr)) != 0
+         || (listen (listener, 256)) != 0
+         || (getsockname (listener, (struct sockaddr *)&addr, &addrlen)) != 0
+         || !(started = (pthread_create (&server, NULL, echo_server, &listener)) == 0)) {
+      CLEANUP ("Failed to start loopback server\n");
+   }
+
+   snprintf (uri, sizeof uri, "http://127.0.0.1:%u/bench", ntohs (addr.sin_port));
+   if (!rt || !(token = rest_test_token_new (token_STRING, uri, "bench", 1))
+         || !(rest_test_req_set_uri (rt, token)) || !(rest_test_eval_req (rt, NULL))) {
+      CLEANUP ("Failed to set up HTTP bench\n");
+   }
+
+   static const size_t pools[] = { 0, 8 };
+   for (size_t p=0; p<sizeof pools / sizeof pools[0]; p++) {
+      if (!(http = rest_test_http_new ()))
+         goto cleanup;
+      rest_test_http_set_pool (http, pools[p]);
+      double start = now ();
+      for (size_t i=0; i<nrequests; i++) {
+         if (!(rest_test_http_send (http, rt))) {
+            CLEANUP ("Failed to send request %zu\n", i);
+         }
+      }
+      printf ("%-10s %8zu requests %8.1f us/request %6zu connections\n",
+              pools[p] ? "keep-alive" : "close", nrequests,
+              (now () - start) * 1e6 / (double)nrequests, rest_test_http_connects (http));
+      rest_test_http_del (&http);
+   }
+
+   // Requests that each wait 10ms on the server, with more in flight at once
+   static const size_t counts[] = { 1, 10, 100 };
+   snprintf (uri, sizeof uri, "http://127.0.0.1:%u/slow", ntohs (addr.sin_port));
+   rest_test_token_del (&token);
+   if (!(rts = calloc (nslow, sizeof *rts))
+         || !(token = rest_test_token_new (token_STRING, uri, "bench", 1))) {
+      CLEANUP ("OOM allocating slow tests\n");
+   }
+   for (size_t i=0; i<nslow; i++) {
+      if (!(rts[i] = rest_test_new ("bench", "bench", 1, global))
+            || !(rest_test_req_set_uri (rts[i], token))) {
+         CLEANUP ("Failed to set up slow test %zu\n", i);
+      }
+   }
+   for (size_t c=0; c<sizeof counts / sizeof counts[0]; c++) {
+      if (!(http = rest_test_http_new ()))
+         goto cleanup;
+      double start = now ();
+      if ((rest_test_http_run (http, rts, nslow, counts[c], NULL, NULL)) != 0) {
+         CLEANUP ("Failed to run slow tests\n");
+      }
+      printf ("parallel %3zu %6zu requests %8.1f us/request %6zu connections\n", counts[c],
+              nslow, (now () - start) * 1e6 / (double)nslow, rest_test_http_connects (http));
+      rest_test_http_del (&http);
+   }
+
+   ret = 0;
+cleanup:
+   rest_test_http_del (&http);
+   if (listener >= 0) {
+      shutdown (listener, SHUT_RDWR);
+      if (started)
+         pthread_join (server, NULL);
+      close (listener);
+   }
+   rest_test_token_del (&token);
+   for (size_t i=0; rts && i<nslow; i++) {
+      rest_test_del (&rts[i]);
+   }
+   free (rts);
+   rest_test_del (&rt);
+   rest_test_symt_del (&global);
+   return ret;
+}
+
+// Evaluates a per-request timestamp, id and signature, computed by builtins
+// and by the shell commands they replace.
+static int bench_builtins (void)
+{
+   int ret = 1;
+   static const size_t nruns[] = { 2000, 100 };
+   static const char *const names[] = { "builtins", "shell" };
+   static const char *const bodies[] = {
+      "{{now()}} {{uuid()}} {{sha256(PAYLOAD)}}",
+      "{{NOW}} {{UUID}} {{SHA256}}",
+   };
+   static const struct {
+      const char *name;
+      const char *command;
+   } commands[] = {
+      { "NOW",     "date +%s" },
+      { "UUID",    "cat /proc/sys/kernel/random/uuid" },
+      { "SHA256",  "printf %s '{{PAYLOAD}}' | sha256sum | cut -c1-64" },
+   };
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_t *rt = global ? rest_test_new ("bench", "bench", 1, global) : NULL;
+   rest_test_token_t *token = NULL;
+
+   if (!rt) {
+      CLEANUP ("OOM allocating builtins bench\n");
+   }
+   bool ok = (token = rest_test_token_new (token_STRING, "{\"id\": 42, \"name\": \"bench\"}",
+                                           "bench", 1))
+          && rest_test_symt_add (global, "PAYLOAD", token);
+   rest_test_token_del (&token);
+   for (size_t i=0; ok && i<sizeof commands / sizeof commands[0]; i++) {
+      ok = (token = rest_test_token_new (token_SHELLCMD, commands[i].command, "bench", 1))
+        && rest_test_symt_add (global, commands[i].name, token);
+      rest_test_token_del (&token);
+   }
+   if (!ok) {
+      CLEANUP ("Failed to set up builtins bench\n");
+   }
+
+   for (size_t b=0; b<sizeof bodies / sizeof bodies[0]; b++) {
+      if (!(token = rest_test_token_new (token_STRING, bodies[b], "bench", 1))
+            || !(rest_test_req_set_body (rt, token))) {
+         CLEANUP ("Failed to set body\n");
+      }
+      rest_test_token_del (&token);
+
+      double start = now ();
+      for (size_t i=0; i<nruns[b]; i++) {
+         if (!(rest_test_eval_req (rt, NULL))) {
+            CLEANUP ("Failed to evaluate [%s]\n", bodies[b]);
+         }
+      }
+      printf ("%-10s %8zu evals %10.2f us/eval\n", names[b], nruns[b],
+              (now () - start) * 1e6 / (double)nruns[b]);
+   }
+
+   ret = 0;
+cleanup:
+   rest_test_token_del (&token);
+   rest_test_del (&rt);
+   rest_test_symt_del (&global);
+   return ret;
+}
+
+int main (int argc, char **argv)
+{
+   int ret = 0;
+
+   struct {
+      const char *name;
+      int (*fptr) (void);
+   } bench_funcs[] = {
+      { "arena",     bench_arena },
+      { "lexer",     bench_lexer },
+      { "bundle",    bench_bundle },
+      { "parallel",  bench_parallel },
+      { "symt",      bench_symt },
+      { "scopes",    bench_scopes },
+      { "state",     bench_state },
+      { "journal",   bench_journal },
+      { "environment", bench_environment },
+      { "interpolate", bench_interpolate },
+      { "fold",        bench_fold },
+      { "shell",       bench_shell },
+      { "builtins",    bench_builtins },
+      { "prefetch",    bench_prefetch },
+      { "http",        bench_http },
+   };
+
+   size_t nbench = 0;
+   for (size_t j=0; j<sizeof bench_funcs/sizeof bench_funcs[0]; j++) {
+      bool run = argc == 1;
+      for (int i=1; i<argc; i++) {
+         run = run || (strcmp (bench_funcs[j].name, argv[i])) == 0;
+      }
+      if (!run)
+         continue;
+      printf ("benchmark %s\n", bench_funcs[j].name);
+      ret += bench_funcs[j].fptr ();
+      nbench++;
+   }
+
+   printf ("Ran %zu benchmarks, with %i errors\n", nbench, ret);
+   return ret;
+}
@@ -1,11 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "ds_str.h"
+
+#include "rest_test_arena.h"
+#include "rest_test_token.h"
+#include "rest_test_symt.h"
+#include "rest_test.h"
+#include "rest_test_bundle.h"
+#include "rest_test_parse.h"
+#include "rest_test_cache.h"
+#include "rest_test_shell.h"
+#include "rest_test_http.h"
+
+#define CLEANUP(...) \
+do {\
+   ERRORF(__VA_ARGS__);\
+   goto cleanup;\
+} while (0)
+
+static void print_help (const char *name)
+{
+   printf ("Usage: %s [-c] [-j N] [-k] [-p] [-r] [-P N] [-s POLICY] FILE...\n"
+           "  -c     Compile each FILE into a test bundle. The bundle for FILE.rtest\n"
+           "         is written to FILE.rtb; other files have .rtb appended.\n"
+           "  -j N   Parse the files on N threads (default: one per CPU).\n"
+           "  -k     Load the files that are unchanged since they were last parsed\n"
+           "         from the cache in $XDG_CACHE_HOME/rest-test (or\n"
+           "         $HOME/.cache/rest-test), and cache the others.\n"
+           "  -p     Run shell commands in one long-lived shell per thread, rather\n"
+           "         than starting a shell for each.\n"
+           "  -r     Send the request of each test, in order, and print the status\n"
+           "         of its response.\n"
+           "  -P N   With -r, send up to N requests at once, except where a\n"
+           "         `.parallel` directive sets the count (default: 1).\n"
+           "  -s POLICY\n"
+           "         How often a shell command is run, rather than its earlier output\n"
+           "         reused: always (the default), run (once), test (once per test)\n"
+           "         or ttl=N (at most once every N seconds).\n"
+           "  -h     Print this message and exit.\n"
+           "Without -c or -r the files are parsed and the number of tests reported.\n",
+           name);
+}
+
+static void print_response (rest_test_t *rt, bool ok, void *param)
+{
+   (void)param;
+   if (ok) {
+      printf ("[%s:%zu] %s: %s %s\n", rest_test_get_fname (rt), rest_test_get_line_no (rt),
+              rest_test_get_name (rt), rest_test_rsp_status_code (rt), rest_test_rsp_reason (rt));
+   }
+}
 
-int main (void)
+// Returns the bundle name for the source file, which the caller must free
+static char *bundle_name (const char *source)
+{
+   static const char ext[] = ".rtest";
+   size_t slen = strlen (source);
+   size_t elen = sizeof ext - 1;
+
+   if (slen > elen && (strcmp (&source[slen - elen], ext)) == 0) {
+      char *ret = malloc (slen - elen + 5);
+      if (ret) {
+         memcpy (ret, source, slen - elen);
+         strcpy (&ret[slen - elen], ".rtb");
+      }
+      return ret;
+   }
+   return ds_str_cat (source, ".rtb", NULL);
+}
+
+int main (int argc, char **argv)
 {
    int ret = EXIT_FAILURE;
+   bool compile = false;
+   bool run = false;
+   bool cached = false;
+   size_t parallel = 1;
+   size_t nthreads = 0;
+   rest_test_symt_t *global = NULL;
+   rest_test_t **rts = NULL;
+   rest_test_http_t *http = NULL;
+   rest_test_cache_t *cache = NULL;
+   char *end;
+   int opt;
+
+   while ((opt = getopt (argc, argv, "chj:kprP:s:")) != -1) {
+      switch (opt) {
+         case 'c':   compile = true;                              break;
+         case 'j':   nthreads = (size_t)strtoul (optarg, &end, 10);
+                     if (*optarg == '-' || *end || nthreads == 0) {
+                        ERRORF ("Invalid thread count [%s]\n", optarg);
+                        return EXIT_FAILURE;
+                     }
+                     break;
+         case 'k':   cached = true;                               break;
+         case 'p':   rest_test_shell_set_persistent (true);       break;
+         case 'r':   run = true;                                  break;
+         case 'P':   parallel = (size_t)strtoul (optarg, &end, 10);
+                     if (*optarg == '-' || *end || parallel == 0) {
+                        ERRORF ("Invalid request count [%s]\n", optarg);
+                        return EXIT_FAILURE;
+                     }
+                     break;
+         case 's':   if (!(rest_test_shell_set_policy (optarg))) {
+                        ERRORF ("Invalid shell cache policy [%s]\n", optarg);
+                        return EXIT_FAILURE;
+                     }
+                     break;
+         case 'h':   print_help (argv[0]); return EXIT_SUCCESS;
+         default:    print_help (argv[0]); return EXIT_FAILURE;
+      }
+   }
 
-   ret = EXIT_SUCCESS;
+   size_t nerrors = 0;
+   for (int i=optind; compile && i<argc; i++) {
+      char *bundle = bundle_name (argv[i]);
+      if (!bundle || !(rest_test_parse_compile (argv[i], bundle))) {
+         ERRORF ("Failed to compile [%s]\n", argv[i]);
+         nerrors++;
+      }
+      free (bundle);
+   }
+
+   if (nerrors)
+      goto cleanup;
+
+   if (!compile && optind < argc) {
+      size_t nfiles = (size_t)(argc - optind);
+      if (!(global = rest_test_symt_new ("global", NULL, 32))) {
+         CLEANUP ("OOM creating global symbol table\n");
+      }
+      // Without a usable cache directory the files are still parsed
+      if (cached && !(cache = rest_test_cache_new (NULL))) {
+         ERRORF ("Parsing without the cache\n");
+      }
+      if (!(rts = rest_test_cache_parse_files (cache, global,
+                                               (const char *const *)&argv[optind],
+                                               nfiles, nthreads))) {
+         goto cleanup;
+      }
+      size_t ntests = 0;
+      for (; rts[ntests]; ntests++) {
+         if (!(rest_test_fold (rts[ntests])))
+            goto cleanup;
+      }
+      printf ("%zu tests in %zu files\n", ntests, nfiles);
+      if (cache) {
+         printf ("%zu files loaded from the cache, %zu parsed\n",
+                 rest_test_cache_hits (cache), rest_test_cache_misses (cache));
+      }
+
+      if (run && !(http = rest_test_http_new ()))
+         goto cleanup;
+      // Consecutive tests with the same count run together
+      for (size_t i=0, j=0; run && i<ntests; i=j) {
+         size_t count = rest_test_get_parallel (rts[i]);
+         while (j < ntests && rest_test_get_parallel (rts[j]) == count)
+            j++;
+         nerrors += rest_test_http_run (http, &rts[i], j - i, count ? count : parallel,
+                                        print_response, NULL);
+      }
+      if (run) {
+         printf ("%zu requests on %zu connections, %zu failed\n", ntests,
+                 rest_test_http_connects (http), nerrors);
+      }
+      if (rest_test_shell_policy () != rest_test_shell_ALWAYS) {
+         printf ("%zu shell commands cached, %zu run\n",
+                 rest_test_shell_hits (), rest_test_shell_misses ());
+      }
+   }
+
+   ret = nerrors ? EXIT_FAILURE : EXIT_SUCCESS;
+cleanup:
+   for (size_t i=0; rts && rts[i]; i++) {
+      rest_test_del (&rts[i]);
+   }
+   free (rts);
+   rest_test_http_del (&http);
+   rest_test_cache_del (&cache);
+   rest_test_symt_del (&global);
+   rest_test_shell_clear ();
+   rest_test_shell_stop ();
    return ret;
 }
-
@@ -4,15 +4,34 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "ds_str.h"
 
+#include "rest_test_arena.h"
 #include "rest_test_token.h"
 #include "rest_test_symt.h"
+#include "rest_test_intern.h"
 #include "rest_test.h"
+#include "rest_test_bundle.h"
 #include "rest_test_parse.h"
+#include "rest_test_cache.h"
+#include "rest_test_state.h"
+#include "rest_test_journal.h"
+#include "rest_test_shell.h"
+#include "rest_test_builtin.h"
+#include "rest_test_http.h"
 
 #define CLEANUP(...) \
 do {\
@@ -245,6 +264,2875 @@ cleanup:
    return ret;
 }
 
+int test_lexer (void)
+{
+   int errcount = 0;
+   static const char *input[] = {
+      "# A comment",
+      ".test 'single \\'quoted\\''",
+      ".body \"one \" \"two\\\" \"",
+      "  \" three\" ; `echo` `hi`",
+      ".value 0x1F 017 42 some_symbol",
+      NULL,
+   };
+   static const struct {
+      enum rest_test_token_type_t type;
+      const char *value;
+      size_t line_no;
+   } expected[] = {
+      { token_DIRECTIVE,   ".test",                2 },
+      { token_STRING,      "single 'quoted'",      2 },
+      { token_DIRECTIVE,   ".body",                3 },
+      { token_STRING,      "one two\"  three",    4 },
+      { token_ASSERT_END,  ";",                    4 },
+      { token_SHELLCMD,    "echohi",               5 },
+      { token_DIRECTIVE,   ".value",               5 },
+      { token_INTEGER,     "0x1F",                 5 },
+      { token_INTEGER,     "017",                  5 },
+      { token_INTEGER,     "42",                   5 },
+      { token_SYMBOL,      "some_symbol",          6 },
+   };
+   static const size_t nexpected = sizeof expected / sizeof expected[0];
+
+   char *fname = file_new (input);
+   rest_test_lexer_t *lexer = rest_test_lexer_new_file (fname);
+   FILE *inf = fname ? fopen (fname, "r") : NULL;
+   char *cmd = fname ? ds_str_cat ("cat ", fname, NULL) : NULL;
+   FILE *pipef = cmd ? popen (cmd, "r") : NULL;
+   if (!lexer || !inf || !pipef) {
+      ERRORF ("Failed to open [%s]\n", fname);
+      errcount++;
+      goto cleanup;
+   }
+
+   // The lexer, and the stream wrapper over both seekable and unseekable streams
+   // must all produce the same tokens.
+   size_t line_nos[2] = { 1, 1 };
+   for (size_t i=0; i<=nexpected; i++) {
+      rest_test_token_t *tokens[3] = {
+         rest_test_lexer_next (lexer),
+         rest_test_token_next (inf, fname, &line_nos[0]),
+         rest_test_token_next (pipef, fname, &line_nos[1]),
+      };
+      for (size_t j=0; j<3; j++) {
+         if (i == nexpected) {
+            if (tokens[j]) {
+               ERRORF ("[%zu] Expected EOF, got [%s]\n", j, rest_test_token_value (tokens[j]));
+               errcount++;
+            }
+            continue;
+         }
+         if (rest_test_token_type (tokens[j]) != expected[i].type
+               || !rest_test_token_value (tokens[j])
+               || strcmp (rest_test_token_value (tokens[j]), expected[i].value) != 0
+               || rest_test_token_line_no (tokens[j]) != expected[i].line_no) {
+            ERRORF ("[%zu:%zu] Expected [%s:%s:%zu], got [%s:%s:%zu]\n", i, j,
+                    rest_test_token_type_string (expected[i].type),
+                    expected[i].value, expected[i].line_no,
+                    rest_test_token_type_string (rest_test_token_type (tokens[j])),
+                    rest_test_token_value (tokens[j]),
+                    rest_test_token_line_no (tokens[j]));
+            errcount++;
+         }
+      }
+      for (size_t j=0; j<3; j++) {
+         rest_test_token_del (&tokens[j]);
+      }
+   }
+
+cleanup:
+   if (pipef)
+      pclose (pipef);
+   if (inf)
+      fclose (inf);
+   free (cmd);
+   rest_test_lexer_del (&lexer);
+   file_del (&fname);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+int test_lexer_runs (void)
+{
+   int errcount = 0;
+   // Strings long enough that the vectorised scan runs across several blocks,
+   // with stop bytes at assorted offsets within them.
+   char a[51], b[21], c[38], d[34], e[65], f[101], g[11];
+   memset (a, 'a', sizeof a - 1); a[sizeof a - 1] = 0;
+   memset (b, 'b', sizeof b - 1); b[sizeof b - 1] = 0;
+   memset (c, 'c', sizeof c - 1); c[sizeof c - 1] = 0;
+   memset (d, 'd', sizeof d - 1); d[sizeof d - 1] = 0;
+   memset (e, 'e', sizeof e - 1); e[sizeof e - 1] = 0;
+   memset (f, 'f', sizeof f - 1); f[sizeof f - 1] = 0;
+   memset (g, 'g', sizeof g - 1); g[sizeof g - 1] = 0;
+
+   char *line1 = ds_str_cat (".body \"", a, "'", b, "`", c, NULL);
+   char *line2 = ds_str_cat (d, "\\\"", e, "\"", NULL);
+   char *line3 = ds_str_cat (".shell `", f, "\\`", g, "`", NULL);
+   char *body = ds_str_cat (a, "'", b, "`", c, "\n", d, "\"", e, NULL);
+   char *shell = ds_str_cat (f, "`", g, NULL);
+   const char *input[] = { line1, line2, line3, ".end", NULL };
+   char *fname = NULL;
+   char *cmd = NULL;
+   FILE *inf = NULL;
+   FILE *pipef = NULL;
+   rest_test_lexer_t *lexer = NULL;
+
+   if (!line1 || !line2 || !line3 || !body || !shell) {
+      ERRORF ("OOM allocating input\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   const struct {
+      enum rest_test_token_type_t type;
+      const char *value;
+      size_t line_no;
+   } expected[] = {
+      { token_DIRECTIVE,   ".body",    1 },
+      { token_STRING,      body,       3 },
+      { token_DIRECTIVE,   ".shell",   3 },
+      { token_SHELLCMD,    shell,      4 },
+      { token_DIRECTIVE,   ".end",     4 },
+   };
+   const size_t nexpected = sizeof expected / sizeof expected[0];
+
+   fname = file_new (input);
+   lexer = fname ? rest_test_lexer_new_file (fname) : NULL;
+   inf = fname ? fopen (fname, "r") : NULL;
+   cmd = fname ? ds_str_cat ("cat ", fname, NULL) : NULL;
+   pipef = cmd ? popen (cmd, "r") : NULL;
+   if (!lexer || !inf || !pipef) {
+      ERRORF ("Failed to open [%s]\n", fname);
+      errcount++;
+      goto cleanup;
+   }
+
+   // The stream wrapper reads string contents up to each delimiter, escaped or
+   // not, whether or not the stream can seek
+   size_t line_nos[2] = { 1, 1 };
+   for (size_t i=0; i<=nexpected; i++) {
+      rest_test_token_t *tokens[3] = {
+         rest_test_lexer_next (lexer),
+         rest_test_token_next (inf, fname, &line_nos[0]),
+         rest_test_token_next (pipef, fname, &line_nos[1]),
+      };
+      for (size_t j=0; j<3; j++) {
+         if (i == nexpected) {
+            if (tokens[j]) {
+               ERRORF ("[%zu] Expected EOF, got [%s]\n", j, rest_test_token_value (tokens[j]));
+               errcount++;
+            }
+            continue;
+         }
+         if (rest_test_token_type (tokens[j]) != expected[i].type
+               || !rest_test_token_value (tokens[j])
+               || strcmp (rest_test_token_value (tokens[j]), expected[i].value) != 0
+               || rest_test_token_line_no (tokens[j]) != expected[i].line_no) {
+            ERRORF ("[%zu:%zu] Expected [%s:%s:%zu], got [%s:%s:%zu]\n", i, j,
+                    rest_test_token_type_string (expected[i].type),
+                    expected[i].value, expected[i].line_no,
+                    rest_test_token_type_string (rest_test_token_type (tokens[j])),
+                    rest_test_token_value (tokens[j]),
+                    rest_test_token_line_no (tokens[j]));
+            errcount++;
+         }
+      }
+      for (size_t j=0; j<3; j++) {
+         rest_test_token_del (&tokens[j]);
+      }
+   }
+
+cleanup:
+   if (pipef)
+      pclose (pipef);
+   if (inf)
+      fclose (inf);
+   free (cmd);
+   rest_test_lexer_del (&lexer);
+   file_del (&fname);
+   free (line1);
+   free (line2);
+   free (line3);
+   free (body);
+   free (shell);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+int test_token_slices (void)
+{
+   int errcount = 0;
+   static const char *input[] = {
+      ".body \"A body that is not copied\"",
+      NULL,
+   };
+   char *fname = file_new (input);
+   rest_test_lexer_t *lexer = rest_test_lexer_new_file (fname);
+   rest_test_token_t *directive = rest_test_lexer_next (lexer);
+   rest_test_token_t *body = rest_test_lexer_next (lexer);
+   rest_test_token_t *copy = rest_test_token_dup (body);
+
+   // Tokens outlive the lexer that they were sliced from
+   rest_test_lexer_del (&lexer);
+   if (!directive || !body || !copy) {
+      ERRORF ("Failed to read tokens from [%s]\n", fname);
+      errcount++;
+      goto cleanup;
+   }
+
+   size_t blen = 0, clen = 0;
+   const char *bslice = rest_test_token_slice (body, &blen);
+   const char *cslice = rest_test_token_slice (copy, &clen);
+   if (bslice != cslice || blen != clen || blen != strlen ("A body that is not copied")) {
+      ERRORF ("Duplicate token does not share the value [%p:%zu] [%p:%zu]\n",
+              bslice, blen, cslice, clen);
+      errcount++;
+   }
+
+   // Values that the lexer terminated in place are read where they are, by the
+   // token and by its duplicate, and the file itself is left as it was
+   if (rest_test_token_value (body) != bslice || rest_test_token_value (copy) != cslice) {
+      ERRORF ("Terminated value was copied [%p] [%p]\n",
+              (const void *)rest_test_token_value (body), (const void *)bslice);
+      errcount++;
+   }
+   char contents[64] = "";
+   FILE *inf = fopen (fname, "r");
+   if (!inf || !(fgets (contents, sizeof contents, inf))
+         || (strcmp (contents, ".body \"A body that is not copied\"\n")) != 0) {
+      ERRORF ("The lexed file was changed: [%s]\n", contents);
+      errcount++;
+   }
+   if (inf)
+      fclose (inf);
+
+   // Changing the copy must not change the original
+   if (!(rest_test_token_set_value (copy, "changed"))) {
+      ERRORF ("Failed to set value\n");
+      errcount++;
+   }
+   if ((strcmp (rest_test_token_value (body), "A body that is not copied")) != 0
+         || (strcmp (rest_test_token_value (copy), "changed")) != 0) {
+      ERRORF ("Unexpected values [%s] [%s]\n",
+              rest_test_token_value (body), rest_test_token_value (copy));
+      errcount++;
+   }
+
+cleanup:
+   rest_test_token_del (&directive);
+   rest_test_token_del (&body);
+   rest_test_token_del (&copy);
+   rest_test_lexer_del (&lexer);
+   file_del (&fname);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+int test_intern (void)
+{
+   int errcount = 0;
+   rest_test_intern_t *intern = rest_test_intern_new (4);
+   rest_test_token_t *t1 = rest_test_token_new (token_STRING, "one", "same-file", 1);
+   rest_test_token_t *t2 = rest_test_token_new (token_STRING, "two", "same-file", 2);
+   rest_test_t *rt = rest_test_new ("test", "same-file", 3, NULL);
+
+   if (!intern || !t1 || !t2 || !rt) {
+      ERRORF ("OOM allocating intern test objects\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Every object from the same source shares a single copy of the filename
+   if (rest_test_token_source (t1) != rest_test_token_source (t2)
+         || rest_test_token_source (t1) != rest_test_get_fname (rt)) {
+      ERRORF ("Source filename is not shared\n");
+      errcount++;
+   }
+
+   size_t id_a = rest_test_intern_id (intern, "a");
+   size_t id_b = rest_test_intern_id (intern, "b");
+   if (id_a == id_b || rest_test_intern_id (intern, "a") != id_a
+         || (strcmp (rest_test_intern_lookup (intern, id_b), "b")) != 0
+         || rest_test_intern_count (intern) != 2) {
+      ERRORF ("Unexpected interned ids [%zu] [%zu]\n", id_a, id_b);
+      errcount++;
+   }
+
+cleanup:
+   rest_test_del (&rt);
+   rest_test_token_del (&t1);
+   rest_test_token_del (&t2);
+   rest_test_intern_del (&intern);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+int test_arena (void)
+{
+   int errcount = 0;
+   static const char *input[] = {
+      ".test 'first'",
+      ".uri 'http://localhost/one'",
+      ".header 'Content-Type' ': text/plain'",
+      ".test 'second'",
+      ".uri 'http://localhost/two'",
+      ".local NAME 'value'",
+      NULL,
+   };
+   static const char *names[] = { "first", "second" };
+
+   char *fname = file_new (input);
+   rest_test_arena_t *arena = rest_test_arena_new (0);
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 2);
+   rest_test_t **rts = NULL;
+
+   if (!fname || !arena || !global) {
+      ERRORF ("OOM allocating arena test objects\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   if (!(rts = rest_test_parse_file_arena (global, fname, arena))) {
+      ERRORF ("Failed to parse [%s] into arena\n", fname);
+      errcount++;
+      goto cleanup;
+   }
+
+   size_t i;
+   for (i=0; rts[i] && i < sizeof names / sizeof names[0]; i++) {
+      if ((strcmp (rest_test_get_name (rts[i]), names[i])) != 0) {
+         ERRORF ("Expected test [%s], got [%s]\n", names[i], rest_test_get_name (rts[i]));
+         errcount++;
+      }
+   }
+   if (i != 2 || rts[i]) {
+      ERRORF ("Expected 2 tests, got at least %zu\n", i);
+      errcount++;
+   }
+
+   const char *ctype = rest_test_req_header (rts[0], "content-type");
+   if (!ctype || (strcmp (ctype, "text/plain")) != 0) {
+      ERRORF ("Unexpected header value [%s]\n", ctype);
+      errcount++;
+   }
+
+   if (rest_test_arena_nallocs (arena) == 0 || rest_test_arena_nchunks (arena) == 0) {
+      ERRORF ("Nothing was allocated from the arena\n");
+      errcount++;
+   }
+
+   // Deleting a test before the arena must be safe
+   rest_test_del (&rts[1]);
+
+cleanup:
+   rest_test_arena_del (&arena);
+   rest_test_symt_del (&global);
+   file_del (&fname);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+// Dumps the tests and both symbol tables into a single string
+static char *dump_suite (rest_test_t **rts, rest_test_symt_t *parent, rest_test_symt_t *global)
+{
+   char *ret = NULL;
+   size_t length = 0;
+   FILE *outf = open_memstream (&ret, &length);
+   if (!outf)
+      return NULL;
+
+   for (size_t i=0; rts && rts[i]; i++) {
+      rest_test_dump (rts[i], outf);
+   }
+   rest_test_symt_dump (parent, outf);
+   rest_test_symt_dump (global, outf);
+   fclose (outf);
+   return ret;
+}
+
+int test_bundle (void)
+{
+   int errcount = 0;
+   static const char *input[] = {
+      ".global BASE_URI \"http://localhost\"",
+      ".test 'first'",
+      ".uri BASE_URI",
+      ".method 'GET'",
+      ".header 'Accept' ': */*'",
+      ".body \"line one\n\" \"line two\"",
+      ".body ' and more'",
+      ".parent BASE_URI 'http://example.com'",
+      ".test 'second'",
+      ".local NAME `echo second`",
+      ".global BASE_URI 'http://overridden'",
+      NULL,
+   };
+   char *fname = file_new (input);
+   char *bname = fname ? ds_str_cat (fname, ".rtb", NULL) : NULL;
+   rest_test_symt_t *globals[2] = {
+      rest_test_symt_new ("global", NULL, 8),
+      rest_test_symt_new ("global", NULL, 8),
+   };
+   rest_test_symt_t *parents[2] = {
+      rest_test_symt_new ("parent", globals[0], 8),
+      rest_test_symt_new ("parent", globals[1], 8),
+   };
+   rest_test_t **rts[2] = { NULL, NULL };
+   char *dumps[2] = { NULL, NULL };
+
+   if (!fname || !bname || !globals[0] || !globals[1] || !parents[0] || !parents[1]) {
+      ERRORF ("OOM allocating bundle test objects\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   if (!(rest_test_parse_compile (fname, bname))) {
+      ERRORF ("Failed to compile [%s] to [%s]\n", fname, bname);
+      errcount++;
+      goto cleanup;
+   }
+
+   // Loading the bundle must produce exactly what parsing the source does
+   rts[0] = rest_test_parse_file (parents[0], fname);
+   rts[1] = rest_test_parse_bundle (parents[1], bname);
+   if (!rts[0] || !rts[1]) {
+      ERRORF ("Failed to load [%s]\n", rts[0] ? bname : fname);
+      errcount++;
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<2; i++) {
+      dumps[i] = dump_suite (rts[i], parents[i], globals[i]);
+   }
+   if (!dumps[0] || !dumps[1] || (strcmp (dumps[0], dumps[1])) != 0) {
+      ERRORF ("Bundle differs from source:\n%s\n---\n%s\n", dumps[0], dumps[1]);
+      errcount++;
+   }
+
+   // The writes happen in source order
+   const rest_test_token_t *uri = rest_test_symt_value (globals[1], "BASE_URI");
+   if (!uri || (strcmp (rest_test_token_value (uri), "http://overridden")) != 0
+         || rest_test_token_line_no (uri) != 12) {
+      ERRORF ("Unexpected global [%s:%zu]\n", rest_test_token_value (uri),
+              rest_test_token_line_no (uri));
+      errcount++;
+   }
+
+   // A file that is not a bundle is rejected
+   rest_test_t **bad = rest_test_parse_bundle (parents[1], fname);
+   if (bad) {
+      ERRORF ("Loaded source file [%s] as a bundle\n", fname);
+      errcount++;
+      for (size_t i=0; bad[i]; i++) {
+         rest_test_del (&bad[i]);
+      }
+      free (bad);
+   }
+
+   // So is one with a token type out of range. The records start at the
+   // offset after the magic, version, byte order and count; the type of the
+   // first parameter of the first record follows its op, count and line.
+   FILE *bf = fopen (bname, "r+b");
+   uint64_t records = 0;
+   uint32_t type = 0xffffffff;
+   if (!bf || (fseek (bf, 24, SEEK_SET)) != 0 || (fread (&records, sizeof records, 1, bf)) != 1
+         || (fseek (bf, (long)records + 16, SEEK_SET)) != 0
+         || (fwrite (&type, sizeof type, 1, bf)) != 1) {
+      ERRORF ("Failed to corrupt [%s]: %m\n", bname);
+      errcount++;
+   }
+   if (bf)
+      fclose (bf);
+   if ((bad = rest_test_parse_bundle (parents[1], bname))) {
+      ERRORF ("Loaded bundle [%s] with an invalid token type\n", bname);
+      errcount++;
+      for (size_t i=0; bad[i]; i++) {
+         rest_test_del (&bad[i]);
+      }
+      free (bad);
+   }
+
+cleanup:
+   for (size_t i=0; i<2; i++) {
+      for (size_t j=0; rts[i] && rts[i][j]; j++) {
+         rest_test_del (&rts[i][j]);
+      }
+      free (rts[i]);
+      free (dumps[i]);
+      rest_test_symt_del (&parents[i]);
+      rest_test_symt_del (&globals[i]);
+   }
+   if (bname)
+      remove (bname);
+   free (bname);
+   file_del (&fname);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+int test_cache (void)
+{
+   int errcount = 0;
+   static const char *input[] = {
+      ".global BASE_URI \"http://localhost\"",
+      ".test 'cached'",
+      ".uri BASE_URI",
+      NULL,
+   };
+   static const char *edited[] = {
+      ".test 'edited'",
+      ".uri BASE_URI",
+      NULL,
+   };
+   char dirname[] = "tmp_cache_XXXXXX";
+   char *fname = file_new (input);
+   char *other = NULL, *dotted = NULL;
+   rest_test_cache_t *cache = mkdtemp (dirname) ? rest_test_cache_new (dirname) : NULL;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+
+   if (!fname || !cache || !global) {
+      ERRORF ("Failed to create cache test objects\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Miss, hit, touch without change (hit), edit (miss), then hit
+   static const struct {
+      const char *name;
+      size_t hits;
+      size_t misses;
+   } expected[] = {
+      { "cached",    0, 1 },
+      { "cached",    1, 1 },
+      { "cached",    2, 1 },
+      { "edited",    2, 2 },
+      { "edited",    3, 2 },
+   };
+   for (size_t i=0; i<sizeof expected / sizeof expected[0]; i++) {
+      if (i == 2) {
+         struct timespec times[2] = { { 0, UTIME_OMIT }, { 1, 0 } };
+         utimensat (AT_FDCWD, fname, times, 0);
+      }
+      if (i == 3) {
+         FILE *outf = fopen (fname, "w");
+         for (size_t j=0; outf && edited[j]; j++) {
+            fprintf (outf, "%s\n", edited[j]);
+         }
+         if (outf)
+            fclose (outf);
+      }
+      rest_test_t **rts = rest_test_cache_parse_file (cache, global, fname);
+      const char *name = rts && rts[0] ? rest_test_get_name (rts[0]) : NULL;
+      if (!name || (strcmp (name, expected[i].name)) != 0
+            || rest_test_cache_hits (cache) != expected[i].hits
+            || rest_test_cache_misses (cache) != expected[i].misses) {
+         ERRORF ("[%zu] Expected [%s] %zu/%zu, got [%s] %zu/%zu\n", i,
+                 expected[i].name, expected[i].hits, expected[i].misses,
+                 name, rest_test_cache_hits (cache), rest_test_cache_misses (cache));
+         errcount++;
+      }
+      for (size_t j=0; rts && rts[j]; j++) {
+         rest_test_del (&rts[j]);
+      }
+      free (rts);
+   }
+
+   // Another path to the same file shares its entry, and the tests loaded from
+   // it are named by the path they were loaded through; so do parallel parses,
+   // which write the entries of the files they parse.
+   if (!(other = file_new (input)) || !(dotted = ds_str_cat ("./", fname, NULL))) {
+      ERRORF ("Failed to create cache test paths\n");
+      errcount++;
+      goto cleanup;
+   }
+   const char *const paths[] = { dotted, fname, other, other, dotted };
+   static const struct {
+      size_t nfiles;
+      size_t hits;
+      size_t misses;
+   } batches[] = {
+      { 1, 4, 2 },
+      { 3, 6, 3 },
+      { 5, 11, 3 },
+   };
+   for (size_t i=0; i<sizeof batches / sizeof batches[0]; i++) {
+      rest_test_t **rts = rest_test_cache_parse_files (cache, global, paths,
+                                                       batches[i].nfiles, 2);
+      size_t ntests = 0;
+      for (; rts && rts[ntests]; ntests++) {
+         if ((strcmp (rest_test_get_fname (rts[ntests]), paths[ntests])) != 0) {
+            ERRORF ("[%zu] Expected test from [%s], got [%s]\n", i, paths[ntests],
+                    rest_test_get_fname (rts[ntests]));
+            errcount++;
+         }
+      }
+      if (ntests != batches[i].nfiles
+            || rest_test_cache_hits (cache) != batches[i].hits
+            || rest_test_cache_misses (cache) != batches[i].misses) {
+         ERRORF ("[%zu] Expected %zu tests, %zu/%zu, got %zu tests, %zu/%zu\n", i,
+                 batches[i].nfiles, batches[i].hits, batches[i].misses, ntests,
+                 rest_test_cache_hits (cache), rest_test_cache_misses (cache));
+         errcount++;
+      }
+      for (size_t j=0; rts && rts[j]; j++) {
+         rest_test_del (&rts[j]);
+      }
+      free (rts);
+   }
+
+cleanup:
+   if (cache) {
+      DIR *dir = opendir (dirname);
+      struct dirent *de;
+      while (dir && (de = readdir (dir))) {
+         if (de->d_name[0] != '.') {
+            char *path = ds_str_cat (dirname, "/", de->d_name, NULL);
+            if (path)
+               remove (path);
+            free (path);
+         }
+      }
+      if (dir)
+         closedir (dir);
+      rmdir (dirname);
+   }
+   rest_test_cache_del (&cache);
+   rest_test_symt_del (&global);
+   file_del (&fname);
+   file_del (&other);
+   free (dotted);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+int test_directives (void)
+{
+   int errcount = 0;
+   // Every directive is recognised, and only when it matches exactly
+   static const struct {
+      const char *line;
+      bool valid;
+   } cases[] = {
+      { ".global G 'g'",         true  },
+      { ".parent P 'p'",         true  },
+      { ".test 't'",             true  },
+      { ".local L 'l'",          true  },
+      { ".method 'GET'",         true  },
+      { ".uri 'u'",              true  },
+      { ".http_version 'h'",     true  },
+      { ".header 'A' ': b'",     true  },
+      { ".body 'b'",             true  },
+      { ".assert 'a'",           true  },
+      { ".prefetch P",           true  },
+      { ".parallel '4'",         true  },
+      { ".parallel '0'",         false },
+      { ".parallel 'x'",         false },
+      { ".testing 't'",          false },
+      { ".tes 't'",              false },
+      { ".header-foo 'A' ': b'", false },
+      { ".bodies 'b'",           false },
+      { ".uris 'u'",             false },
+      { ".globall G 'g'",        false },
+      { ".http_versions 'h'",    false },
+      { ".prefetchs P",          false },
+      { ".parallels '4'",        false },
+      { ".gxxxxx G 'g'",         false },
+   };
+
+   for (size_t i=0; i<sizeof cases / sizeof cases[0]; i++) {
+      const char *input[] = { ".test 'first'", cases[i].line, NULL };
+      char *fname = file_new (input);
+      rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 2);
+      rest_test_t **rts = fname && global ? rest_test_parse_file (global, fname) : NULL;
+      if ((rts != NULL) != cases[i].valid) {
+         ERRORF ("[%s] expected to %s\n", cases[i].line, cases[i].valid ? "parse" : "fail");
+         errcount++;
+      }
+      for (size_t j=0; rts && rts[j]; j++) {
+         rest_test_del (&rts[j]);
+      }
+      free (rts);
+      rest_test_symt_del (&global);
+      file_del (&fname);
+   }
+
+   // Every directive in the parser's table is found by its name, and no name
+   // that differs from one in its length or a single byte is
+   size_t ndirectives = 0;
+   for (const char *name; (name = rest_test_parse_directive_name (ndirectives)); ndirectives++) {
+      char word[64];
+      size_t length = strlen (name);
+      if (!(rest_test_parse_is_directive (name))) {
+         ERRORF ("Directive [%s] is not recognised\n", name);
+         errcount++;
+      }
+      snprintf (word, sizeof word, "%sx", name);
+      bool longer = rest_test_parse_is_directive (word);
+      word[length - 1] = 0;
+      bool shorter = rest_test_parse_is_directive (word);
+      bool changed = false;
+      for (size_t i=1; i<length; i++) {
+         snprintf (word, sizeof word, "%s", name);
+         word[i] = word[i] == 'z' ? 'y' : 'z';
+         changed = changed || rest_test_parse_is_directive (word);
+      }
+      if (longer || shorter || changed) {
+         ERRORF ("Near misses of [%s] were recognised\n", name);
+         errcount++;
+      }
+   }
+   if (!ndirectives || rest_test_parse_is_directive ("") || rest_test_parse_is_directive (".")) {
+      ERRORF ("Unexpected directive table of %zu names\n", ndirectives);
+      errcount++;
+   }
+
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+struct stream_count_t {
+   size_t ntests;
+   size_t stop_at;
+   int errcount;
+};
+
+static bool stream_count (rest_test_t *rt, void *param)
+{
+   struct stream_count_t *count = param;
+   char expected[32];
+   snprintf (expected, sizeof expected, "test-%zu", count->ntests);
+   if ((strcmp (rest_test_get_name (rt), expected)) != 0
+         || (strcmp (rest_test_req_uri (rt), "/path")) != 0) {
+      ERRORF ("Expected [%s], got [%s]\n", expected, rest_test_get_name (rt));
+      count->errcount++;
+   }
+   rest_test_del (&rt);
+   count->ntests++;
+   return count->ntests != count->stop_at;
+}
+
+// Checks that the body of the one test is the escaped JSON that test_stream()
+// writes, `{"k":1},` repeated
+static bool stream_body (rest_test_t *rt, void *param)
+{
+   struct stream_count_t *count = param;
+   const char *body = rest_test_req_body (rt);
+   size_t length = body ? strlen (body) : 0;
+   for (size_t i=0; i<length && !count->errcount; i+=8) {
+      if ((strncmp (&body[i], "{\"k\":1},", 8)) != 0) {
+         ERRORF ("Unexpected body at offset %zu: [%.16s]\n", i, &body[i]);
+         count->errcount++;
+      }
+   }
+   if (length != count->stop_at * 8) {
+      ERRORF ("Expected a body of %zu bytes, got %zu\n", count->stop_at * 8, length);
+      count->errcount++;
+   }
+   rest_test_del (&rt);
+   count->ntests++;
+   return true;
+}
+
+int test_stream (void)
+{
+   int errcount = 0;
+   static const size_t ntests = 1000;
+   char *fname = ds_str_dup ("tmp_XXXXXX");
+   int fd = fname ? mkstemp (fname) : -1;
+   FILE *outf = fd >= 0 ? fdopen (fd, "w") : NULL;
+   char *cmd = fname ? ds_str_cat ("cat ", fname, NULL) : NULL;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+
+   if (!outf || !cmd || !global) {
+      ERRORF ("Failed to create stream test objects\n");
+      errcount++;
+      goto cleanup;
+   }
+   for (size_t i=0; i<ntests; i++) {
+      fprintf (outf, ".test 'test-%zu'\n.uri '/path'\n", i);
+   }
+   fclose (outf);
+   outf = NULL;
+
+   // Every test is handed over, in order, from both a file and a pipe
+   for (size_t i=0; i<2; i++) {
+      struct stream_count_t count = { 0, 0, 0 };
+      FILE *pipef = i ? popen (cmd, "r") : NULL;
+      bool rc = i
+         ? rest_test_parse_stream_each (global, pipef, fname, stream_count, &count)
+         : rest_test_parse_file_each (global, fname, stream_count, &count);
+      if (pipef)
+         pclose (pipef);
+      if (!rc || count.ntests != ntests || count.errcount) {
+         ERRORF ("[%zu] Streamed %zu/%zu tests, %i errors\n", i, count.ntests, ntests,
+                 count.errcount);
+         errcount++;
+      }
+   }
+
+   // The callback can stop the parse
+   struct stream_count_t count = { 0, 3, 0 };
+   if ((rest_test_parse_file_each (global, fname, stream_count, &count)) || count.ntests != 3) {
+      ERRORF ("Parse did not stop after 3 tests, got %zu\n", count.ntests);
+      errcount++;
+   }
+
+   // A large body full of escaped quotes is read from a pipe in time linear
+   // in its size: the string is not lexed again at each escaped quote
+   static const size_t nrepeats = 20000;
+   if (!(outf = fopen (fname, "w"))) {
+      ERRORF ("Failed to rewrite [%s]: %m\n", fname);
+      errcount++;
+      goto cleanup;
+   }
+   fprintf (outf, ".test 'escaped'\n.body \"");
+   for (size_t i=0; i<nrepeats; i++) {
+      fprintf (outf, "{\\\"k\\\":1},");
+   }
+   fprintf (outf, "\"\n");
+   fclose (outf);
+   outf = NULL;
+
+   struct timespec start, end;
+   struct stream_count_t body = { 0, nrepeats, 0 };
+   FILE *pipef = popen (cmd, "r");
+   clock_gettime (CLOCK_MONOTONIC, &start);
+   bool rc = pipef && rest_test_parse_stream_each (global, pipef, fname, stream_body, &body);
+   clock_gettime (CLOCK_MONOTONIC, &end);
+   if (pipef)
+      pclose (pipef);
+   double elapsed = (double)(end.tv_sec - start.tv_sec)
+                  + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+   if (!rc || body.ntests != 1 || body.errcount || elapsed > 2.0) {
+      ERRORF ("Streamed %zu tests with %i errors in %.3fs\n", body.ntests, body.errcount,
+              elapsed);
+      errcount++;
+   }
+
+cleanup:
+   if (outf)
+      fclose (outf);
+   rest_test_symt_del (&global);
+   free (cmd);
+   file_del (&fname);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+static bool symt_expect (rest_test_symt_t *symt, const char *symbol, const char *expected)
+{
+   const char *value = rest_test_token_value (rest_test_symt_value (symt, symbol));
+   if (!expected)
+      return value == NULL;
+   return value && (strcmp (value, expected)) == 0;
+}
+
+int test_symt_ids (void)
+{
+   int errcount = 0;
+   static const size_t nsymbols = 1000;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 1);
+   rest_test_symt_t *local = rest_test_symt_new ("local", global, 1);
+   char name[32];
+
+   if (!global || !local) {
+      ERRORF ("OOM allocating symbol tables\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Enough symbols to grow the table several times from its smallest size
+   for (size_t i=0; i<nsymbols; i++) {
+      snprintf (name, sizeof name, "sym-%zu", i);
+      rest_test_token_t *token = rest_test_token_new (token_STRING, name, "test", i);
+      if (!token || !(rest_test_symt_add (global, name, token))) {
+         ERRORF ("Failed to add [%s]\n", name);
+         errcount++;
+      }
+      rest_test_token_del (&token);
+   }
+
+   // Removing every other symbol shifts the probe sequences of the rest
+   for (size_t i=0; i<nsymbols; i+=2) {
+      snprintf (name, sizeof name, "sym-%zu", i);
+      rest_test_symt_clear (global, name);
+   }
+
+   for (size_t i=0; i<nsymbols; i++) {
+      snprintf (name, sizeof name, "sym-%zu", i);
+      const rest_test_token_t *value = rest_test_symt_value (local, name);
+      const rest_test_token_t *by_id = rest_test_symt_value_id (local, rest_test_symt_id (name));
+      bool expected = i % 2;
+      if ((value != NULL) != expected || value != by_id
+            || (value && (strcmp (rest_test_token_value (value), name)) != 0)) {
+         ERRORF ("Unexpected value for [%s]: [%s]\n", name, rest_test_token_value (value));
+         errcount++;
+      }
+   }
+
+   // A local shadows its parent, and the parent shows through once it is gone
+   rest_test_token_t *token = rest_test_token_new (token_STRING, "shadow", "test", 1);
+   if (!token || !(rest_test_symt_add (local, "sym-1", token))
+         || (strcmp (rest_test_token_value (rest_test_symt_value (local, "sym-1")), "shadow")) != 0) {
+      ERRORF ("Local did not shadow global\n");
+      errcount++;
+   }
+   rest_test_token_del (&token);
+   rest_test_symt_clear (local, "sym-1");
+   if ((strcmp (rest_test_token_value (rest_test_symt_value (local, "sym-1")), "sym-1")) != 0) {
+      ERRORF ("Global not visible after clearing local\n");
+      errcount++;
+   }
+
+   // Looking up a symbol that no table has does not intern it
+   if (rest_test_symt_value (local, "never-added")
+         || rest_test_intern_symbol_find ("never-added") != (size_t)-1) {
+      ERRORF ("Lookup of a missing symbol interned it\n");
+      errcount++;
+   }
+
+   // Clearing a symbol that was never interned leaves a populated table alone
+   size_t count = rest_test_symt_count (global);
+   rest_test_symt_clear (global, "never-cleared");
+   rest_test_symt_clear (local, "never-cleared");
+   if (rest_test_symt_count (global) != count || !(symt_expect (local, "sym-1", "sym-1"))
+         || !(symt_expect (global, "sym-999", "sym-999"))) {
+      ERRORF ("Clearing an unknown symbol changed the table: %zu entries, was %zu\n",
+              rest_test_symt_count (global), count);
+      errcount++;
+   }
+
+cleanup:
+   rest_test_symt_del (&local);
+   rest_test_symt_del (&global);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+static bool symt_set (rest_test_symt_t *symt, const char *symbol, const char *value)
+{
+   rest_test_token_t *token = rest_test_token_new (token_STRING, value, "test", 1);
+   bool ret = token && rest_test_symt_add (symt, symbol, token);
+   rest_test_token_del (&token);
+   return ret;
+}
+
+int test_symt_cache (void)
+{
+   int errcount = 0;
+   rest_test_symt_t *site = rest_test_symt_new ("site", NULL, 8);
+   rest_test_symt_t *project = rest_test_symt_new ("project", site, 8);
+   rest_test_symt_t *file = rest_test_symt_new ("file", project, 8);
+   rest_test_symt_t *test = rest_test_symt_new ("test", file, 8);
+
+   if (!site || !project || !file || !test) {
+      ERRORF ("OOM allocating symbol tables\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Each step reads through the cache filled by the step before it
+   struct {
+      rest_test_symt_t *symt;
+      const char *value;      // NULL to clear
+      const char *expected;
+   } steps[] = {
+      { site,     "site-1",      "site-1" },
+      { site,     "site-2",      "site-2" },
+      { file,     "file-1",      "file-1" },
+      { project,  "project-1",   "file-1" },
+      { file,     NULL,          "project-1" },
+      { project,  NULL,          "site-2" },
+      { test,     "test-1",      "test-1" },
+      { test,     NULL,          "site-2" },
+      { site,     NULL,          NULL },
+      { project,  "project-2",   "project-2" },
+   };
+
+   for (size_t i=0; i<sizeof steps / sizeof steps[0]; i++) {
+      if (steps[i].value) {
+         if (!(symt_set (steps[i].symt, "uriBase", steps[i].value))) {
+            ERRORF ("[%zu] Failed to set uriBase\n", i);
+            errcount++;
+         }
+      } else {
+         rest_test_symt_clear (steps[i].symt, "uriBase");
+      }
+      // Read twice, so that the second read comes from the cache
+      for (size_t j=0; j<2; j++) {
+         if (!(symt_expect (test, "uriBase", steps[i].expected))) {
+            ERRORF ("[%zu] Expected [%s], got [%s]\n", i, steps[i].expected,
+                    rest_test_token_value (rest_test_symt_value (test, "uriBase")));
+            errcount++;
+         }
+      }
+   }
+
+   // A cached miss is refreshed too
+   if (!(symt_expect (test, "later", NULL)) || !(symt_set (site, "later", "yes"))
+         || !(symt_expect (test, "later", "yes"))) {
+      ERRORF ("Cached miss not invalidated by a write to the root\n");
+      errcount++;
+   }
+
+   // Only writes to the chain change its version, which is what keeps the
+   // cache and folded requests valid across writes to other tables
+   rest_test_symt_t *sibling = rest_test_symt_new ("sibling", file, 8);
+   rest_test_symt_t *unrelated = rest_test_symt_new ("unrelated", NULL, 8);
+   size_t version = rest_test_symt_version (test);
+   if (!sibling || !unrelated || !(symt_set (sibling, "uriBase", "sibling-1"))
+         || !(symt_set (unrelated, "uriBase", "unrelated-1"))
+         || rest_test_symt_version (test) != version
+         || !(symt_expect (test, "uriBase", "project-2"))) {
+      ERRORF ("Writes outside the chain changed its version\n");
+      errcount++;
+   }
+   rest_test_symt_clear (sibling, "uriBase");
+   if (rest_test_symt_version (test) != version) {
+      ERRORF ("A clear outside the chain changed its version\n");
+      errcount++;
+   }
+   rest_test_symt_t *chain[] = { test, file, site };
+   for (size_t i=0; i<sizeof chain / sizeof chain[0]; i++) {
+      if (!(symt_set (chain[i], "version", "1"))
+            || rest_test_symt_version (test) == version) {
+         ERRORF ("A write to [%s] did not change the version\n",
+                 rest_test_symt_name (chain[i]));
+         errcount++;
+      }
+      version = rest_test_symt_version (test);
+      rest_test_symt_clear (chain[i], "version");
+      if (rest_test_symt_version (test) == version) {
+         ERRORF ("A clear from [%s] did not change the version\n",
+                 rest_test_symt_name (chain[i]));
+         errcount++;
+      }
+      version = rest_test_symt_version (test);
+   }
+   rest_test_symt_del (&unrelated);
+   rest_test_symt_del (&sibling);
+
+cleanup:
+   rest_test_symt_del (&test);
+   rest_test_symt_del (&file);
+   rest_test_symt_del (&project);
+   rest_test_symt_del (&site);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+int test_symt_fork (void)
+{
+   int errcount = 0;
+   static const size_t nsymbols = 100;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_symt_t *big = rest_test_symt_new ("big", global, 64);
+   rest_test_symt_t *small = rest_test_symt_new ("small", global, 0);
+   rest_test_symt_t *forks[3] = { NULL, NULL, NULL };
+   char name[32];
+
+   if (!global || !big || !small || !symt_set (global, "G", "global")
+         || !symt_set (small, "A", "small-a") || !symt_set (small, "B", "small-b")) {
+      ERRORF ("OOM allocating symbol tables\n");
+      errcount++;
+      goto cleanup;
+   }
+   for (size_t i=0; i<nsymbols; i++) {
+      snprintf (name, sizeof name, "sym-%zu", i);
+      if (!(symt_set (big, name, name))) {
+         ERRORF ("Failed to set [%s]\n", name);
+         errcount++;
+         goto cleanup;
+      }
+   }
+
+   // Forks see the entries and the parent of the original
+   forks[0] = rest_test_symt_fork (big);
+   forks[1] = rest_test_symt_fork (forks[0]);
+   forks[2] = rest_test_symt_fork (small);
+   if (!forks[0] || !forks[1] || !forks[2]
+         || rest_test_symt_parent (forks[0]) != global
+         || !symt_expect (forks[1], "sym-42", "sym-42") || !symt_expect (forks[1], "G", "global")
+         || !symt_expect (forks[2], "B", "small-b")) {
+      ERRORF ("Fork does not match its original\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Writes to either side of a fork are not seen by the other
+   rest_test_symt_clear (forks[0], "sym-1");
+   if (!symt_set (forks[1], "sym-2", "changed") || !symt_set (big, "sym-3", "changed")
+         || !symt_set (forks[2], "A", "changed")) {
+      ERRORF ("Failed to write to forked tables\n");
+      errcount++;
+   }
+   struct {
+      rest_test_symt_t *symt;
+      const char *symbol;
+      const char *expected;
+   } checks[] = {
+      { big,      "sym-1", "sym-1" },
+      { forks[0], "sym-1", NULL },
+      { forks[1], "sym-1", "sym-1" },
+      { big,      "sym-2", "sym-2" },
+      { forks[0], "sym-2", "sym-2" },
+      { forks[1], "sym-2", "changed" },
+      { big,      "sym-3", "changed" },
+      { forks[0], "sym-3", "sym-3" },
+      { forks[1], "sym-3", "sym-3" },
+      { small,    "A",     "small-a" },
+      { forks[2], "A",     "changed" },
+   };
+   for (size_t i=0; i<sizeof checks / sizeof checks[0]; i++) {
+      if (!(symt_expect (checks[i].symt, checks[i].symbol, checks[i].expected))) {
+         ERRORF ("[%zu] [%s:%s] expected [%s], got [%s]\n", i,
+                 rest_test_symt_name (checks[i].symt), checks[i].symbol, checks[i].expected,
+                 rest_test_token_value (rest_test_symt_value (checks[i].symt, checks[i].symbol)));
+         errcount++;
+      }
+   }
+
+   // A fork outlives its original
+   rest_test_symt_del (&big);
+   if (!(symt_expect (forks[0], "sym-99", "sym-99"))) {
+      ERRORF ("Fork lost its entries when the original was deleted\n");
+      errcount++;
+   }
+
+cleanup:
+   for (size_t i=0; i<3; i++) {
+      rest_test_symt_del (&forks[i]);
+   }
+   rest_test_symt_del (&small);
+   rest_test_symt_del (&big);
+   rest_test_symt_del (&global);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+int test_symt_stats (void)
+{
+   int errcount = 0;
+   static const size_t nsymbols = 10000;
+   struct rest_test_symt_stats_t stats;
+   rest_test_symt_t *small = rest_test_symt_new ("small", NULL, 1);
+   rest_test_symt_t *fork = NULL;
+   char name[32];
+
+   if (!small || !symt_set (small, "A", "a")) {
+      ERRORF ("OOM allocating symbol tables\n");
+      errcount++;
+      goto cleanup;
+   }
+   if (!(rest_test_symt_stats (small, &stats)) || !stats.inline_slots || stats.nentries != 1
+         || stats.probes[0] != 1) {
+      ERRORF ("Unexpected stats for a one-entry table\n");
+      errcount++;
+   }
+
+   // A hint of one does not stop the table from holding many entries
+   for (size_t i=0; i<nsymbols; i++) {
+      snprintf (name, sizeof name, "stats-%zu", i);
+      if (!(symt_set (small, name, name))) {
+         ERRORF ("Failed to set [%s]\n", name);
+         errcount++;
+         goto cleanup;
+      }
+   }
+
+   if (!(rest_test_symt_stats (small, &stats))) {
+      ERRORF ("Failed to get stats\n");
+      errcount++;
+      goto cleanup;
+   }
+   size_t total = 0;
+   for (size_t i=0; i<REST_TEST_SYMT_PROBES; i++) {
+      total += stats.probes[i];
+   }
+   if (stats.inline_slots || stats.nentries != nsymbols + 1 || total != stats.nentries
+         || stats.nentries * 4 > stats.nslots * 3 || stats.mean_probes > 3.0) {
+      rest_test_symt_dump_stats (small, stderr);
+      ERRORF ("Table did not grow to keep probes short\n");
+      errcount++;
+   }
+
+   if (!(fork = rest_test_symt_fork (small)) || !(rest_test_symt_stats (fork, &stats))
+         || !stats.shared) {
+      ERRORF ("Fork does not report shared entries\n");
+      errcount++;
+   }
+
+cleanup:
+   rest_test_symt_del (&fork);
+   rest_test_symt_del (&small);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+static bool state_token (rest_test_symt_t *symt, const char *symbol,
+                         enum rest_test_token_type_t type, const char *value,
+                         const char *source, size_t line_no)
+{
+   rest_test_token_t *token = rest_test_token_new (type, value, source, line_no);
+   bool ret = token && rest_test_symt_add (symt, symbol, token);
+   rest_test_token_del (&token);
+   return ret;
+}
+
+static bool state_expect (rest_test_symt_t *symt, const char *symbol,
+                          enum rest_test_token_type_t type, const char *value,
+                          const char *source, size_t line_no)
+{
+   const rest_test_token_t *token = rest_test_symt_value (symt, symbol);
+   return token
+       && rest_test_token_type (token) == type
+       && (strcmp (rest_test_token_value (token), value)) == 0
+       && (strcmp (rest_test_token_source (token), source)) == 0
+       && rest_test_token_line_no (token) == line_no;
+}
+
+int test_state (void)
+{
+   int errcount = 0;
+   static const char *empty[] = { NULL };
+   char *fname = file_new (empty);
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_symt_t *suite = rest_test_symt_new ("suite", global, 8);
+   rest_test_symt_t *login = rest_test_symt_new ("login", suite, 1);
+   rest_test_symt_t *logout = rest_test_symt_new ("logout", suite, 1);
+   rest_test_symt_t **loaded = NULL;
+   rest_test_token_t *kept = NULL;
+   FILE *outf = NULL;
+   char name[32];
+
+   if (!fname || !global || !suite || !login || !logout) {
+      ERRORF ("OOM allocating symbol tables\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   bool ok = state_token (global, "HOST", token_STRING, "example.com", "site.rtest", 3)
+          && state_token (global, "PORT", token_INTEGER, "8443", "site.rtest", 4)
+          && state_token (suite, "HOST", token_STRING, "", "suite.rtest", 1)
+          && state_token (login, "SESSION", token_STRING, "a1b2c3", "login.rtest", 12)
+          && state_token (login, "OTP", token_SHELLCMD, "otp --now", "login.rtest", 13)
+          && state_token (logout, "SESSION", token_STRING, "expired", "logout.rtest", 2);
+   for (size_t i=0; ok && i<100; i++) {
+      snprintf (name, sizeof name, "many-%zu", i);
+      ok = state_token (suite, name, token_STRING, name, "suite.rtest", i + 2);
+   }
+   if (!ok) {
+      ERRORF ("Failed to populate symbol tables\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Both chains share global and suite, which are written once
+   rest_test_symt_t *leaves[] = { login, logout };
+   if (!(rest_test_state_save (leaves, 2, fname))) {
+      ERRORF ("Failed to save state to [%s]\n", fname);
+      errcount++;
+      goto cleanup;
+   }
+   if (!(loaded = rest_test_state_load (fname))) {
+      ERRORF ("Failed to load state from [%s]\n", fname);
+      errcount++;
+      goto cleanup;
+   }
+
+   static const char *names[] = { "global", "suite", "login", "logout", NULL };
+   static const size_t parents[] = { (size_t)-1, 0, 1, 1 };
+   for (size_t i=0; names[i] || loaded[i]; i++) {
+      if (!names[i] || !loaded[i]
+            || (strcmp (rest_test_symt_name (loaded[i]), names[i])) != 0
+            || rest_test_symt_parent (loaded[i])
+                  != (parents[i] == (size_t)-1 ? NULL : loaded[parents[i]])) {
+         ERRORF ("Unexpected table %zu [%s]\n", i,
+                  loaded[i] ? rest_test_symt_name (loaded[i]) : "(null)");
+         errcount++;
+         goto cleanup;
+      }
+   }
+   if (rest_test_symt_count (loaded[1]) != 101) {
+      ERRORF ("Expected 101 entries in suite, found %zu\n", rest_test_symt_count (loaded[1]));
+      errcount++;
+   }
+
+   // Values resolve through the restored chain as they did through the original
+   if (!(state_expect (loaded[2], "SESSION", token_STRING, "a1b2c3", "login.rtest", 12))
+         || !(state_expect (loaded[2], "OTP", token_SHELLCMD, "otp --now", "login.rtest", 13))
+         || !(state_expect (loaded[2], "HOST", token_STRING, "", "suite.rtest", 1))
+         || !(state_expect (loaded[3], "PORT", token_INTEGER, "8443", "site.rtest", 4))
+         || !(state_expect (loaded[3], "SESSION", token_STRING, "expired", "logout.rtest", 2))
+         || !(state_expect (loaded[0], "HOST", token_STRING, "example.com", "site.rtest", 3))
+         || !(state_expect (loaded[3], "many-42", token_STRING, "many-42", "suite.rtest", 44))
+         || rest_test_symt_value (loaded[0], "SESSION")) {
+      ERRORF ("Restored values differ from the saved values\n");
+      rest_test_symt_dump (loaded[2], stderr);
+      errcount++;
+   }
+
+   // Loaded tokens share the mapping and outlive the tables
+   if (!(kept = rest_test_token_dup (rest_test_symt_value (loaded[2], "SESSION")))) {
+      ERRORF ("Failed to copy a loaded token\n");
+      errcount++;
+      goto cleanup;
+   }
+   rest_test_state_del (&loaded);
+   if ((strcmp (rest_test_token_value (kept), "a1b2c3")) != 0) {
+      ERRORF ("Token did not outlive its table\n");
+      errcount++;
+   }
+
+   // A truncated file is rejected rather than read past its end
+   if (!(outf = fopen (fname, "r+b")) || (ftruncate (fileno (outf), 100)) != 0) {
+      ERRORF ("Failed to truncate [%s]: %m\n", fname);
+      errcount++;
+      goto cleanup;
+   }
+   fclose (outf);
+   outf = NULL;
+   if ((loaded = rest_test_state_load (fname))) {
+      ERRORF ("Loaded a truncated state file\n");
+      errcount++;
+   }
+
+cleanup:
+   if (outf)
+      fclose (outf);
+   rest_test_token_del (&kept);
+   rest_test_state_del (&loaded);
+   rest_test_symt_del (&logout);
+   rest_test_symt_del (&login);
+   rest_test_symt_del (&suite);
+   rest_test_symt_del (&global);
+   file_del (&fname);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+static bool journal_expect (rest_test_symt_t *symt, size_t nvalues)
+{
+   char name[32];
+   for (size_t i=0; i<nvalues; i++) {
+      snprintf (name, sizeof name, "TOKEN_%zu", i);
+      // TOKEN_3 is cleared and TOKEN_5 overwritten
+      bool ok = i == 3 ? rest_test_symt_value (symt, name) == NULL
+              : i == 5 ? state_expect (symt, name, token_INTEGER, "55", "run-2", 99)
+              : state_expect (symt, name, token_STRING, name, "run-1", i + 1);
+      if (!ok) {
+         ERRORF ("Unexpected value for [%s]\n", name);
+         rest_test_symt_dump (symt, stderr);
+         return false;
+      }
+   }
+   return true;
+}
+
+// Opens the journal on a new table and checks that it replays to `nvalues`
+static bool journal_replays (const char *fname, size_t nvalues)
+{
+   rest_test_symt_t *symt = rest_test_symt_new ("global", NULL, 8);
+   rest_test_journal_t *journal = symt ? rest_test_journal_open (fname, symt) : NULL;
+   bool ret = journal && journal_expect (symt, nvalues);
+   rest_test_journal_close (&journal);
+   rest_test_symt_del (&symt);
+   return ret;
+}
+
+int test_journal (void)
+{
+   int errcount = 0;
+   static const char *empty[] = { NULL };
+   char *fname = file_new (empty);
+   char *lname = fname ? ds_str_cat (fname, ".log", NULL) : NULL;
+   rest_test_symt_t *symt = rest_test_symt_new ("global", NULL, 8);
+   rest_test_journal_t *journal = NULL;
+   struct stat sb;
+   char name[32];
+   int fd = -1;
+
+   if (!fname || !lname || !symt) {
+      ERRORF ("OOM allocating journal test\n");
+      errcount++;
+      goto cleanup;
+   }
+   // The journal starts with no snapshot
+   remove (fname);
+
+   if (!(journal = rest_test_journal_open (fname, symt))) {
+      ERRORF ("Failed to open a new journal [%s]\n", fname);
+      errcount++;
+      goto cleanup;
+   }
+   rest_test_journal_set_limits (journal, 4, 1000000);
+   bool ok = true;
+   for (size_t i=0; ok && i<10; i++) {
+      snprintf (name, sizeof name, "TOKEN_%zu", i);
+      ok = state_token (symt, name, token_STRING, name, "run-1", i + 1);
+   }
+   rest_test_symt_clear (symt, "TOKEN_3");
+   ok = ok && state_token (symt, "TOKEN_5", token_INTEGER, "55", "run-2", 99);
+   if (!ok || rest_test_journal_records (journal) != 12) {
+      ERRORF ("Expected 12 records, found %zu\n", rest_test_journal_records (journal));
+      errcount++;
+   }
+   rest_test_journal_close (&journal);
+
+   // Writes made after the journal is closed are not recorded
+   state_token (symt, "TOKEN_3", token_STRING, "unjournaled", "run-3", 1);
+   if (!(journal_replays (fname, 10))) {
+      ERRORF ("Journal did not replay its log\n");
+      errcount++;
+   }
+
+   // A record torn by a crash is discarded and the log cut back to the last
+   // good record
+   if ((stat (lname, &sb)) != 0
+         || (fd = open (lname, O_WRONLY | O_APPEND)) < 0
+         || (write (fd, "\x01\0\0\0\x03\0\0\0\x07", 9)) != 9) {
+      ERRORF ("Failed to damage [%s]: %m\n", lname);
+      errcount++;
+      goto cleanup;
+   }
+   close (fd);
+   fd = -1;
+   off_t good = sb.st_size;
+   if (!(journal_replays (fname, 10)) || (stat (lname, &sb)) != 0 || sb.st_size != good) {
+      ERRORF ("Torn record was not discarded\n");
+      errcount++;
+   }
+
+   // A crash between writing the snapshot and emptying the log replays the
+   // log onto a snapshot that already holds it
+   rest_test_symt_t *replayed = rest_test_symt_new ("global", NULL, 8);
+   if (!replayed || !(journal = rest_test_journal_open (fname, replayed))
+         || !(rest_test_state_save (&replayed, 1, fname))) {
+      ERRORF ("Failed to snapshot [%s]\n", fname);
+      errcount++;
+   }
+   rest_test_journal_close (&journal);
+   rest_test_symt_del (&replayed);
+   if (!(journal_replays (fname, 10))) {
+      ERRORF ("Snapshot and log did not replay to the same table\n");
+      errcount++;
+   }
+
+   // A long run compacts the log rather than growing it without bound
+   rest_test_symt_del (&symt);
+   if (!(symt = rest_test_symt_new ("global", NULL, 8))
+         || !(journal = rest_test_journal_open (fname, symt))) {
+      ERRORF ("Failed to reopen [%s]\n", fname);
+      errcount++;
+      goto cleanup;
+   }
+   rest_test_journal_set_limits (journal, 0, 16);
+   for (size_t i=10; ok && i<1000; i++) {
+      snprintf (name, sizeof name, "TOKEN_%zu", i);
+      ok = state_token (symt, name, token_STRING, name, "run-1", i + 1);
+   }
+   if (!ok || rest_test_journal_records (journal) >= 1000) {
+      ERRORF ("Log was not compacted: %zu records\n", rest_test_journal_records (journal));
+      errcount++;
+   }
+   rest_test_journal_close (&journal);
+   if (!(journal_replays (fname, 1000))) {
+      ERRORF ("Compacted journal did not replay\n");
+      errcount++;
+   }
+
+cleanup:
+   if (fd >= 0)
+      close (fd);
+   rest_test_journal_close (&journal);
+   rest_test_symt_del (&symt);
+   if (lname)
+      remove (lname);
+   free (lname);
+   file_del (&fname);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+int test_environment (void)
+{
+   int errcount = 0;
+   static const char *envp[] = {
+      "RT_ENV_A=alpha", "RT_ENV_B=beta=gamma", "RT_ENV_A=shadowed", "=nameless",
+      "RT_ENV_EMPTY=", "NOEQUALS", NULL,
+   };
+   static const char *changed[] = { "RT_ENV_A=changed", NULL };
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_symt_t *suite = rest_test_symt_new ("suite", global, 8);
+   rest_test_symt_t *test = rest_test_symt_new ("test", suite, 1);
+
+   if (!global || !suite || !test || !(rest_test_symt_environment (envp))) {
+      ERRORF ("OOM setting up environment test\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Misses in every scope fall back to the snapshot
+   if (!(state_expect (test, "RT_ENV_A", token_STRING, "alpha", "environment", 0))
+         || !(symt_expect (global, "RT_ENV_B", "beta=gamma"))
+         || !(symt_expect (suite, "RT_ENV_EMPTY", ""))
+         || !(symt_expect (test, "NOEQUALS", NULL))
+         || !(symt_expect (test, "", NULL))
+         || !(symt_expect (test, "RT_ENV_MISSING", NULL))) {
+      ERRORF ("Unexpected environment fallback\n");
+      errcount++;
+   }
+
+   // Any table in the chain shadows the environment
+   if (!(symt_set (suite, "RT_ENV_A", "suite")) || !(symt_expect (test, "RT_ENV_A", "suite"))
+         || !(symt_expect (global, "RT_ENV_A", "alpha"))) {
+      ERRORF ("Environment was not shadowed by the chain\n");
+      errcount++;
+   }
+   rest_test_symt_clear (suite, "RT_ENV_A");
+
+   // The snapshot is not the live environment: a change is seen on refresh,
+   // including by lookups that were cached before it
+   if (!(symt_expect (test, "RT_ENV_A", "alpha"))
+         || (setenv ("RT_ENV_LIVE", "live", 1)) != 0
+         || !(symt_expect (test, "RT_ENV_LIVE", NULL))
+         || !(rest_test_symt_environment (changed))
+         || !(symt_expect (test, "RT_ENV_A", "changed"))
+         || !(symt_expect (test, "RT_ENV_B", NULL))
+         || !(rest_test_symt_environment (NULL))
+         || !(symt_expect (test, "RT_ENV_LIVE", "live"))) {
+      ERRORF ("Environment refresh was not seen\n");
+      errcount++;
+   }
+
+cleanup:
+   unsetenv ("RT_ENV_LIVE");
+   rest_test_symt_environment (NULL);
+   rest_test_symt_del (&test);
+   rest_test_symt_del (&suite);
+   rest_test_symt_del (&global);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+static bool req_set (rest_test_t *rt, bool (*set) (rest_test_t *, const rest_test_token_t *),
+                     const char *value)
+{
+   rest_test_token_t *token = rest_test_token_new (token_STRING, value, "interpolate", 1);
+   bool ret = token && set (rt, token);
+   rest_test_token_del (&token);
+   return ret;
+}
+
+int test_interpolate (void)
+{
+   int errcount = 0;
+   static const size_t nrefs = 300;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_t *rt = global ? rest_test_new ("interpolate", "interpolate", 1, global) : NULL;
+   rest_test_token_t *errtoken = NULL;
+   char *many = NULL, *expected = NULL;
+
+   if (!rt || !(many = calloc (nrefs, 8)) || !(expected = calloc (nrefs, 8))) {
+      ERRORF ("OOM allocating interpolation test\n");
+      errcount++;
+      goto cleanup;
+   }
+   for (size_t i=0; i<nrefs; i++) {
+      strcat (many, "{{ID}}/");
+      strcat (expected, "7/");
+   }
+
+   bool ok = symt_set (global, "ID", "7")
+          && symt_set (global, "NAME", "name-{{ID}}")
+          && symt_set (global, "SELF", "x{{SELF}}")
+          && state_token (global, "CMD", token_SHELLCMD, "echo cmd-{{ID}}", "interpolate", 1)
+          && req_set (rt, rest_test_req_set_method, "POST")
+          && req_set (rt, rest_test_req_set_uri, many)
+          && req_set (rt, rest_test_req_set_http_version, "HTTP/{{ID}}")
+          && req_set (rt, rest_test_req_set_body, "a{{ID}}b{{NAME}}c[{{CMD}}]d ")
+          && req_set (rt, rest_test_req_append_body, "{{ID}} \\{{ID}} {{ID}}");
+   if (!ok) {
+      ERRORF ("Failed to set up interpolation test\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Nested values are expanded and shell commands run; an escaped reference
+   // ends interpolation
+   if (!(rest_test_eval_req (rt, &errtoken))
+         || (strcmp (rest_test_req_body (rt), "a7bname-7c[cmd-7]d 7 \\{{ID}} {{ID}}")) != 0
+         || (strcmp (rest_test_req_uri (rt), expected)) != 0
+         || (strcmp (rest_test_req_http_version (rt), "HTTP/7")) != 0
+         || (strcmp (rest_test_req_method (rt), "POST")) != 0) {
+      ERRORF ("Unexpected interpolation\n");
+      rest_test_dump (rt, stderr);
+      errcount++;
+   }
+
+   // Evaluating again renders from the values as set, with the new symbols
+   if (!(symt_set (global, "ID", "8")) || !(rest_test_eval_req (rt, &errtoken))
+         || (strcmp (rest_test_req_body (rt), "a8bname-8c[cmd-8]d 8 \\{{ID}} {{ID}}")) != 0
+         || (strcmp (rest_test_req_http_version (rt), "HTTP/8")) != 0) {
+      ERRORF ("Re-evaluation did not see the new symbol value\n");
+      rest_test_dump (rt, stderr);
+      errcount++;
+   }
+
+   // A missing symbol, and a symbol that refers to itself, are errors
+   if (!(req_set (rt, rest_test_req_set_method, "{{MISSING}}"))
+         || (rest_test_eval_req (rt, &errtoken))
+         || (strcmp (rest_test_token_value (errtoken), "{{MISSING}}")) != 0) {
+      ERRORF ("Missing symbol was not reported\n");
+      errcount++;
+   }
+   if (!(req_set (rt, rest_test_req_set_method, "{{SELF}}"))
+         || (rest_test_eval_req (rt, &errtoken))) {
+      ERRORF ("Self-referencing symbol was not reported\n");
+      errcount++;
+   }
+
+cleanup:
+   free (many);
+   free (expected);
+   rest_test_del (&rt);
+   rest_test_symt_del (&global);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+int test_fold (void)
+{
+   int errcount = 0;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_t *rt = global ? rest_test_new ("fold", "fold", 1, global) : NULL;
+   rest_test_token_t *errtoken = NULL;
+
+   bool ok = rt
+          && symt_set (global, "HOST", "example.com")
+          && symt_set (global, "BASE", "https://{{HOST}}/v1")
+          && symt_set (global, "ID", "7")
+          && state_token (global, "CMD", token_SHELLCMD, "echo cmd-{{ID}}", "fold", 1)
+          && req_set (rt, rest_test_req_set_method, "POST")
+          && req_set (rt, rest_test_req_set_uri, "{{BASE}}/items/{{ID}}")
+          && req_set (rt, rest_test_req_set_http_version, "HTTP/1.1")
+          && req_set (rt, rest_test_req_set_body, "id={{ID}} cmd={{CMD}} late={{LATE}}");
+   if (!ok) {
+      ERRORF ("Failed to set up folding test\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // A field of constants is rendered by the fold; a field with a shell
+   // command, or a symbol not yet set, keeps those references
+   if (!(rest_test_fold (rt))
+         || (strcmp (rest_test_req_uri (rt), "https://example.com/v1/items/7")) != 0
+         || (strcmp (rest_test_req_body (rt), "id={{ID}} cmd={{CMD}} late={{LATE}}")) != 0) {
+      ERRORF ("Unexpected folding\n");
+      rest_test_dump (rt, stderr);
+      errcount++;
+      goto cleanup;
+   }
+
+   // Folding and then evaluating renders what evaluating alone does
+   if (!(symt_set (global, "LATE", "{{ID}}{{CMD}}"))
+         || !(rest_test_fold (rt))
+         || !(rest_test_eval_req (rt, &errtoken))
+         || (strcmp (rest_test_req_uri (rt), "https://example.com/v1/items/7")) != 0
+         || (strcmp (rest_test_req_body (rt), "id=7 cmd=cmd-7 late=7cmd-7")) != 0
+         || (strcmp (rest_test_req_method (rt), "POST")) != 0) {
+      ERRORF ("Unexpected evaluation after folding\n");
+      rest_test_dump (rt, stderr);
+      errcount++;
+   }
+
+   // A write to the chain after the fold is seen by the next evaluation
+   if (!(symt_set (global, "ID", "8")) || !(rest_test_eval_req (rt, &errtoken))
+         || (strcmp (rest_test_req_uri (rt), "https://example.com/v1/items/8")) != 0
+         || (strcmp (rest_test_req_body (rt), "id=8 cmd=cmd-8 late=8cmd-8")) != 0) {
+      ERRORF ("Evaluation after a write did not see the new symbol value\n");
+      rest_test_dump (rt, stderr);
+      errcount++;
+   }
+
+   // Setting a field drops its fold
+   if (!(rest_test_fold (rt))
+         || !(req_set (rt, rest_test_req_set_uri, "/{{ID}}"))
+         || !(rest_test_eval_req (rt, &errtoken))
+         || (strcmp (rest_test_req_uri (rt), "/8")) != 0) {
+      ERRORF ("Setting a folded field did not replace it\n");
+      rest_test_dump (rt, stderr);
+      errcount++;
+   }
+
+cleanup:
+   rest_test_del (&rt);
+   rest_test_symt_del (&global);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+// Runs `command` through the cache and checks its output
+static bool shell_expect (const char *command, const char *expected)
+{
+   char *output = NULL;
+   int status = -1;
+   bool ret = rest_test_shell_exec (command, &output, &status)
+            && status == 0 && (strcmp (output, expected)) == 0;
+   if (!ret) {
+      ERRORF ("[%s]: expected [%s], got [%s] (status %i)\n", command, expected,
+              output ? output : "(null)", status);
+   }
+   free (output);
+   return ret;
+}
+
+int test_shell (void)
+{
+   int errcount = 0;
+   static const size_t nbig = 300000;
+   const char *empty[] = { NULL };
+   char *counter = file_new (empty);
+   char *command = NULL, *output = NULL;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_t *rt = global ? rest_test_new ("shell", "shell", 1, global) : NULL;
+   int status = -1;
+
+   if (!counter || !rt || !(command = ds_str_cat ("echo x >> ", counter, " && wc -l < ",
+                                                  counter, NULL))) {
+      ERRORF ("Failed to set up shell test\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Output larger than any pipe buffer is read whole; stderr is not captured
+   if (!(rest_test_shell_run ("head -c 300000 /dev/zero | tr '\\0' a; echo err >&2",
+                              &output, &status))
+         || status != 0 || strlen (output) != nbig || output[nbig - 1] != 'a') {
+      ERRORF ("Unexpected large output (status %i)\n", status);
+      errcount++;
+   }
+   free (output);
+
+   // The exit status is returned separately from the output
+   if ((rest_test_shell_run ("echo out; exit 3", &output, &status)) || status != 3 || output) {
+      ERRORF ("Failed command was not reported (status %i)\n", status);
+      errcount++;
+   }
+   free (output);
+   output = NULL;
+
+   // Without caching every reference runs the command
+   if (!(shell_expect (command, "1\n")) || !(shell_expect (command, "2\n"))) {
+      errcount++;
+   }
+
+   // Once per run
+   if (!(rest_test_shell_set_policy ("run"))
+         || !(shell_expect (command, "3\n")) || !(shell_expect (command, "3\n"))) {
+      errcount++;
+   }
+   rest_test_shell_begin_test (NULL);
+   if (!(shell_expect (command, "3\n")) || rest_test_shell_hits () != 2) {
+      ERRORF ("Expected 2 hits, got %zu\n", rest_test_shell_hits ());
+      errcount++;
+   }
+
+   // Once per test
+   rest_test_shell_clear ();
+   if (!(rest_test_shell_set_policy ("test"))
+         || !(shell_expect (command, "4\n")) || !(shell_expect (command, "4\n"))) {
+      errcount++;
+   }
+   rest_test_shell_begin_test (NULL);
+   if (!(shell_expect (command, "5\n"))) {
+      errcount++;
+   }
+
+   // Within the TTL only
+   rest_test_shell_clear ();
+   if (!(rest_test_shell_set_policy ("ttl=0.2"))
+         || !(shell_expect (command, "6\n")) || !(shell_expect (command, "6\n"))) {
+      errcount++;
+   }
+   nanosleep (&(struct timespec) { 0, 250000000 }, NULL);
+   if (!(shell_expect (command, "7\n"))) {
+      errcount++;
+   }
+
+   if ((rest_test_shell_set_policy ("ttl=0")) || (rest_test_shell_set_policy ("forever"))
+         || rest_test_shell_policy () != rest_test_shell_TTL) {
+      ERRORF ("Invalid policy was accepted\n");
+      errcount++;
+   }
+
+   // A shell symbol referenced twice in a test is run once per test
+   rest_test_shell_clear ();
+   rest_test_token_t *token = rest_test_token_new (token_STRING, "{{N}}/{{N}}", "shell", 1);
+   bool ok = rest_test_shell_set_policy ("test")
+          && state_token (global, "N", token_SHELLCMD, command, "shell", 1)
+          && token && rest_test_req_set_body (rt, token)
+          && rest_test_eval_req (rt, NULL)
+          && (strcmp (rest_test_req_body (rt), "8/8")) == 0
+          && rest_test_eval_req (rt, NULL)
+          && (strcmp (rest_test_req_body (rt), "9/9")) == 0;
+   rest_test_token_del (&token);
+   if (!ok || rest_test_shell_hits () != 2 || rest_test_shell_misses () != 2) {
+      ERRORF ("Unexpected caching of shell symbol [%s]: %zu hits, %zu misses\n",
+              rest_test_req_body (rt), rest_test_shell_hits (), rest_test_shell_misses ());
+      errcount++;
+   }
+
+cleanup:
+   rest_test_shell_set_policy ("always");
+   rest_test_shell_clear ();
+   free (command);
+   file_del (&counter);
+   rest_test_del (&rt);
+   rest_test_symt_del (&global);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+// Runs `echo $$` in the calling thread's shell
+static void *coproc_pid (void *ptr)
+{
+   char **output = ptr;
+   if (!(rest_test_shell_run ("echo $$", output, NULL)))
+      *output = NULL;
+   rest_test_shell_stop ();
+   return NULL;
+}
+
+int test_coproc (void)
+{
+   int errcount = 0;
+   static const size_t nbig = 300000;
+   char *pid = NULL, *output = NULL, *thread_pid = NULL;
+   int status = -1;
+
+   rest_test_shell_set_persistent (true);
+
+   static const struct {
+      const char *command;
+      const char *expected;
+   } commands[] = {
+      { "echo hello",                           "hello\n" },
+      { "printf 'no newline'",                  "no newline" },
+      { "echo 'quoted '\"words\"; echo err >&2", "quoted words\n" },
+      { "cd / && X=1 && pwd",                   "/\n" },
+      { "test -z \"$X\" && pwd | grep -vx /",   NULL },
+      { "cat",                                  "" },
+      { "",                                     "" },
+   };
+   for (size_t i=0; i<sizeof commands / sizeof commands[0]; i++) {
+      bool ok = rest_test_shell_run (commands[i].command, &output, &status);
+      if (!ok || (commands[i].expected && (strcmp (output, commands[i].expected)) != 0)) {
+         ERRORF ("[%s]: expected [%s], got [%s] (status %i)\n", commands[i].command,
+                 commands[i].expected, output ? output : "(null)", status);
+         errcount++;
+      }
+      free (output);
+   }
+
+   // Every command runs in the same shell
+   if (!(rest_test_shell_run ("echo $$", &pid, NULL))) {
+      ERRORF ("Failed to read the shell's pid\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Failures, including a syntax error and an exit, do not end the shell
+   static const struct {
+      const char *command;
+      int status;
+   } failures[] = {
+      { "echo out; exit 5",   5 },
+      { "echo (",             2 },
+      { "kill -9 $(sh -c 'echo $PPID')", 137 },
+   };
+   for (size_t i=0; i<sizeof failures / sizeof failures[0]; i++) {
+      if ((rest_test_shell_run (failures[i].command, &output, &status))
+            || status != failures[i].status || output) {
+         ERRORF ("[%s]: expected status %i, got %i\n", failures[i].command,
+                 failures[i].status, status);
+         errcount++;
+      }
+   }
+   if (!(rest_test_shell_run ("echo $$", &output, NULL)) || (strcmp (output, pid)) != 0) {
+      ERRORF ("Shell was restarted: [%s] is not [%s]\n", output, pid);
+      errcount++;
+   }
+   free (output);
+
+   if (!(rest_test_shell_run ("head -c 300000 /dev/zero | tr '\\0' a", &output, &status))
+         || strlen (output) != nbig || output[nbig - 1] != 'a') {
+      ERRORF ("Unexpected large output (status %i)\n", status);
+      errcount++;
+   }
+   free (output);
+
+   // Each thread has its own shell
+   pthread_t thread;
+   if ((pthread_create (&thread, NULL, coproc_pid, &thread_pid)) != 0
+         || (pthread_join (thread, NULL)) != 0
+         || !thread_pid || (strcmp (thread_pid, pid)) == 0) {
+      ERRORF ("Thread did not run its own shell: [%s]\n", thread_pid);
+      errcount++;
+   }
+
+   // A shell that dies fails its command, and a shell that dies or is stopped
+   // is replaced on the next command
+   if ((rest_test_shell_run ("kill -9 $$", &output, NULL))) {
+      ERRORF ("Command that killed the shell succeeded\n");
+      errcount++;
+   }
+   for (size_t i=0; i<2; i++) {
+      if (!(rest_test_shell_run ("echo $$", &output, NULL)) || (strcmp (output, pid)) == 0) {
+         ERRORF ("Shell was not replaced: [%s]\n", output);
+         errcount++;
+      }
+      free (output);
+      rest_test_shell_stop ();
+   }
+
+cleanup:
+   rest_test_shell_stop ();
+   rest_test_shell_set_persistent (false);
+   free (thread_pid);
+   free (pid);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+int test_prefetch (void)
+{
+   int errcount = 0;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_t *rts[4] = { NULL, NULL, NULL, NULL };
+   static const char *bodies[] = {
+      "{{N}}", "{{N}}/{{N}}", "<{{NESTED}}>", "{{LATER}} {{PLAIN}}",
+   };
+   bool ok = global
+          && state_token (global, "N", token_SHELLCMD, "echo n-{{ID}}", "prefetch", 1)
+          && state_token (global, "LATER", token_SHELLCMD, "echo {{N}}", "prefetch", 1)
+          && state_token (global, "PLAIN", token_SHELLCMD, "echo plain", "prefetch", 1)
+          && symt_set (global, "NESTED", "[{{N}}]")
+          && rest_test_prefetch_symbol ("N")
+          && rest_test_prefetch_symbol ("LATER");
+   for (size_t i=0; ok && i<sizeof rts / sizeof rts[0]; i++) {
+      char id[8];
+      snprintf (id, sizeof id, "%zu", i);
+      ok = (rts[i] = rest_test_new ("prefetch", "prefetch", 1, global))
+        && symt_set (rest_test_symt (rts[i]), "ID", id)
+        && req_set (rts[i], rest_test_req_set_body, bodies[i]);
+   }
+   if (!ok) {
+      ERRORF ("Failed to set up prefetch test\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Each reference to an enabled symbol is started, including those in
+   // nested values; a command that refers to another command, and a symbol
+   // not enabled, are not
+   static const size_t nstarted[] = { 1, 2, 1, 0 };
+   for (size_t i=0; i<sizeof rts / sizeof rts[0]; i++) {
+      size_t started = rest_test_prefetch (rts[i]);
+      if (started != nstarted[i]) {
+         ERRORF ("[%s]: expected %zu prefetches, started %zu\n", bodies[i],
+                 nstarted[i], started);
+         errcount++;
+      }
+   }
+
+   // Tests evaluated in any order take the output of their own commands
+   static const char *expected[] = {
+      "n-0", "n-1/n-1", "<[n-2]>", "n-3 plain",
+   };
+   static const size_t order[] = { 2, 0, 3, 1 };
+   for (size_t i=0; i<sizeof order / sizeof order[0]; i++) {
+      size_t j = order[i];
+      if (!(rest_test_eval_req (rts[j], NULL))
+            || (strcmp (rest_test_req_body (rts[j]), expected[j])) != 0) {
+         ERRORF ("Expected [%s], got [%s]\n", expected[j], rest_test_req_body (rts[j]));
+         errcount++;
+      }
+   }
+   if (rest_test_shell_prefetched () != 4 || rest_test_shell_misses () != 3) {
+      ERRORF ("Expected 4 prefetched and 3 run, got %zu and %zu\n",
+              rest_test_shell_prefetched (), rest_test_shell_misses ());
+      errcount++;
+   }
+
+   // A command that changed after it was started is run again, and the
+   // prefetched one is discarded
+   if (rest_test_prefetch (rts[0]) != 1
+         || !(symt_set (rest_test_symt (rts[0]), "ID", "changed"))
+         || !(rest_test_eval_req (rts[0], NULL))
+         || (strcmp (rest_test_req_body (rts[0]), "n-changed")) != 0
+         || rest_test_shell_prefetched () != 4 || rest_test_shell_misses () != 4) {
+      ERRORF ("Stale prefetch was used: [%s]\n", rest_test_req_body (rts[0]));
+      errcount++;
+   }
+
+   // Commands never taken are discarded with their test
+   if (rest_test_prefetch (rts[1]) != 2) {
+      ERRORF ("Failed to prefetch for a test that is not evaluated\n");
+      errcount++;
+   }
+
+cleanup:
+   for (size_t i=0; i<sizeof rts / sizeof rts[0]; i++) {
+      rest_test_del (&rts[i]);
+   }
+   rest_test_shell_clear ();
+   rest_test_symt_del (&global);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+/* *****************************************************************************
+ * A loopback HTTP server for the client tests, on a thread of its own. The path
+ * of each request selects the response.
+ */
+#define SERVER_MAXCONNS    (16)
+
+struct server_conn_t {
+   int      fd;
+   bool     drop_next;     // Close without responding to the next request
+   double   due;           // When to answer a slow request; 0 when none is
+   size_t   len;
+   char     buffer[8192];
+};
+
+struct server_t {
+   int                  listener;
+   int                  wake[2];
+   unsigned             port;
+   size_t               accepts;
+   pthread_t            thread;
+   struct server_conn_t conns[SERVER_MAXCONNS];
+};
+
+static double server_now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void server_write (int fd, const char *data, size_t length)
+{
+   while (length) {
+      ssize_t n = send (fd, data, length, MSG_NOSIGNAL);
+      if (n <= 0)
+         return;
+      data += n;
+      length -= (size_t)n;
+   }
+}
+
+static void server_send (int fd, const char *data)
+{
+   server_write (fd, data, strlen (data));
+}
+
+// Responds to one request. Returns false when the connection is to be closed.
+static bool server_respond (struct server_conn_t *conn, const char *method,
+                            const char *target, const char *host, const char *body)
+{
+   char rsp[2048];
+   if (conn->drop_next)
+      return false;
+
+   if ((strncmp (target, "/echo", 5)) == 0) {
+      char echo[1024];
+      int n = snprintf (echo, sizeof echo, "%s %s %s", method, target, body);
+      snprintf (rsp, sizeof rsp, "HTTP/1.1 200 OK\r\ncontent-length: %i\r\nx-host: %s\r\n"
+                                 "x-dup: a\r\nX-Dup:  b \r\n\r\n%s",
+                n, host, (strcmp (method, "HEAD")) == 0 ? "" : echo);
+      server_send (conn->fd, rsp);
+      return true;
+   }
+   if ((strcmp (target, "/chunked")) == 0) {
+      static const char *const parts[] = {
+         "HTTP/1.1 201 Created\r\ntransfer-encoding: chunked\r\n\r\n5;ext=1\r",
+         "\nhel", "lo\r\n1\r\n \r\n", "5\r\nworld\r", "\n0\r\nx-trailer: t\r\n", "\r\n",
+      };
+      for (size_t i=0; i<sizeof parts / sizeof parts[0]; i++) {
+         server_send (conn->fd, parts[i]);
+         nanosleep (&(struct timespec) { 0, 2000000 }, NULL);
+      }
+      return true;
+   }
+   if ((strcmp (target, "/slow")) == 0) {
+      conn->due = server_now () + 0.1;
+      return true;
+   }
+   if ((strcmp (target, "/close")) == 0) {
+      server_send (conn->fd, "HTTP/1.1 200 OK\r\nconnection: close\r\n"
+                             "content-length: 6\r\n\r\nclosed");
+      return false;
+   }
+   if ((strcmp (target, "/drop-next")) == 0) {
+      server_send (conn->fd, "HTTP/1.1 200 OK\r\ncontent-length: 4\r\n\r\ndrop");
+      conn->drop_next = true;
+      return true;
+   }
+   if ((strcmp (target, "/http10")) == 0) {
+      server_send (conn->fd, "HTTP/1.0 200 OK\r\n\r\nuntil close");
+      return false;
+   }
+   if ((strcmp (target, "/nocontent")) == 0) {
+      server_send (conn->fd, "HTTP/1.1 204 No Content\n\n");
+      return true;
+   }
+   if ((strcmp (target, "/continue")) == 0) {
+      server_send (conn->fd, "HTTP/1.1 100 Continue\r\n\r\n"
+                             "HTTP/1.1 200 OK\r\ncontent-length: 2\r\n\r\nok");
+      return true;
+   }
+   if ((strcmp (target, "/truncated")) == 0) {
+      server_send (conn->fd, "HTTP/1.1 200 OK\r\ncontent-length: 10\r\n\r\nshort");
+      return false;
+   }
+   server_send (conn->fd, "garbage\r\n\r\n");
+   return false;
+}
+
+// Responds to each complete request received. Returns false when the
+// connection is to be closed.
+static bool server_process (struct server_conn_t *conn)
+{
+   char *end;
+   while (!conn->due && (end = strstr (conn->buffer, "\r\n\r\n"))) {
+      char method[16], target[256], host[64] = "";
+      size_t head = (size_t)(end - conn->buffer) + 4, length = 0;
+      const char *field = NULL;
+      if ((sscanf (conn->buffer, "%15s %255s", method, target)) != 2)
+         return false;
+      if ((field = strstr (conn->buffer, "\r\nhost: ")) && field < end)
+         sscanf (field + 8, "%63[^\r]", host);
+      if ((field = strstr (conn->buffer, "\r\ncontent-length: ")) && field < end)
+         length = (size_t)strtoul (field + 18, NULL, 10);
+      if (conn->len < head + length)
+         return true;
+
+      char body[1024];
+      snprintf (body, sizeof body, "%.*s", (int)length, &conn->buffer[head]);
+      if (!(server_respond (conn, method, target, host, body)))
+         return false;
+      conn->len -= head + length;
+      memmove (conn->buffer, &conn->buffer[head + length], conn->len + 1);
+   }
+   return true;
+}
+
+static void *server_run (void *ptr)
+{
+   struct server_t *server = ptr;
+   struct pollfd pfds[SERVER_MAXCONNS + 2];
+
+   for (;;) {
+      pfds[0] = (struct pollfd) { server->wake[0], POLLIN, 0 };
+      pfds[1] = (struct pollfd) { server->listener, POLLIN, 0 };
+      // Wait no longer than the next slow request is due
+      double due = 0;
+      for (size_t i=0; i<SERVER_MAXCONNS; i++) {
+         pfds[i + 2] = (struct pollfd) { server->conns[i].fd, POLLIN, 0 };
+         if (server->conns[i].due && (!due || server->conns[i].due < due))
+            due = server->conns[i].due;
+      }
+      int timeout = due ? (int)((due - server_now ()) * 1000) + 1 : -1;
+      if ((poll (pfds, SERVER_MAXCONNS + 2, timeout < 0 && due ? 0 : timeout)) < 0
+            || pfds[0].revents) {
+         break;
+      }
+
+      for (size_t i=0; i<SERVER_MAXCONNS; i++) {
+         struct server_conn_t *conn = &server->conns[i];
+         if (conn->fd < 0 || !conn->due || conn->due > server_now ())
+            continue;
+         server_send (conn->fd, "HTTP/1.1 200 OK\r\ncontent-length: 4\r\n\r\nslow");
+         conn->due = 0;
+         if (!(server_process (conn))) {
+            close (conn->fd);
+            conn->fd = -1;
+         }
+      }
+
+      if (pfds[1].revents) {
+         int fd = accept (server->listener, NULL, NULL);
+         size_t i = 0;
+         while (i < SERVER_MAXCONNS && server->conns[i].fd >= 0)
+            i++;
+         if (fd >= 0 && i < SERVER_MAXCONNS) {
+            server->conns[i].fd = fd;
+            server->conns[i].len = 0;
+            server->conns[i].drop_next = false;
+            server->conns[i].due = 0;
+            server->accepts++;
+         } else if (fd >= 0) {
+            close (fd);
+         }
+      }
+
+      for (size_t i=0; i<SERVER_MAXCONNS; i++) {
+         struct server_conn_t *conn = &server->conns[i];
+         if (conn->fd < 0 || !pfds[i + 2].revents)
+            continue;
+         ssize_t n = recv (conn->fd, &conn->buffer[conn->len],
+                           sizeof conn->buffer - conn->len - 1, 0);
+         if (n > 0) {
+            conn->len += (size_t)n;
+            conn->buffer[conn->len] = 0;
+         }
+         if (n <= 0 || !(server_process (conn))) {
+            close (conn->fd);
+            conn->fd = -1;
+         }
+      }
+   }
+
+   for (size_t i=0; i<SERVER_MAXCONNS; i++) {
+      if (server->conns[i].fd >= 0)
+         close (server->conns[i].fd);
+   }
+   return NULL;
+}
+
+static bool server_start (struct server_t *server)
+{
+   struct sockaddr_in addr;
+   socklen_t addrlen = sizeof addr;
+   memset (server, 0, sizeof *server);
+   memset (&addr, 0, sizeof addr);
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+   for (size_t i=0; i<SERVER_MAXCONNS; i++) {
+      server->conns[i].fd = -1;
+   }
+   server->wake[0] = server->wake[1] = -1;
+
+   if ((server->listener = socket (AF_INET, SOCK_STREAM, 0)) < 0
+         || (bind (server->listener, (struct sockaddr *)&addr, sizeof addr)) != 0
+         || (listen (server->listener, 16)) != 0
+         || (getsockname (server->listener, (struct sockaddr *)&addr, &addrlen)) != 0
+         || (pipe (server->wake)) != 0
+         || (pthread_create (&server->thread, NULL, server_run, server)) != 0) {
+      if (server->listener >= 0)
+         close (server->listener);
+      if (server->wake[0] >= 0) {
+         close (server->wake[0]);
+         close (server->wake[1]);
+      }
+      return false;
+   }
+   server->port = ntohs (addr.sin_port);
+   return true;
+}
+
+// Stops the server and returns the number of connections it accepted
+static size_t server_stop (struct server_t *server)
+{
+   if ((write (server->wake[1], "", 1)) == 1)
+      pthread_join (server->thread, NULL);
+   close (server->listener);
+   close (server->wake[0]);
+   close (server->wake[1]);
+   return server->accepts;
+}
+
+// Sends `method` to `path` on the server and checks the status and body
+static bool http_expect (rest_test_http_t *http, rest_test_t *rt, unsigned port,
+                         const char *method, const char *path,
+                         const char *status, const char *body)
+{
+   char uri[128];
+   snprintf (uri, sizeof uri, "http://127.0.0.1:%u%s", port, path);
+   bool sent = req_set (rt, rest_test_req_set_method, method)
+            && req_set (rt, rest_test_req_set_uri, uri)
+            && rest_test_eval_req (rt, NULL)
+            && rest_test_http_send (http, rt);
+   if (!status)
+      return !sent && !rest_test_rsp_status_code (rt);
+   if (!sent || (strcmp (rest_test_rsp_status_code (rt), status)) != 0
+         || (strcmp (rest_test_rsp_body (rt), body)) != 0) {
+      ERRORF ("%s %s: expected [%s %s], got [%s %s]\n", method, path, status, body,
+              rest_test_rsp_status_code (rt), rest_test_rsp_body (rt));
+      return false;
+   }
+   return true;
+}
+
+int test_http (void)
+{
+   int errcount = 0;
+   static const size_t nrequests = 50;
+   struct server_t server;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_t *rt = global ? rest_test_new ("http", "http", 1, global) : NULL;
+   rest_test_http_t *http = rest_test_http_new ();
+   bool started = false;
+   size_t connects = 0;
+   char expected[64];
+
+   if (!rt || !http || !(started = server_start (&server))) {
+      ERRORF ("Failed to set up HTTP test\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // The request is sent whole, with a host header and the body's length;
+   // the fragment is not sent, and repeated response headers are joined
+   snprintf (expected, sizeof expected, "127.0.0.1:%u", server.port);
+   if (!(req_set (rt, rest_test_req_set_body, "data"))
+         || !(rest_test_req_set_header (rt, "http", 1, "X-Test: 1"))
+         || !(http_expect (http, rt, server.port, "POST", "/echo?q=1#frag",
+                           "200", "POST /echo?q=1 data"))
+         || (strcmp (rest_test_rsp_http_version (rt), "HTTP/1.1")) != 0
+         || (strcmp (rest_test_rsp_reason (rt), "OK")) != 0
+         || (strcmp (rest_test_rsp_header (rt, "x-host"), expected)) != 0
+         || (strcmp (rest_test_rsp_header (rt, "x-dup"), "a, b")) != 0) {
+      ERRORF ("Unexpected response [%s %s], x-host [%s], x-dup [%s]\n",
+              rest_test_rsp_http_version (rt), rest_test_rsp_reason (rt),
+              rest_test_rsp_header (rt, "x-host"), rest_test_rsp_header (rt, "x-dup"));
+      errcount++;
+   }
+
+   // Sequential requests share one connection, whatever the framing of the
+   // responses
+   req_set (rt, rest_test_req_set_body, "");
+   for (size_t i=0; i<nrequests; i++) {
+      if (!(http_expect (http, rt, server.port, "", "/echo", "200", "GET /echo "))) {
+         errcount++;
+         break;
+      }
+   }
+   if (!(http_expect (http, rt, server.port, "GET", "/chunked", "201", "hello world"))
+         || (strcmp (rest_test_rsp_header (rt, "x-trailer"), "t")) != 0
+         || !(http_expect (http, rt, server.port, "HEAD", "/echo", "200", ""))
+         || !(http_expect (http, rt, server.port, "GET", "/nocontent", "204", ""))
+         || !(http_expect (http, rt, server.port, "GET", "/continue", "200", "ok"))
+         || rest_test_http_connects (http) != 1
+         || rest_test_http_reuses (http) != nrequests + 4) {
+      ERRORF ("Expected 1 connection and %zu reuses, got %zu and %zu\n", nrequests + 4,
+              rest_test_http_connects (http), rest_test_http_reuses (http));
+      errcount++;
+   }
+
+   // A connection that the server closes, or that it will not respond on, is
+   // replaced
+   static const struct {
+      const char *path;
+      const char *body;
+   } closes[] = {
+      { "/close",       "closed" },
+      { "/http10",      "until close" },
+      { "/drop-next",   "drop" },
+   };
+   for (size_t i=0; i<sizeof closes / sizeof closes[0]; i++) {
+      size_t connects = rest_test_http_connects (http);
+      if (!(http_expect (http, rt, server.port, "GET", closes[i].path, "200", closes[i].body))
+            || !(http_expect (http, rt, server.port, "GET", "/echo", "200", "GET /echo "))
+            || rest_test_http_connects (http) != connects + 1) {
+         ERRORF ("%s: expected 1 new connection, made %zu\n", closes[i].path,
+                 rest_test_http_connects (http) - connects);
+         errcount++;
+      }
+   }
+
+   // A request that is not idempotent is not sent again once the server has
+   // read it, as the server may have acted on it; an idempotent one is
+   static const struct {
+      const char *method;
+      bool        retried;
+   } drops[] = {
+      { "POST",   false },
+      { "PATCH",  false },
+      { "PUT",    true },
+      { "DELETE", true },
+   };
+   for (size_t i=0; i<sizeof drops / sizeof drops[0]; i++) {
+      size_t connects = rest_test_http_connects (http);
+      char echo[32];
+      snprintf (echo, sizeof echo, "%s /echo ", drops[i].method);
+      if (!(http_expect (http, rt, server.port, "GET", "/drop-next", "200", "drop"))
+            || !(http_expect (http, rt, server.port, drops[i].method, "/echo",
+                              drops[i].retried ? "200" : NULL,
+                              drops[i].retried ? echo : NULL))
+            || rest_test_http_connects (http) != connects + drops[i].retried
+            || !(http_expect (http, rt, server.port, "GET", "/echo", "200", "GET /echo "))
+            || rest_test_http_connects (http) != connects + 1) {
+         ERRORF ("%s on a dropped connection: %s retried, made %zu connections\n",
+                 drops[i].method, drops[i].retried ? "expected to be" : "should not be",
+                 rest_test_http_connects (http) - connects);
+         errcount++;
+      }
+   }
+
+   // Invalid and incomplete responses, and requests that cannot be sent, fail
+   // and leave no response
+   static const char *const failures[] = {
+      "/garbage", "/truncated",
+   };
+   for (size_t i=0; i<sizeof failures / sizeof failures[0]; i++) {
+      if (!(http_expect (http, rt, server.port, "GET", failures[i], NULL, NULL))) {
+         ERRORF ("%s: expected to fail\n", failures[i]);
+         errcount++;
+      }
+   }
+   static const char *const uris[] = {
+      "https://127.0.0.1/", "ftp://127.0.0.1/", "/relative", "http:///", "http://host:0/",
+      "http://host:99999/", "http://user@host/", "http://[::1/", "http://127.0.0.1:1/",
+   };
+   for (size_t i=0; i<sizeof uris / sizeof uris[0]; i++) {
+      if (!(req_set (rt, rest_test_req_set_uri, uris[i]))
+            || (rest_test_http_send (http, rt)) || rest_test_rsp_status_code (rt)) {
+         ERRORF ("[%s]: expected to fail\n", uris[i]);
+         errcount++;
+      }
+   }
+
+   // Without pooling, or when the request asks, the connection is closed
+   connects = rest_test_http_connects (http);
+   rest_test_http_set_pool (http, 0);
+   for (size_t i=0; i<2; i++) {
+      if (!(http_expect (http, rt, server.port, "GET", "/echo", "200", "GET /echo "))) {
+         errcount++;
+      }
+   }
+   rest_test_http_set_pool (http, 8);
+   if (!(rest_test_req_set_header (rt, "http", 1, "connection: close"))
+         || !(http_expect (http, rt, server.port, "GET", "/echo", "200", "GET /echo "))
+         || !(http_expect (http, rt, server.port, "GET", "/echo", "200", "GET /echo "))
+         || rest_test_http_connects (http) != connects + 4) {
+      ERRORF ("Expected 4 connections, made %zu\n", rest_test_http_connects (http) - connects);
+      errcount++;
+   }
+
+cleanup:
+   connects = rest_test_http_connects (http);
+   rest_test_http_del (&http);
+   if (started && server_stop (&server) != connects) {
+      ERRORF ("Server accepted %zu connections, not %zu\n", server.accepts, connects);
+      errcount++;
+   }
+   rest_test_del (&rt);
+   rest_test_symt_del (&global);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+struct run_count_t {
+   size_t ok;
+   size_t failed;
+};
+
+static void run_count (rest_test_t *rt, bool ok, void *param)
+{
+   struct run_count_t *count = param;
+   (void)rt;
+   if (ok) {
+      count->ok++;
+   } else {
+      count->failed++;
+   }
+}
+
+// Runs the tests and checks how many succeed and how long they take at most,
+// or at least when `at_least` is set
+static bool run_expect (rest_test_http_t *http, rest_test_t **rts, size_t ntests,
+                        size_t parallel, size_t nok, double seconds, bool at_least)
+{
+   struct run_count_t count = { 0, 0 };
+   double start = server_now ();
+   size_t nfailed = rest_test_http_run (http, rts, ntests, parallel, run_count, &count);
+   double elapsed = server_now () - start;
+   if (nfailed != ntests - nok || count.ok != nok || count.failed != nfailed
+         || (at_least ? elapsed < seconds : elapsed > seconds)) {
+      ERRORF ("%zu tests, %zu at once: %zu (%zu) failed in %.3fs, expected %zu in %s %.3fs\n",
+              ntests, parallel, nfailed, count.failed, elapsed, ntests - nok,
+              at_least ? "at least" : "at most", seconds);
+      return false;
+   }
+   return true;
+}
+
+int test_executor (void)
+{
+   int errcount = 0;
+   static const size_t ntests = 12;
+   struct server_t server;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_http_t *http = rest_test_http_new ();
+   rest_test_t *rts[12];
+   bool started = false;
+   size_t connects = 0;
+   char host[64];
+
+   memset (rts, 0, sizeof rts);
+   bool ok = global && http && (started = server_start (&server));
+   snprintf (host, sizeof host, "http://127.0.0.1:%u", started ? server.port : 0);
+   ok = ok && symt_set (global, "HOST", host);
+   for (size_t i=0; ok && i<ntests; i++) {
+      ok = (rts[i] = rest_test_new ("executor", "executor", i + 1, global))
+        && req_set (rts[i], rest_test_req_set_uri, "{{HOST}}/slow");
+   }
+   if (!ok) {
+      ERRORF ("Failed to set up executor test\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Slow requests all in flight at once take little longer than one; the
+   // next run reuses their connections
+   for (size_t run=0; run<2; run++) {
+      if (!(run_expect (http, rts, ntests, ntests, ntests, 0.6, false))
+            || rest_test_http_connects (http) != ntests
+            || rest_test_http_reuses (http) != ntests * run) {
+         ERRORF ("Run %zu: %zu connections, %zu reuses\n", run,
+                 rest_test_http_connects (http), rest_test_http_reuses (http));
+         errcount++;
+      }
+   }
+   for (size_t i=0; i<ntests; i++) {
+      if ((strcmp (rest_test_rsp_body (rts[i]), "slow")) != 0) {
+         ERRORF ("Test %zu: unexpected response [%s]\n", i, rest_test_rsp_body (rts[i]));
+         errcount++;
+      }
+   }
+
+   // One at a time, they do not overlap
+   if (!(run_expect (http, rts, 3, 1, 3, 0.3, true))) {
+      errcount++;
+   }
+
+   // A test that cannot be evaluated, or whose request fails, does not hold
+   // up the others
+   for (size_t i=0; i<ntests; i++) {
+      req_set (rts[i], rest_test_req_set_uri, i == 0 ? "{{MISSING}}/slow"
+                                            : i == 1 ? "{{HOST}}/garbage"
+                                            : "{{HOST}}/echo");
+   }
+   if (!(run_expect (http, rts, ntests, 4, ntests - 2, 5, false))
+         || rest_test_rsp_status_code (rts[0]) || rest_test_rsp_status_code (rts[1])
+         || (strcmp (rest_test_rsp_body (rts[ntests - 1]), "GET /echo ")) != 0) {
+      ERRORF ("Unexpected responses [%s] [%s] [%s]\n", rest_test_rsp_status_code (rts[0]),
+              rest_test_rsp_status_code (rts[1]), rest_test_rsp_body (rts[ntests - 1]));
+      errcount++;
+   }
+
+   // Requests that outlast the timeout fail
+   rest_test_http_set_timeout (http, 30);
+   req_set (rts[0], rest_test_req_set_uri, "{{HOST}}/slow");
+   req_set (rts[1], rest_test_req_set_uri, "{{HOST}}/slow");
+   if (!(run_expect (http, rts, 2, 2, 0, 5, false))) {
+      errcount++;
+   }
+
+   // `.parallel` applies to the tests that follow it
+   static const char *input[] = {
+      ".test 'a'", ".parallel 4", ".test 'b'", ".test 'c'", ".parallel 1", ".test 'd'", NULL,
+   };
+   static const size_t counts[] = { 0, 4, 4, 1 };
+   char *fname = file_new (input);
+   rest_test_t **parsed = fname ? rest_test_parse_file (global, fname) : NULL;
+   for (size_t i=0; i<sizeof counts / sizeof counts[0]; i++) {
+      if (!parsed || !parsed[i] || rest_test_get_parallel (parsed[i]) != counts[i]) {
+         ERRORF ("Test %zu: expected parallel %zu\n", i, counts[i]);
+         errcount++;
+         break;
+      }
+   }
+   for (size_t i=0; parsed && parsed[i]; i++) {
+      rest_test_del (&parsed[i]);
+   }
+   free (parsed);
+   file_del (&fname);
+
+cleanup:
+   connects = rest_test_http_connects (http);
+   rest_test_http_del (&http);
+   if (started && server_stop (&server) != connects) {
+      ERRORF ("Server accepted %zu connections, not %zu\n", server.accepts, connects);
+      errcount++;
+   }
+   for (size_t i=0; i<ntests; i++) {
+      rest_test_del (&rts[i]);
+   }
+   rest_test_symt_del (&global);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+// A registered builtin
+static bool builtin_twice (size_t nargs, const char *const *args, const size_t *lengths,
+                           char **result, size_t *length)
+{
+   (void)nargs;
+   if (!(*result = malloc (lengths[0] * 2 + 1)))
+      return false;
+   memcpy (*result, args[0], lengths[0]);
+   memcpy (&(*result)[lengths[0]], args[0], lengths[0] + 1);
+   *length = lengths[0] * 2;
+   return true;
+}
+
+int test_builtins (void)
+{
+   int errcount = 0;
+   rest_test_symt_t *global = rest_test_symt_new ("global", NULL, 8);
+   rest_test_t *rt = global ? rest_test_new ("builtins", "builtins", 1, global) : NULL;
+
+   static const struct {
+      const char *value;
+      const char *expected;
+   } calls[] = {
+      { "{{sha256(\"abc\")}}",
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+      { "{{sha256('')}}",
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+      { "{{sha256(\"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq\")}}",
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+      { "{{hmac_sha256(\"key\", \"The quick brown fox jumps over the lazy dog\")}}",
+        "f7bc83f430538424b13298e6aa6fb143ef4d59a14946175997479dbc2d1a3cd8" },
+      { "{{hmac_sha256_b64(KEY, MSG)}}",
+        "97yD9DBThCSxMpjmqm+xQ+9NWaFJRhdZl0edvC0aPNg=" },
+      { "{{base64(\"hello\")}} {{base64('hell')}} {{base64(\"<<?>>\")}} {{base64url(\"<<?>>\")}}",
+        "aGVsbG8= aGVsbA== PDw/Pj4= PDw_Pj4" },
+      { "{{unbase64(\"aGVsbG8=\")}} {{unbase64(base64url(\"hell\"))}}", "hello hell" },
+      { "{{hex(\"AZ\")}}",                         "415a" },
+      { "{{urlencode(\"a b&c/~\")}}",              "a%20b%26c%2F~" },
+      { "{{json(\"say \\\"hi\\\"\\n\")}}",         "say \\\"hi\\\"\\n" },
+      // Arguments can hold NUL bytes
+      { "{{urlencode(unbase64(\"AA==\"))}} {{urlencode(unbase64(\"YQBi\"))}}", "%00 a%00b" },
+      { "{{json(unbase64(\"AAAA\"))}} {{json(unbase64(\"YQBi\"))}}",
+        "\\u0000\\u0000\\u0000 a\\u0000b" },
+      { "{{upper(concat(\"ab\", NAME, 'c'))}}",    "ABNAME-7C" },
+      { "{{lower( \"MiXeD\" )}}|{{trim(\"  x \")}}|{{length(NAME)}}", "mixed|x|6" },
+      { "{{substr(\"abcdef\", 2)}} {{substr(\"abcdef\", -3, 2)}} {{substr('ab', 5)}}",
+        "cdef de " },
+      { "{{replace(\"a.b.c\", \".\", \"::\")}}",  "a::b::c" },
+      { "{{date(\"%Y\")}}",                        NULL },
+      { "{{twice(\"ab\")}}",                       "abab" },
+   };
+
+   if (!rt || !(symt_set (global, "ID", "7")) || !(symt_set (global, "NAME", "name-{{ID}}"))
+         || !(symt_set (global, "KEY", "key"))
+         || !(symt_set (global, "MSG", "The quick brown fox jumps over the lazy dog"))
+         || !(rest_test_builtin_register ("twice", 1, 1, builtin_twice))) {
+      ERRORF ("Failed to set up builtins test\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<sizeof calls / sizeof calls[0]; i++) {
+      if (!(req_set (rt, rest_test_req_set_body, calls[i].value))
+            || !(rest_test_eval_req (rt, NULL))
+            || (calls[i].expected && (strcmp (rest_test_req_body (rt), calls[i].expected)) != 0)) {
+         ERRORF ("[%s]: expected [%s], got [%s]\n", calls[i].value, calls[i].expected,
+                 rest_test_req_body (rt));
+         errcount++;
+      }
+   }
+
+   // Values that differ on each call have the right shape, and are not folded
+   if (!(req_set (rt, rest_test_req_set_body, "{{uuid()}} {{random(10)}} {{random_hex(4)}}"))
+         || !(rest_test_fold (rt)) || !(rest_test_eval_req (rt, NULL))) {
+      ERRORF ("Failed to evaluate random values\n");
+      errcount++;
+      goto cleanup;
+   }
+   const char *body = rest_test_req_body (rt);
+   if (strlen (body) != 36 + 1 + 1 + 1 + 8 || body[14] != '4' || body[8] != '-'
+         || !strchr ("89ab", body[19]) || !isdigit ((unsigned char)body[37])) {
+      ERRORF ("Unexpected random values [%s]\n", body);
+      errcount++;
+   }
+   char first[64];
+   snprintf (first, sizeof first, "%s", body);
+   if (!(rest_test_eval_req (rt, NULL)) || (strcmp (first, rest_test_req_body (rt))) == 0) {
+      ERRORF ("Random values were reused: [%s]\n", first);
+      errcount++;
+   }
+
+   // Errors
+   static const char *const bad[] = {
+      "{{nosuch()}}", "{{sha256()}}", "{{sha256(\"a\", \"b\")}}", "{{sha256(\"a\"}}",
+      "{{sha256(\"a)}}", "{{sha256(MISSING)}}", "{{random(0)}}", "{{substr(\"a\", x1)}}",
+      "{{upper(\"a\") x}}", "{{unbase64(\"a\")}}",
+   };
+   for (size_t i=0; i<sizeof bad / sizeof bad[0]; i++) {
+      if (!(req_set (rt, rest_test_req_set_body, bad[i])) || (rest_test_eval_req (rt, NULL))) {
+         ERRORF ("[%s] did not fail\n", bad[i]);
+         errcount++;
+      }
+   }
+
+cleanup:
+   rest_test_del (&rt);
+   rest_test_symt_del (&global);
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
+// Refuses the fifth add to the table it is set on
+static bool refuse_fifth (void *ctx, rest_test_symt_t *symt, size_t id,
+                          const rest_test_token_t *token)
+{
+   (void)symt;
+   (void)id;
+   size_t *nadds = ctx;
+   return !token || ++*nadds != 5;
+}
+
+int test_parallel (void)
+{
+   int errcount = 0;
+   static const size_t nfiles = 16;
+   char *fnames[17] = { NULL };
+   rest_test_symt_t *globals[2] = {
+      rest_test_symt_new ("global", NULL, 8),
+      rest_test_symt_new ("global", NULL, 8),
+   };
+   rest_test_symt_t *parents[2] = {
+      rest_test_symt_new ("parent", globals[0], 8),
+      rest_test_symt_new ("parent", globals[1], 8),
+   };
+   rest_test_t **rts[2] = { NULL, NULL };
+   char *dumps[2] = { NULL, NULL };
+   rest_test_t **bad = NULL;
+
+   if (!globals[0] || !globals[1] || !parents[0] || !parents[1]) {
+      ERRORF ("OOM allocating parallel test objects\n");
+      errcount++;
+      goto cleanup;
+   }
+
+   // Every file writes the same globals, so the result depends on the order in
+   // which the writes are applied.
+   for (size_t i=0; i<nfiles; i++) {
+      const char *lines[] = {
+         i ? ".global COUNT 'more'" : ".global COUNT 'one'",
+         ".test 'first'",
+         ".uri COUNT",
+         i % 2 ? ".parent ODD 'yes'" : ".parent EVEN 'yes'",
+         ".test 'second'",
+         NULL,
+      };
+      fnames[i] = file_new (lines);
+      if (!fnames[i]) {
+         ERRORF ("Failed to create input file %zu\n", i);
+         errcount++;
+         goto cleanup;
+      }
+   }
+
+   // Parsing in parallel must produce exactly what parsing each file in turn does
+   size_t ntests = 0;
+   for (size_t i=0; i<nfiles; i++) {
+      rest_test_t **tmp = rest_test_parse_file (parents[0], fnames[i]);
+      for (size_t j=0; tmp && tmp[j]; j++) {
+         rest_test_t **grown = realloc (rts[0], (ntests + 2) * sizeof *grown);
+         if (!grown) {
+            rest_test_del (&tmp[j]);
+            continue;
+         }
+         rts[0] = grown;
+         rts[0][ntests++] = tmp[j];
+         rts[0][ntests] = NULL;
+      }
+      free (tmp);
+   }
+   rts[1] = rest_test_parse_files (parents[1], (const char *const *)fnames, nfiles, 4);
+   if (!rts[0] || !rts[1] || ntests != nfiles * 2) {
+      ERRORF ("Failed to parse %zu files (%zu tests)\n", nfiles, ntests);
+      errcount++;
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<2; i++) {
+      dumps[i] = dump_suite (rts[i], parents[i], globals[i]);
+   }
+   if (!dumps[0] || !dumps[1] || (strcmp (dumps[0], dumps[1])) != 0) {
+      ERRORF ("Parallel parse differs:\n%s\n---\n%s\n", dumps[0], dumps[1]);
+      errcount++;
+   }
+
+   const rest_test_token_t *count = rest_test_symt_value (globals[1], "COUNT");
+   if (!count || (strcmp (rest_test_token_source (count), fnames[nfiles - 1])) != 0) {
+      ERRORF ("Last write to COUNT came from [%s]\n", rest_test_token_source (count));
+      errcount++;
+   }
+
+   // A file that fails leaves the tables untouched
+   if (!(fnames[nfiles] = file_new ((const char *[]) { ".global COUNT 'bad'", ".bogus", NULL }))) {
+      ERRORF ("Failed to create bad input file\n");
+      errcount++;
+      goto cleanup;
+   }
+   if ((bad = rest_test_parse_files (parents[1], (const char *const *)fnames, nfiles + 1, 0))) {
+      ERRORF ("Parsed a file with an unknown directive\n");
+      errcount++;
+   }
+   free (dumps[1]);
+   dumps[1] = dump_suite (rts[1], parents[1], globals[1]);
+   if (!dumps[1] || (strcmp (dumps[0], dumps[1])) != 0) {
+      ERRORF ("Failed parallel parse changed the tables:\n%s\n", dumps[1]);
+      errcount++;
+   }
+
+   // So does a write that fails after others were applied: in reverse order
+   // the files would leave COUNT from the first file, and the fifth write to
+   // the parent table is refused
+   const char *reversed[16];
+   for (size_t i=0; i<nfiles; i++) {
+      reversed[i] = fnames[nfiles - 1 - i];
+   }
+   size_t nadds = 0;
+   struct rest_test_symt_hook_t refuse = { refuse_fifth, &nadds };
+   rest_test_symt_set_hook (parents[1], &refuse);
+   if ((bad = rest_test_parse_files (parents[1], reversed, nfiles, 4))) {
+      ERRORF ("Parse succeeded although a write was refused\n");
+      errcount++;
+   }
+   rest_test_symt_set_hook (parents[1], NULL);
+   free (dumps[1]);
+   dumps[1] = dump_suite (rts[1], parents[1], globals[1]);
+   count = rest_test_symt_value (globals[1], "COUNT");
+   if (!count || (strcmp (rest_test_token_source (count), fnames[nfiles - 1])) != 0) {
+      ERRORF ("COUNT left from [%s]\n", rest_test_token_source (count));
+      errcount++;
+   }
+   if (nadds < 5 || !dumps[1] || (strcmp (dumps[0], dumps[1])) != 0) {
+      ERRORF ("Refused write left the tables changed (%zu adds):\n%s\n", nadds, dumps[1]);
+      errcount++;
+   }
+
+cleanup:
+   for (size_t i=0; bad && bad[i]; i++) {
+      rest_test_del (&bad[i]);
+   }
+   free (bad);
+   for (size_t i=0; i<2; i++) {
+      for (size_t j=0; rts[i] && rts[i][j]; j++) {
+         rest_test_del (&rts[i][j]);
+      }
+      free (rts[i]);
+      free (dumps[i]);
+      rest_test_symt_del (&parents[i]);
+      rest_test_symt_del (&globals[i]);
+   }
+   for (size_t i=0; i<=nfiles; i++) {
+      file_del (&fnames[i]);
+   }
+   printf ("Encountered %i errors\n", errcount);
+   return errcount;
+}
+
 int main (int argc, char **argv)
 {
    int ret = 0;
@@ -256,6 +3144,31 @@ int main (int argc, char **argv)
       { "symt",      test_symt },
       { "rest_test", test_rest_test },
       { "parser",    test_parser },
+      { "lexer",     test_lexer },
+      { "runs",      test_lexer_runs },
+      { "slices",    test_token_slices },
+      { "intern",    test_intern },
+      { "arena",     test_arena },
+      { "bundle",    test_bundle },
+      { "cache",     test_cache },
+      { "directives", test_directives },
+      { "stream",    test_stream },
+      { "parallel",  test_parallel },
+      { "symt_ids",  test_symt_ids },
+      { "symt_cache", test_symt_cache },
+      { "symt_fork", test_symt_fork },
+      { "symt_stats", test_symt_stats },
+      { "state",     test_state },
+      { "journal",   test_journal },
+      { "environment", test_environment },
+      { "interpolate", test_interpolate },
+      { "fold",        test_fold },
+      { "shell",       test_shell },
+      { "coproc",      test_coproc },
+      { "builtins",    test_builtins },
+      { "prefetch",    test_prefetch },
+      { "http",        test_http },
+      { "executor",    test_executor },
    };
 
    printf ("%i\n", argc);
@@ -3,14 +3,20 @@
 #include <stdlib.h>
 #include <ctype.h>
 
+#include <pthread.h>
+
 #include "ds_hmap.h"
 #include "ds_stack.h"
 #include "ds_array.h"
 #include "ds_str.h"
 
+#include "rest_test_arena.h"
 #include "rest_test_token.h"
 #include "rest_test_symt.h"
+#include "rest_test_intern.h"
 #include "rest_test.h"
+#include "rest_test_shell.h"
+#include "rest_test_builtin.h"
 
 /* ***************************************************************************
  *
@@ -136,10 +142,25 @@
 
 // Store headers. Essentially just a key/value pair and a source (file + line)
 struct header_t {
-   char     *source;
+   const char *source;     // interned
    size_t   line_no;
    char     *name;
    char     *value;
+   bool     pooled;        // Allocated from an arena
+};
+
+// An interpolatable value compiled into literal text and `{{symbol}}` references
+struct template_t;
+
+// A request token compiled for interpolation
+struct interp_t {
+   // The token as it was set; NULL when it has no references
+   struct template_t *tmpl;
+   // `tmpl` with the references to constant values substituted, valid while
+   // the table it was folded against is at `version`. Without references
+   // left, the token already holds the result.
+   struct template_t *folded;
+   size_t             version;
 };
 
 // Store the request information
@@ -149,7 +170,13 @@ struct req_t {
    rest_test_token_t *uri;
    rest_test_token_t *http_version;
    rest_test_token_t *body;
+   // How each token is rendered when the request is evaluated
+   struct interp_t    method_interp;
+   struct interp_t    uri_interp;
+   struct interp_t    http_version_interp;
+   struct interp_t    body_interp;
    ds_hmap_t         *headers;    // struct header_t *
+   rest_test_arena_t *arena;      // Tokens and headers are allocated from here
 };
 
 // Store the response information
@@ -168,7 +195,7 @@ struct rsp_t {
 // nested expressions. When the stack of operator + operands is constructed
 // correctly (i.e. postfix notation) then evaluating an expression becomes simple.
 struct assertion_t {
-   char        *source;
+   const char  *source;    // interned
    size_t       line_no;
    ds_stack_t  *stack;
 };
@@ -178,14 +205,21 @@ struct rest_test_t {
    // Caller need not check for failure after every access
    int lasterr;
 
+   // When not NULL, the test was created by a parse session and is released
+   // together with everything else allocated from this arena.
+   rest_test_arena_t *arena;
+
    // Symbol table
    rest_test_symt_t  *st;
 
    // Identify the test
-   char  *fname;
+   const char *fname;      // interned
    size_t line_no;
    char  *name;
 
+   // The most requests in flight with this one; 0 when not set
+   size_t parallel;
+
    // The request and response data; note that all responses are stored in memory
    struct req_t req;
    struct rsp_t rsp;
@@ -212,20 +246,6 @@ for (size_t i=0; s[i]; i++) {\
    s[i] = (unsigned char)tolower(s[i]);\
 }
 
-#define SET_TOKEN_FIELD(obj,field,value)  \
-do {\
-   if (!obj || obj->lasterr)\
-      return false;\
-   rest_test_token_t *tmp = rest_test_token_dup (value);\
-   if (!tmp) {\
-      obj->lasterr = -1;\
-      return false;\
-   }\
-   rest_test_token_del (&obj->field);\
-   obj->field = tmp;\
-   return true;\
-} while (0)
-
 #define SET_STRING_FIELD(obj,field,value)  \
 do {\
    if (!obj || obj->lasterr)\
@@ -241,6 +261,596 @@ do {\
 } while (0)
 
 
+/* *********************************************************************************
+ * Interpolation templates.
+ *
+ * A value is compiled once into a list of segments, each either a run of literal
+ * text or a reference to a symbol, so that rendering it is a single pass into a
+ * buffer sized beforehand. A `{{` preceded by a backslash, or with no closing
+ * `}}`, ends the references: the rest of the value is literal.
+ *
+ * A referenced value that itself holds references is expanded in turn, and a
+ * referenced shell command is run and replaced by its output. A reference of
+ * the form `{{name(args)}}` calls a builtin function (see rest_test_builtin.h).
+ */
+
+#define SEGMENT_LITERAL    ((size_t)-1)
+#define SEGMENT_CALL       ((size_t)-2)
+// Deeper nesting than this is taken to be a symbol that refers to itself
+#define TEMPLATE_MAXDEPTH  (16)
+
+struct segment_t {
+   size_t   offset;     // In the template text
+   size_t   length;
+   size_t   id;         // The symbol id, SEGMENT_LITERAL or SEGMENT_CALL
+};
+
+struct template_t {
+   // The compiled value; each symbol name or call is NUL-terminated in place
+   char             *text;
+   size_t            nsegments;
+   size_t            nreferences;
+   struct segment_t  segments[];
+};
+
+// What a reference renders to
+struct part_t {
+   const char        *value;
+   size_t             length;
+   char              *expanded;    // Owned by the part
+   rest_test_token_t *output;      // Owned by the part
+};
+
+static void template_del (struct template_t **tmpl)
+{
+   if (!tmpl)
+      return;
+   free (*tmpl);
+   *tmpl = NULL;
+}
+
+// Finds the next reference at or after `pos`, returning false if there are no
+// more references
+static bool template_next (const char *text, size_t pos, size_t *start, size_t *end)
+{
+   const char *open = strstr (&text[pos], "{{");
+   if (!open || (open != text && open[-1] == '\\'))
+      return false;
+
+   const char *close = strstr (open + 2, "}}");
+   if (!close)
+      return false;
+
+   *start = (size_t)(open - text);
+   *end = (size_t)(close - text);
+   return true;
+}
+
+// Compiles `value` into `*dst`, which is set to NULL if the value has no
+// references. Returns false on failure.
+static bool template_compile (const char *value, struct template_t **dst)
+{
+   size_t start, end, pos = 0, nreferences = 0;
+
+   *dst = NULL;
+   if (!value)
+      return true;
+
+   while ((template_next (value, pos, &start, &end))) {
+      nreferences++;
+      pos = end + 2;
+   }
+   if (!nreferences)
+      return true;
+
+   // The segments and the text share one allocation
+   size_t nsegments = nreferences * 2 + 1;
+   size_t length = strlen (value);
+   struct template_t *ret = malloc (sizeof *ret + nsegments * sizeof ret->segments[0] + length + 1);
+   if (!ret)
+      return false;
+
+   ret->text = (char *)&ret->segments[nsegments];
+   memcpy (ret->text, value, length + 1);
+   ret->nsegments = 0;
+   ret->nreferences = nreferences;
+
+   pos = 0;
+   for (size_t i=0; i<nreferences; i++) {
+      template_next (value, pos, &start, &end);
+      if (start > pos) {
+         ret->segments[ret->nsegments++] = (struct segment_t) { pos, start - pos, SEGMENT_LITERAL };
+      }
+      ret->text[end] = 0;
+      size_t id = strchr (&ret->text[start + 2], '(') ? SEGMENT_CALL
+                : rest_test_symt_id (&ret->text[start + 2]);
+      if (id == (size_t)-1) {
+         free (ret);
+         return false;
+      }
+      ret->segments[ret->nsegments++] = (struct segment_t) { start + 2, end - start - 2, id };
+      pos = end + 2;
+   }
+   if (pos < length) {
+      ret->segments[ret->nsegments++] = (struct segment_t) { pos, length - pos, SEGMENT_LITERAL };
+   }
+
+   *dst = ret;
+   return true;
+}
+
+static bool token_exec (rest_test_token_t *token, const struct template_t *tmpl,
+                        rest_test_symt_t *st, size_t depth);
+static bool template_fold (const struct template_t *tmpl, rest_test_symt_t *st,
+                           size_t depth, struct template_t **dst);
+static bool template_render (const struct template_t *tmpl, rest_test_symt_t *st,
+                             const char *source, size_t line_no, size_t depth,
+                             char **dst);
+
+// A call being evaluated
+struct call_t {
+   const char        *text;        // The whole reference, for messages
+   rest_test_symt_t  *st;
+   const char        *source;
+   size_t             line_no;
+};
+
+static bool call_eval (const struct call_t *call, const char **pos, size_t depth,
+                       char **result, size_t *length);
+
+// Resolves the reference `name` to the text that replaces it
+static bool part_resolve (struct part_t *part, size_t id, const char *name,
+                          rest_test_symt_t *st, const char *source, size_t line_no,
+                          size_t depth)
+{
+   if (id == SEGMENT_CALL) {
+      struct call_t call = { name, st, source, line_no };
+      const char *pos = name;
+      if (!(call_eval (&call, &pos, depth, &part->expanded, &part->length)))
+         return false;
+      pos += strspn (pos, " \t");
+      if (*pos) {
+         ERRORF ("[%s:%zu] Unexpected [%s] after call in [%s]\n", source, line_no, pos, name);
+         return false;
+      }
+      // The result may hold NULs, so the length is the function's
+      part->value = part->expanded;
+      return true;
+   }
+
+   const rest_test_token_t *token = rest_test_symt_value_id (st, id);
+   if (!token) {
+      ERRORF ("[%s:%zu] No symbol value found for [%s]\n", source, line_no, name);
+      return false;
+   }
+
+   if ((rest_test_token_type (token)) == token_SHELLCMD) {
+      struct template_t *tmpl = NULL;
+      if (!(part->output = rest_test_token_dup (token))
+            || !(template_compile (rest_test_token_value (token), &tmpl))) {
+         ERRORF ("[%s:%zu] OOM expanding [%s]\n", source, line_no, name);
+         return false;
+      }
+      bool ok = token_exec (part->output, tmpl, st, depth + 1);
+      template_del (&tmpl);
+      if (!ok)
+         return false;
+      part->value = rest_test_token_value (part->output);
+   } else {
+      part->value = rest_test_token_value (token);
+      if (part->value && strstr (part->value, "{{")) {
+         struct template_t *tmpl = NULL;
+         if (!(template_compile (part->value, &tmpl))) {
+            ERRORF ("[%s:%zu] OOM expanding [%s]\n", source, line_no, name);
+            return false;
+         }
+         bool ok = !tmpl || template_render (tmpl, st, source, line_no, depth + 1,
+                                             &part->expanded);
+         template_del (&tmpl);
+         if (!ok)
+            return false;
+         if (part->expanded)
+            part->value = part->expanded;
+      }
+   }
+
+   if (!part->value) {
+      ERRORF ("[%s:%zu] Internal error retrieving value for [%s]\n", source, line_no, name);
+      return false;
+   }
+   part->length = strlen (part->value);
+   return true;
+}
+
+#define CALL_SPACE   " \t"
+
+// Evaluates one argument of a call at `*pos`: a quoted string, a number, a
+// symbol or a nested call. The value is stored in `arg`, which the caller
+// frees, and `*pos` is left after the argument.
+static bool arg_eval (const struct call_t *call, const char **pos, size_t depth,
+                      char **arg, size_t *length)
+{
+   const char *p = *pos + strspn (*pos, CALL_SPACE);
+
+   if (*p == '"' || *p == '\'') {
+      char quote = *p++;
+      const char *start = p;
+      while (*p && *p != quote) {
+         p += p[0] == '\\' && p[1] ? 2 : 1;
+      }
+      if (*p != quote) {
+         ERRORF ("[%s:%zu] Unterminated string in [%s]\n", call->source, call->line_no,
+                 call->text);
+         return false;
+      }
+      if (!(*arg = malloc ((size_t)(p - start) + 1))) {
+         ERRORF ("[%s:%zu] OOM evaluating [%s]\n", call->source, call->line_no, call->text);
+         return false;
+      }
+      char *dst = *arg;
+      for (const char *src = start; src < p; src++) {
+         if (*src == '\\') {
+            src++;
+            *dst++ = *src == 'n' ? '\n' : *src == 't' ? '\t' : *src == 'r' ? '\r' : *src;
+         } else {
+            *dst++ = *src;
+         }
+      }
+      *dst = 0;
+      *length = (size_t)(dst - *arg);
+      *pos = p + 1;
+      return true;
+   }
+
+   size_t n = strcspn (p, CALL_SPACE ",()");
+   if (!n) {
+      ERRORF ("[%s:%zu] Missing argument in [%s]\n", call->source, call->line_no, call->text);
+      return false;
+   }
+   const char *next = p + n + strspn (p + n, CALL_SPACE);
+   if (*next == '(') {
+      *pos = p;
+      return call_eval (call, pos, depth + 1, arg, length);
+   }
+
+   if (!(*arg = malloc (n + 1))) {
+      ERRORF ("[%s:%zu] OOM evaluating [%s]\n", call->source, call->line_no, call->text);
+      return false;
+   }
+   memcpy (*arg, p, n);
+   (*arg)[n] = 0;
+   *length = n;
+   *pos = p + n;
+   if (isdigit ((unsigned char)*p) || (*p == '-' && isdigit ((unsigned char)p[1])))
+      return true;
+
+   // A symbol, rendered as its reference would be
+   struct part_t part = { NULL, 0, NULL, NULL };
+   size_t id = rest_test_symt_id (*arg);
+   bool ok = id != (size_t)-1
+          && part_resolve (&part, id, *arg, call->st, call->source, call->line_no, depth + 1);
+   char *value = ok ? malloc (part.length + 1) : NULL;
+   if (value) {
+      memcpy (value, part.value, part.length);
+      value[part.length] = 0;
+      *length = part.length;
+   }
+   free (part.expanded);
+   rest_test_token_del (&part.output);
+   free (*arg);
+   *arg = value;
+   return value != NULL;
+}
+
+// Evaluates the call `name(args)` at `*pos`, leaving `*pos` after the `)`
+static bool call_eval (const struct call_t *call, const char **pos, size_t depth,
+                       char **result, size_t *length)
+{
+   bool error = true;
+   char *args[REST_TEST_BUILTIN_MAXARGS];
+   size_t lengths[REST_TEST_BUILTIN_MAXARGS];
+   size_t nargs = 0;
+
+   if (depth > TEMPLATE_MAXDEPTH) {
+      ERRORF ("[%s:%zu] Calls nested more than %i deep in [%s]\n", call->source,
+              call->line_no, TEMPLATE_MAXDEPTH, call->text);
+      return false;
+   }
+
+   const char *name = *pos + strspn (*pos, CALL_SPACE);
+   size_t nlen = strcspn (name, CALL_SPACE "(");
+   const char *p = name + nlen + strspn (name + nlen, CALL_SPACE);
+   if (!nlen || *p++ != '(') {
+      CLEANUP ("[%s:%zu] Malformed call [%s]\n", call->source, call->line_no, call->text);
+   }
+
+   p += strspn (p, CALL_SPACE);
+   while (*p != ')') {
+      if (nargs == REST_TEST_BUILTIN_MAXARGS) {
+         CLEANUP ("[%s:%zu] More than %i arguments in [%s]\n", call->source, call->line_no,
+                  REST_TEST_BUILTIN_MAXARGS, call->text);
+      }
+      if (!(arg_eval (call, &p, depth, &args[nargs], &lengths[nargs])))
+         goto cleanup;
+      nargs++;
+      p += strspn (p, CALL_SPACE);
+      if (*p == ',') {
+         p++;
+      } else if (*p != ')') {
+         CLEANUP ("[%s:%zu] Expected ',' or ')' in [%s]\n", call->source, call->line_no,
+                  call->text);
+      }
+   }
+
+   if (!(rest_test_builtin_call (name, nlen, nargs, (const char *const *)args, lengths,
+                                 result, length))) {
+      CLEANUP ("[%s:%zu] Failed to evaluate [%s]\n", call->source, call->line_no, call->text);
+   }
+   *pos = p + 1;
+
+   error = false;
+cleanup:
+   for (size_t i=0; i<nargs; i++) {
+      free (args[i]);
+   }
+   return !error;
+}
+
+// Renders the template into a new string, stored in `dst`
+static bool template_render (const struct template_t *tmpl, rest_test_symt_t *st,
+                             const char *source, size_t line_no, size_t depth,
+                             char **dst)
+{
+   bool error = true;
+   struct part_t stack_parts[16];
+   struct part_t *parts = stack_parts;
+   char *ret = NULL;
+
+   *dst = NULL;
+   if (depth > TEMPLATE_MAXDEPTH) {
+      ERRORF ("[%s:%zu] References nested more than %i deep (a symbol refers to itself?)\n",
+              source, line_no, TEMPLATE_MAXDEPTH);
+      return false;
+   }
+
+   if (tmpl->nreferences > sizeof stack_parts / sizeof stack_parts[0]
+         && !(parts = malloc (tmpl->nreferences * sizeof *parts))) {
+      ERRORF ("[%s:%zu] OOM rendering [%s]\n", source, line_no, tmpl->text);
+      return false;
+   }
+   memset (parts, 0, tmpl->nreferences * sizeof *parts);
+
+   // Every reference is resolved first, so that the result is allocated once
+   size_t length = 0;
+   for (size_t i=0, r=0; i<tmpl->nsegments; i++) {
+      const struct segment_t *seg = &tmpl->segments[i];
+      if (seg->id == SEGMENT_LITERAL) {
+         length += seg->length;
+         continue;
+      }
+      if (!(part_resolve (&parts[r], seg->id, &tmpl->text[seg->offset], st,
+                          source, line_no, depth))) {
+         goto cleanup;
+      }
+      length += parts[r++].length;
+   }
+
+   if (!(ret = malloc (length + 1))) {
+      CLEANUP ("[%s:%zu] OOM rendering [%s]\n", source, line_no, tmpl->text);
+   }
+
+   char *out = ret;
+   for (size_t i=0, r=0; i<tmpl->nsegments; i++) {
+      const struct segment_t *seg = &tmpl->segments[i];
+      const char *src = seg->id == SEGMENT_LITERAL ? &tmpl->text[seg->offset] : parts[r].value;
+      size_t n = seg->id == SEGMENT_LITERAL ? seg->length : parts[r++].length;
+      memcpy (out, src, n);
+      out += n;
+   }
+   *out = 0;
+
+   *dst = ret;
+   ret = NULL;
+   error = false;
+cleanup:
+   for (size_t i=0; i<tmpl->nreferences; i++) {
+      free (parts[i].expanded);
+      rest_test_token_del (&parts[i].output);
+   }
+   if (parts != stack_parts)
+      free (parts);
+   free (ret);
+   return !error;
+}
+
+// Renders the template into the value of `token`. A NULL template has no
+// references and leaves the token unchanged.
+static bool token_render (rest_test_token_t *token, const struct template_t *tmpl,
+                          rest_test_symt_t *st, size_t depth)
+{
+   if (!tmpl)
+      return true;
+
+   const char *source = rest_test_token_source (token);
+   size_t line_no = rest_test_token_line_no (token);
+   char *value = NULL;
+   if (!(template_render (tmpl, st, source, line_no, depth, &value)))
+      return false;
+
+   bool ret = rest_test_token_set_value (token, value);
+   if (!ret) {
+      ERRORF ("[%s:%zu] Failed to interpolate [%s] (possible OOM condition)\n",
+              source, line_no, tmpl->text);
+   }
+   free (value);
+   return ret;
+}
+
+
+static void interp_clear (struct interp_t *interp)
+{
+   template_del (&interp->tmpl);
+   template_del (&interp->folded);
+   interp->version = 0;
+}
+
+// Returns the value that the reference `id` always renders to, or NULL if it
+// is not a constant: a string or integer whose own references, if any, are
+// constants. A nested value that was expanded is returned in `expanded`.
+static const char *constant_value (size_t id, rest_test_symt_t *st, size_t depth,
+                                   char **expanded)
+{
+   // A call may return something different each time
+   if (id == SEGMENT_CALL)
+      return NULL;
+
+   const rest_test_token_t *token = rest_test_symt_value_id (st, id);
+   enum rest_test_token_type_t type = rest_test_token_type (token);
+   if (!token || (type != token_STRING && type != token_INTEGER))
+      return NULL;
+
+   const char *value = rest_test_token_value (token);
+   if (!value || !strstr (value, "{{"))
+      return value;
+
+   struct template_t *tmpl = NULL, *folded = NULL;
+   if (depth >= TEMPLATE_MAXDEPTH || !(template_compile (value, &tmpl)))
+      return NULL;
+   if (!tmpl)
+      return value;
+
+   const char *ret = NULL;
+   if ((template_fold (tmpl, st, depth + 1, &folded)) && folded->nreferences == 0) {
+      // A fully folded template is a single literal run, if not empty
+      size_t length = folded->nsegments ? folded->segments[0].length : 0;
+      if ((*expanded = malloc (length + 1))) {
+         memcpy (*expanded, folded->nsegments ? folded->text : "", length);
+         (*expanded)[length] = 0;
+         ret = *expanded;
+      }
+   }
+   template_del (&folded);
+   template_del (&tmpl);
+   return ret;
+}
+
+// Builds in `dst` the template with every reference to a constant replaced by
+// its value, and adjacent literals merged. References to anything else are
+// kept, to be resolved when the template is rendered.
+static bool template_fold (const struct template_t *tmpl, rest_test_symt_t *st,
+                           size_t depth, struct template_t **dst)
+{
+   bool error = true;
+   struct part_t stack_parts[16];
+   struct part_t *parts = stack_parts;
+   struct template_t *ret = NULL;
+
+   *dst = NULL;
+   if (tmpl->nreferences > sizeof stack_parts / sizeof stack_parts[0]
+         && !(parts = malloc (tmpl->nreferences * sizeof *parts))) {
+      return false;
+   }
+   memset (parts, 0, tmpl->nreferences * sizeof *parts);
+
+   // Sizes the result: folded values become literal text, and the names of
+   // the other references are kept
+   size_t length = 0;
+   for (size_t i=0, r=0; i<tmpl->nsegments; i++) {
+      const struct segment_t *seg = &tmpl->segments[i];
+      if (seg->id != SEGMENT_LITERAL) {
+         struct part_t *part = &parts[r++];
+         if ((part->value = constant_value (seg->id, st, depth, &part->expanded))) {
+            part->length = strlen (part->value);
+            length += part->length;
+            continue;
+         }
+      }
+      length += seg->length + 1;
+   }
+
+   size_t nsegments = tmpl->nsegments;
+   if (!(ret = malloc (sizeof *ret + nsegments * sizeof ret->segments[0] + length + 1))) {
+      goto cleanup;
+   }
+   ret->text = (char *)&ret->segments[nsegments];
+   ret->nsegments = 0;
+   ret->nreferences = 0;
+
+   size_t offset = 0;
+   struct segment_t *last = NULL;
+   for (size_t i=0, r=0; i<tmpl->nsegments; i++) {
+      const struct segment_t *seg = &tmpl->segments[i];
+      const char *src = &tmpl->text[seg->offset];
+      size_t n = seg->length;
+      if (seg->id != SEGMENT_LITERAL) {
+         const struct part_t *part = &parts[r++];
+         if (!part->value) {
+            // The name is kept NUL-terminated for error messages
+            memcpy (&ret->text[offset], src, n);
+            ret->text[offset + n] = 0;
+            last = &ret->segments[ret->nsegments++];
+            *last = (struct segment_t) { offset, n, seg->id };
+            ret->nreferences++;
+            offset += n + 1;
+            continue;
+         }
+         src = part->value;
+         n = part->length;
+      }
+      if (!n)
+         continue;
+      memcpy (&ret->text[offset], src, n);
+      if (last && last->id == SEGMENT_LITERAL && last->offset + last->length == offset) {
+         last->length += n;
+      } else {
+         last = &ret->segments[ret->nsegments++];
+         *last = (struct segment_t) { offset, n, SEGMENT_LITERAL };
+      }
+      offset += n;
+   }
+   ret->text[offset] = 0;
+
+   *dst = ret;
+   ret = NULL;
+   error = false;
+cleanup:
+   for (size_t i=0; i<tmpl->nreferences; i++) {
+      free (parts[i].expanded);
+   }
+   if (parts != stack_parts)
+      free (parts);
+   free (ret);
+   return !error;
+}
+
+// Folds the constant references in a request token. A string that folds
+// completely is rendered now, and is not evaluated again while `st` and its
+// ancestors are unchanged.
+static bool interp_fold (struct interp_t *interp, rest_test_token_t *token,
+                         rest_test_symt_t *st)
+{
+   template_del (&interp->folded);
+   if (!interp->tmpl)
+      return true;
+
+   size_t version = rest_test_symt_version (st);
+   struct template_t *folded = NULL;
+   if (!(template_fold (interp->tmpl, st, 0, &folded)))
+      return false;
+
+   if (folded->nreferences == 0 && (rest_test_token_type (token)) == token_STRING) {
+      // A literal with nothing left to render is at most one segment
+      if (!(rest_test_token_set_value (token, folded->nsegments ? folded->text : ""))) {
+         template_del (&folded);
+         return false;
+      }
+   }
+   interp->folded = folded;
+   interp->version = version;
+   return true;
+}
+
+
 /* *********************************************************************************
  * Header functions.
  */
@@ -249,10 +859,12 @@ static void header_del (struct header_t **h)
 {
    if (!h || !*h)
       return;
-   free ((*h)->source);
-   free ((*h)->name);
-   free ((*h)->value);
-   free (*h);
+   // Headers allocated from an arena are released with the arena
+   if (!(*h)->pooled) {
+      free ((*h)->name);
+      free ((*h)->value);
+      free (*h);
+   }
    *h = NULL;
 }
 
@@ -281,10 +893,64 @@ static void _header_print (const void *key, size_t keylen,
 }
 
 
-static struct header_t *header_new (const char *source,
+// Stores `h` under its name, deleting any header that it replaces
+static bool header_replace (ds_hmap_t *headers, struct header_t *h)
+{
+   struct header_t *old = NULL;
+   if ((ds_hmap_get_str_ptr (headers, h->name, (void **)&old)) && old != h) {
+      header_del (&old);
+   }
+   if (!(ds_hmap_set_str_ptr (headers, h->name, h))) {
+      header_del (&h);
+      return false;
+   }
+   return true;
+}
+
+// Headers allocated from an arena are split in place within a single copy of the
+// line.
+static struct header_t *header_new_arena (rest_test_arena_t *arena,
+                                          const char *source,
+                                          size_t line_no,
+                                          const char *line)
+{
+   struct header_t *ret = rest_test_arena_alloc (arena, sizeof *ret);
+   char *copy = rest_test_arena_strdup (arena, line);
+
+   if (!ret || !copy) {
+      ERRORF ("[%s:%zu %s] OOM allocating header object\n", source, line_no, line);
+      return NULL;
+   }
+
+   if (!(ret->source = rest_test_intern_source (source))) {
+      ERRORF ("[%s:%zu %s] OOM allocating source\n", source, line_no, line);
+      return NULL;
+   }
+
+   char *delim = strchr (copy, ':');
+   if (!delim) {
+      ERRORF ("[%s:%zu %s] Invalid header, missing `:`\n", source, line_no, line);
+      return NULL;
+   }
+
+   *delim++ = 0;
+   ret->pooled = true;
+   ret->line_no = line_no;
+   ret->name = ds_str_trim (copy);
+   ret->value = ds_str_trim (delim);
+   TOLOWER (ret->name);
+
+   return ret;
+}
+
+static struct header_t *header_new (rest_test_arena_t *arena,
+                                    const char *source,
                                     size_t line_no,
                                     const char *line)
 {
+   if (arena)
+      return header_new_arena (arena, source, line_no, line);
+
    bool error = true;
    struct header_t *ret = calloc (1, sizeof *ret);
    char *copy = ds_str_dup (line);
@@ -292,7 +958,7 @@ static struct header_t *header_new (const char *source,
    if (!ret || !copy)
       CLEANUP ("[%s:%zu %s] OOM allocating header object\n", source, line_no, line);
 
-   if (!(ret->source = ds_str_dup (source)))
+   if (!(ret->source = rest_test_intern_source (source)))
       CLEANUP ("[%s:%zu %s] OOM allocating source\n", source, line_no, line);
 
    char *delim = strchr (copy, ':');
@@ -335,6 +1001,10 @@ static void req_clear (struct req_t *req)
    rest_test_token_del (&req->uri);
    rest_test_token_del (&req->http_version);
    rest_test_token_del (&req->body);
+   interp_clear (&req->method_interp);
+   interp_clear (&req->uri_interp);
+   interp_clear (&req->http_version_interp);
+   interp_clear (&req->body_interp);
 
    ds_hmap_iterate (req->headers, _header_del, req->headers);
    ds_hmap_del (req->headers);
@@ -343,24 +1013,57 @@ static void req_clear (struct req_t *req)
    memset (req, 0, sizeof *req);
 }
 
+// Compiles the value of `token` into `interp`, replacing the previous template
+static bool req_compile (struct req_t *req, const rest_test_token_t *token,
+                         struct interp_t *interp)
+{
+   struct template_t *tmp = NULL;
+   enum rest_test_token_type_t type = rest_test_token_type (token);
+   if ((type == token_STRING || type == token_SHELLCMD)
+         && !(template_compile (rest_test_token_value (token), &tmp))) {
+      req->lasterr = -1;
+      return false;
+   }
+   interp_clear (interp);
+   interp->tmpl = tmp;
+   return true;
+}
+
+static bool req_token (struct req_t *req, rest_test_token_t **field,
+                       struct interp_t *interp, const rest_test_token_t *value)
+{
+   if (!req || req->lasterr)
+      return false;
+
+   rest_test_token_t *tmp = rest_test_token_dup_arena (value, req->arena);
+   if (!tmp || !(req_compile (req, tmp, interp))) {
+      rest_test_token_del (&tmp);
+      req->lasterr = -1;
+      return false;
+   }
+   rest_test_token_del (field);
+   *field = tmp;
+   return true;
+}
+
 static bool req_method (struct req_t *req, const rest_test_token_t *method)
 {
-   SET_TOKEN_FIELD (req, method, method);
+   return req_token (req, &req->method, &req->method_interp, method);
 }
 
 static bool req_uri (struct req_t *req, const rest_test_token_t *uri)
 {
-   SET_TOKEN_FIELD (req, uri, uri);
+   return req_token (req, &req->uri, &req->uri_interp, uri);
 }
 
 static bool req_http_version (struct req_t *req, const rest_test_token_t *http_version)
 {
-   SET_TOKEN_FIELD (req, http_version, http_version);
+   return req_token (req, &req->http_version, &req->http_version_interp, http_version);
 }
 
 static bool req_body (struct req_t *req, const rest_test_token_t *body)
 {
-   SET_TOKEN_FIELD (req, body, body);
+   return req_token (req, &req->body, &req->body_interp, body);
 }
 
 static bool req_body_append (struct req_t *req, const rest_test_token_t *body)
@@ -368,9 +1071,11 @@ static bool req_body_append (struct req_t *req, const rest_test_token_t *body)
    if (!req || req->lasterr)
       return false;
 
-   return req->body
-      ? rest_test_token_append (req->body, body)
-      : req_body (req, body);
+   if (!req->body)
+      return req_body (req, body);
+
+   return rest_test_token_append (req->body, body)
+       && req_compile (req, req->body, &req->body_interp);
 }
 
 
@@ -463,16 +1168,42 @@ rest_test_t *rest_test_new (const char *name,
                             const char *fname,
                             size_t line_no,
                             rest_test_symt_t *parent)
+{
+   return rest_test_new_arena (name, fname, line_no, parent, NULL);
+}
+
+static void rest_test_finalize (void *rt)
+{
+   rest_test_t *tmp = rt;
+   rest_test_del (&tmp);
+}
+
+rest_test_t *rest_test_new_arena (const char *name,
+                                  const char *fname,
+                                  size_t line_no,
+                                  rest_test_symt_t *parent,
+                                  rest_test_arena_t *arena)
 {
    bool error = true;
 
-   rest_test_t *ret = calloc (1, sizeof *ret);
+   rest_test_t *ret = arena
+      ? rest_test_arena_alloc (arena, sizeof *ret)
+      : calloc (1, sizeof *ret);
    if (!ret)
       CLEANUP ("OOM error allocating rest_test_t structure\n");
 
-   ret->st = rest_test_symt_new (name, parent, 32);
-   ret->name = ds_str_dup (name);
-   ret->fname = ds_str_dup (fname);
+   ret->arena = arena;
+   ret->req.arena = arena;
+
+   // The finalizer releases what the arena does not own: the hash maps, and the
+   // references that tokens hold on mapped source files.
+   if (arena && !(rest_test_arena_defer (arena, rest_test_finalize, ret)))
+      CLEANUP ("OOM error registering rest_test_t finalizer\n");
+
+   // Most tests set no more than a few locals, which the table holds inline
+   ret->st = rest_test_symt_new_arena (name, parent, 0, arena);
+   ret->name = arena ? rest_test_arena_strdup (arena, name) : ds_str_dup (name);
+   ret->fname = rest_test_intern_source (fname);
    ret->line_no = line_no;
    ret->req.headers = ds_hmap_new (32);
    ret->rsp.headers = ds_hmap_new (32);
@@ -499,15 +1230,25 @@ void rest_test_del (rest_test_t **rt)
       return;
 
    rest_test_symt_del (&(*rt)->st);
-   free ((*rt)->name);
-   free ((*rt)->fname);
+   if (!(*rt)->arena) {
+      free ((*rt)->name);
+   }
+   (*rt)->name = NULL;
    // ds_array_iterate ((*rt)->assertions, _assertion_del, (*rt)->assertions);
    ds_array_del ((*rt)->assertions);
+   (*rt)->assertions = NULL;
 
    req_clear (&(*rt)->req);
    rsp_clear (&(*rt)->rsp);
+   rest_test_shell_prefetch_drop (*rt);
 
-   free (*rt);
+   // A test allocated from an arena is released with the arena, which also runs
+   // this function again as a finalizer; everything released above has been
+   // cleared so that the second run does nothing.
+   if (!(*rt)->arena) {
+      free (*rt);
+   }
+   *rt = NULL;
 }
 
 void rest_test_dump (rest_test_t *rt, FILE *outf)
@@ -548,11 +1289,13 @@ rest_test_symt_t *rest_test_symt (rest_test_t *rt)
 const char *rest_test_set_name (rest_test_t *rt, const char *name)
 {
    TEST_RT_BOOL(rt);
-   char *tmp = ds_str_dup (name);
+   char *tmp = rt->arena ? rest_test_arena_strdup (rt->arena, name) : ds_str_dup (name);
    if (!tmp)
       return false;
 
-   free (rt->name);
+   if (!rt->arena) {
+      free (rt->name);
+   }
    rt->name = tmp;
    return rest_test_symt_set_name (rt->st, tmp);
 }
@@ -560,11 +1303,10 @@ const char *rest_test_set_name (rest_test_t *rt, const char *name)
 const char *rest_test_set_fname (rest_test_t *rt, const char *fname)
 {
    TEST_RT_BOOL(rt);
-   char *tmp = ds_str_dup (fname);
+   const char *tmp = rest_test_intern_source (fname);
    if (!tmp)
       return false;
 
-   free (rt->fname);
    rt->fname = tmp;
    return tmp;
 }
@@ -576,6 +1318,18 @@ size_t rest_test_set_line_no (rest_test_t *rt, size_t line_no)
    return line_no;
 }
 
+size_t rest_test_set_parallel (rest_test_t *rt, size_t parallel)
+{
+   TEST_RT_BOOL(rt);
+   rt->parallel = parallel;
+   return parallel;
+}
+
+size_t rest_test_get_parallel (rest_test_t *rt)
+{
+   return rt ? rt->parallel : 0;
+}
+
 const char *rest_test_get_name (rest_test_t *rt)
 {
    return rt ? rt->name : NULL;
@@ -637,13 +1391,13 @@ bool rest_test_req_set_header (rest_test_t *rt,
                                const char *value)
 {
    TEST_RT_BOOL(rt);
-   struct header_t *h = header_new (source, line_no, value);
+   struct header_t *h = header_new (rt->arena, source, line_no, value);
    if (!h) {
       rt->lasterr = -5;
       return false;
    }
 
-   return ds_hmap_set_str_ptr (rt->req.headers, h->name, h);
+   return header_replace (rt->req.headers, h);
 }
 
 // Get all the fields in the request
@@ -671,15 +1425,45 @@ const char *rest_test_req_body (rest_test_t *rt)
    return rest_test_token_value (rt->req.body);
 }
 
+struct header_visit_t {
+   void (*fn) (const char *name, const char *value, void *param);
+   void *param;
+   size_t count;
+};
+
+static void _header_visit (const void *key, size_t keylen,
+                           void *header, size_t headerlen,
+                           void *param)
+{
+   struct header_t *h = header;
+   struct header_visit_t *visit = param;
+   (void)key;
+   (void)keylen;
+   (void)headerlen;
+   visit->fn (h->name, h->value, visit->param);
+   visit->count++;
+}
+
+size_t rest_test_req_headers (rest_test_t *rt,
+                              void (*fn) (const char *name, const char *value, void *param),
+                              void *param)
+{
+   if (!rt || !fn)
+      return 0;
+   struct header_visit_t visit = { fn, param, 0 };
+   ds_hmap_iterate (rt->req.headers, _header_visit, &visit);
+   return visit.count;
+}
+
 const char *rest_test_req_header (rest_test_t *rt, const char *header)
 {
    TEST_RT_STRING(rt);
-   char *value = NULL;
-   if (!(ds_hmap_get_str_str(rt->req.headers, header, &value))) {
+   struct header_t *h = NULL;
+   if (!(ds_hmap_get_str_ptr(rt->req.headers, header, (void **)&h)) || !h) {
       rt->lasterr = -4;
       return "";
    }
-   return value;
+   return h->value;
 }
 
 
@@ -727,13 +1511,25 @@ bool rest_test_rsp_set_header (rest_test_t *rt,
                                const char *value)
 {
    TEST_RT_BOOL(rt);
-   struct header_t *h = header_new (source, line_no, value);
+   struct header_t *h = header_new (NULL, source, line_no, value);
    if (!h) {
       rt->lasterr = -5;
       return false;
    }
 
-   return ds_hmap_set_str_ptr (rt->rsp.headers, h->name, h);
+   return header_replace (rt->rsp.headers, h);
+}
+
+void rest_test_rsp_clear (rest_test_t *rt)
+{
+   if (!rt)
+      return;
+   free (rt->rsp.http_version);
+   free (rt->rsp.status_code);
+   free (rt->rsp.reason);
+   free (rt->rsp.body);
+   rt->rsp.http_version = rt->rsp.status_code = rt->rsp.reason = rt->rsp.body = NULL;
+   ds_hmap_iterate (rt->rsp.headers, _header_del, rt->rsp.headers);
 }
 
 // Get all the fields in the response
@@ -764,133 +1560,30 @@ const char *rest_test_rsp_body (rest_test_t *rt)
 const char *rest_test_rsp_header (rest_test_t *rt, const char *header)
 {
    TEST_RT_STRING(rt);
-   char *value = NULL;
-   if (!(ds_hmap_get_str_str(rt->rsp.headers, header, &value))) {
+   struct header_t *h = NULL;
+   if (!(ds_hmap_get_str_ptr(rt->rsp.headers, header, (void **)&h)) || !h) {
       rt->lasterr = -4;
       return "";
    }
-   return value;
-}
-
-static bool next_reference (const char *src, size_t *start, size_t *end)
-{
-   if (!src)
-      return false;
-
-   char *tmp = strstr (src, "{{");
-   if (!tmp || (tmp != src && tmp[-1] == '\\'))
-      return false;
-
-   *start = tmp - src;
-   tmp = strstr (tmp, "}}");
-   if (!tmp)
-      return false;
-
-   *end = tmp - src;
-
-   return true;
+   return h->value;
 }
 
-static char *interpolate (const char *src, size_t old_start, size_t old_end, const char *new)
-{
-   size_t slen_new = strlen (new);
-   size_t slen = strlen (src) + slen_new;
-   char *ret = calloc (1, slen);
-   if (!ret)
-      return NULL;
-
-   memcpy (ret, src, old_start);
-   memcpy (&ret[old_start], new, slen_new);
-   memcpy (&ret[old_start + slen_new], &src[old_end + 2], strlen (&src[old_end+2]));
-
-   return ret;
-}
-
-static char *extract_varname (const char *src)
-{
-   if (!(strstr (src, "}}")))
-      return NULL;
-
-   size_t slen = strlen (src);
-
-   if (src[0] != '{' || src[1] != '{')
-      return NULL;
-
-   char *ret = malloc (slen); // No harm in overallocating
-   if (!ret) {
-      return NULL;
-   }
-   strcpy (ret, &src[2]);
-   char *end = strstr (ret, "}}");
-   if (!end) { // This should never happen
-      free (ret);
-      return NULL;
-   }
-
-   *end = 0;
-
-   return ret;
-}
-
-static bool shellrun (const char *shellcmd, char **output, int *retcode)
-{
-   bool error = true;
-   FILE *cmdf = NULL;
-
-   fflush (stdout);
-   if (output) {
-      *output = NULL;
-   }
-
-
-   if (!(cmdf = popen (shellcmd, "re"))) {
-      ERRORF ("Failed to execute [%s]: %m\n", shellcmd);
-      goto cleanup;
-   }
-
-   int c = EOF;
-   while ((c = fgetc (cmdf)) != EOF) {
-      char tmp[2] = { (char)c, 0 };
-      if (output) {
-         if (!(ds_str_append (output, tmp, NULL))) {
-            ERRORF ("OOM error executing [%s]\n", shellcmd);
-            goto cleanup;
-         }
-      }
-   }
-
-   int pclose_retcode = -1;
-   error = false;
-cleanup:
-   if ((pclose_retcode = pclose (cmdf)) != 0)
-      error = true;
-
-   if (retcode)
-      *retcode = pclose_retcode;
-
-   if (error) {
-      if (output)
-         free (*output);
-   }
-
-   return !error;
-}
-
-static bool interpolate_string (rest_test_token_t *token, rest_test_symt_t *st);
-static bool token_exec (rest_test_token_t *token, rest_test_symt_t *st)
+// Renders the command from the template and replaces it with its output
+static bool token_exec (rest_test_token_t *token, const struct template_t *tmpl,
+                        rest_test_symt_t *st, size_t depth)
 {
    const char *source = rest_test_token_source (token);
    size_t line_no = rest_test_token_line_no (token);
    const char *value = rest_test_token_value (token);
 
-   if (!(interpolate_string (token, st))) {
+   if (!(token_render (token, tmpl, st, depth))) {
       ERRORF ("[%s:%zu] String interpolation failure on value [%s]\n",
             source, line_no, value);
       return false;
    }
    char *shell_output = NULL;
    int shell_retcode = -1;
-   if (!(shellrun (rest_test_token_value (token), &shell_output, &shell_retcode))) {
+   if (!(rest_test_shell_exec (rest_test_token_value (token), &shell_output, &shell_retcode))) {
       ERRORF ("[%s:%zu] Shell execution failure on [%s]: Process returned %i\n",
             source, line_no, rest_test_token_value (token), shell_retcode);
       free (shell_output);
@@ -922,58 +1615,7 @@ static bool token_exec (rest_test_token_t *token, rest_test_symt_t *st)
    return true;
 }
 
-static bool interpolate_string (rest_test_token_t *token, rest_test_symt_t *st)
-{
-   bool error = true;
-   size_t startpos = 0, endpos = 0;
-
-   const char *source = rest_test_token_source (token);
-   size_t line_no = rest_test_token_line_no (token);
-   const char *value = rest_test_token_value (token);
-
-   char *varname = NULL;
-   char *newstring = NULL;
-   rest_test_token_t *newval = NULL;
-
-   while ((next_reference (value = rest_test_token_value (token), &startpos, &endpos))) {
-      varname = extract_varname (&value[startpos]);
-      if (!varname) {
-         ERRORF ("[%s:%zu] Extraction failure of symbol name [%s] (possible OOM condition)\n",
-               source, line_no, value);
-         goto cleanup;
-      }
-
-      newval = rest_test_token_dup (rest_test_symt_value (st, varname));
-      if (!newval) {
-         ERRORF ("[%s:%zu] No symbol value found for [%s]\n", source, line_no, varname);
-         goto cleanup;
-      }
-
-      if ((rest_test_token_type (newval)) == token_SHELLCMD) {
-         if (!(token_exec (newval, st))) {
-            goto cleanup;
-         }
-      }
-      newstring = interpolate (value, startpos, endpos, rest_test_token_value (newval));
-      if (!(rest_test_token_set_value (token, newstring))) {
-         ERRORF ("[%s:%zu] Failed to interpolate variable [%s] with value [%s]\n",
-               source, line_no, value, newstring);
-         goto cleanup;
-      }
-      free (varname); varname = NULL;
-      free (newstring); newstring = NULL;
-      rest_test_token_del (&newval);
-   }
-
-   error = false;
-cleanup:
-   free (varname);
-   free (newstring);
-   rest_test_token_del (&newval);
-   return !error;
-}
-
-static bool eval (rest_test_token_t *token, rest_test_symt_t *st)
+static bool eval (rest_test_token_t *token, const struct template_t *tmpl, rest_test_symt_t *st)
 {
    const rest_test_token_t *target = NULL;
    const char *newvalue = NULL;
@@ -993,12 +1635,12 @@ static bool eval (rest_test_token_t *token, rest_test_symt_t *st)
          return true;
 
       case token_SHELLCMD:
-         if (!(token_exec (token, st)))
+         if (!(token_exec (token, tmpl, st, 0)))
                return false;
          break;
 
       case token_STRING:
-         if (!(interpolate_string (token, st))) {
+         if (!(token_render (token, tmpl, st, 0))) {
             ERRORF ("[%s:%zu] String interpolation failure on value [%s]\n",
                     source, line_no, rest_test_token_value (token));
             return false;
@@ -1029,13 +1671,131 @@ static bool eval (rest_test_token_t *token, rest_test_symt_t *st)
    return true;
 }
 
+// Evaluates a request token, using its folded template while that is current
+static bool eval_field (rest_test_token_t *token, const struct interp_t *interp,
+                        rest_test_symt_t *st)
+{
+   const struct template_t *tmpl = interp->tmpl;
+   if (interp->folded && interp->version == rest_test_symt_version (st)) {
+      // A string folded completely was rendered when it was folded
+      if (interp->folded->nreferences == 0 && (rest_test_token_type (token)) == token_STRING)
+         return true;
+      tmpl = interp->folded;
+   }
+   return eval (token, tmpl, st);
+}
+
+// The symbols whose shell commands may be started ahead of the tests that use
+// them, indexed by symbol id
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool *prefetch_ids;
+static size_t nprefetch_ids;
+
+static bool prefetch_enabled (size_t id)
+{
+   pthread_mutex_lock (&prefetch_lock);
+   bool ret = id < nprefetch_ids && prefetch_ids[id];
+   pthread_mutex_unlock (&prefetch_lock);
+   return ret;
+}
+
+// Starts each shell command that rendering `tmpl` will run, if the command's
+// symbol allows it and its own references are all to constants: a command
+// that depends on another command, or on a symbol not yet set, is left to run
+// when it is needed. Returns the number started.
+static size_t prefetch_template (rest_test_t *rt, const struct template_t *tmpl, size_t depth)
+{
+   size_t ret = 0;
+   for (size_t i=0; tmpl && depth <= TEMPLATE_MAXDEPTH && i<tmpl->nsegments; i++) {
+      size_t id = tmpl->segments[i].id;
+      if (id == SEGMENT_LITERAL || id == SEGMENT_CALL)
+         continue;
+
+      const rest_test_token_t *token = rest_test_symt_value_id (rt->st, id);
+      enum rest_test_token_type_t type = rest_test_token_type (token);
+      const char *value = rest_test_token_value (token);
+      struct template_t *inner = NULL, *folded = NULL;
+      if (!token || !value || (type != token_SHELLCMD && !strstr (value, "{{"))
+            || (type == token_SHELLCMD && !(prefetch_enabled (id)))
+            || !(template_compile (value, &inner))) {
+         continue;
+      }
+
+      if (type != token_SHELLCMD) {
+         // The commands in a nested value are run when it is expanded
+         ret += prefetch_template (rt, inner, depth + 1);
+      } else if (!inner) {
+         ret += rest_test_shell_prefetch (rt, value);
+      } else if ((template_fold (inner, rt->st, 0, &folded)) && folded->nreferences == 0) {
+         size_t length = folded->nsegments ? folded->segments[0].length : 0;
+         folded->text[length] = 0;
+         ret += rest_test_shell_prefetch (rt, folded->text);
+      }
+      template_del (&folded);
+      template_del (&inner);
+   }
+   return ret;
+}
+
+bool rest_test_prefetch_symbol (const char *name)
+{
+   size_t id = rest_test_symt_id (name);
+   if (id == (size_t)-1)
+      return false;
+
+   pthread_mutex_lock (&prefetch_lock);
+   if (id >= nprefetch_ids) {
+      size_t newsize = id + 1 > nprefetch_ids * 2 ? id + 1 : nprefetch_ids * 2;
+      bool *tmp = realloc (prefetch_ids, newsize * sizeof *tmp);
+      if (!tmp) {
+         pthread_mutex_unlock (&prefetch_lock);
+         return false;
+      }
+      memset (&tmp[nprefetch_ids], 0, (newsize - nprefetch_ids) * sizeof *tmp);
+      prefetch_ids = tmp;
+      nprefetch_ids = newsize;
+   }
+   prefetch_ids[id] = true;
+   pthread_mutex_unlock (&prefetch_lock);
+   return true;
+}
+
+size_t rest_test_prefetch (rest_test_t *rt)
+{
+   if (!rt)
+      return 0;
+
+   // In the order that rest_test_eval_req() renders the fields
+   struct req_t *req = &rt->req;
+   return prefetch_template (rt, req->method_interp.tmpl, 0)
+        + prefetch_template (rt, req->uri_interp.tmpl, 0)
+        + prefetch_template (rt, req->http_version_interp.tmpl, 0)
+        + prefetch_template (rt, req->body_interp.tmpl, 0);
+}
+
+bool rest_test_fold (rest_test_t *rt)
+{
+   TEST_RT_BOOL(rt);
+
+   struct req_t *req = &rt->req;
+   if (!(interp_fold (&req->method_interp, req->method, rt->st))
+         || !(interp_fold (&req->uri_interp, req->uri, rt->st))
+         || !(interp_fold (&req->http_version_interp, req->http_version, rt->st))
+         || !(interp_fold (&req->body_interp, req->body, rt->st))) {
+      ERRORF ("[%s:%zu] OOM folding constants in test [%s]\n", rt->fname, rt->line_no, rt->name);
+      return false;
+   }
+   return true;
+}
+
 bool rest_test_eval_req (rest_test_t *rt, rest_test_token_t **errtoken)
 {
    bool error = true;
    TEST_RT_BOOL(rt);
    rest_test_token_t *et = NULL;
 
-   if (!(eval(rt->req.method, rt->st))) {
+   rest_test_shell_begin_test (rt);
+   if (!(eval_field (rt->req.method, &rt->req.method_interp, rt->st))) {
       et = rt->req.method;
       CLEANUP ("[%s:%zu] Failed to perform evaluation on method [%s]\n",
                rest_test_token_source (rt->req.method),
@@ -1043,7 +1803,7 @@ bool rest_test_eval_req (rest_test_t *rt, rest_test_token_t **errtoken)
                rest_test_token_value (rt->req.method));
    }
 
-   if (!(eval(rt->req.uri, rt->st))) {
+   if (!(eval_field (rt->req.uri, &rt->req.uri_interp, rt->st))) {
       et = rt->req.uri;
       CLEANUP ("[%s:%zu] Failed to perform evaluation on uri [%s]\n",
                rest_test_token_source (rt->req.uri),
@@ -1051,7 +1811,7 @@ bool rest_test_eval_req (rest_test_t *rt, rest_test_token_t **errtoken)
                rest_test_token_value (rt->req.uri));
    }
 
-   if (!(eval(rt->req.http_version, rt->st))) {
+   if (!(eval_field (rt->req.http_version, &rt->req.http_version_interp, rt->st))) {
       et = rt->req.http_version;
       CLEANUP ("[%s:%zu] Failed to perform evaluation on http_version [%s]\n",
                rest_test_token_source (rt->req.http_version),
@@ -1059,7 +1819,7 @@ bool rest_test_eval_req (rest_test_t *rt, rest_test_token_t **errtoken)
                rest_test_token_value (rt->req.http_version));
    }
 
-   if (!(eval(rt->req.body, rt->st))) {
+   if (!(eval_field (rt->req.body, &rt->req.body_interp, rt->st))) {
       et = rt->req.body;
       CLEANUP ("[%s:%zu] Failed to perform evaluation on body [%s]\n",
                rest_test_token_source (rt->req.body),
@@ -1073,7 +1833,9 @@ cleanup:
       *errtoken = et;
    }
 
-
+   // Commands prefetched for a field that failed, or whose output came from
+   // the cache, are not needed
+   rest_test_shell_prefetch_drop (rt);
    return !error;
 }
 
@@ -18,6 +18,14 @@ extern "C" {
                                const char *fname,
                                size_t line_no,
                                rest_test_symt_t *parent);
+   // As rest_test_new(), but the test and everything that it stores from the
+   // parse is allocated from the arena. Deleting the arena deletes the test;
+   // rest_test_del() may still be called on it before then.
+   rest_test_t *rest_test_new_arena (const char *name,
+                                     const char *fname,
+                                     size_t line_no,
+                                     rest_test_symt_t *parent,
+                                     rest_test_arena_t *arena);
    void rest_test_del (rest_test_t **rt);
    void rest_test_dump (rest_test_t *rt, FILE *fout);
 
@@ -36,6 +44,12 @@ extern "C" {
    const char *rest_test_get_fname (rest_test_t *rt);
    size_t rest_test_get_line_no (rest_test_t *rt);
 
+   // Set and get the most requests that may be in flight while this test's
+   // is, as the `.parallel N` directive before the test set it. 0, the
+   // default, leaves it to the runner.
+   size_t rest_test_set_parallel (rest_test_t *rt, size_t parallel);
+   size_t rest_test_get_parallel (rest_test_t *rt);
+
    // Set all the fields in the request
    bool rest_test_req_set_method (rest_test_t *rt, const rest_test_token_t *method);
    bool rest_test_req_set_uri (rest_test_t *rt, const rest_test_token_t *uri);
@@ -52,6 +66,12 @@ extern "C" {
    const char *rest_test_req_http_version (rest_test_t *rt);
    const char *rest_test_req_body (rest_test_t *rt);
    const char *rest_test_req_header (rest_test_t *rt, const char *header);
+   // Calls `fn` with the name, in lowercase, and value of each request header,
+   // in no particular order. Returns the number of headers.
+   size_t rest_test_req_headers (rest_test_t *rt,
+                                 void (*fn) (const char *name, const char *value,
+                                             void *param),
+                                 void *param);
 
    // Set all the fields in the response
    bool rest_test_rsp_set_http_version (rest_test_t *rt, const char *http_version);
@@ -62,6 +82,8 @@ extern "C" {
    bool rest_test_rsp_set_header (rest_test_t *rt,
                                   const char *source, size_t line_no,
                                   const char *value);
+   // Removes every field from the response, as before it was received
+   void rest_test_rsp_clear (rest_test_t *rt);
 
 
    // Get all the fields in the response
@@ -78,8 +100,36 @@ extern "C" {
    //
    // If the `errtoken` parameter is NULL, the token causing the error will not be
    // returned.
+   //
+   // References are compiled when a field is set, and each evaluation renders
+   // the field from the value it was set to, so evaluating again picks up any
+   // symbols changed since. Each call is a new test to the `test` shell-cache
+   // policy (see rest_test_shell.h).
    bool rest_test_eval_req (rest_test_t *rt, rest_test_token_t **errtoken);
 
+   // Substitutes the references in the request fields that resolve to
+   // constants: strings and integers, rather than shell commands, whose own
+   // references are constants too. A string field with no other references is
+   // rendered now and skipped by rest_test_eval_req(). The folding holds until
+   // any symbol table is next written to, after which the fields are evaluated
+   // in full. Call this once parsing is complete, before the tests are run.
+   // Returns false on OOM.
+   bool rest_test_fold (rest_test_t *rt);
+
+   // Allows the shell command held by the symbol `name` to be started before
+   // the test that uses it is evaluated. Prefetching is off for every symbol
+   // until enabled here or with the `.prefetch NAME` directive.
+   bool rest_test_prefetch_symbol (const char *name);
+
+   // Starts, without waiting for them, the shell commands that evaluating the
+   // request will run: those held by symbols enabled for prefetching whose own
+   // references are all to constants, so that the command cannot change before
+   // it is used. Call this for the next tests while the current one runs; each
+   // test's evaluation takes the output of its own commands, in order, and any
+   // command whose text has changed by then is run again. Returns the number of
+   // commands started.
+   size_t rest_test_prefetch (rest_test_t *rt);
+
 #ifdef __cplusplus
 };
 #endif
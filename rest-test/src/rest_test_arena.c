@@ -0,0 +1,157 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "rest_test_arena.h"
+
+// All allocations are aligned to this boundary
+#define ALIGNMENT          (16)
+#define ALIGN(n)           (((n) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+#define DEFAULT_CHUNK      (64 * 1024)
+
+struct chunk_t {
+   struct chunk_t *next;
+   size_t          size;
+   size_t          used;
+   // Pads the header so that `data` is aligned
+   size_t          pad;
+   unsigned char   data[];
+};
+
+struct finalizer_t {
+   struct finalizer_t  *next;
+   void               (*fptr) (void *);
+   void                *ptr;
+};
+
+struct rest_test_arena_t {
+   struct chunk_t       *chunks;    // The first chunk is the current one
+   struct finalizer_t   *finalizers;
+   size_t                chunk_size;
+
+   size_t                nallocs;
+   size_t                nbytes;
+   size_t                nchunks;
+};
+
+
+rest_test_arena_t *rest_test_arena_new (size_t chunk_size)
+{
+   rest_test_arena_t *ret = calloc (1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   ret->chunk_size = ALIGN (chunk_size ? chunk_size : DEFAULT_CHUNK);
+   return ret;
+}
+
+void rest_test_arena_del (rest_test_arena_t **arena)
+{
+   if (!arena || !*arena)
+      return;
+
+   // Finalizers may refer to memory in the arena, so they all run before any
+   // chunk is released.
+   struct finalizer_t *f = (*arena)->finalizers;
+   while (f) {
+      f->fptr (f->ptr);
+      f = f->next;
+   }
+
+   struct chunk_t *c = (*arena)->chunks;
+   while (c) {
+      struct chunk_t *next = c->next;
+      free (c);
+      c = next;
+   }
+
+   free (*arena);
+   *arena = NULL;
+}
+
+void *rest_test_arena_alloc (rest_test_arena_t *arena, size_t size)
+{
+   if (!arena)
+      return NULL;
+
+   size = ALIGN (size ? size : 1);
+
+   struct chunk_t *current = arena->chunks;
+   if (!current || current->size - current->used < size) {
+      // Oversized allocations get a chunk of their own, which goes behind the
+      // current chunk so that the free space in the current chunk is not lost.
+      bool oversized = size > arena->chunk_size / 4;
+      size_t csize = oversized ? size : arena->chunk_size;
+      struct chunk_t *chunk = calloc (1, sizeof *chunk + csize);
+      if (!chunk)
+         return NULL;
+
+      chunk->size = csize;
+      if (oversized && current) {
+         chunk->next = current->next;
+         current->next = chunk;
+      } else {
+         chunk->next = current;
+         arena->chunks = chunk;
+      }
+      arena->nchunks++;
+      current = chunk;
+   }
+
+   void *ret = &current->data[current->used];
+   current->used += size;
+   arena->nallocs++;
+   arena->nbytes += size;
+   return ret;
+}
+
+char *rest_test_arena_strndup (rest_test_arena_t *arena, const char *src, size_t length)
+{
+   if (!src)
+      return NULL;
+
+   char *ret = rest_test_arena_alloc (arena, length + 1);
+   if (!ret)
+      return NULL;
+
+   memcpy (ret, src, length);
+   ret[length] = 0;
+   return ret;
+}
+
+char *rest_test_arena_strdup (rest_test_arena_t *arena, const char *src)
+{
+   return src ? rest_test_arena_strndup (arena, src, strlen (src)) : NULL;
+}
+
+bool rest_test_arena_defer (rest_test_arena_t *arena, void (*fptr) (void *), void *ptr)
+{
+   struct finalizer_t *f = rest_test_arena_alloc (arena, sizeof *f);
+   if (!f)
+      return false;
+
+   f->fptr = fptr;
+   f->ptr = ptr;
+   f->next = arena->finalizers;
+   arena->finalizers = f;
+   return true;
+}
+
+size_t rest_test_arena_nallocs (const rest_test_arena_t *arena)
+{
+   return arena ? arena->nallocs : 0;
+}
+
+size_t rest_test_arena_nbytes (const rest_test_arena_t *arena)
+{
+   return arena ? arena->nbytes : 0;
+}
+
+size_t rest_test_arena_nchunks (const rest_test_arena_t *arena)
+{
+   return arena ? arena->nchunks : 0;
+}
+
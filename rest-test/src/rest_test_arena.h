@@ -0,0 +1,52 @@
+
+#ifndef H_REST_TEST_ARENA
+#define H_REST_TEST_ARENA
+
+typedef struct rest_test_arena_t rest_test_arena_t;
+
+/* *****************************************************************************
+ * A bump allocator for the objects created while parsing. Allocations are carved
+ * out of large chunks and are never freed individually; deleting the arena
+ * releases everything at once.
+ *
+ * Objects that hold resources which the arena does not own (hash maps, mapped
+ * files) register a finalizer with rest_test_arena_defer(). Finalizers are run,
+ * most recent first, when the arena is deleted.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Create a new arena. Chunks of `chunk_size` bytes are allocated as needed; a
+   // `chunk_size` of zero selects a default. On failure NULL is returned.
+   rest_test_arena_t *rest_test_arena_new (size_t chunk_size);
+
+   // Runs all the finalizers, then releases all memory allocated from the arena.
+   void rest_test_arena_del (rest_test_arena_t **arena);
+
+   // Returns `size` bytes of zeroed memory, suitably aligned for any object, or
+   // NULL on failure.
+   void *rest_test_arena_alloc (rest_test_arena_t *arena, size_t size);
+
+   // Copies the first `length` bytes of `src` into the arena, adding a
+   // terminator. Returns NULL on failure.
+   char *rest_test_arena_strndup (rest_test_arena_t *arena, const char *src, size_t length);
+   char *rest_test_arena_strdup (rest_test_arena_t *arena, const char *src);
+
+   // Register `fptr` to be called with `ptr` when the arena is deleted. Returns
+   // false if the finalizer could not be registered.
+   bool rest_test_arena_defer (rest_test_arena_t *arena, void (*fptr) (void *), void *ptr);
+
+   // Statistics: the number of allocations made from the arena, the number of
+   // bytes handed out and the number of chunks obtained from the system.
+   size_t rest_test_arena_nallocs (const rest_test_arena_t *arena);
+   size_t rest_test_arena_nbytes (const rest_test_arena_t *arena);
+   size_t rest_test_arena_nchunks (const rest_test_arena_t *arena);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,817 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/random.h>
+
+#include "rest_test_arena.h"
+#include "rest_test_token.h"
+#include "rest_test_symt.h"
+#include "rest_test.h"
+#include "rest_test_builtin.h"
+
+struct builtin_t {
+   const char             *name;
+   size_t                  minargs;
+   size_t                  maxargs;
+   rest_test_builtin_fn_t  fn;
+};
+
+#define FUNCTION(name)     static bool name (size_t nargs, const char *const *args,\
+                                             const size_t *lengths,\
+                                             char **result, size_t *length)
+#define UNUSED_ARGS        do { (void)nargs; (void)args; (void)lengths; } while (0)
+
+/* *****************************************************************************
+ * Helpers.
+ */
+
+// Allocates a result of `n` bytes plus the terminator
+static char *result_new (size_t n, char **result, size_t *length)
+{
+   if (!(*result = malloc (n + 1))) {
+      ERRORF ("OOM allocating %zu byte result\n", n);
+      return NULL;
+   }
+   (*result)[n] = 0;
+   *length = n;
+   return *result;
+}
+
+static bool result_copy (const void *data, size_t n, char **result, size_t *length)
+{
+   if (!(result_new (n, result, length)))
+      return false;
+   memcpy (*result, data, n);
+   return true;
+}
+
+// Parses the whole argument as a decimal integer
+static bool arg_integer (const char *arg, long long *value)
+{
+   char *end = NULL;
+   errno = 0;
+   *value = strtoll (arg, &end, 10);
+   if (end == arg || *end || errno) {
+      ERRORF ("[%s] is not an integer\n", arg);
+      return false;
+   }
+   return true;
+}
+
+static bool random_bytes (void *dst, size_t n)
+{
+   unsigned char *p = dst;
+   while (n) {
+      ssize_t nbytes = getrandom (p, n, 0);
+      if (nbytes < 0 && errno == EINTR)
+         continue;
+      if (nbytes < 0) {
+         ERRORF ("Failed to read random bytes: %m\n");
+         return false;
+      }
+      p += nbytes;
+      n -= (size_t)nbytes;
+   }
+   return true;
+}
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static void hex_encode (const unsigned char *src, size_t n, char *dst)
+{
+   for (size_t i=0; i<n; i++) {
+      dst[i * 2] = hexdigits[src[i] >> 4];
+      dst[i * 2 + 1] = hexdigits[src[i] & 0x0f];
+   }
+}
+
+static const char b64std[] =
+   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char b64url[] =
+   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static bool base64_encode (const unsigned char *src, size_t n, const char *alphabet, bool pad,
+                           char **result, size_t *length)
+{
+   size_t full = n / 3, rest = n % 3;
+   size_t size = full * 4 + (rest ? (pad ? 4 : rest + 1) : 0);
+   char *dst = result_new (size, result, length);
+   if (!dst)
+      return false;
+
+   for (size_t i=0; i<full; i++, src += 3) {
+      uint32_t v = (uint32_t)src[0] << 16 | (uint32_t)src[1] << 8 | src[2];
+      *dst++ = alphabet[v >> 18];
+      *dst++ = alphabet[(v >> 12) & 0x3f];
+      *dst++ = alphabet[(v >> 6) & 0x3f];
+      *dst++ = alphabet[v & 0x3f];
+   }
+   if (rest) {
+      uint32_t v = (uint32_t)src[0] << 16 | (rest == 2 ? (uint32_t)src[1] << 8 : 0);
+      *dst++ = alphabet[v >> 18];
+      *dst++ = alphabet[(v >> 12) & 0x3f];
+      if (rest == 2)
+         *dst++ = alphabet[(v >> 6) & 0x3f];
+      for (size_t i=rest; pad && i<3; i++) {
+         *dst++ = '=';
+      }
+   }
+   return true;
+}
+
+
+/* *****************************************************************************
+ * SHA-256 (FIPS 180-4) and HMAC (RFC 2104).
+ */
+
+struct sha256_t {
+   uint32_t          state[8];
+   uint64_t          length;
+   unsigned char     block[64];
+   size_t            used;
+};
+
+static const uint32_t sha256_k[64] = {
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+   0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+   0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+   0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+   0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t ror32 (uint32_t x, unsigned r)
+{
+   return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block (struct sha256_t *ctx, const unsigned char *p)
+{
+   uint32_t w[64];
+   for (size_t i=0; i<16; i++) {
+      w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16
+           | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+   }
+   for (size_t i=16; i<64; i++) {
+      uint32_t s0 = ror32 (w[i - 15], 7) ^ ror32 (w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = ror32 (w[i - 2], 17) ^ ror32 (w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+   }
+
+   uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+   uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+   for (size_t i=0; i<64; i++) {
+      uint32_t s1 = ror32 (e, 6) ^ ror32 (e, 11) ^ ror32 (e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+      uint32_t s0 = ror32 (a, 2) ^ ror32 (a, 13) ^ ror32 (a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+   }
+   ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+   ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void sha256_init (struct sha256_t *ctx)
+{
+   static const uint32_t init[8] = {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+   };
+   memcpy (ctx->state, init, sizeof init);
+   ctx->length = 0;
+   ctx->used = 0;
+}
+
+static void sha256_update (struct sha256_t *ctx, const void *data, size_t n)
+{
+   const unsigned char *p = data;
+   ctx->length += n;
+   if (ctx->used) {
+      size_t take = 64 - ctx->used < n ? 64 - ctx->used : n;
+      memcpy (&ctx->block[ctx->used], p, take);
+      ctx->used += take;
+      p += take;
+      n -= take;
+      if (ctx->used < 64)
+         return;
+      sha256_block (ctx, ctx->block);
+      ctx->used = 0;
+   }
+   for (; n >= 64; p += 64, n -= 64) {
+      sha256_block (ctx, p);
+   }
+   memcpy (ctx->block, p, n);
+   ctx->used = n;
+}
+
+static void sha256_final (struct sha256_t *ctx, unsigned char digest[32])
+{
+   uint64_t bits = ctx->length * 8;
+   ctx->block[ctx->used++] = 0x80;
+   if (ctx->used > 56) {
+      memset (&ctx->block[ctx->used], 0, 64 - ctx->used);
+      sha256_block (ctx, ctx->block);
+      ctx->used = 0;
+   }
+   memset (&ctx->block[ctx->used], 0, 56 - ctx->used);
+   for (size_t i=0; i<8; i++) {
+      ctx->block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+   }
+   sha256_block (ctx, ctx->block);
+   for (size_t i=0; i<8; i++) {
+      digest[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+      digest[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+      digest[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+      digest[i * 4 + 3] = (unsigned char)ctx->state[i];
+   }
+}
+
+static void sha256 (const void *data, size_t n, unsigned char digest[32])
+{
+   struct sha256_t ctx;
+   sha256_init (&ctx);
+   sha256_update (&ctx, data, n);
+   sha256_final (&ctx, digest);
+}
+
+static void hmac_sha256 (const void *key, size_t klen, const void *data, size_t n,
+                         unsigned char digest[32])
+{
+   unsigned char pad[64] = { 0 };
+   struct sha256_t ctx;
+
+   // A key longer than a block is hashed first
+   if (klen > sizeof pad) {
+      sha256 (key, klen, pad);
+   } else {
+      memcpy (pad, key, klen);
+   }
+
+   for (size_t i=0; i<sizeof pad; i++) {
+      pad[i] ^= 0x36;
+   }
+   sha256_init (&ctx);
+   sha256_update (&ctx, pad, sizeof pad);
+   sha256_update (&ctx, data, n);
+   sha256_final (&ctx, digest);
+
+   for (size_t i=0; i<sizeof pad; i++) {
+      pad[i] ^= 0x36 ^ 0x5c;
+   }
+   sha256_init (&ctx);
+   sha256_update (&ctx, pad, sizeof pad);
+   sha256_update (&ctx, digest, 32);
+   sha256_final (&ctx, digest);
+}
+
+
+/* *****************************************************************************
+ * Time.
+ */
+
+FUNCTION (fn_now)
+{
+   UNUSED_ARGS;
+   char tmp[32];
+   int n = snprintf (tmp, sizeof tmp, "%lld", (long long)time (NULL));
+   return result_copy (tmp, (size_t)n, result, length);
+}
+
+FUNCTION (fn_now_ms)
+{
+   UNUSED_ARGS;
+   struct timespec ts;
+   clock_gettime (CLOCK_REALTIME, &ts);
+   char tmp[32];
+   int n = snprintf (tmp, sizeof tmp, "%lld",
+                     (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+   return result_copy (tmp, (size_t)n, result, length);
+}
+
+static bool format_time (const char *fmt, bool local, char **result, size_t *length)
+{
+   time_t now = time (NULL);
+   struct tm tm;
+   if (!(local ? localtime_r (&now, &tm) : gmtime_r (&now, &tm))) {
+      ERRORF ("Failed to convert the time\n");
+      return false;
+   }
+
+   char tmp[256];
+   size_t n = strftime (tmp, sizeof tmp, fmt, &tm);
+   if (!n && *fmt) {
+      ERRORF ("Time format [%s] is too long\n", fmt);
+      return false;
+   }
+   return result_copy (tmp, n, result, length);
+}
+
+FUNCTION (fn_date)
+{
+   (void)lengths;
+   return format_time (nargs ? args[0] : "%Y-%m-%dT%H:%M:%SZ", false, result, length);
+}
+
+FUNCTION (fn_localdate)
+{
+   (void)lengths;
+   return format_time (nargs ? args[0] : "%Y-%m-%dT%H:%M:%S%z", true, result, length);
+}
+
+
+/* *****************************************************************************
+ * Random values.
+ */
+
+FUNCTION (fn_uuid)
+{
+   UNUSED_ARGS;
+   unsigned char bytes[16];
+   char hex[32];
+   if (!(random_bytes (bytes, sizeof bytes)))
+      return false;
+   bytes[6] = (bytes[6] & 0x0f) | 0x40;
+   bytes[8] = (bytes[8] & 0x3f) | 0x80;
+   hex_encode (bytes, sizeof bytes, hex);
+
+   char *dst = result_new (36, result, length);
+   if (!dst)
+      return false;
+   static const size_t groups[] = { 8, 4, 4, 4, 12 };
+   for (size_t i=0, pos=0; i<sizeof groups / sizeof groups[0]; i++) {
+      if (i)
+         *dst++ = '-';
+      memcpy (dst, &hex[pos], groups[i]);
+      dst += groups[i];
+      pos += groups[i];
+   }
+   return true;
+}
+
+FUNCTION (fn_random)
+{
+   (void)lengths;
+   long long limit = (long long)1 << 32;
+   if (nargs && !(arg_integer (args[0], &limit)))
+      return false;
+   if (limit <= 0) {
+      ERRORF ("random() needs a positive limit, not [%s]\n", args[0]);
+      return false;
+   }
+
+   // Values past the last multiple of the limit are drawn again, so that every
+   // result is equally likely
+   uint64_t range = (uint64_t)limit;
+   uint64_t bound = UINT64_MAX - UINT64_MAX % range;
+   uint64_t value;
+   do {
+      if (!(random_bytes (&value, sizeof value)))
+         return false;
+   } while (value >= bound);
+
+   char tmp[32];
+   int n = snprintf (tmp, sizeof tmp, "%llu", (unsigned long long)(value % range));
+   return result_copy (tmp, (size_t)n, result, length);
+}
+
+FUNCTION (fn_random_hex)
+{
+   (void)nargs;
+   (void)lengths;
+   long long n = 0;
+   if (!(arg_integer (args[0], &n)))
+      return false;
+   if (n < 0 || n > 4096) {
+      ERRORF ("random_hex() takes from 0 to 4096 bytes, not [%s]\n", args[0]);
+      return false;
+   }
+
+   unsigned char bytes[4096];
+   if (!(random_bytes (bytes, (size_t)n)) || !(result_new ((size_t)n * 2, result, length)))
+      return false;
+   hex_encode (bytes, (size_t)n, *result);
+   return true;
+}
+
+
+/* *****************************************************************************
+ * Encodings.
+ */
+
+FUNCTION (fn_base64)
+{
+   (void)nargs;
+   return base64_encode ((const unsigned char *)args[0], lengths[0], b64std, true,
+                         result, length);
+}
+
+FUNCTION (fn_base64url)
+{
+   (void)nargs;
+   return base64_encode ((const unsigned char *)args[0], lengths[0], b64url, false,
+                         result, length);
+}
+
+FUNCTION (fn_unbase64)
+{
+   (void)nargs;
+   const char *src = args[0];
+   size_t n = lengths[0];
+   while (n && src[n - 1] == '=')
+      n--;
+   if (n % 4 == 1) {
+      ERRORF ("[%s] is not base64\n", args[0]);
+      return false;
+   }
+
+   char *dst = result_new (n / 4 * 3 + (n % 4 ? n % 4 - 1 : 0), result, length);
+   if (!dst)
+      return false;
+
+   uint32_t v = 0;
+   for (size_t i=0; i<n; i++) {
+      const char *c = strchr (b64std, src[i]);
+      if (!src[i] || !c) {
+         if (src[i] == '-' || src[i] == '_') {
+            c = strchr (b64url, src[i]);
+            v = v << 6 | (uint32_t)(c - b64url);
+         } else {
+            ERRORF ("[%s] is not base64\n", args[0]);
+            free (*result);
+            *result = NULL;
+            return false;
+         }
+      } else {
+         v = v << 6 | (uint32_t)(c - b64std);
+      }
+      if (i % 4 == 3) {
+         *dst++ = (char)(v >> 16);
+         *dst++ = (char)(v >> 8);
+         *dst++ = (char)v;
+         v = 0;
+      }
+   }
+   if (n % 4 == 2) {
+      *dst++ = (char)(v >> 4);
+   } else if (n % 4 == 3) {
+      *dst++ = (char)(v >> 10);
+      *dst++ = (char)(v >> 2);
+   }
+   return true;
+}
+
+FUNCTION (fn_hex)
+{
+   (void)nargs;
+   if (!(result_new (lengths[0] * 2, result, length)))
+      return false;
+   hex_encode ((const unsigned char *)args[0], lengths[0], *result);
+   return true;
+}
+
+// Arguments can hold NUL bytes, which strchr() would match against the
+// terminator of its set; both passes of an encoder classify bytes through
+// these so that the sizes they compute and the bytes they write agree.
+static bool url_unreserved (unsigned char c)
+{
+   return c && (isalnum (c) || strchr ("-._~", c));
+}
+
+static const char *json_escape (unsigned char c)
+{
+   return c ? strchr ("\b\f\n\r\t", c) : NULL;
+}
+
+FUNCTION (fn_urlencode)
+{
+   (void)nargs;
+   const unsigned char *src = (const unsigned char *)args[0];
+   size_t n = 0;
+   for (size_t i=0; i<lengths[0]; i++) {
+      n += url_unreserved (src[i]) ? 1 : 3;
+   }
+
+   char *dst = result_new (n, result, length);
+   if (!dst)
+      return false;
+   for (size_t i=0; i<lengths[0]; i++) {
+      if (url_unreserved (src[i])) {
+         *dst++ = (char)src[i];
+      } else {
+         *dst++ = '%';
+         *dst++ = "0123456789ABCDEF"[src[i] >> 4];
+         *dst++ = "0123456789ABCDEF"[src[i] & 0x0f];
+      }
+   }
+   return true;
+}
+
+FUNCTION (fn_json)
+{
+   (void)nargs;
+   const unsigned char *src = (const unsigned char *)args[0];
+   size_t n = 0;
+   for (size_t i=0; i<lengths[0]; i++) {
+      n += src[i] == '"' || src[i] == '\\' || json_escape (src[i]) ? 2
+         : src[i] < 0x20 ? 6
+         : 1;
+   }
+
+   char *dst = result_new (n, result, length);
+   if (!dst)
+      return false;
+   for (size_t i=0; i<lengths[0]; i++) {
+      const char *escape = json_escape (src[i]);
+      if (src[i] == '"' || src[i] == '\\') {
+         *dst++ = '\\';
+         *dst++ = (char)src[i];
+      } else if (escape) {
+         *dst++ = '\\';
+         *dst++ = "bfnrt"[escape - "\b\f\n\r\t"];
+      } else if (src[i] < 0x20) {
+         dst += sprintf (dst, "\\u%04x", src[i]);
+      } else {
+         *dst++ = (char)src[i];
+      }
+   }
+   return true;
+}
+
+
+/* *****************************************************************************
+ * Hashes.
+ */
+
+FUNCTION (fn_sha256)
+{
+   (void)nargs;
+   unsigned char digest[32];
+   sha256 (args[0], lengths[0], digest);
+   if (!(result_new (64, result, length)))
+      return false;
+   hex_encode (digest, sizeof digest, *result);
+   return true;
+}
+
+FUNCTION (fn_sha256_b64)
+{
+   (void)nargs;
+   unsigned char digest[32];
+   sha256 (args[0], lengths[0], digest);
+   return base64_encode (digest, sizeof digest, b64std, true, result, length);
+}
+
+FUNCTION (fn_hmac_sha256)
+{
+   (void)nargs;
+   unsigned char digest[32];
+   hmac_sha256 (args[0], lengths[0], args[1], lengths[1], digest);
+   if (!(result_new (64, result, length)))
+      return false;
+   hex_encode (digest, sizeof digest, *result);
+   return true;
+}
+
+FUNCTION (fn_hmac_sha256_b64)
+{
+   (void)nargs;
+   unsigned char digest[32];
+   hmac_sha256 (args[0], lengths[0], args[1], lengths[1], digest);
+   return base64_encode (digest, sizeof digest, b64std, true, result, length);
+}
+
+
+/* *****************************************************************************
+ * Strings.
+ */
+
+static bool change_case (const char *src, size_t n, int (*convert) (int),
+                         char **result, size_t *length)
+{
+   char *dst = result_new (n, result, length);
+   if (!dst)
+      return false;
+   for (size_t i=0; i<n; i++) {
+      dst[i] = (char)convert ((unsigned char)src[i]);
+   }
+   return true;
+}
+
+FUNCTION (fn_upper)
+{
+   (void)nargs;
+   return change_case (args[0], lengths[0], toupper, result, length);
+}
+
+FUNCTION (fn_lower)
+{
+   (void)nargs;
+   return change_case (args[0], lengths[0], tolower, result, length);
+}
+
+FUNCTION (fn_trim)
+{
+   (void)nargs;
+   const char *start = args[0];
+   const char *end = &args[0][lengths[0]];
+   while (start < end && isspace ((unsigned char)*start))
+      start++;
+   while (end > start && isspace ((unsigned char)end[-1]))
+      end--;
+   return result_copy (start, (size_t)(end - start), result, length);
+}
+
+FUNCTION (fn_length)
+{
+   (void)nargs;
+   (void)args;
+   char tmp[32];
+   int n = snprintf (tmp, sizeof tmp, "%zu", lengths[0]);
+   return result_copy (tmp, (size_t)n, result, length);
+}
+
+// A negative start counts from the end; both are clamped to the string
+FUNCTION (fn_substr)
+{
+   long long start = 0, count = (long long)lengths[0];
+   if (!(arg_integer (args[1], &start)) || (nargs > 2 && !(arg_integer (args[2], &count))))
+      return false;
+
+   long long n = (long long)lengths[0];
+   if (start < 0)
+      start = n + start < 0 ? 0 : n + start;
+   if (start > n)
+      start = n;
+   if (count < 0)
+      count = 0;
+   if (count > n - start)
+      count = n - start;
+   return result_copy (&args[0][start], (size_t)count, result, length);
+}
+
+FUNCTION (fn_replace)
+{
+   (void)nargs;
+   const char *src = args[0], *from = args[1], *to = args[2];
+   size_t flen = lengths[1], tlen = lengths[2];
+   if (!flen) {
+      ERRORF ("replace() cannot replace an empty string\n");
+      return false;
+   }
+
+   size_t count = 0;
+   for (const char *p = src; (p = strstr (p, from)); p += flen) {
+      count++;
+   }
+   char *dst = result_new (lengths[0] - count * flen + count * tlen, result, length);
+   if (!dst)
+      return false;
+
+   const char *p = src, *match;
+   while ((match = strstr (p, from))) {
+      memcpy (dst, p, (size_t)(match - p));
+      dst += match - p;
+      memcpy (dst, to, tlen);
+      dst += tlen;
+      p = match + flen;
+   }
+   memcpy (dst, p, (size_t)(&src[lengths[0]] - p));
+   return true;
+}
+
+FUNCTION (fn_concat)
+{
+   size_t n = 0;
+   for (size_t i=0; i<nargs; i++) {
+      n += lengths[i];
+   }
+   char *dst = result_new (n, result, length);
+   if (!dst)
+      return false;
+   for (size_t i=0; i<nargs; i++) {
+      memcpy (dst, args[i], lengths[i]);
+      dst += lengths[i];
+   }
+   return true;
+}
+
+
+/* *****************************************************************************
+ * The registry. The builtins are sorted by name for a binary search; functions
+ * registered later are searched first.
+ */
+
+static const struct builtin_t builtins[] = {
+   { "base64",          1, 1, fn_base64 },
+   { "base64url",       1, 1, fn_base64url },
+   { "concat",          1, REST_TEST_BUILTIN_MAXARGS, fn_concat },
+   { "date",            0, 1, fn_date },
+   { "hex",             1, 1, fn_hex },
+   { "hmac_sha256",     2, 2, fn_hmac_sha256 },
+   { "hmac_sha256_b64", 2, 2, fn_hmac_sha256_b64 },
+   { "json",            1, 1, fn_json },
+   { "length",          1, 1, fn_length },
+   { "localdate",       0, 1, fn_localdate },
+   { "lower",           1, 1, fn_lower },
+   { "now",             0, 0, fn_now },
+   { "now_ms",          0, 0, fn_now_ms },
+   { "random",          0, 1, fn_random },
+   { "random_hex",      1, 1, fn_random_hex },
+   { "replace",         3, 3, fn_replace },
+   { "sha256",          1, 1, fn_sha256 },
+   { "sha256_b64",      1, 1, fn_sha256_b64 },
+   { "substr",          2, 3, fn_substr },
+   { "trim",            1, 1, fn_trim },
+   { "unbase64",        1, 1, fn_unbase64 },
+   { "upper",           1, 1, fn_upper },
+   { "urlencode",       1, 1, fn_urlencode },
+   { "uuid",            0, 0, fn_uuid },
+};
+
+static struct builtin_t *registered;
+static size_t nregistered;
+
+// Compares the `nlen` bytes at `name` to the NUL-terminated `other`
+static int name_cmp (const char *name, size_t nlen, const char *other)
+{
+   int ret = strncmp (name, other, nlen);
+   return ret ? ret : -(unsigned char)other[nlen];
+}
+
+static const struct builtin_t *builtin_find (const char *name, size_t nlen)
+{
+   for (size_t i=0; i<nregistered; i++) {
+      if ((name_cmp (name, nlen, registered[i].name)) == 0)
+         return &registered[i];
+   }
+
+   size_t lo = 0, hi = sizeof builtins / sizeof builtins[0];
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      int cmp = name_cmp (name, nlen, builtins[mid].name);
+      if (cmp == 0)
+         return &builtins[mid];
+      if (cmp < 0) {
+         hi = mid;
+      } else {
+         lo = mid + 1;
+      }
+   }
+   return NULL;
+}
+
+bool rest_test_builtin_register (const char *name, size_t minargs, size_t maxargs,
+                                 rest_test_builtin_fn_t fn)
+{
+   if (!name || !*name || !fn || minargs > maxargs || maxargs > REST_TEST_BUILTIN_MAXARGS)
+      return false;
+
+   size_t i = 0;
+   while (i < nregistered && (strcmp (registered[i].name, name)) != 0)
+      i++;
+   if (i == nregistered) {
+      struct builtin_t *tmp = realloc (registered, (nregistered + 1) * sizeof *tmp);
+      if (!tmp)
+         return false;
+      registered = tmp;
+      // The name is the caller's, and must outlive the registration
+      registered[nregistered++].name = name;
+   }
+   registered[i].minargs = minargs;
+   registered[i].maxargs = maxargs;
+   registered[i].fn = fn;
+   return true;
+}
+
+bool rest_test_builtin_call (const char *name, size_t nlen,
+                             size_t nargs, const char *const *args,
+                             const size_t *lengths,
+                             char **result, size_t *length)
+{
+   const struct builtin_t *builtin = builtin_find (name, nlen);
+   *result = NULL;
+   *length = 0;
+   if (!builtin) {
+      ERRORF ("No builtin function [%.*s]\n", (int)nlen, name);
+      return false;
+   }
+   if (nargs < builtin->minargs || nargs > builtin->maxargs) {
+      ERRORF ("%s() takes from %zu to %zu arguments, not %zu\n", builtin->name,
+              builtin->minargs, builtin->maxargs, nargs);
+      return false;
+   }
+   return builtin->fn (nargs, args, lengths, result, length);
+}
+
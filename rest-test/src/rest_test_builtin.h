@@ -0,0 +1,72 @@
+
+#ifndef H_REST_TEST_BUILTIN
+#define H_REST_TEST_BUILTIN
+
+/* *****************************************************************************
+ * Builtin functions, called from a value as `{{name(arg, ...)}}` and computed
+ * in-process rather than by a shell command. An argument is a quoted string
+ * ("..." or '...', with backslash escapes), a number, a symbol name (replaced
+ * by the symbol's value, as `{{name}}` would be) or another call. Arguments
+ * cannot contain `}}`, which ends the reference.
+ *
+ *    Time        now()             seconds since the epoch
+ *                now_ms()          milliseconds since the epoch
+ *                date([fmt])       UTC time formatted by strftime(); ISO 8601
+ *                                  by default
+ *                localdate([fmt])  local time, likewise
+ *    Random      uuid()            a version 4 UUID
+ *                random([n])       an integer in [0, n), by default [0, 2^32)
+ *                random_hex(n)     n random bytes, hex-encoded
+ *    Encodings   base64(s)         base64url(s) is unpadded, with - and _
+ *                base64url(s)
+ *                unbase64(s)       accepts either alphabet
+ *                hex(s)
+ *                urlencode(s)      percent-encodes all but unreserved bytes
+ *                json(s)           escaped for use inside a JSON string
+ *    Hashes      sha256(s)         hex digest; sha256_b64(s) is base64
+ *                sha256_b64(s)
+ *                hmac_sha256(key, s)
+ *                hmac_sha256_b64(key, s)
+ *    Strings     upper(s) lower(s) trim(s) length(s)
+ *                substr(s, start[, length])
+ *                replace(s, from, to)
+ *                concat(s, ...)
+ *
+ * Further functions can be registered, before any tests are run.
+ */
+
+#define REST_TEST_BUILTIN_MAXARGS   (8)
+
+// Computes a result from `nargs` arguments, each `lengths[i]` bytes and
+// NUL-terminated. The result must be allocated with malloc(), NUL-terminated,
+// and its length stored. On failure the function reports the error and returns
+// false.
+typedef bool (*rest_test_builtin_fn_t) (size_t nargs, const char *const *args,
+                                        const size_t *lengths,
+                                        char **result, size_t *length);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Adds a function taking from `minargs` to `maxargs` arguments (at most
+   // REST_TEST_BUILTIN_MAXARGS), replacing any function of the same name. The
+   // name is not copied. Not safe to call while values are being rendered.
+   bool rest_test_builtin_register (const char *name, size_t minargs, size_t maxargs,
+                                    rest_test_builtin_fn_t fn);
+
+   // Calls the function `name`, of `nlen` bytes. Returns false, having
+   // reported the error, if there is no such function, the number of
+   // arguments is wrong or the function fails.
+   bool rest_test_builtin_call (const char *name, size_t nlen,
+                                size_t nargs, const char *const *args,
+                                const size_t *lengths,
+                                char **result, size_t *length);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
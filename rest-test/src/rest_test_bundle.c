@@ -0,0 +1,438 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ds_str.h"
+
+#include "rest_test_arena.h"
+#include "rest_test_token.h"
+#include "rest_test_symt.h"
+#include "rest_test_intern.h"
+#include "rest_test_hash.h"
+#include "rest_test.h"
+#include "rest_test_bundle.h"
+
+#define CLEANUP(...) \
+do {\
+   ERRORF(__VA_ARGS__);\
+   goto cleanup;\
+} while (0)
+
+#define BUNDLE_MAGIC       "RTBUNDLE"
+#define BUNDLE_BYTEORDER   (0x01020304u)
+
+// A value in the string pool. The value is followed by a terminator that is not
+// counted in `length`.
+struct bstring_t {
+   uint64_t offset;
+   uint64_t length;
+};
+
+// Identifies the contents of the source file that a bundle was compiled from
+struct borigin_t {
+   uint64_t          size;
+   int64_t           mtime_sec;
+   int64_t           mtime_nsec;
+   uint64_t          hash;
+};
+
+struct bheader_t {
+   char              magic[8];
+   uint32_t          version;
+   uint32_t          byteorder;
+   uint64_t          nrecords;
+   uint64_t          records;    // File offset of the records
+   uint64_t          strings;    // File offset of the string pool
+   uint64_t          nstrings;   // Length of the string pool
+   struct bstring_t  source;
+   struct borigin_t  origin;
+};
+
+struct bparam_t {
+   uint32_t          type;
+   uint32_t          reserved;
+   uint64_t          line_no;
+   struct bstring_t  value;
+};
+
+struct brecord_t {
+   uint32_t          op;
+   uint32_t          nparams;
+   uint64_t          line_no;
+   struct bparam_t   params[REST_TEST_BUNDLE_MAXPARAMS];
+};
+
+struct rest_test_bundle_t {
+   struct brecord_t *records;
+   size_t            nrecords;
+   size_t            records_size;
+   char             *strings;
+   size_t            nstrings;
+   size_t            strings_size;
+   struct bstring_t  source;
+   struct borigin_t  origin;
+};
+
+struct rest_test_bundle_reader_t {
+   rest_test_token_t       *file;     // The entire mapped file
+   const char              *data;
+   const struct bheader_t  *header;
+   const struct brecord_t  *records;
+   const char              *source;   // interned
+   size_t                   next;
+};
+
+
+/* *********************************************************************************
+ * Source file identification.
+ */
+
+static bool origin_stat (const char *filename, struct borigin_t *origin)
+{
+   struct stat sb;
+   if ((stat (filename, &sb)) != 0)
+      return false;
+
+   origin->size = (uint64_t)sb.st_size;
+   origin->mtime_sec = (int64_t)sb.st_mtim.tv_sec;
+   origin->mtime_nsec = (int64_t)sb.st_mtim.tv_nsec;
+   return true;
+}
+
+static bool origin_hash (const char *filename, uint64_t *hash)
+{
+   // Empty files cannot be mapped
+   rest_test_token_t *file = rest_test_token_map (filename);
+   size_t length = 0;
+   const char *data = file ? rest_test_token_slice (file, &length) : "";
+
+   if (!file) {
+      struct stat sb;
+      if ((stat (filename, &sb)) != 0 || sb.st_size != 0)
+         return false;
+   }
+   *hash = rest_test_hash64 (data, length, 0);
+   rest_test_token_del (&file);
+   return true;
+}
+
+
+/* *********************************************************************************
+ * Writing bundles.
+ */
+
+static bool grow (void **array, size_t *size, size_t needed, size_t elsize)
+{
+   if (needed <= *size)
+      return true;
+
+   size_t newsize = *size ? *size : 16;
+   while (newsize < needed)
+      newsize *= 2;
+
+   void *tmp = realloc (*array, newsize * elsize);
+   if (!tmp)
+      return false;
+   *array = tmp;
+   *size = newsize;
+   return true;
+}
+
+static bool pool_add (rest_test_bundle_t *bundle, const char *value, size_t length,
+                      struct bstring_t *dst)
+{
+   if (!(grow ((void **)&bundle->strings, &bundle->strings_size,
+               bundle->nstrings + length + 1, 1)))
+      return false;
+
+   memcpy (&bundle->strings[bundle->nstrings], value, length);
+   bundle->strings[bundle->nstrings + length] = 0;
+   dst->offset = bundle->nstrings;
+   dst->length = length;
+   bundle->nstrings += length + 1;
+   return true;
+}
+
+rest_test_bundle_t *rest_test_bundle_new (const char *source)
+{
+   rest_test_bundle_t *ret = calloc (1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   if (!source || !(pool_add (ret, source, strlen (source), &ret->source))) {
+      rest_test_bundle_del (&ret);
+      return NULL;
+   }
+   return ret;
+}
+
+void rest_test_bundle_del (rest_test_bundle_t **bundle)
+{
+   if (!bundle || !*bundle)
+      return;
+
+   free ((*bundle)->records);
+   free ((*bundle)->strings);
+   free (*bundle);
+   *bundle = NULL;
+}
+
+bool rest_test_bundle_add (rest_test_bundle_t *bundle, unsigned op, size_t line_no,
+                           size_t nparams, rest_test_token_t *const *params)
+{
+   if (!bundle || nparams > REST_TEST_BUNDLE_MAXPARAMS)
+      return false;
+
+   if (!(grow ((void **)&bundle->records, &bundle->records_size,
+               bundle->nrecords + 1, sizeof *bundle->records)))
+      return false;
+
+   struct brecord_t *record = &bundle->records[bundle->nrecords];
+   memset (record, 0, sizeof *record);
+   record->op = op;
+   record->nparams = (uint32_t)nparams;
+   record->line_no = line_no;
+
+   for (size_t i=0; i<nparams; i++) {
+      size_t length = 0;
+      const char *value = rest_test_token_slice (params[i], &length);
+      if (!value)
+         return false;
+      record->params[i].type = (uint32_t)rest_test_token_type (params[i]);
+      record->params[i].line_no = rest_test_token_line_no (params[i]);
+      if (!(pool_add (bundle, value, length, &record->params[i].value)))
+         return false;
+   }
+
+   bundle->nrecords++;
+   return true;
+}
+
+bool rest_test_bundle_set_origin (rest_test_bundle_t *bundle, const char *filename)
+{
+   if (!bundle || !filename)
+      return false;
+
+   if (!(origin_stat (filename, &bundle->origin))
+         || !(origin_hash (filename, &bundle->origin.hash))) {
+      ERRORF ("Failed to identify [%s]: %m\n", filename);
+      return false;
+   }
+   return true;
+}
+
+bool rest_test_bundle_write (const rest_test_bundle_t *bundle, const char *filename)
+{
+   bool error = true;
+   char *tmpname = NULL;
+   FILE *outf = NULL;
+   int fd = -1;
+
+   if (!bundle || !filename)
+      return false;
+
+   struct bheader_t header;
+   memset (&header, 0, sizeof header);
+   memcpy (header.magic, BUNDLE_MAGIC, sizeof header.magic);
+   header.version = REST_TEST_BUNDLE_VERSION;
+   header.byteorder = BUNDLE_BYTEORDER;
+   header.nrecords = bundle->nrecords;
+   header.records = sizeof header;
+   header.strings = header.records + bundle->nrecords * sizeof *bundle->records;
+   header.nstrings = bundle->nstrings;
+   header.source = bundle->source;
+   header.origin = bundle->origin;
+
+   if (!(tmpname = ds_str_cat (filename, ".XXXXXX", NULL))) {
+      CLEANUP ("OOM allocating temporary name for [%s]\n", filename);
+   }
+   if ((fd = mkstemp (tmpname)) < 0) {
+      CLEANUP ("Failed to create [%s]: %m\n", tmpname);
+   }
+   // mkstemp() creates the file readable only by the owner
+   if ((fchmod (fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) != 0) {
+      CLEANUP ("Failed to set permissions on [%s]: %m\n", tmpname);
+   }
+   if (!(outf = fdopen (fd, "wb"))) {
+      CLEANUP ("Failed to open [%s]: %m\n", tmpname);
+   }
+   fd = -1;
+
+   if ((fwrite (&header, sizeof header, 1, outf)) != 1
+         || (fwrite (bundle->records, sizeof *bundle->records, bundle->nrecords, outf))
+               != bundle->nrecords
+         || (fwrite (bundle->strings, 1, bundle->nstrings, outf)) != bundle->nstrings) {
+      CLEANUP ("Failed to write [%s]: %m\n", tmpname);
+   }
+
+   int rc = fclose (outf);
+   outf = NULL;
+   if (rc != 0) {
+      CLEANUP ("Failed to write [%s]: %m\n", tmpname);
+   }
+
+   if ((rename (tmpname, filename)) != 0) {
+      CLEANUP ("Failed to rename [%s] to [%s]: %m\n", tmpname, filename);
+   }
+
+   error = false;
+cleanup:
+   if (outf)
+      fclose (outf);
+   if (fd >= 0)
+      close (fd);
+   if (error && tmpname)
+      remove (tmpname);
+   free (tmpname);
+   return !error;
+}
+
+
+/* *********************************************************************************
+ * Reading bundles.
+ */
+
+static bool pool_valid (const struct bheader_t *header, const char *data,
+                        const struct bstring_t *s)
+{
+   return s->offset < header->nstrings
+       && s->length < header->nstrings - s->offset
+       && data[header->strings + s->offset + s->length] == 0;
+}
+
+rest_test_bundle_reader_t *rest_test_bundle_open (const char *filename)
+{
+   bool error = true;
+   rest_test_bundle_reader_t *ret = calloc (1, sizeof *ret);
+   size_t length = 0;
+
+   if (!ret) {
+      CLEANUP ("OOM allocating bundle reader\n");
+   }
+
+   if (!(ret->file = rest_test_token_map (filename))) {
+      goto cleanup;
+   }
+   ret->data = rest_test_token_slice (ret->file, &length);
+
+   const struct bheader_t *header = (const struct bheader_t *)ret->data;
+   if (length < sizeof *header
+         || (memcmp (header->magic, BUNDLE_MAGIC, sizeof header->magic)) != 0) {
+      CLEANUP ("[%s] is not a test bundle\n", filename);
+   }
+   if (header->version != REST_TEST_BUNDLE_VERSION) {
+      CLEANUP ("[%s] is a version %u bundle, expected version %u\n",
+               filename, header->version, REST_TEST_BUNDLE_VERSION);
+   }
+   if (header->byteorder != BUNDLE_BYTEORDER) {
+      CLEANUP ("[%s] was written on a host with a different byte order\n", filename);
+   }
+   if (header->records != sizeof *header
+         || header->nrecords > (length - header->records) / sizeof (struct brecord_t)
+         || header->strings != header->records + header->nrecords * sizeof (struct brecord_t)
+         || header->nstrings != length - header->strings
+         || !(pool_valid (header, ret->data, &header->source))) {
+      CLEANUP ("[%s] is truncated or corrupt\n", filename);
+   }
+
+   ret->header = header;
+   ret->records = (const struct brecord_t *)&ret->data[header->records];
+   if (!(ret->source = rest_test_intern_source (&ret->data[header->strings
+                                                           + header->source.offset]))) {
+      CLEANUP ("OOM interning bundle source\n");
+   }
+
+   error = false;
+cleanup:
+   if (error) {
+      rest_test_bundle_close (&ret);
+   }
+   return ret;
+}
+
+void rest_test_bundle_close (rest_test_bundle_reader_t **reader)
+{
+   if (!reader || !*reader)
+      return;
+
+   rest_test_token_del (&(*reader)->file);
+   free (*reader);
+   *reader = NULL;
+}
+
+const char *rest_test_bundle_source (const rest_test_bundle_reader_t *reader)
+{
+   return reader ? reader->source : NULL;
+}
+
+bool rest_test_bundle_set_source (rest_test_bundle_reader_t *reader, const char *source)
+{
+   const char *interned = reader && source ? rest_test_intern_source (source) : NULL;
+   if (!interned)
+      return false;
+   reader->source = interned;
+   return true;
+}
+
+bool rest_test_bundle_fresh (const rest_test_bundle_reader_t *reader, const char *filename)
+{
+   struct borigin_t current;
+   if (!reader || !filename || !(origin_stat (filename, &current)))
+      return false;
+
+   const struct borigin_t *origin = &reader->header->origin;
+   if (current.size != origin->size)
+      return false;
+   if (current.mtime_sec == origin->mtime_sec && current.mtime_nsec == origin->mtime_nsec)
+      return true;
+
+   // Touched, but possibly not changed
+   return origin_hash (filename, &current.hash) && current.hash == origin->hash;
+}
+
+int rest_test_bundle_next (rest_test_bundle_reader_t *reader,
+                           unsigned *op, size_t *line_no,
+                           rest_test_token_t **params)
+{
+   for (size_t i=0; i<REST_TEST_BUNDLE_MAXPARAMS; i++) {
+      params[i] = NULL;
+   }
+
+   if (!reader)
+      return -1;
+   if (reader->next >= reader->header->nrecords)
+      return 0;
+
+   const struct brecord_t *record = &reader->records[reader->next++];
+   if (record->nparams > REST_TEST_BUNDLE_MAXPARAMS) {
+      ERRORF ("[%s] Corrupt record %zu\n", reader->source, reader->next - 1);
+      return -1;
+   }
+
+   for (size_t i=0; i<record->nparams; i++) {
+      const struct bparam_t *param = &record->params[i];
+      if (param->type > token_SHELLCMD
+            || !(pool_valid (reader->header, reader->data, &param->value))
+            || !(params[i] = rest_test_token_subslice (reader->file,
+                                                       (enum rest_test_token_type_t)param->type,
+                                                       reader->header->strings + param->value.offset,
+                                                       param->value.length,
+                                                       reader->source, param->line_no))) {
+         ERRORF ("[%s] Corrupt parameter in record %zu\n", reader->source, reader->next - 1);
+         for (size_t j=0; j<i; j++) {
+            rest_test_token_del (&params[j]);
+         }
+         return -1;
+      }
+   }
+
+   *op = record->op;
+   *line_no = record->line_no;
+   return 1;
+}
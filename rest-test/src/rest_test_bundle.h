@@ -0,0 +1,83 @@
+
+#ifndef H_REST_TEST_BUNDLE
+#define H_REST_TEST_BUNDLE
+
+/* *****************************************************************************
+ * Compiled test bundles (.rtb files). A bundle is the stream of directives that
+ * the parser read from a source file, already lexed: each record holds a
+ * directive and its parameter tokens, in source order. Loading a bundle replays
+ * the records through the parser without lexing the source again.
+ *
+ * The file is relocatable: records refer to their token values by offset into
+ * a string pool, so the file is mapped in and tokens are sliced from the mapping
+ * without copying. Every value in the pool is NUL-terminated.
+ *
+ * Layout (all integers in host byte order, which the header records):
+ *    header      magic, version, byte-order mark, record count, offsets and
+ *                the size, mtime and content hash of the source
+ *    records     nrecords fixed-size records
+ *    strings     the string pool
+ *
+ * A bundle with the wrong magic, version or byte order is rejected, and the
+ * caller is expected to fall back to parsing the source.
+ */
+
+#define REST_TEST_BUNDLE_VERSION    (2)
+#define REST_TEST_BUNDLE_MAXPARAMS  (2)
+
+typedef struct rest_test_bundle_t rest_test_bundle_t;
+typedef struct rest_test_bundle_reader_t rest_test_bundle_reader_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Create a new, empty bundle for the specified source file.
+   rest_test_bundle_t *rest_test_bundle_new (const char *source);
+   void rest_test_bundle_del (rest_test_bundle_t **bundle);
+
+   // Append a record of directive `op` at `line_no`, with `nparams` parameters.
+   // The parameter values are copied into the bundle.
+   bool rest_test_bundle_add (rest_test_bundle_t *bundle, unsigned op, size_t line_no,
+                              size_t nparams, rest_test_token_t *const *params);
+
+   // Record the size, modification time and content hash of the source file in
+   // the bundle, so that readers can tell whether the bundle is out of date.
+   bool rest_test_bundle_set_origin (rest_test_bundle_t *bundle, const char *filename);
+
+   // Write the bundle to the named file. The file is written under a temporary
+   // name and renamed into place, so readers never see a partial bundle.
+   bool rest_test_bundle_write (const rest_test_bundle_t *bundle, const char *filename);
+
+   // Map a bundle and validate its header. Returns NULL if the file is not a
+   // bundle of this version and byte order.
+   rest_test_bundle_reader_t *rest_test_bundle_open (const char *filename);
+   void rest_test_bundle_close (rest_test_bundle_reader_t **reader);
+
+   // The source file that the bundle was compiled from.
+   const char *rest_test_bundle_source (const rest_test_bundle_reader_t *reader);
+
+   // Names the source of the records still to be read, and of the tests loaded
+   // from them, as `source` rather than as recorded; for a source file reached
+   // by another path. Returns false if the name could not be stored.
+   bool rest_test_bundle_set_source (rest_test_bundle_reader_t *reader, const char *source);
+
+   // Returns true if the source file is unchanged since the bundle was written.
+   // When the size and modification time match no further checks are made;
+   // otherwise a file of the same size is hashed and compared.
+   bool rest_test_bundle_fresh (const rest_test_bundle_reader_t *reader, const char *filename);
+
+   // Read the next record. Unused parameters are set to NULL; the caller owns the
+   // returned tokens, which share the mapping and may outlive the reader.
+   // Returns 1 when a record was read, 0 at the end of the bundle and -1 on error.
+   int rest_test_bundle_next (rest_test_bundle_reader_t *reader,
+                              unsigned *op, size_t *line_no,
+                              rest_test_token_t **params);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
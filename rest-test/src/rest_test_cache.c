@@ -0,0 +1,209 @@
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <sys/stat.h>
+
+#include "ds_str.h"
+
+#include "rest_test_arena.h"
+#include "rest_test_token.h"
+#include "rest_test_symt.h"
+#include "rest_test_hash.h"
+#include "rest_test.h"
+#include "rest_test_bundle.h"
+#include "rest_test_parse.h"
+#include "rest_test_cache.h"
+
+#define CLEANUP(...) \
+do {\
+   ERRORF(__VA_ARGS__);\
+   goto cleanup;\
+} while (0)
+
+struct rest_test_cache_t {
+   char    *directory;
+   size_t   hits;
+   size_t   misses;
+};
+
+// Creates the directory and all its missing parents
+static bool mkdirs (char *path)
+{
+   for (char *p = path + 1; *p; p++) {
+      if (*p != '/')
+         continue;
+      *p = 0;
+      int rc = mkdir (path, 0755);
+      *p = '/';
+      if (rc != 0 && errno != EEXIST)
+         return false;
+   }
+   return mkdir (path, 0755) == 0 || errno == EEXIST;
+}
+
+rest_test_cache_t *rest_test_cache_new (const char *directory)
+{
+   bool error = true;
+   rest_test_cache_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      CLEANUP ("OOM allocating cache\n");
+   }
+
+   const char *xdg = getenv ("XDG_CACHE_HOME");
+   const char *home = getenv ("HOME");
+   if (directory) {
+      ret->directory = ds_str_dup (directory);
+   } else if (xdg && xdg[0]) {
+      ret->directory = ds_str_cat (xdg, "/rest-test", NULL);
+   } else if (home && home[0]) {
+      ret->directory = ds_str_cat (home, "/.cache/rest-test", NULL);
+   } else {
+      CLEANUP ("No cache directory: neither XDG_CACHE_HOME nor HOME is set\n");
+   }
+
+   if (!ret->directory) {
+      CLEANUP ("OOM allocating cache directory name\n");
+   }
+
+   if (!(mkdirs (ret->directory))) {
+      CLEANUP ("Failed to create cache directory [%s]: %m\n", ret->directory);
+   }
+
+   error = false;
+cleanup:
+   if (error) {
+      rest_test_cache_del (&ret);
+   }
+   return ret;
+}
+
+void rest_test_cache_del (rest_test_cache_t **cache)
+{
+   if (!cache || !*cache)
+      return;
+
+   free ((*cache)->directory);
+   free (*cache);
+   *cache = NULL;
+}
+
+const char *rest_test_cache_directory (const rest_test_cache_t *cache)
+{
+   return cache ? cache->directory : NULL;
+}
+
+// Returns the canonical path of the source file, which the caller must free.
+// A file that cannot be resolved is keyed by the name as given.
+static char *source_key (const char *filename)
+{
+   char *ret = realpath (filename, NULL);
+   return ret ? ret : ds_str_dup (filename);
+}
+
+// Returns the name of the entry for the source key, which the caller must free
+static char *entry_name (const rest_test_cache_t *cache, const char *key)
+{
+   char hex[17];
+
+   snprintf (hex, sizeof hex, "%016" PRIx64, rest_test_hash64 (key, strlen (key), 0));
+   return ds_str_cat (cache->directory, "/", hex, ".rtb", NULL);
+}
+
+rest_test_bundle_reader_t *rest_test_cache_open (rest_test_cache_t *cache, const char *filename)
+{
+   if (!cache || !filename)
+      return NULL;
+
+   char *key = source_key (filename);
+   char *entry = key ? entry_name (cache, key) : NULL;
+   rest_test_bundle_reader_t *ret = entry ? rest_test_bundle_open (entry) : NULL;
+
+   // Entries record the canonical path, which guards against two paths that
+   // hash the same, and the loaded tests are renamed to match the caller's.
+   if (!ret || (strcmp (rest_test_bundle_source (ret), key)) != 0
+         || !(rest_test_bundle_fresh (ret, filename))
+         || !(rest_test_bundle_set_source (ret, filename))) {
+      rest_test_bundle_close (&ret);
+   } else {
+      __atomic_add_fetch (&cache->hits, 1, __ATOMIC_RELAXED);
+   }
+
+   free (entry);
+   free (key);
+   return ret;
+}
+
+rest_test_bundle_t *rest_test_cache_record (rest_test_cache_t *cache, const char *filename)
+{
+   if (!cache || !filename)
+      return NULL;
+
+   __atomic_add_fetch (&cache->misses, 1, __ATOMIC_RELAXED);
+   char *key = source_key (filename);
+   rest_test_bundle_t *ret = key ? rest_test_bundle_new (key) : NULL;
+   if (ret && !(rest_test_bundle_set_origin (ret, filename))) {
+      rest_test_bundle_del (&ret);
+   }
+   free (key);
+   return ret;
+}
+
+void rest_test_cache_store (rest_test_cache_t *cache, const char *filename,
+                            rest_test_bundle_t **recorder)
+{
+   if (!recorder || !*recorder)
+      return;
+
+   char *key = cache && filename ? source_key (filename) : NULL;
+   char *entry = key ? entry_name (cache, key) : NULL;
+   if (entry) {
+      rest_test_bundle_write (*recorder, entry);
+   }
+   free (entry);
+   free (key);
+   rest_test_bundle_del (recorder);
+}
+
+rest_test_t **rest_test_cache_parse_file (rest_test_cache_t *cache,
+                                          rest_test_symt_t *parent,
+                                          const char *filename)
+{
+   if (!cache)
+      return rest_test_parse_file (parent, filename);
+
+   rest_test_t **ret = NULL;
+   rest_test_bundle_reader_t *reader = rest_test_cache_open (cache, filename);
+   if (reader) {
+      ret = rest_test_parse_reader (parent, reader);
+      rest_test_bundle_close (&reader);
+      if (ret)
+         return ret;
+   }
+
+   rest_test_bundle_t *recorder = rest_test_cache_record (cache, filename);
+   ret = recorder
+      ? rest_test_parse_file_recorded (parent, filename, recorder)
+      : rest_test_parse_file (parent, filename);
+
+   if (ret) {
+      rest_test_cache_store (cache, filename, &recorder);
+   }
+   rest_test_bundle_del (&recorder);
+   return ret;
+}
+
+size_t rest_test_cache_hits (const rest_test_cache_t *cache)
+{
+   return cache ? __atomic_load_n (&cache->hits, __ATOMIC_RELAXED) : 0;
+}
+
+size_t rest_test_cache_misses (const rest_test_cache_t *cache)
+{
+   return cache ? __atomic_load_n (&cache->misses, __ATOMIC_RELAXED) : 0;
+}
@@ -0,0 +1,68 @@
+
+#ifndef H_REST_TEST_CACHE
+#define H_REST_TEST_CACHE
+
+typedef struct rest_test_cache_t rest_test_cache_t;
+
+/* *****************************************************************************
+ * An on-disk cache of parsed test files. Each entry is a compiled bundle (see
+ * rest_test_bundle.h), named after a hash of the canonical path of the source.
+ * An entry is used only while the source is unchanged: the size and mtime of
+ * the source are compared first and, when only the mtime differs, the content
+ * hash. A stale or missing entry is replaced by parsing the source.
+ *
+ * The cache is an optimisation only; failing to read or write an entry never
+ * causes a parse to fail.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Open the cache in `directory`, creating it if necessary. When `directory`
+   // is NULL, $XDG_CACHE_HOME/rest-test is used, or $HOME/.cache/rest-test when
+   // XDG_CACHE_HOME is not set. Returns NULL if there is no usable directory.
+   rest_test_cache_t *rest_test_cache_new (const char *directory);
+   void rest_test_cache_del (rest_test_cache_t **cache);
+
+   const char *rest_test_cache_directory (const rest_test_cache_t *cache);
+
+   // As rest_test_parse_file(), but unchanged files are loaded from the cache.
+   rest_test_t **rest_test_cache_parse_file (rest_test_cache_t *cache,
+                                             rest_test_symt_t *parent,
+                                             const char *filename);
+
+   // As rest_test_parse_files(), but unchanged files are loaded from the
+   // cache, and the others are written to it once parsed. With a NULL cache
+   // this is rest_test_parse_files().
+   rest_test_t **rest_test_cache_parse_files (rest_test_cache_t *cache,
+                                              rest_test_symt_t *parent,
+                                              const char *const *filenames, size_t nfiles,
+                                              size_t nthreads);
+
+   // The parts of rest_test_cache_parse_file(), for callers that parse the
+   // source themselves. rest_test_cache_open() returns a reader over the entry
+   // for the source file if the entry is fresh, naming the source as `filename`
+   // does, or NULL. Otherwise rest_test_cache_record() returns a bundle to record
+   // the parse in, with the origin of the source set, or NULL if the parse
+   // cannot be recorded; rest_test_cache_store() writes the recording to the
+   // entry once the parse succeeds, and deletes it. Entries are keyed by the
+   // canonical path, so every path to the same source shares one entry.
+   // These may be called from several threads at once, for different files.
+   rest_test_bundle_reader_t *rest_test_cache_open (rest_test_cache_t *cache,
+                                                    const char *filename);
+   rest_test_bundle_t *rest_test_cache_record (rest_test_cache_t *cache, const char *filename);
+   void rest_test_cache_store (rest_test_cache_t *cache, const char *filename,
+                               rest_test_bundle_t **recorder);
+
+   // The number of files loaded from the cache, and the number parsed. A fresh
+   // entry that fails to load, and so is parsed again, counts as both.
+   size_t rest_test_cache_hits (const rest_test_cache_t *cache);
+   size_t rest_test_cache_misses (const rest_test_cache_t *cache);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
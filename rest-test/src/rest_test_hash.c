@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "rest_test_hash.h"
+
+// XXH64, as specified at https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+
+#define PRIME1    (0x9E3779B185EBCA87ULL)
+#define PRIME2    (0xC2B2AE3D27D4EB4FULL)
+#define PRIME3    (0x165667B19E3779F9ULL)
+#define PRIME4    (0x85EBCA77C2B2AE63ULL)
+#define PRIME5    (0x27D4EB2F165667C5ULL)
+
+static uint64_t rotl (uint64_t x, unsigned r)
+{
+   return (x << r) | (x >> (64 - r));
+}
+
+// Unaligned little-endian reads
+static uint64_t read64 (const unsigned char *p)
+{
+   uint64_t ret = 0;
+   for (size_t i=0; i<8; i++) {
+      ret |= (uint64_t)p[i] << (8 * i);
+   }
+   return ret;
+}
+
+static uint64_t read32 (const unsigned char *p)
+{
+   return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24;
+}
+
+static uint64_t round64 (uint64_t acc, uint64_t lane)
+{
+   acc += lane * PRIME2;
+   acc = rotl (acc, 31);
+   return acc * PRIME1;
+}
+
+static uint64_t merge64 (uint64_t acc, uint64_t val)
+{
+   acc ^= round64 (0, val);
+   return acc * PRIME1 + PRIME4;
+}
+
+uint64_t rest_test_hash64 (const void *data, size_t length, uint64_t seed)
+{
+   const unsigned char *p = data;
+   const unsigned char *end = p + length;
+   uint64_t acc;
+
+   if (length >= 32) {
+      uint64_t v[4] = {
+         seed + PRIME1 + PRIME2,
+         seed + PRIME2,
+         seed,
+         seed - PRIME1,
+      };
+      const unsigned char *limit = end - 32;
+      do {
+         for (size_t i=0; i<4; i++) {
+            v[i] = round64 (v[i], read64 (p));
+            p += 8;
+         }
+      } while (p <= limit);
+
+      acc = rotl (v[0], 1) + rotl (v[1], 7) + rotl (v[2], 12) + rotl (v[3], 18);
+      for (size_t i=0; i<4; i++) {
+         acc = merge64 (acc, v[i]);
+      }
+   } else {
+      acc = seed + PRIME5;
+   }
+
+   acc += (uint64_t)length;
+
+   while (end - p >= 8) {
+      acc ^= round64 (0, read64 (p));
+      acc = rotl (acc, 27) * PRIME1 + PRIME4;
+      p += 8;
+   }
+   if (end - p >= 4) {
+      acc ^= read32 (p) * PRIME1;
+      acc = rotl (acc, 23) * PRIME2 + PRIME3;
+      p += 4;
+   }
+   while (p < end) {
+      acc ^= (*p++) * PRIME5;
+      acc = rotl (acc, 11) * PRIME1;
+   }
+
+   acc ^= acc >> 33;
+   acc *= PRIME2;
+   acc ^= acc >> 29;
+   acc *= PRIME3;
+   acc ^= acc >> 32;
+   return acc;
+}
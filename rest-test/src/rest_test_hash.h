@@ -0,0 +1,21 @@
+
+#ifndef H_REST_TEST_HASH
+#define H_REST_TEST_HASH
+
+/* *****************************************************************************
+ * A fast, non-cryptographic 64-bit hash (XXH64) for fingerprinting file contents
+ * and keys. Not suitable where an adversary chooses the input.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   uint64_t rest_test_hash64 (const void *data, size_t length, uint64_t seed);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
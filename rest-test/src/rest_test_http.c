@@ -0,0 +1,1260 @@
+// getaddrinfo() and SOCK_CLOEXEC, so that a connection is never inherited by a
+// shell command spawned on another thread
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "ds_hmap.h"
+#include "ds_str.h"
+
+#include "rest_test_arena.h"
+#include "rest_test_token.h"
+#include "rest_test_symt.h"
+#include "rest_test.h"
+#include "rest_test_http.h"
+
+#define CLEANUP(...) \
+do {\
+   ERRORF(__VA_ARGS__);\
+   goto cleanup;\
+} while (0)
+
+#define HTTP_BLOCK         (16384)
+#define HTTP_MAXHEAD       (65536)
+#define HTTP_MAXLINE       (4096)
+
+// One scheme, host and port: its addresses, and the connections to it that are
+// idle, most recently used last
+struct host_t {
+   struct addrinfo  *addrs;
+   int              *idle;
+   size_t            nidle;
+   size_t            size;
+};
+
+struct rest_test_http_t {
+   ds_hmap_t        *hosts;      // "scheme://host:port" -> struct host_t *
+   size_t            maxidle;
+   size_t            running;    // Requests that may be in flight at once
+   size_t            timeout;    // milliseconds
+   size_t            connects;
+   size_t            reuses;
+};
+
+// The parts of an absolute URI that the request needs
+struct target_t {
+   char             *host;
+   char             *authority;  // host[:port], as the `host` header
+   char             *path;       // with the query, without the fragment
+   char             *key;        // The pool to take a connection from
+   char              port[6];
+};
+
+// A growable byte buffer, always with room for a NUL after its contents
+struct buffer_t {
+   char             *data;
+   size_t            len;
+   size_t            size;
+};
+
+// The request head, and what the test's own headers provide
+struct head_t {
+   struct buffer_t   buffer;
+   bool              host;
+   bool              length;
+   bool              close;
+   bool              error;
+};
+
+enum framing_t {
+   framing_NONE,
+   framing_LENGTH,
+   framing_CHUNKED,
+   framing_CLOSE,
+};
+
+enum chunk_state_t {
+   chunk_SIZE,
+   chunk_DATA,
+   chunk_DATA_END,
+   chunk_TRAILER,
+};
+
+enum parse_t {
+   parse_MORE,
+   parse_DONE,
+   parse_ERROR,
+};
+
+// A header field, as offsets of its NUL-terminated name and value into the
+// received bytes, which may move as more are received
+struct field_t {
+   size_t            name;
+   size_t            value;
+};
+
+// A response as it is received and parsed. The status line and header fields
+// are terminated in place; a chunked body is decoded into `body`.
+struct response_t {
+   struct buffer_t   buffer;
+   size_t            head;       // The length of the head, once received
+   size_t            scan;       // Where to look for the end of the head
+   size_t            version;
+   size_t            code;
+   size_t            reason;
+   int               status;
+   struct field_t   *fields;
+   size_t            nfields;
+   size_t            fsize;
+
+   enum framing_t    framing;
+   size_t            remaining;  // Of the body, or of the current chunk
+   enum chunk_state_t chunk;
+   size_t            pos;        // The next byte to decode
+   struct buffer_t   body;
+
+   bool              keep_alive;
+   const char       *error;
+};
+
+
+/* *****************************************************************************
+ * Buffers
+ */
+
+static bool buffer_reserve (struct buffer_t *b, size_t length)
+{
+   if (b->len + length < b->size)
+      return true;
+   size_t newsize = b->size ? b->size : HTTP_BLOCK;
+   while (newsize <= b->len + length)
+      newsize *= 2;
+   char *tmp = realloc (b->data, newsize);
+   if (!tmp)
+      return false;
+   b->data = tmp;
+   b->size = newsize;
+   return true;
+}
+
+static bool buffer_cat (struct buffer_t *b, const char *data, size_t length)
+{
+   if (!(buffer_reserve (b, length)))
+      return false;
+   memcpy (&b->data[b->len], data, length);
+   b->len += length;
+   b->data[b->len] = 0;
+   return true;
+}
+
+static void buffer_clear (struct buffer_t *b)
+{
+   free (b->data);
+   memset (b, 0, sizeof *b);
+}
+
+
+/* *****************************************************************************
+ * Targets
+ */
+
+static void target_clear (struct target_t *t)
+{
+   free (t->host);
+   free (t->authority);
+   free (t->path);
+   free (t->key);
+   memset (t, 0, sizeof *t);
+}
+
+static bool target_parse (const char *uri, struct target_t *t, const char **error)
+{
+   memset (t, 0, sizeof *t);
+   *error = "OOM parsing URI";
+
+   const char *sep = uri ? strstr (uri, "://") : NULL;
+   if (!sep || sep == uri) {
+      *error = "URI is not absolute";
+      return false;
+   }
+   if ((size_t)(sep - uri) != 4 || (strncasecmp (uri, "http", 4)) != 0) {
+      *error = (size_t)(sep - uri) == 5 && (strncasecmp (uri, "https", 5)) == 0
+             ? "https is not supported"
+             : "Unsupported scheme";
+      return false;
+   }
+
+   const char *authority = sep + 3;
+   size_t alen = strcspn (authority, "/?#");
+   const char *end = &authority[alen];
+   if (alen == 0 || memchr (authority, '@', alen)) {
+      *error = alen ? "User information in URIs is not supported" : "Missing host";
+      return false;
+   }
+
+   // A bracketed IPv6 address may contain colons
+   const char *host = authority, *hend = NULL, *port = NULL;
+   if (*host == '[') {
+      if (!(hend = memchr (host, ']', alen))) {
+         *error = "Unterminated IPv6 address";
+         return false;
+      }
+      host++;
+      port = hend[1] == ':' ? &hend[2] : NULL;
+      if (&hend[1] != end && !port) {
+         *error = "Invalid authority";
+         return false;
+      }
+   } else {
+      for (hend = end; hend > host && hend[-1] != ':'; hend--)
+         ;
+      if (hend > host) {
+         port = hend--;
+      } else {
+         hend = end;
+      }
+   }
+
+   size_t plen = port ? (size_t)(end - port) : 0;
+   unsigned long portnum = 80;
+   if (port) {
+      char *pend = NULL;
+      portnum = plen && plen < sizeof t->port && isdigit ((unsigned char)*port)
+              ? strtoul (port, &pend, 10) : 0;
+      if (pend != end || portnum == 0 || portnum > 65535) {
+         *error = "Invalid port";
+         return false;
+      }
+   }
+   if (hend == host) {
+      *error = "Missing host";
+      return false;
+   }
+   snprintf (t->port, sizeof t->port, "%lu", portnum);
+
+   // The request target is the path and query; the fragment is not sent
+   size_t rlen = strcspn (end, "#");
+   bool slash = *end != '/';
+   if (!(t->host = strndup (host, (size_t)(hend - host)))
+         || !(t->authority = strndup (authority, alen))
+         || !(t->path = malloc (rlen + 2))
+         || !(t->key = ds_str_cat ("http://", t->host, ":", t->port, NULL))) {
+      target_clear (t);
+      return false;
+   }
+   t->path[0] = '/';
+   memcpy (&t->path[slash], end, rlen);
+   t->path[rlen + slash] = 0;
+   return true;
+}
+
+
+/* *****************************************************************************
+ * Requests
+ */
+
+static bool has_token (const char *value, const char *token)
+{
+   size_t tlen = strlen (token);
+   while (value && *value) {
+      value += strspn (value, " \t,");
+      size_t len = strcspn (value, ",");
+      while (len && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+         len--;
+      if (len == tlen && (strncasecmp (value, token, tlen)) == 0)
+         return true;
+      value = strchr (value, ',');
+   }
+   return false;
+}
+
+static void head_header (const char *name, const char *value, void *param)
+{
+   struct head_t *head = param;
+   if (strpbrk (name, "\r\n") || strpbrk (value, "\r\n")) {
+      ERRORF ("Header [%s] contains a line break\n", name);
+      head->error = true;
+      return;
+   }
+   if ((strcmp (name, "host")) == 0)
+      head->host = true;
+   if ((strcmp (name, "content-length")) == 0 || (strcmp (name, "transfer-encoding")) == 0)
+      head->length = true;
+   if ((strcmp (name, "connection")) == 0 && (has_token (value, "close")))
+      head->close = true;
+
+   head->error |= !(buffer_cat (&head->buffer, name, strlen (name)))
+               || !(buffer_cat (&head->buffer, ": ", 2))
+               || !(buffer_cat (&head->buffer, value, strlen (value)))
+               || !(buffer_cat (&head->buffer, "\r\n", 2));
+}
+
+static bool head_build (rest_test_t *rt, const struct target_t *target,
+                        const char *method, size_t blen, struct head_t *head)
+{
+   const char *version = rest_test_req_http_version (rt);
+   if (!version || !*version)
+      version = "HTTP/1.1";
+
+   bool ok = buffer_cat (&head->buffer, method, strlen (method))
+          && buffer_cat (&head->buffer, " ", 1)
+          && buffer_cat (&head->buffer, target->path, strlen (target->path))
+          && buffer_cat (&head->buffer, " ", 1)
+          && buffer_cat (&head->buffer, version, strlen (version))
+          && buffer_cat (&head->buffer, "\r\n", 2);
+   if (!ok)
+      return false;
+
+   rest_test_req_headers (rt, head_header, head);
+   if (head->error)
+      return false;
+
+   if (!head->host) {
+      ok = buffer_cat (&head->buffer, "host: ", 6)
+        && buffer_cat (&head->buffer, target->authority, strlen (target->authority))
+        && buffer_cat (&head->buffer, "\r\n", 2);
+   }
+
+   // Servers may refuse a POST without a length, even when there is no body
+   bool needs_length = blen
+                    || (strcmp (method, "POST")) == 0
+                    || (strcmp (method, "PUT")) == 0
+                    || (strcmp (method, "PATCH")) == 0;
+   if (ok && !head->length && needs_length) {
+      char length[48];
+      int n = snprintf (length, sizeof length, "content-length: %zu\r\n", blen);
+      ok = buffer_cat (&head->buffer, length, (size_t)n);
+   }
+   return ok && buffer_cat (&head->buffer, "\r\n", 2);
+}
+
+
+/* *****************************************************************************
+ * Responses
+ */
+
+static void response_clear (struct response_t *r)
+{
+   buffer_clear (&r->buffer);
+   buffer_clear (&r->body);
+   free (r->fields);
+   memset (r, 0, sizeof *r);
+}
+
+static const char *response_field (const struct response_t *r, const char *name)
+{
+   for (size_t i=0; i<r->nfields; i++) {
+      if ((strcmp (&r->buffer.data[r->fields[i].name], name)) == 0)
+         return &r->buffer.data[r->fields[i].value];
+   }
+   return NULL;
+}
+
+// Terminates the line starting at `start` in place, without its CR, and
+// returns the offset of the next line
+static size_t line_end (char *data, size_t start, size_t limit)
+{
+   char *nl = memchr (&data[start], '\n', limit - start);
+   size_t end = nl ? (size_t)(nl - data) : limit;
+   data[end] = 0;
+   if (end > start && data[end - 1] == '\r')
+      data[end - 1] = 0;
+   return end + 1;
+}
+
+// Splits the `name: value` field at `start`, lowercasing the name
+static bool field_add (struct response_t *r, size_t start)
+{
+   char *data = r->buffer.data;
+   size_t nlen = strcspn (&data[start], ":");
+   if (nlen == 0 || !data[start + nlen] || (strcspn (&data[start], " \t")) < nlen)
+      return false;
+
+   char *colon = &data[start + nlen];
+   *colon++ = 0;
+   for (char *c = &data[start]; *c; c++) {
+      *c = (char)tolower ((unsigned char)*c);
+   }
+   colon += strspn (colon, " \t");
+   for (size_t len = strlen (colon); len && (colon[len - 1] == ' ' || colon[len - 1] == '\t'); len--) {
+      colon[len - 1] = 0;
+   }
+
+   if (r->nfields == r->fsize) {
+      size_t newsize = r->fsize ? r->fsize * 2 : 16;
+      struct field_t *tmp = realloc (r->fields, newsize * sizeof *tmp);
+      if (!tmp)
+         return false;
+      r->fields = tmp;
+      r->fsize = newsize;
+   }
+   r->fields[r->nfields].name = start;
+   r->fields[r->nfields].value = (size_t)(colon - data);
+   r->nfields++;
+   return true;
+}
+
+// Finds the end of the head, allowing for bare LF line endings. Returns 0
+// until it has been received.
+static size_t head_end (const char *data, size_t len, size_t *scan)
+{
+   for (size_t i=*scan; i<len; i++) {
+      if (data[i] != '\n')
+         continue;
+      if (i + 1 == len || (i + 2 == len && data[i + 1] == '\r')) {
+         *scan = i;
+         return 0;
+      }
+      if (data[i + 1] == '\n')
+         return i + 2;
+      if (data[i + 1] == '\r' && data[i + 2] == '\n')
+         return i + 3;
+   }
+   *scan = len;
+   return 0;
+}
+
+// Parses the status line and header fields and decides how the body is framed
+static enum parse_t response_head (struct response_t *r, bool head_request)
+{
+   char *data = r->buffer.data;
+   size_t next = line_end (data, 0, r->head);
+
+   // HTTP/x.y SP 3DIGIT [SP reason]
+   char *sp = strchr (data, ' ');
+   if ((strncmp (data, "HTTP/", 5)) != 0 || !sp
+         || !isdigit ((unsigned char)sp[1]) || !isdigit ((unsigned char)sp[2])
+         || !isdigit ((unsigned char)sp[3]) || (sp[4] != ' ' && sp[4] != 0)) {
+      r->error = "Invalid status line";
+      return parse_ERROR;
+   }
+   *sp = 0;
+   r->version = 0;
+   r->code = (size_t)(sp - data) + 1;
+   r->reason = sp[4] ? r->code + 4 : r->code + 3;
+   r->status = (sp[1] - '0') * 100 + (sp[2] - '0') * 10 + (sp[3] - '0');
+   sp[4] = 0;
+
+   r->nfields = 0;
+   while (next < r->head) {
+      size_t start = next;
+      next = line_end (data, start, r->head);
+      if (!data[start])
+         break;
+      if (!(field_add (r, start))) {
+         r->error = "Invalid header field";
+         return parse_ERROR;
+      }
+   }
+
+   const char *connection = response_field (r, "connection");
+   bool http10 = (strcmp (data, "HTTP/1.0")) == 0;
+   r->keep_alive = http10 ? has_token (connection, "keep-alive")
+                          : !(has_token (connection, "close"));
+
+   const char *te = response_field (r, "transfer-encoding");
+   const char *cl = response_field (r, "content-length");
+   if (head_request || r->status == 204 || r->status == 304 || r->status < 200) {
+      r->framing = framing_NONE;
+      r->keep_alive &= r->status != 101;
+   } else if (te) {
+      // The body is chunked only if that is the last coding applied
+      const char *last = strrchr (te, ',');
+      last = last ? last + 1 : te;
+      r->framing = has_token (last, "chunked") ? framing_CHUNKED : framing_CLOSE;
+   } else if (cl) {
+      char *end = NULL;
+      errno = 0;
+      unsigned long long length = isdigit ((unsigned char)*cl) ? strtoull (cl, &end, 10) : 0;
+      if (!end || *end || errno || length > (size_t)-1 / 2) {
+         r->error = "Invalid content-length";
+         return parse_ERROR;
+      }
+      r->framing = framing_LENGTH;
+      r->remaining = (size_t)length;
+   } else {
+      r->framing = framing_CLOSE;
+   }
+   r->keep_alive &= r->framing != framing_CLOSE;
+   r->pos = r->head;
+   return parse_MORE;
+}
+
+static enum parse_t response_chunks (struct response_t *r)
+{
+   char *data = r->buffer.data;
+   size_t len = r->buffer.len;
+
+   while (r->pos < len) {
+      char *nl = NULL;
+      switch (r->chunk) {
+         case chunk_SIZE:
+         case chunk_TRAILER:
+            if (!(nl = memchr (&data[r->pos], '\n', len - r->pos))) {
+               if (len - r->pos > HTTP_MAXLINE) {
+                  r->error = "Chunk line too long";
+                  return parse_ERROR;
+               }
+               return parse_MORE;
+            }
+            size_t start = r->pos;
+            r->pos = line_end (data, start, len);
+            if (r->chunk == chunk_TRAILER) {
+               if (!data[start])
+                  return parse_DONE;
+               if (!(field_add (r, start))) {
+                  r->error = "Invalid trailer field";
+                  return parse_ERROR;
+               }
+               break;
+            }
+            char *end = NULL;
+            errno = 0;
+            unsigned long long size = isxdigit ((unsigned char)data[start])
+                                    ? strtoull (&data[start], &end, 16) : 0;
+            if (!end || (*end && *end != ';' && *end != ' ' && *end != '\t')
+                  || errno || size > (size_t)-1 / 2) {
+               r->error = "Invalid chunk size";
+               return parse_ERROR;
+            }
+            r->remaining = (size_t)size;
+            r->chunk = size ? chunk_DATA : chunk_TRAILER;
+            break;
+
+         case chunk_DATA: {
+            size_t n = len - r->pos < r->remaining ? len - r->pos : r->remaining;
+            if (!(buffer_cat (&r->body, &data[r->pos], n))) {
+               r->error = "OOM decoding chunk";
+               return parse_ERROR;
+            }
+            r->pos += n;
+            r->remaining -= n;
+            if (!r->remaining)
+               r->chunk = chunk_DATA_END;
+            break;
+         }
+
+         case chunk_DATA_END:
+            if (data[r->pos] == '\n') {
+               r->pos++;
+            } else if (data[r->pos] == '\r' && r->pos + 1 < len && data[r->pos + 1] == '\n') {
+               r->pos += 2;
+            } else if (data[r->pos] != '\r') {
+               r->error = "Chunk is longer than its size";
+               return parse_ERROR;
+            } else {
+               return parse_MORE;
+            }
+            r->chunk = chunk_SIZE;
+            break;
+      }
+   }
+   return parse_MORE;
+}
+
+// Parses what has been received so far
+static enum parse_t response_parse (struct response_t *r, bool head_request)
+{
+   while (!r->head) {
+      if (!(r->head = head_end (r->buffer.data, r->buffer.len, &r->scan))) {
+         if (r->buffer.len > HTTP_MAXHEAD) {
+            r->error = "Response head too large";
+            return parse_ERROR;
+         }
+         return parse_MORE;
+      }
+      if ((response_head (r, head_request)) == parse_ERROR)
+         return parse_ERROR;
+
+      // An interim response is followed by the final one
+      if (r->status >= 100 && r->status < 200 && r->status != 101) {
+         r->buffer.len -= r->head;
+         memmove (r->buffer.data, &r->buffer.data[r->head], r->buffer.len);
+         r->buffer.data[r->buffer.len] = 0;
+         r->head = r->scan = 0;
+      }
+   }
+
+   enum parse_t ret = parse_MORE;
+   switch (r->framing) {
+      case framing_NONE:
+         ret = parse_DONE;
+         r->pos = r->head;
+         break;
+      case framing_LENGTH:
+         if (r->buffer.len - r->head >= r->remaining) {
+            ret = parse_DONE;
+            r->pos = r->head + r->remaining;
+         }
+         break;
+      case framing_CHUNKED:
+         ret = response_chunks (r);
+         break;
+      case framing_CLOSE:
+         break;
+   }
+
+   // Bytes after the response are not from this request; the connection
+   // cannot be trusted with another
+   if (ret == parse_DONE && r->pos < r->buffer.len)
+      r->keep_alive = false;
+   return ret;
+}
+
+// Stores the parsed response in the test
+static bool response_store (struct response_t *r, rest_test_t *rt)
+{
+   char *data = r->buffer.data;
+   const char *body = "";
+   switch (r->framing) {
+      case framing_NONE:      break;
+      case framing_LENGTH:    data[r->head + r->remaining] = 0;
+                              body = &data[r->head];
+                              break;
+      case framing_CHUNKED:   body = r->body.data ? r->body.data : "";
+                              break;
+      case framing_CLOSE:     body = &data[r->head];
+                              break;
+   }
+
+   bool ok = rest_test_rsp_set_http_version (rt, &data[r->version])
+          && rest_test_rsp_set_status_code (rt, &data[r->code])
+          && rest_test_rsp_set_reason (rt, &data[r->reason])
+          && rest_test_rsp_set_body (rt, body);
+
+   // Repeated fields are joined into one header
+   const char *source = rest_test_get_fname (rt);
+   size_t line_no = rest_test_get_line_no (rt);
+   for (size_t i=0; ok && i<r->nfields; i++) {
+      const char *name = &data[r->fields[i].name];
+      size_t j = 0;
+      while (j < i && (strcmp (&data[r->fields[j].name], name)) != 0)
+         j++;
+      if (j < i)
+         continue;
+
+      char *line = ds_str_cat (name, ": ", &data[r->fields[i].value], NULL);
+      for (j=i + 1; line && j<r->nfields; j++) {
+         if ((strcmp (&data[r->fields[j].name], name)) == 0) {
+            char *tmp = ds_str_cat (line, ", ", &data[r->fields[j].value], NULL);
+            free (line);
+            line = tmp;
+         }
+      }
+      ok = line && rest_test_rsp_set_header (rt, source, line_no, line);
+      free (line);
+   }
+   return ok;
+}
+
+
+/* *****************************************************************************
+ * Connections. Each request is a state machine over a non-blocking socket:
+ * connecting, writing the request, then reading and parsing the response. The
+ * same machine is driven by poll() for a single request and by epoll for many.
+ */
+
+enum conn_state_t {
+   conn_IDLE,
+   conn_CONNECT,
+   conn_WRITE,
+   conn_READ,
+   conn_DONE,
+   conn_FAILED,
+};
+
+struct conn_t {
+   rest_test_t          *rt;
+   enum conn_state_t     state;
+   int                   fd;
+   bool                  reused;
+   bool                  head_request;
+   bool                  idempotent;
+   struct target_t       target;
+   struct head_t         head;
+   const char           *body;
+   size_t                blen;
+   size_t                sent;       // Of the head and then the body
+   struct response_t     rsp;
+   const struct addrinfo *addr;      // The address being connected to
+   double                deadline;   // For the next progress
+   // The epoll set watching `fd`, if any, and what for
+   int                   epfd;
+   bool                  watched;
+   uint32_t              events;
+};
+
+static double now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void _host_del (const void *key, size_t keylen,
+                       void *host, size_t hostlen,
+                       void *hmap)
+{
+   struct host_t *h = host;
+   (void)hostlen;
+   for (size_t i=0; i<h->nidle; i++) {
+      close (h->idle[i]);
+   }
+   if (h->addrs)
+      freeaddrinfo (h->addrs);
+   free (h->idle);
+   free (h);
+   ds_hmap_remove (hmap, key, keylen);
+}
+
+// Finds the pool for the target, resolving its host the first time
+static struct host_t *host_get (rest_test_http_t *http, const struct target_t *target,
+                                const char **error)
+{
+   struct host_t *host = NULL;
+   if (!(ds_hmap_get_str_ptr (http->hosts, target->key, (void **)&host)) || !host) {
+      if (!(host = calloc (1, sizeof *host))
+            || !(ds_hmap_set_str_ptr (http->hosts, target->key, host))) {
+         free (host);
+         *error = "OOM allocating connection pool";
+         return NULL;
+      }
+   }
+   if (!host->addrs) {
+      struct addrinfo hints;
+      memset (&hints, 0, sizeof hints);
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      int rc = getaddrinfo (target->host, target->port, &hints, &host->addrs);
+      if (rc != 0) {
+         host->addrs = NULL;
+         *error = gai_strerror (rc);
+         return NULL;
+      }
+   }
+   return host;
+}
+
+// Takes the most recently used idle connection that the server has not closed
+static int pool_take (struct host_t *host)
+{
+   while (host->nidle) {
+      int fd = host->idle[--host->nidle];
+      // An idle connection has nothing to read unless it was closed
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      if ((poll (&pfd, 1, 0)) == 0)
+         return fd;
+      close (fd);
+   }
+   return -1;
+}
+
+static void pool_put (rest_test_http_t *http, const char *key, int fd)
+{
+   struct host_t *host = NULL;
+   // While requests run concurrently, every connection that they use is kept
+   size_t maxidle = http->maxidle && http->maxidle < http->running
+                  ? http->running : http->maxidle;
+   if (!(ds_hmap_get_str_ptr (http->hosts, key, (void **)&host)) || !host
+         || host->nidle >= maxidle) {
+      close (fd);
+      return;
+   }
+   if (host->nidle == host->size) {
+      size_t newsize = host->size ? host->size * 2 : 4;
+      int *tmp = realloc (host->idle, newsize * sizeof *tmp);
+      if (!tmp) {
+         close (fd);
+         return;
+      }
+      host->idle = tmp;
+      host->size = newsize;
+   }
+   host->idle[host->nidle++] = fd;
+}
+
+// Stops watching the connection's descriptor, which is about to be closed or
+// returned to the pool
+static void conn_unwatch (struct conn_t *conn)
+{
+   if (conn->watched)
+      epoll_ctl (conn->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+   conn->watched = false;
+}
+
+static void conn_close (struct conn_t *conn)
+{
+   conn_unwatch (conn);
+   if (conn->fd >= 0)
+      close (conn->fd);
+   conn->fd = -1;
+}
+
+static bool conn_fail (struct conn_t *conn, const char *error)
+{
+   const char *uri = rest_test_req_uri (conn->rt);
+   ERRORF ("[%s:%zu] [%s]: %s\n", rest_test_get_fname (conn->rt),
+           rest_test_get_line_no (conn->rt), uri ? uri : "", error);
+   conn_close (conn);
+   rest_test_rsp_clear (conn->rt);
+   conn->state = conn_FAILED;
+   return false;
+}
+
+// Starts connecting to `addr`, or the first of the addresses after it that a
+// connection can be started to
+static bool conn_connect (struct conn_t *conn, const struct addrinfo *addr)
+{
+   const char *error = "No address";
+   int nodelay = 1;
+   for (; addr; addr = addr->ai_next) {
+      int fd = socket (addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       addr->ai_protocol);
+      if (fd < 0) {
+         error = strerror (errno);
+         continue;
+      }
+      // Each request is written whole; waiting to coalesce it only adds latency
+      setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+      if ((connect (fd, addr->ai_addr, addr->ai_addrlen)) != 0 && errno != EINPROGRESS) {
+         error = strerror (errno);
+         close (fd);
+         continue;
+      }
+      conn->fd = fd;
+      conn->addr = addr;
+      conn->state = conn_CONNECT;
+      return true;
+   }
+   return conn_fail (conn, error);
+}
+
+// Takes a pooled connection to the target, or starts a new one
+static bool conn_open (rest_test_http_t *http, struct conn_t *conn)
+{
+   const char *error = NULL;
+   struct host_t *host = host_get (http, &conn->target, &error);
+   if (!host)
+      return conn_fail (conn, error);
+
+   conn->deadline = now () + (double)http->timeout / 1000;
+   if ((conn->fd = pool_take (host)) >= 0) {
+      conn->reused = true;
+      conn->state = conn_WRITE;
+      return true;
+   }
+   conn->reused = false;
+   return conn_connect (conn, host->addrs);
+}
+
+static bool method_idempotent (const char *method)
+{
+   static const char *const methods[] = {
+      "GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE",
+   };
+   for (size_t i=0; i<sizeof methods / sizeof methods[0]; i++) {
+      if ((strcmp (method, methods[i])) == 0)
+         return true;
+   }
+   return false;
+}
+
+// A pooled connection may have been closed by the server at any time; if
+// nothing was received, the request is sent again on another. The server may
+// have acted on a request that it read before closing, so one that is not
+// idempotent (RFC 9110, 9.2.2) is only sent again if none of it was sent.
+static bool conn_retry (rest_test_http_t *http, struct conn_t *conn, const char *error)
+{
+   if (!conn->reused || conn->rsp.buffer.len || (conn->sent && !conn->idempotent))
+      return conn_fail (conn, error);
+   conn_close (conn);
+   response_clear (&conn->rsp);
+   conn->sent = 0;
+   return conn_open (http, conn);
+}
+
+// Stores the response and keeps the connection for the next request
+static bool conn_complete (rest_test_http_t *http, struct conn_t *conn)
+{
+   if (!(response_store (&conn->rsp, conn->rt)))
+      return conn_fail (conn, "OOM storing response");
+
+   http->reuses += conn->reused;
+   conn_unwatch (conn);
+   if (conn->rsp.keep_alive && !conn->head.close) {
+      pool_put (http, conn->target.key, conn->fd);
+      conn->fd = -1;
+   }
+   conn_close (conn);
+   conn->state = conn_DONE;
+   return true;
+}
+
+static bool conn_write (rest_test_http_t *http, struct conn_t *conn)
+{
+   size_t hlen = conn->head.buffer.len;
+   while (conn->sent < hlen + conn->blen) {
+      struct iovec iov[2];
+      struct msghdr msg;
+      memset (&msg, 0, sizeof msg);
+      msg.msg_iov = iov;
+      if (conn->sent < hlen) {
+         iov[msg.msg_iovlen].iov_base = &conn->head.buffer.data[conn->sent];
+         iov[msg.msg_iovlen++].iov_len = hlen - conn->sent;
+      }
+      size_t boff = conn->sent > hlen ? conn->sent - hlen : 0;
+      if (boff < conn->blen) {
+         iov[msg.msg_iovlen].iov_base = (char *)&conn->body[boff];
+         iov[msg.msg_iovlen++].iov_len = conn->blen - boff;
+      }
+
+      ssize_t n = sendmsg (conn->fd, &msg, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+         return true;
+      if (n < 0)
+         return conn_retry (http, conn, strerror (errno));
+      conn->sent += (size_t)n;
+      conn->deadline = now () + (double)http->timeout / 1000;
+   }
+   conn->state = conn_READ;
+   return true;
+}
+
+static bool conn_read (rest_test_http_t *http, struct conn_t *conn)
+{
+   struct response_t *r = &conn->rsp;
+   for (;;) {
+      if (!(buffer_reserve (&r->buffer, HTTP_BLOCK / 2)))
+         return conn_fail (conn, "OOM reading response");
+      ssize_t n = recv (conn->fd, &r->buffer.data[r->buffer.len],
+                        r->buffer.size - r->buffer.len - 1, 0);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+         return true;
+      if (n < 0)
+         return conn_retry (http, conn, strerror (errno));
+      if (n == 0) {
+         // Only a body that runs to the end of the connection may end here
+         if (r->head && r->framing == framing_CLOSE) {
+            r->pos = r->buffer.len;
+            return conn_complete (http, conn);
+         }
+         return conn_retry (http, conn, "Connection closed before the response was complete");
+      }
+
+      r->buffer.len += (size_t)n;
+      r->buffer.data[r->buffer.len] = 0;
+      conn->deadline = now () + (double)http->timeout / 1000;
+      switch (response_parse (r, conn->head_request)) {
+         case parse_MORE:  break;
+         case parse_DONE:  return conn_complete (http, conn);
+         case parse_ERROR: return conn_fail (conn, r->error);
+      }
+   }
+}
+
+// Makes what progress the socket allows without blocking
+static bool conn_step (rest_test_http_t *http, struct conn_t *conn)
+{
+   if (conn->state == conn_CONNECT) {
+      int err = 0;
+      socklen_t len = sizeof err;
+      if ((getsockopt (conn->fd, SOL_SOCKET, SO_ERROR, &err, &len)) != 0)
+         err = errno;
+      if (err == EINPROGRESS || err == EALREADY)
+         return true;
+      if (err) {
+         const struct addrinfo *next = conn->addr->ai_next;
+         conn_close (conn);
+         if (!next)
+            return conn_fail (conn, strerror (err));
+         return conn_connect (conn, next);
+      }
+      conn->state = conn_WRITE;
+      conn->deadline = now () + (double)http->timeout / 1000;
+      http->connects++;
+   }
+   if (conn->state == conn_WRITE && !(conn_write (http, conn)))
+      return false;
+   if (conn->state == conn_READ)
+      return conn_read (http, conn);
+   return true;
+}
+
+static bool conn_timeout (struct conn_t *conn)
+{
+   return conn_fail (conn, conn->state == conn_CONNECT ? "Timed out connecting"
+                         : conn->state == conn_WRITE   ? "Timed out sending"
+                         : "Timed out waiting for response");
+}
+
+static bool conn_active (const struct conn_t *conn)
+{
+   return conn->state == conn_CONNECT || conn->state == conn_WRITE || conn->state == conn_READ;
+}
+
+// Starts sending the request in `rt`
+static bool conn_begin (rest_test_http_t *http, struct conn_t *conn, rest_test_t *rt, int epfd)
+{
+   memset (conn, 0, sizeof *conn);
+   conn->rt = rt;
+   conn->fd = -1;
+   conn->epfd = epfd;
+   rest_test_rsp_clear (rt);
+
+   const char *error = NULL;
+   if (!(target_parse (rest_test_req_uri (rt), &conn->target, &error)))
+      return conn_fail (conn, error);
+
+   const char *method = rest_test_req_method (rt);
+   if (!method || !*method)
+      method = "GET";
+   if (!(conn->body = rest_test_req_body (rt)))
+      conn->body = "";
+   conn->blen = strlen (conn->body);
+   conn->head_request = (strcmp (method, "HEAD")) == 0;
+   conn->idempotent = method_idempotent (method);
+
+   if (!(head_build (rt, &conn->target, method, conn->blen, &conn->head)))
+      return conn_fail (conn, "Failed to build request");
+
+   // A pooled connection can be written to at once
+   return conn_open (http, conn) && (conn->state != conn_WRITE || conn_step (http, conn));
+}
+
+static void conn_release (struct conn_t *conn)
+{
+   conn_close (conn);
+   response_clear (&conn->rsp);
+   buffer_clear (&conn->head.buffer);
+   target_clear (&conn->target);
+   conn->rt = NULL;
+   conn->state = conn_IDLE;
+}
+
+// Watches the descriptor for what the connection waits for
+static bool conn_watch (struct conn_t *conn)
+{
+   uint32_t events = conn->state == conn_READ ? EPOLLIN : EPOLLOUT;
+   if (conn->watched && events == conn->events)
+      return true;
+
+   struct epoll_event ev;
+   memset (&ev, 0, sizeof ev);
+   ev.events = events;
+   ev.data.ptr = conn;
+   if ((epoll_ctl (conn->epfd, conn->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                   conn->fd, &ev)) != 0) {
+      return conn_fail (conn, strerror (errno));
+   }
+   conn->watched = true;
+   conn->events = events;
+   return true;
+}
+
+
+/* *****************************************************************************
+ * The client
+ */
+
+rest_test_http_t *rest_test_http_new (void)
+{
+   rest_test_http_t *ret = calloc (1, sizeof *ret);
+   if (!ret || !(ret->hosts = ds_hmap_new (32))) {
+      ERRORF ("OOM allocating HTTP client\n");
+      free (ret);
+      return NULL;
+   }
+   ret->maxidle = 8;
+   ret->timeout = 30000;
+   return ret;
+}
+
+void rest_test_http_del (rest_test_http_t **http)
+{
+   if (!http || !*http)
+      return;
+   ds_hmap_iterate ((*http)->hosts, _host_del, (*http)->hosts);
+   ds_hmap_del ((*http)->hosts);
+   free (*http);
+   *http = NULL;
+}
+
+void rest_test_http_set_pool (rest_test_http_t *http, size_t maxidle)
+{
+   if (http)
+      http->maxidle = maxidle;
+}
+
+void rest_test_http_set_timeout (rest_test_http_t *http, size_t ms)
+{
+   if (http)
+      http->timeout = ms;
+}
+
+bool rest_test_http_send (rest_test_http_t *http, rest_test_t *rt)
+{
+   if (!http || !rt) {
+      ERRORF ("Null object passed to HTTP client\n");
+      return false;
+   }
+
+   struct conn_t conn;
+   conn_begin (http, &conn, rt, -1);
+   while (conn_active (&conn)) {
+      struct pollfd pfd = { conn.fd, conn.state == conn_READ ? POLLIN : POLLOUT, 0 };
+      double wait = conn.deadline - now ();
+      int rc = wait > 0 ? poll (&pfd, 1, (int)(wait * 1000) + 1) : 0;
+      if (rc < 0 && errno == EINTR)
+         continue;
+      if (rc < 0) {
+         conn_fail (&conn, strerror (errno));
+      } else if (rc == 0) {
+         conn_timeout (&conn);
+      } else {
+         conn_step (http, &conn);
+      }
+   }
+
+   bool ret = conn.state == conn_DONE;
+   conn_release (&conn);
+   return ret;
+}
+
+size_t rest_test_http_run (rest_test_http_t *http, rest_test_t **rts, size_t ntests,
+                           size_t parallel,
+                           void (*done) (rest_test_t *rt, bool ok, void *param),
+                           void *param)
+{
+   size_t nfailed = 0, next = 0, nprefetched = 0, inflight = 0;
+   struct conn_t *conns = NULL;
+   struct epoll_event *events = NULL;
+   int epfd = -1;
+
+   if (!http || !rts || !ntests)
+      return ntests;
+   if (parallel == 0)
+      parallel = 1;
+   if (parallel > ntests)
+      parallel = ntests;
+
+   if (!(conns = calloc (parallel, sizeof *conns))
+         || !(events = calloc (parallel, sizeof *events))
+         || (epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+      ERRORF ("Failed to start %zu requests: %m\n", ntests);
+      nfailed = ntests;
+      goto cleanup;
+   }
+   for (size_t i=0; i<parallel; i++) {
+      conns[i].fd = -1;
+   }
+   http->running = parallel;
+
+   while (next < ntests || inflight) {
+      // Start requests in every free slot. Each test is evaluated as its
+      // request starts, and the commands of the tests after it are started
+      // while it runs.
+      for (size_t i=0; i<parallel && next < ntests; i++) {
+         struct conn_t *conn = &conns[i];
+         if (conn->state != conn_IDLE)
+            continue;
+         while (nprefetched < ntests && nprefetched <= next + parallel) {
+            rest_test_prefetch (rts[nprefetched++]);
+         }
+
+         rest_test_t *rt = rts[next++];
+         rest_test_token_t *errtoken = NULL;
+         if (!(rest_test_eval_req (rt, &errtoken))) {
+            ERRORF ("[%s:%zu] Failed to evaluate [%s]\n", rest_test_get_fname (rt),
+                    rest_test_get_line_no (rt),
+                    errtoken ? rest_test_token_value (errtoken) : "");
+            rest_test_rsp_clear (rt);
+            memset (conn, 0, sizeof *conn);
+            conn->fd = -1;
+            conn->rt = rt;
+            conn->state = conn_FAILED;
+         } else {
+            conn_begin (http, conn, rt, epfd);
+         }
+         inflight++;
+         if (conn_active (conn))
+            conn_watch (conn);
+      }
+
+      // Wait for the connection closest to timing out, at most
+      double deadline = 0;
+      for (size_t i=0; i<parallel; i++) {
+         if (conn_active (&conns[i]) && (!deadline || conns[i].deadline < deadline))
+            deadline = conns[i].deadline;
+      }
+      int nevents = 0;
+      if (deadline) {
+         double wait = deadline - now ();
+         nevents = epoll_wait (epfd, events, (int)parallel, wait > 0 ? (int)(wait * 1000) + 1 : 0);
+         if (nevents < 0 && errno != EINTR) {
+            ERRORF ("Failed waiting for responses: %m\n");
+            for (size_t i=0; i<parallel; i++) {
+               if (conn_active (&conns[i]))
+                  conn_fail (&conns[i], strerror (errno));
+            }
+         }
+      }
+      for (int i=0; i<nevents; i++) {
+         struct conn_t *conn = events[i].data.ptr;
+         if (conn_active (conn) && (conn_step (http, conn)) && conn_active (conn))
+            conn_watch (conn);
+      }
+
+      double t = now ();
+      for (size_t i=0; i<parallel; i++) {
+         struct conn_t *conn = &conns[i];
+         if (conn_active (conn) && t > conn->deadline)
+            conn_timeout (conn);
+         if (conn->state != conn_DONE && conn->state != conn_FAILED)
+            continue;
+         nfailed += conn->state == conn_FAILED;
+         if (done)
+            done (conn->rt, conn->state == conn_DONE, param);
+         conn_release (conn);
+         inflight--;
+      }
+   }
+
+cleanup:
+   http->running = 0;
+   for (size_t i=0; conns && i<parallel; i++) {
+      conn_release (&conns[i]);
+   }
+   if (epfd >= 0)
+      close (epfd);
+   free (events);
+   free (conns);
+   return nfailed;
+}
+
+size_t rest_test_http_connects (rest_test_http_t *http)
+{
+   return http ? http->connects : 0;
+}
+
+size_t rest_test_http_reuses (rest_test_http_t *http)
+{
+   return http ? http->reuses : 0;
+}
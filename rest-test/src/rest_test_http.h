@@ -0,0 +1,80 @@
+
+#ifndef H_REST_TEST_HTTP
+#define H_REST_TEST_HTTP
+
+/* *****************************************************************************
+ * The HTTP/1.1 client. A request is sent as rest_test_eval_req() left it: the
+ * method (GET when empty), the URI, which must be absolute (`http://host[:port]
+ * /path`), the HTTP version (HTTP/1.1 when empty), the headers and the body.
+ * A `host` header is added unless the test sets one, and a `content-length`
+ * header unless the test sets it or `transfer-encoding`. The response is
+ * stored in the test with the rest_test_rsp_set_*() functions, replacing any
+ * earlier one; a response body is stored as a string, so it ends at its first
+ * NUL byte. Header names are lowercase, and a header that is repeated is stored
+ * once with its values joined by ", ".
+ *
+ * Connections are kept open and reused, pooled by scheme, host and port, unless
+ * the request or the response asks for the connection to be closed. A request
+ * sent on a pooled connection that the server has since closed is sent again
+ * on a new connection, unless its method is not idempotent (such as POST or
+ * PATCH) and any of it had been sent: the server may have acted on it, so the
+ * test fails instead. A host name is resolved when the client first connects
+ * to it, and the addresses are kept for the life of the client. Only `http` is
+ * supported; there is no TLS.
+ *
+ * Many requests can be run concurrently on one thread: each is a state machine
+ * over a non-blocking socket (connecting, writing the request, reading and
+ * parsing the response), and an epoll set waits on all of them. Each request in
+ * flight needs a descriptor of its own.
+ *
+ * A client is not thread-safe: use one per thread.
+ */
+
+typedef struct rest_test_http_t rest_test_http_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   rest_test_http_t *rest_test_http_new (void);
+   // Closes every pooled connection
+   void rest_test_http_del (rest_test_http_t **http);
+
+   // Sets the most connections kept open to each host while idle; 0 closes
+   // each connection after its response. The default is 8.
+   void rest_test_http_set_pool (rest_test_http_t *http, size_t maxidle);
+
+   // Sets how long connecting, sending or waiting for the next part of the
+   // response may take, in milliseconds. The default is 30000.
+   void rest_test_http_set_timeout (rest_test_http_t *http, size_t ms);
+
+   // Sends the request in `rt` and waits for the response, which is stored in
+   // `rt`. Returns false, having reported the error, if the request could not
+   // be sent or no valid response was received; the response is then empty.
+   bool rest_test_http_send (rest_test_http_t *http, rest_test_t *rt);
+
+   // Evaluates and sends the requests of `ntests` tests, in order, with up to
+   // `parallel` in flight at once, and waits for every response. Each test is
+   // evaluated as its request starts, after the shell commands that the next
+   // `parallel` tests can prefetch are started (see rest_test_prefetch()).
+   // `done`, if not NULL, is called as each request completes, in the order
+   // that they complete, with whether a response was stored. While requests
+   // run, as many idle connections are kept per host as may be in flight.
+   // Returns the number of tests that failed.
+   size_t rest_test_http_run (rest_test_http_t *http, rest_test_t **rts, size_t ntests,
+                              size_t parallel,
+                              void (*done) (rest_test_t *rt, bool ok, void *param),
+                              void *param);
+
+   // The number of connections opened, and the number of requests sent on a
+   // connection that an earlier request opened
+   size_t rest_test_http_connects (rest_test_http_t *http);
+   size_t rest_test_http_reuses (rest_test_http_t *http);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,180 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+#include "ds_hmap.h"
+
+#include "rest_test_intern.h"
+
+// Each string is stored with its id, so that both the string and the id can be
+// found with a single lookup.
+struct entry_t {
+   size_t   id;
+   char     string[];
+};
+
+struct rest_test_intern_t {
+   ds_hmap_t       *hmap;      // string -> struct entry_t *
+   struct entry_t **entries;   // indexed by id
+   size_t           nentries;
+   size_t           size;
+};
+
+
+rest_test_intern_t *rest_test_intern_new (size_t buckets)
+{
+   rest_test_intern_t *ret = calloc (1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   if (!(ret->hmap = ds_hmap_new (buckets ? buckets : 1))) {
+      free (ret);
+      return NULL;
+   }
+
+   return ret;
+}
+
+void rest_test_intern_del (rest_test_intern_t **intern)
+{
+   if (!intern || !*intern)
+      return;
+
+   for (size_t i=0; i<(*intern)->nentries; i++) {
+      free ((*intern)->entries[i]);
+   }
+   free ((*intern)->entries);
+   ds_hmap_del ((*intern)->hmap);
+   free (*intern);
+   *intern = NULL;
+}
+
+static struct entry_t *intern_entry (rest_test_intern_t *intern, const char *string)
+{
+   struct entry_t *ret = NULL;
+
+   if (!intern || !string)
+      return NULL;
+
+   if ((ds_hmap_get_str_ptr (intern->hmap, string, (void **)&ret)))
+      return ret;
+
+   if (intern->nentries == intern->size) {
+      size_t newsize = intern->size ? intern->size * 2 : 16;
+      struct entry_t **tmp = realloc (intern->entries, newsize * sizeof *tmp);
+      if (!tmp)
+         return NULL;
+      intern->entries = tmp;
+      intern->size = newsize;
+   }
+
+   size_t slen = strlen (string);
+   if (!(ret = malloc (sizeof *ret + slen + 1)))
+      return NULL;
+
+   ret->id = intern->nentries;
+   memcpy (ret->string, string, slen + 1);
+   if (!(ds_hmap_set_str_ptr (intern->hmap, ret->string, ret))) {
+      free (ret);
+      return NULL;
+   }
+
+   intern->entries[intern->nentries++] = ret;
+   return ret;
+}
+
+const char *rest_test_intern_string (rest_test_intern_t *intern, const char *string)
+{
+   struct entry_t *entry = intern_entry (intern, string);
+   return entry ? entry->string : NULL;
+}
+
+size_t rest_test_intern_id (rest_test_intern_t *intern, const char *string)
+{
+   struct entry_t *entry = intern_entry (intern, string);
+   return entry ? entry->id : (size_t)-1;
+}
+
+size_t rest_test_intern_find (const rest_test_intern_t *intern, const char *string)
+{
+   struct entry_t *entry = NULL;
+   if (!intern || !string
+         || !(ds_hmap_get_str_ptr (intern->hmap, string, (void **)&entry)))
+      return (size_t)-1;
+
+   return entry->id;
+}
+
+const char *rest_test_intern_lookup (const rest_test_intern_t *intern, size_t id)
+{
+   if (!intern || id >= intern->nentries)
+      return NULL;
+
+   return intern->entries[id]->string;
+}
+
+size_t rest_test_intern_count (const rest_test_intern_t *intern)
+{
+   return intern ? intern->nentries : 0;
+}
+
+// A run only ever sees a handful of distinct source files. Files may be parsed
+// on several threads at once, so the table is guarded by a lock.
+static rest_test_intern_t *sources = NULL;
+static pthread_mutex_t sources_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *rest_test_intern_source (const char *source)
+{
+   const char *ret = NULL;
+
+   pthread_mutex_lock (&sources_lock);
+   if (sources || (sources = rest_test_intern_new (64))) {
+      ret = rest_test_intern_string (sources, source);
+   }
+   pthread_mutex_unlock (&sources_lock);
+
+   return ret;
+}
+
+// Symbols are looked up far more often than new ones are added, so readers
+// share the lock.
+static rest_test_intern_t *symbols = NULL;
+static pthread_rwlock_t symbols_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+size_t rest_test_intern_symbol (const char *symbol)
+{
+   size_t ret = rest_test_intern_symbol_find (symbol);
+   if (ret != (size_t)-1 || !symbol)
+      return ret;
+
+   pthread_rwlock_wrlock (&symbols_lock);
+   if (symbols || (symbols = rest_test_intern_new (256))) {
+      ret = rest_test_intern_id (symbols, symbol);
+   }
+   pthread_rwlock_unlock (&symbols_lock);
+
+   return ret;
+}
+
+size_t rest_test_intern_symbol_find (const char *symbol)
+{
+   pthread_rwlock_rdlock (&symbols_lock);
+   size_t ret = rest_test_intern_find (symbols, symbol);
+   pthread_rwlock_unlock (&symbols_lock);
+
+   return ret;
+}
+
+const char *rest_test_intern_symbol_name (size_t id)
+{
+   pthread_rwlock_rdlock (&symbols_lock);
+   const char *ret = rest_test_intern_lookup (symbols, id);
+   pthread_rwlock_unlock (&symbols_lock);
+
+   return ret;
+}
@@ -0,0 +1,63 @@
+
+#ifndef H_REST_TEST_INTERN
+#define H_REST_TEST_INTERN
+
+typedef struct rest_test_intern_t rest_test_intern_t;
+
+/* *****************************************************************************
+ * A string-intern table. Each distinct string is stored once and given a small
+ * integer id; interning an equal string again returns the same pointer and the
+ * same id. Interned strings remain valid until the table is deleted.
+ *
+ * Source filenames are interned in a process-wide table, so that tokens, headers
+ * and tests can share a single copy of the filename they came from. Symbol names
+ * are interned in another, so that symbol tables can be keyed by integer id.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Create a new table. The bucket count is a hint for the expected number of
+   // distinct strings. On failure NULL is returned.
+   rest_test_intern_t *rest_test_intern_new (size_t buckets);
+   void rest_test_intern_del (rest_test_intern_t **intern);
+
+   // Returns the interned copy of `string`, adding it to the table if necessary.
+   // Returns NULL on failure (out of memory).
+   const char *rest_test_intern_string (rest_test_intern_t *intern, const char *string);
+
+   // Returns the id of `string`, adding it to the table if necessary. Returns
+   // (size_t)-1 on failure.
+   size_t rest_test_intern_id (rest_test_intern_t *intern, const char *string);
+
+   // Returns the id of `string` if it is in the table, without adding it.
+   // Returns (size_t)-1 if it is not.
+   size_t rest_test_intern_find (const rest_test_intern_t *intern, const char *string);
+
+   // Returns the string with the specified id, or NULL if there is no such id.
+   const char *rest_test_intern_lookup (const rest_test_intern_t *intern, size_t id);
+
+   // Returns the number of strings in the table.
+   size_t rest_test_intern_count (const rest_test_intern_t *intern);
+
+   // Interns a source filename in the process-wide table of sources. The
+   // returned string is valid for the lifetime of the process. It may be called
+   // from several threads at once.
+   const char *rest_test_intern_source (const char *source);
+
+   // The process-wide table of symbol names. rest_test_intern_symbol() returns
+   // the id of `symbol`, adding it if necessary, and (size_t)-1 on failure;
+   // rest_test_intern_symbol_find() returns (size_t)-1 for a symbol that was
+   // never interned, which therefore has no value in any symbol table. These
+   // may be called from several threads at once.
+   size_t rest_test_intern_symbol (const char *symbol);
+   size_t rest_test_intern_symbol_find (const char *symbol);
+   const char *rest_test_intern_symbol_name (size_t id);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
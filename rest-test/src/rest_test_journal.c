@@ -0,0 +1,423 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "ds_str.h"
+
+#include "rest_test_arena.h"
+#include "rest_test_token.h"
+#include "rest_test_symt.h"
+#include "rest_test_intern.h"
+#include "rest_test_hash.h"
+#include "rest_test.h"
+#include "rest_test_state.h"
+#include "rest_test_journal.h"
+
+#define CLEANUP(...) \
+do {\
+   ERRORF(__VA_ARGS__);\
+   goto cleanup;\
+} while (0)
+
+#define JOURNAL_MAGIC      "RTJOURNL"
+#define JOURNAL_BYTEORDER  (0x01020304u)
+#define JOURNAL_NO_SOURCE  (UINT32_MAX)
+
+enum journal_op_t {
+   journal_ADD = 1,
+   journal_CLEAR,
+};
+
+struct jheader_t {
+   char              magic[8];
+   uint32_t          version;
+   uint32_t          byteorder;
+};
+
+// Followed by the symbol, the source (unless there is none) and the value, each
+// NUL-terminated. `check` is the hash of the record with `check` set to zero.
+struct jrecord_t {
+   uint32_t          op;
+   uint32_t          type;
+   uint32_t          nsymbol;
+   uint32_t          nsource;    // JOURNAL_NO_SOURCE if there is no source
+   uint64_t          line_no;
+   uint64_t          nvalue;
+   uint64_t          check;
+};
+
+struct rest_test_journal_t {
+   char                         *snapshot;
+   char                         *logname;
+   int                           fd;
+   rest_test_symt_t             *symt;
+   struct rest_test_symt_hook_t  hook;
+   size_t                        nrecords;
+   size_t                        unsynced;
+   size_t                        batch;
+   size_t                        compact;
+   // Records are encoded here before they are written
+   char                         *buffer;
+   size_t                        buffer_size;
+};
+
+
+/* *********************************************************************************
+ * Replaying the snapshot and the log.
+ */
+
+static bool entry_copy (void *ctx, size_t id, const rest_test_token_t *token)
+{
+   return rest_test_symt_add_id (ctx, id, (rest_test_token_t *)token);
+}
+
+static bool snapshot_load (const char *filename, rest_test_symt_t *symt)
+{
+   struct stat sb;
+   if ((stat (filename, &sb)) != 0)
+      return errno == ENOENT;
+
+   rest_test_symt_t **tables = rest_test_state_load (filename);
+   if (!tables)
+      return false;
+
+   // The journaled table is the last one saved; any others are its ancestors
+   size_t ntables = 0;
+   while (tables[ntables])
+      ntables++;
+   bool ret = ntables && rest_test_symt_walk (tables[ntables - 1], entry_copy, symt);
+   rest_test_state_del (&tables);
+   return ret;
+}
+
+static size_t record_size (const struct jrecord_t *record)
+{
+   return sizeof *record
+        + record->nsymbol + 1
+        + (record->nsource == JOURNAL_NO_SOURCE ? 0 : record->nsource + 1)
+        + record->nvalue + 1;
+}
+
+static uint64_t record_check (const struct jrecord_t *record, const char *payload)
+{
+   struct jrecord_t copy = *record;
+   copy.check = 0;
+   uint64_t seed = rest_test_hash64 (&copy, sizeof copy, 0);
+   return rest_test_hash64 (payload, record_size (record) - sizeof *record, seed);
+}
+
+// Reads the record at the start of `data`, returning its length, or 0 if the
+// record is incomplete or damaged. Mapped records are not aligned, so the
+// header is copied out.
+static size_t record_read (const char *data, size_t length, struct jrecord_t *record,
+                           const char **symbol, const char **source, const char **value)
+{
+   if (length < sizeof *record)
+      return 0;
+   memcpy (record, data, sizeof *record);
+   if (record->nsymbol == 0 || record->nsymbol > length || record->nvalue > length
+         || (record->nsource != JOURNAL_NO_SOURCE && record->nsource > length))
+      return 0;
+
+   size_t size = record_size (record);
+   if (size > length)
+      return 0;
+
+   *symbol = &data[sizeof *record];
+   *source = record->nsource == JOURNAL_NO_SOURCE ? NULL : &(*symbol)[record->nsymbol + 1];
+   *value = *source ? &(*source)[record->nsource + 1] : &(*symbol)[record->nsymbol + 1];
+   if (record_check (record, *symbol) != record->check
+         || (*symbol)[record->nsymbol] || (*source && (*source)[record->nsource])
+         || (*value)[record->nvalue]
+         || (record->op != journal_ADD && record->op != journal_CLEAR)
+         || record->type > token_SHELLCMD)
+      return 0;
+   return size;
+}
+
+static bool record_apply (rest_test_symt_t *symt, const struct jrecord_t *record,
+                          const char *symbol, const char *source, const char *value)
+{
+   if (record->op == journal_CLEAR) {
+      rest_test_symt_clear (symt, symbol);
+      return true;
+   }
+
+   rest_test_token_t *token = rest_test_token_new ((enum rest_test_token_type_t)record->type,
+                                                   value, source, record->line_no);
+   bool ret = token && rest_test_symt_add (symt, symbol, token);
+   rest_test_token_del (&token);
+   return ret;
+}
+
+// Replays the log into the table, and returns the length of its undamaged
+// prefix in `valid`
+static bool log_replay (rest_test_journal_t *journal, size_t *valid)
+{
+   struct stat sb;
+   *valid = 0;
+   if ((stat (journal->logname, &sb)) != 0)
+      return errno == ENOENT;
+   // Empty files cannot be mapped
+   if (sb.st_size == 0)
+      return true;
+
+   size_t length = 0;
+   rest_test_token_t *file = rest_test_token_map (journal->logname);
+   const char *data = file ? rest_test_token_slice (file, &length) : NULL;
+   if (!data)
+      return false;
+
+   const struct jheader_t *header = (const struct jheader_t *)data;
+   bool ret = false;
+   if (length < sizeof *header
+         || (memcmp (header->magic, JOURNAL_MAGIC, sizeof header->magic)) != 0) {
+      ERRORF ("[%s] is not a journal\n", journal->logname);
+   } else if (header->version != REST_TEST_JOURNAL_VERSION) {
+      ERRORF ("[%s] is a version %u journal, expected version %u\n",
+              journal->logname, header->version, REST_TEST_JOURNAL_VERSION);
+   } else if (header->byteorder != JOURNAL_BYTEORDER) {
+      ERRORF ("[%s] was written on a host with a different byte order\n", journal->logname);
+   } else {
+      struct jrecord_t record;
+      const char *symbol, *source, *value;
+      size_t offset = sizeof *header;
+      size_t size;
+      ret = true;
+      while (ret && (size = record_read (&data[offset], length - offset, &record,
+                                         &symbol, &source, &value)) > 0) {
+         if (!(ret = record_apply (journal->symt, &record, symbol, source, value))) {
+            ERRORF ("[%s] Failed to replay [%s]\n", journal->logname, symbol);
+         }
+         offset += size;
+         journal->nrecords++;
+      }
+      if (ret && offset < length) {
+         ERRORF ("[%s] Discarding %zu bytes of damaged records\n",
+                 journal->logname, length - offset);
+      }
+      *valid = offset;
+   }
+   rest_test_token_del (&file);
+   return ret;
+}
+
+
+/* *********************************************************************************
+ * Recording writes.
+ */
+
+static bool write_all (int fd, const char *data, size_t length)
+{
+   while (length) {
+      ssize_t nbytes = write (fd, data, length);
+      if (nbytes < 0) {
+         if (errno == EINTR)
+            continue;
+         return false;
+      }
+      data += nbytes;
+      length -= (size_t)nbytes;
+   }
+   return true;
+}
+
+static bool journal_record (void *ctx, rest_test_symt_t *symt, size_t id,
+                            const rest_test_token_t *token)
+{
+   rest_test_journal_t *journal = ctx;
+   (void)symt;
+
+   // The table does not yet hold this write, so the snapshot is taken before
+   // the record is logged
+   if (journal->nrecords >= journal->compact
+         && journal->nrecords >= rest_test_symt_count (journal->symt)) {
+      rest_test_journal_compact (journal);
+   }
+
+   const char *symbol = rest_test_intern_symbol_name (id);
+   const char *source = token ? rest_test_token_source (token) : NULL;
+   size_t nvalue = 0;
+   const char *value = token ? rest_test_token_slice (token, &nvalue) : "";
+   if (!symbol || !value)
+      return false;
+
+   struct jrecord_t record;
+   memset (&record, 0, sizeof record);
+   record.op = token ? journal_ADD : journal_CLEAR;
+   record.type = token ? (uint32_t)rest_test_token_type (token) : 0;
+   record.nsymbol = (uint32_t)strlen (symbol);
+   record.nsource = source ? (uint32_t)strlen (source) : JOURNAL_NO_SOURCE;
+   record.line_no = token ? rest_test_token_line_no (token) : 0;
+   record.nvalue = nvalue;
+
+   size_t size = record_size (&record);
+   if (size > journal->buffer_size) {
+      char *tmp = realloc (journal->buffer, size);
+      if (!tmp) {
+         ERRORF ("OOM journaling [%s]\n", symbol);
+         return false;
+      }
+      journal->buffer = tmp;
+      journal->buffer_size = size;
+   }
+
+   char *dst = &journal->buffer[sizeof record];
+   memcpy (dst, symbol, record.nsymbol + 1);
+   dst += record.nsymbol + 1;
+   if (source) {
+      memcpy (dst, source, record.nsource + 1);
+      dst += record.nsource + 1;
+   }
+   // Sliced values are not necessarily terminated
+   memcpy (dst, value, nvalue);
+   dst[nvalue] = 0;
+   record.check = record_check (&record, &journal->buffer[sizeof record]);
+   memcpy (journal->buffer, &record, sizeof record);
+
+   if (!(write_all (journal->fd, journal->buffer, size))) {
+      ERRORF ("Failed to journal [%s] to [%s]: %m\n", symbol, journal->logname);
+      return false;
+   }
+   journal->nrecords++;
+   if (++journal->unsynced >= journal->batch) {
+      rest_test_journal_sync (journal);
+   }
+   return true;
+}
+
+rest_test_journal_t *rest_test_journal_open (const char *filename, rest_test_symt_t *symt)
+{
+   bool error = true;
+   rest_test_journal_t *ret = NULL;
+   size_t valid = 0;
+
+   if (!filename || !symt)
+      return NULL;
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      CLEANUP ("OOM allocating journal\n");
+   }
+   ret->fd = -1;
+   ret->symt = symt;
+   ret->batch = REST_TEST_JOURNAL_BATCH;
+   ret->compact = REST_TEST_JOURNAL_COMPACT;
+   ret->hook.fn = journal_record;
+   ret->hook.ctx = ret;
+   if (!(ret->snapshot = ds_str_dup (filename))
+         || !(ret->logname = ds_str_cat (filename, ".log", NULL))) {
+      CLEANUP ("OOM allocating journal names for [%s]\n", filename);
+   }
+
+   if (!(snapshot_load (ret->snapshot, symt))) {
+      CLEANUP ("Failed to load snapshot [%s]\n", ret->snapshot);
+   }
+   if (!(log_replay (ret, &valid))) {
+      CLEANUP ("Failed to replay [%s]\n", ret->logname);
+   }
+
+   // The journal may hold credentials, so it is readable only by the owner
+   if ((ret->fd = open (ret->logname, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR)) < 0) {
+      CLEANUP ("Failed to open [%s]: %m\n", ret->logname);
+   }
+   // New records must follow the last good one, not a torn one
+   if (valid == 0) {
+      struct jheader_t header;
+      memset (&header, 0, sizeof header);
+      memcpy (header.magic, JOURNAL_MAGIC, sizeof header.magic);
+      header.version = REST_TEST_JOURNAL_VERSION;
+      header.byteorder = JOURNAL_BYTEORDER;
+      if ((ftruncate (ret->fd, 0)) != 0
+            || !(write_all (ret->fd, (const char *)&header, sizeof header))
+            || (fdatasync (ret->fd)) != 0) {
+         CLEANUP ("Failed to initialise [%s]: %m\n", ret->logname);
+      }
+   } else if ((ftruncate (ret->fd, (off_t)valid)) != 0) {
+      CLEANUP ("Failed to truncate [%s]: %m\n", ret->logname);
+   }
+
+   rest_test_symt_set_hook (symt, &ret->hook);
+   error = false;
+cleanup:
+   if (error) {
+      rest_test_journal_close (&ret);
+   }
+   return ret;
+}
+
+void rest_test_journal_close (rest_test_journal_t **journal)
+{
+   if (!journal || !*journal)
+      return;
+
+   rest_test_journal_t *j = *journal;
+   if (j->fd >= 0) {
+      rest_test_symt_set_hook (j->symt, NULL);
+      rest_test_journal_sync (j);
+      close (j->fd);
+   }
+   free (j->snapshot);
+   free (j->logname);
+   free (j->buffer);
+   free (j);
+   *journal = NULL;
+}
+
+void rest_test_journal_set_limits (rest_test_journal_t *journal, size_t batch, size_t compact)
+{
+   if (!journal)
+      return;
+   if (batch)
+      journal->batch = batch;
+   if (compact)
+      journal->compact = compact;
+}
+
+bool rest_test_journal_sync (rest_test_journal_t *journal)
+{
+   if (!journal)
+      return false;
+   if (!journal->unsynced)
+      return true;
+
+   if ((fdatasync (journal->fd)) != 0) {
+      ERRORF ("Failed to sync [%s]: %m\n", journal->logname);
+      return false;
+   }
+   journal->unsynced = 0;
+   return true;
+}
+
+bool rest_test_journal_compact (rest_test_journal_t *journal)
+{
+   if (!journal)
+      return false;
+
+   // Until the log is emptied both hold the same writes, which replay to the
+   // same table
+   if (!(rest_test_state_save (&journal->symt, 1, journal->snapshot))) {
+      ERRORF ("Failed to compact [%s]\n", journal->logname);
+      return false;
+   }
+   if ((ftruncate (journal->fd, sizeof (struct jheader_t))) != 0
+         || (fdatasync (journal->fd)) != 0) {
+      ERRORF ("Failed to empty [%s]: %m\n", journal->logname);
+      return false;
+   }
+   journal->nrecords = 0;
+   journal->unsynced = 0;
+   return true;
+}
+
+size_t rest_test_journal_records (const rest_test_journal_t *journal)
+{
+   return journal ? journal->nrecords : 0;
+}
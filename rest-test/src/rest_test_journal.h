@@ -0,0 +1,64 @@
+
+#ifndef H_REST_TEST_JOURNAL
+#define H_REST_TEST_JOURNAL
+
+/* *****************************************************************************
+ * A journaled symbol table. Every add and clear on the table is appended to a
+ * log as it happens, so values captured during a long run survive the run
+ * without the whole table being rewritten after each change.
+ *
+ * The journal at FILE is two files: FILE is a snapshot in the state format (see
+ * rest_test_state.h) and FILE.log is the log of the writes made since the
+ * snapshot. Opening the journal replays both into the table. When the log has
+ * grown to at least the size of the table it is compacted: the table is written
+ * as the new snapshot and the log is emptied.
+ *
+ * Each record is written to the log before the table is changed, and so
+ * survives the process crashing. Records reach the disk in batches: the log is
+ * synced after every `batch` records, on rest_test_journal_sync() and on close.
+ * A record torn by a crash is detected by its checksum and discarded, along
+ * with anything after it. Replaying a record that the snapshot already holds
+ * is harmless, so a crash during compaction loses nothing.
+ */
+
+#define REST_TEST_JOURNAL_VERSION   (1)
+#define REST_TEST_JOURNAL_BATCH     (32)
+#define REST_TEST_JOURNAL_COMPACT   (4096)
+
+typedef struct rest_test_journal_t rest_test_journal_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Replays the journal at `filename`, if there is one, into `symt` and then
+   // records every further write to `symt`. Only the table's own entries are
+   // journaled. Returns NULL if an existing journal cannot be read or the log
+   // cannot be opened. The journal must be closed before the table is deleted.
+   rest_test_journal_t *rest_test_journal_open (const char *filename, rest_test_symt_t *symt);
+
+   // Syncs the log and stops recording writes to the table.
+   void rest_test_journal_close (rest_test_journal_t **journal);
+
+   // Sync the log after every `batch` records (1 syncs every record), and
+   // compact it once it holds at least `compact` records and at least as many
+   // records as the table has entries. Zero leaves a setting unchanged.
+   void rest_test_journal_set_limits (rest_test_journal_t *journal,
+                                      size_t batch, size_t compact);
+
+   // Writes the records not yet synced to the disk.
+   bool rest_test_journal_sync (rest_test_journal_t *journal);
+
+   // Writes the table as the new snapshot and empties the log.
+   bool rest_test_journal_compact (rest_test_journal_t *journal);
+
+   // The number of records in the log.
+   size_t rest_test_journal_records (const rest_test_journal_t *journal);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -1,16 +1,26 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include <pthread.h>
+#include <unistd.h>
 
 #include "ds_str.h"
 
+#include "rest_test_arena.h"
 #include "rest_test_token.h"
 #include "rest_test_symt.h"
 #include "rest_test.h"
+#include "rest_test_bundle.h"
 #include "rest_test_parse.h"
+#include "rest_test_cache.h"
 
 
 #define CLEANUP(...) \
@@ -20,17 +30,23 @@ do {\
 } while (0)
 
 
-static bool array_push (void ***array, size_t *nitems, void *el)
+// Appends to a NULL-terminated array of `*size` elements, growing it
+// geometrically.
+static bool array_push (void ***array, size_t *nitems, size_t *size, void *el)
 {
    if (!el)
       return true;
 
-   void **tmp = realloc (*array, (sizeof *tmp) * ((*nitems) + 2));
-   if (!tmp)
-      return false;
-   *array = tmp;
-   tmp[*nitems] = el;
-   tmp[(*nitems) + 1] = NULL;
+   if ((*nitems) + 2 > *size) {
+      size_t newsize = *size ? *size * 2 : 16;
+      void **tmp = realloc (*array, (sizeof *tmp) * newsize);
+      if (!tmp)
+         return false;
+      *array = tmp;
+      *size = newsize;
+   }
+   (*array)[*nitems] = el;
+   (*array)[(*nitems) + 1] = NULL;
    (*nitems) = (*nitems) + 1;
    return true;
 }
@@ -41,6 +57,8 @@ static bool array_push (void ***array, size_t *nitems, void *el)
  * Directive identification
  */
 
+// These values are stored in compiled bundles: append new directives to the end
+// and bump REST_TEST_BUNDLE_VERSION when changing any existing value.
 enum directive_t {
    directive_UNKNOWN,
    directive_GLOBAL,
@@ -55,238 +73,883 @@ enum directive_t {
    directive_BODY,
 
    directive_ASSERT,
+
+   directive_PREFETCH,
+   directive_PARALLEL,
 };
 struct prefix_t {
    const char *prefix;
    enum directive_t directive;
+   size_t nparams;
 };
 
+// Indexed by directive
 static const struct prefix_t directives[] = {
-   { ".global",         directive_GLOBAL        },
-   { ".parent",         directive_PARENT        },
-   { ".local",          directive_LOCAL         },
-
-   { ".test",           directive_TEST          },
-   { ".method",         directive_METHOD        },
-   { ".uri",            directive_URI           },
-   { ".http_version",   directive_HTTP_VERSION  },
-   { ".header",         directive_HEADER        },
-   { ".body",           directive_BODY          },
-
-   { ".assert",         directive_ASSERT        },
+   [directive_GLOBAL]         = { ".global",         directive_GLOBAL,       2 },
+   [directive_PARENT]         = { ".parent",         directive_PARENT,       2 },
+   [directive_LOCAL]          = { ".local",          directive_LOCAL,        2 },
+
+   [directive_TEST]           = { ".test",           directive_TEST,         1 },
+   [directive_METHOD]         = { ".method",         directive_METHOD,       1 },
+   [directive_URI]            = { ".uri",            directive_URI,          1 },
+   [directive_HTTP_VERSION]   = { ".http_version",   directive_HTTP_VERSION, 1 },
+   [directive_HEADER]         = { ".header",         directive_HEADER,       2 },
+   [directive_BODY]           = { ".body",           directive_BODY,         1 },
+
+   [directive_ASSERT]         = { ".assert",         directive_ASSERT,       1 },
+
+   [directive_PREFETCH]       = { ".prefetch",       directive_PREFETCH,     1 },
+   [directive_PARALLEL]       = { ".parallel",       directive_PARALLEL,     1 },
 };
 
 static size_t nprefix = sizeof directives/sizeof directives[0];
 
-static enum directive_t directive_value (const char *line)
+static const struct prefix_t *directive_info (enum directive_t directive)
+{
+   if ((size_t)directive >= nprefix || !directives[directive].prefix)
+      return NULL;
+   return &directives[directive];
+}
+
+// Directives are looked up through an index built from the table: among the
+// directives of each length, the first byte after the '.' that tells them all
+// apart selects the candidate, and a single comparison then confirms the match.
+// Where no one byte tells them apart, the directives of that length are tried
+// in turn.
+#define DIRECTIVE_MAXLEN      (31)
+
+static struct {
+   size_t      pos;        // The byte that selects; 0 to try each in turn
+   uint8_t     candidates[UCHAR_MAX + 1];
+} directive_index[DIRECTIVE_MAXLEN + 1];
+static pthread_once_t directive_once = PTHREAD_ONCE_INIT;
+
+// Whether the byte at `pos` differs between every directive of `length`
+static bool directive_distinct (size_t length, size_t pos)
 {
+   bool seen[UCHAR_MAX + 1] = { false };
    for (size_t i=0; i<nprefix; i++) {
-      if ((strstr (line, directives[i].prefix)) == line) {
-         return directives[i].directive;
-      }
+      const char *prefix = directives[i].prefix;
+      if (!prefix || strlen (prefix) != length)
+         continue;
+      if (seen[(unsigned char)prefix[pos]])
+         return false;
+      seen[(unsigned char)prefix[pos]] = true;
    }
+   return true;
+}
 
-   return directive_UNKNOWN;
+static void directive_index_build (void)
+{
+   for (size_t length=2; length<=DIRECTIVE_MAXLEN; length++) {
+      size_t pos = 1;
+      while (pos < length && !(directive_distinct (length, pos)))
+         pos++;
+      directive_index[length].pos = pos < length ? pos : 0;
+   }
+   for (size_t i=0; i<nprefix; i++) {
+      const char *prefix = directives[i].prefix;
+      size_t length = prefix ? strlen (prefix) : 0;
+      if (length < 2 || length > DIRECTIVE_MAXLEN)
+         continue;
+      size_t pos = directive_index[length].pos;
+      if (pos)
+         directive_index[length].candidates[(unsigned char)prefix[pos]] = (uint8_t)i;
+   }
 }
 
+// Identifies the directive that is exactly the `length` bytes at `value`
+static const struct prefix_t *directive_find (const char *value, size_t length)
+{
+   if (length < 2 || length > DIRECTIVE_MAXLEN)
+      return NULL;
+   pthread_once (&directive_once, directive_index_build);
+
+   size_t pos = directive_index[length].pos;
+   if (!pos) {
+      for (size_t i=0; i<nprefix; i++) {
+         const char *prefix = directives[i].prefix;
+         if (prefix && strlen (prefix) == length && (memcmp (value, prefix, length)) == 0)
+            return &directives[i];
+      }
+      return NULL;
+   }
 
+   const struct prefix_t *info =
+      directive_info ((enum directive_t)directive_index[length].candidates[(unsigned char)value[pos]]);
+   if (!info || (memcmp (value, info->prefix, length)) != 0)
+      return NULL;
+   return info;
+}
 
+const char *rest_test_parse_directive_name (size_t n)
+{
+   for (size_t i=0; i<nprefix; i++) {
+      if (directives[i].prefix && !n--)
+         return directives[i].prefix;
+   }
+   return NULL;
+}
 
+bool rest_test_parse_is_directive (const char *word)
+{
+   return word && directive_find (word, strlen (word)) != NULL;
+}
 
 
 
 /* *********************************************************************************
- * Public functions.
+ * The parser proper. The input is a stream of directives, each with its
+ * parameters, which either comes from the lexer or from a compiled bundle. The
+ * directives are applied to the tests in the order that they are read.
+ *
+ * Each test is complete when the next one starts, or at the end of the input.
+ * Complete tests are either handed to the caller's callback or collected into
+ * the returned array.
  */
 
-rest_test_t **rest_test_parse_file (rest_test_symt_t *parent, const char *filename)
+// A `.global` or `.parent` write held back until it can be applied in order
+struct write_t {
+   rest_test_symt_t  *symt;
+   char              *symbol;
+   rest_test_token_t *token;
+};
+
+struct parse_t {
+   rest_test_symt_t  *parent;
+   rest_test_symt_t  *global;
+   rest_test_arena_t *arena;
+   rest_test_t      **ret;
+   size_t             nitems;
+   size_t             size;
+   rest_test_t       *current;
+   rest_test_symt_t  *local;
+   // Set on each test that starts, from the last `.parallel` directive
+   size_t             parallel;
+   bool             (*fptr) (rest_test_t *rt, void *param);
+   void              *param;
+   // When staged, writes to the shared tables are collected here instead of
+   // being applied, so that the parse never modifies `parent` or `global`.
+   bool               staged;
+   struct write_t   **writes;
+   size_t             nwrites;
+   size_t             wsize;
+};
+
+static void parse_init (struct parse_t *p, rest_test_symt_t *parent, rest_test_arena_t *arena,
+                        bool (*fptr) (rest_test_t *, void *), void *param)
 {
-   FILE *inf = fopen (filename, "r");
-   if (!inf) {
-      return NULL;
+   memset (p, 0, sizeof *p);
+   p->parent = parent;
+   p->arena = arena;
+   p->fptr = fptr;
+   p->param = param;
+
+   // Find the topmost symbol table
+   p->global = parent;
+   while (rest_test_symt_parent (p->global)) {
+      p->global = rest_test_symt_parent (p->global);
+   }
+}
+
+static void parse_writes_del (struct parse_t *p)
+{
+   for (size_t i=0; i<p->nwrites; i++) {
+      free (p->writes[i]->symbol);
+      rest_test_token_del (&p->writes[i]->token);
+      free (p->writes[i]);
+   }
+   free (p->writes);
+   p->writes = NULL;
+   p->nwrites = 0;
+   p->wsize = 0;
+}
+
+// Applies a `.global` or `.parent` write to `symt`, or stages it for later.
+static bool parse_write (struct parse_t *p, rest_test_symt_t *symt,
+                         const char *symbol, rest_test_token_t *token)
+{
+   if (!symt)
+      return true;
+   if (!p->staged)
+      return rest_test_symt_add (symt, symbol, token);
+
+   struct write_t *w = calloc (1, sizeof *w);
+   if (!w || !(w->symbol = ds_str_dup (symbol)) || !(w->token = rest_test_token_dup (token))
+          || !(array_push ((void ***)&p->writes, &p->nwrites, &p->wsize, w))) {
+      if (w) {
+         free (w->symbol);
+         rest_test_token_del (&w->token);
+      }
+      free (w);
+      return false;
+   }
+   w->symt = symt;
+   return true;
+}
+
+// Hands the current test, if any, to the callback or appends it to the result.
+// Returns false if the test could not be stored or the callback asked to stop.
+static bool parse_emit (struct parse_t *p)
+{
+   rest_test_t *rt = p->current;
+   if (!rt)
+      return true;
+
+   p->current = NULL;
+   p->local = NULL;
+   if (p->fptr)
+      return p->fptr (rt, p->param);
+
+   if (!(array_push ((void ***)&p->ret, &p->nitems, &p->size, rt))) {
+      ERRORF ("OOM appending to array\n");
+      p->current = rt;
+      return false;
+   }
+   return true;
+}
+
+// Reads the next directive and its parameters from the lexer. Returns 1 when a
+// directive was read, 0 on EOF and -1 on error.
+static int lex_directive (rest_test_lexer_t *lexer, enum directive_t *directive,
+                          size_t *line_no, rest_test_token_t **ptokens)
+{
+   int ret = -1;
+   const char *source = rest_test_lexer_source (lexer);
+   rest_test_token_t *token = rest_test_lexer_next (lexer);
+   *line_no = rest_test_lexer_line_no (lexer);
+
+   enum rest_test_token_type_t type = rest_test_token_type (token);
+   size_t length = 0;
+   const char *slice = rest_test_token_slice (token, &length);
+   if (!token || type == token_NONE) {
+      ret = 0;
+      goto cleanup;
+   }
+   if (type == token_UNKNOWN) {
+      CLEANUP ("[%s:%zu] Unknown token type found\n", source, *line_no);
+   }
+   if (type != token_DIRECTIVE) {
+      CLEANUP ("Expected directive, found token of type '%s':[%s]\n",
+               rest_test_token_type_string (type), rest_test_token_value (token));
    }
-   rest_test_t **ret = rest_test_parse_stream (parent, inf, filename);
-   fclose (inf);
 
+   const struct prefix_t *info = directive_find (slice, length);
+   if (!info) {
+      CLEANUP ("Unhandled directive in [%s:%zu]: %s\n", source, *line_no,
+               rest_test_token_value (token));
+   }
+
+   for (size_t i=0; i<info->nparams; i++) {
+      ptokens[i] = rest_test_lexer_next (lexer);
+      *line_no = rest_test_lexer_line_no (lexer);
+      if (ptokens[i] == NULL) {
+         CLEANUP ("[%s:%zu] (%s) Expected parameter %zu, found NULL\n",
+                  source, *line_no, info->prefix, i+1);
+      }
+   }
+
+   *directive = info->directive;
+   ret = 1;
+cleanup:
+   rest_test_token_del (&token);
    return ret;
 }
 
-rest_test_t **rest_test_parse_stream (rest_test_symt_t *parent, FILE *inf, const char *source)
+static bool apply_directive (struct parse_t *p, enum directive_t directive,
+                             const char *source, size_t line_no,
+                             rest_test_token_t **ptokens)
 {
-   bool error = true;
-   size_t line_no = 1;
-   struct rest_test_token_t *token = NULL;
-   rest_test_t **ret = NULL;
-   size_t nitems = 0;
-   rest_test_t *current = NULL;
-   rest_test_symt_t *local = NULL;
-   rest_test_symt_t *global = parent;
-   // Used for whatever temporary strings are needed during execution
+   const char *pstrings[2] = {
+      rest_test_token_value (ptokens[0]),
+      rest_test_token_value (ptokens[1]),
+   };
+   const struct prefix_t *info = directive_info (directive);
+   for (size_t i=0; info && i<info->nparams; i++) {
+      if (ptokens[i] == NULL) {
+         ERRORF ("[%s:%zu] (%s) Expected parameter %zu, found NULL\n",
+                 source, line_no, info->prefix, i+1);
+         return false;
+      }
+   }
+
+   bool dispatch_code = false;
    char *tmp = NULL;
+   switch (directive) {
+      case directive_GLOBAL:
+         dispatch_code = parse_write (p, p->global, pstrings[0], ptokens[1]);
+         break;
 
-   // At most two parameters for a directive
-   struct rest_test_token_t *ptokens[2] = { NULL, NULL };
-   const char *pstrings[2] = { NULL, NULL };
+      case directive_PARENT:
+         dispatch_code = parse_write (p, p->parent, pstrings[0], ptokens[1]);
+         break;
 
-   // Find the topmost symbol table
-   while (rest_test_symt_parent (global)) {
-      global = rest_test_symt_parent (global);
-   }
-
-   // Read directive token, then dispatch an action based on the directive
-   while ((token = rest_test_token_next (inf, source, &line_no))) {
-      free (tmp);
-      tmp = NULL;
-      enum rest_test_token_type_t type = rest_test_token_type (token);
-      const char *value = rest_test_token_value (token);
-      if (type == token_UNKNOWN) {
-         CLEANUP ("[%s:%zu] Unknown token type found\n", source, line_no);
-      }
-      if (type == token_NONE) {
-         if (!(array_push ((void ***)&ret, &nitems, current))) {
-            CLEANUP ("OOM appending to array\n");
+      case directive_LOCAL:
+         if (p->current == NULL) {
+            ERRORF ("[%s:%zu] Directive [%s] only valid within a test\n",
+                    source, line_no, info->prefix);
+            return false;
+         }
+         dispatch_code = rest_test_symt_add (p->local, pstrings[0], ptokens[1]);
+         break;
+
+      case directive_TEST:
+         if (!(parse_emit (p))) {
+            return false;
+         }
+         p->current = rest_test_new_arena ("", source, line_no, p->parent, p->arena);
+         p->local = rest_test_symt (p->current);
+         if (!p->current || !p->local) {
+            ERRORF ("Failed to allocate new test [%s:%zu]: %s\n",
+                    source, line_no, pstrings[0]);
+            return false;
+         }
+         rest_test_set_name (p->current, pstrings[0]);
+         rest_test_set_parallel (p->current, p->parallel);
+         dispatch_code = true;
+         break;
+
+      case directive_METHOD:
+         dispatch_code = rest_test_req_set_method (p->current, ptokens[0]);
+         break;
+
+      case directive_URI:
+         dispatch_code = rest_test_req_set_uri (p->current, ptokens[0]);
+         break;
+
+      case directive_HTTP_VERSION:
+         dispatch_code = rest_test_req_set_http_version (p->current, ptokens[0]);
+         break;
+
+      case directive_HEADER:
+         if (!(tmp = ds_str_cat (pstrings[0], pstrings[1], NULL))) {
+            ERRORF ("[%s:%zu] OOM concatenating header value\n", source, line_no);
+            return false;
+         }
+         dispatch_code = rest_test_req_set_header (p->current, source, line_no, tmp);
+         free (tmp);
+         break;
+
+      case directive_BODY:
+         dispatch_code = rest_test_req_append_body (p->current, ptokens[0]);
+         break;
+
+      case directive_ASSERT:
+         // TODO: Read the assert
+         dispatch_code = true;
+         break;
+
+      case directive_PREFETCH:
+         dispatch_code = rest_test_prefetch_symbol (pstrings[0]);
+         break;
+
+      case directive_PARALLEL:
+         errno = 0;
+         p->parallel = (size_t)strtoul (pstrings[0], &tmp, 10);
+         if (errno || !isdigit ((unsigned char)*pstrings[0]) || *tmp || p->parallel == 0) {
+            ERRORF ("[%s:%zu] Invalid request count [%s]\n", source, line_no, pstrings[0]);
+            return false;
          }
-         current = NULL;
+         dispatch_code = true;
          break;
+
+      case directive_UNKNOWN:
+         break;
+   }
+
+   if (dispatch_code != true) {
+      ERRORF ("[%s:%zu]: dispatch on [%s] failed\n",
+              source, line_no, info ? info->prefix : "unknown directive");
+   }
+   return dispatch_code;
+}
+
+// Reads directives from either the lexer or the bundle reader. When `recorder`
+// is not NULL every directive read is also added to it. On failure, all tests
+// not yet handed to a callback are deleted.
+static bool parse_input (struct parse_t *p,
+                         rest_test_lexer_t *lexer,
+                         rest_test_bundle_reader_t *reader,
+                         rest_test_bundle_t *recorder)
+{
+   bool error = true;
+   const char *source = lexer
+      ? rest_test_lexer_source (lexer)
+      : rest_test_bundle_source (reader);
+   size_t line_no = 0;
+
+   // At most two parameters for a directive
+   rest_test_token_t *ptokens[2] = { NULL, NULL };
+
+   // Read a directive, then dispatch an action based on the directive
+   for (;;) {
+      enum directive_t directive = directive_UNKNOWN;
+      int rc;
+      if (lexer) {
+         rc = lex_directive (lexer, &directive, &line_no, ptokens);
+      } else {
+         unsigned op = 0;
+         rc = rest_test_bundle_next (reader, &op, &line_no, ptokens);
+         directive = directive_info ((enum directive_t)op)
+            ? (enum directive_t)op
+            : directive_UNKNOWN;
       }
-      if (type != token_DIRECTIVE) {
-         CLEANUP ("Expected directive, found token of type '%s':[%s]\n",
-                  rest_test_token_type_string (type), value);
+      if (rc == 0)
+         break;
+      if (rc < 0)
+         goto cleanup;
+
+      if (recorder) {
+         const struct prefix_t *info = directive_info (directive);
+         if (!(rest_test_bundle_add (recorder, directive, line_no,
+                                     info ? info->nparams : 0, ptokens))) {
+            CLEANUP ("[%s:%zu] OOM recording directive\n", source, line_no);
+         }
       }
 
+      if (!(apply_directive (p, directive, source, line_no, ptokens))) {
+         goto cleanup;
+      }
       rest_test_token_del (&ptokens[0]);
       rest_test_token_del (&ptokens[1]);
+   }
 
-#define CHECK_PARAMS(n)  \
-for (size_t i=0; i<n; i++) {\
-   if (ptokens[i] == NULL) {\
-      CLEANUP ("[%s:%zu] (%s) Expected parameter %zu, found NULL\n",\
-               source, line_no, value, i+1);\
-   }\
-}
+   if (!(parse_emit (p))) {
+      goto cleanup;
+   }
 
-#define GET_PARAMS(n)   \
-do {\
-   for (size_t i=0; i<n; i++) {\
-      ptokens[i] = rest_test_token_next (inf, source, &line_no);\
-      pstrings[i] = rest_test_token_value (ptokens[i]);\
-   }\
-   CHECK_PARAMS(n);\
-} while (0)
+   // Move the result into the arena too, so that deleting the arena releases
+   // everything that this parse allocated.
+   if (p->arena && !p->fptr) {
+      rest_test_t **pooled = rest_test_arena_alloc (p->arena, (sizeof *pooled) * (p->nitems + 1));
+      if (!pooled) {
+         CLEANUP ("OOM moving result array into arena\n");
+      }
+      if (p->ret) {
+         memcpy (pooled, p->ret, (sizeof *pooled) * p->nitems);
+      }
+      free (p->ret);
+      p->ret = pooled;
+      p->nitems = 0;
+      p->size = 0;
+   }
+
+   error = false;
+cleanup:
+   rest_test_token_del (&ptokens[0]);
+   rest_test_token_del (&ptokens[1]);
+   rest_test_del (&p->current);
 
-#define CHECK_CURRENT   \
-if (current == NULL) {\
-      CLEANUP ("[%s:%zu] Directive [%s] only valid within a test\n",\
-               source, line_no, rest_test_token_value (token));\
+   if (error) {
+      for (size_t i=0; p->ret && p->ret[i]; i++) {
+         rest_test_del (&p->ret[i]);
+      }
+      if (!p->arena) {
+         free (p->ret);
+      }
+      p->ret = NULL;
+      p->nitems = 0;
+      p->size = 0;
+   }
+
+   return !error;
 }
 
-      bool dispatch_code = false;
-      switch (directive_value (value)) {
-         case directive_GLOBAL:
-            GET_PARAMS(2);
-            dispatch_code = global
-               ? rest_test_symt_add (global, pstrings[0], ptokens[1])
-               : true;
-            break;
+// Collects all the tests into a NULL-terminated array
+static rest_test_t **parse_all (rest_test_symt_t *parent,
+                                rest_test_lexer_t *lexer,
+                                rest_test_bundle_reader_t *reader,
+                                rest_test_arena_t *arena,
+                                rest_test_bundle_t *recorder)
+{
+   struct parse_t p;
+   parse_init (&p, parent, arena, NULL, NULL);
+   return parse_input (&p, lexer, reader, recorder) ? p.ret : NULL;
+}
 
-         case directive_PARENT:
-            GET_PARAMS(2);
-            dispatch_code = parent
-               ? rest_test_symt_add (parent, pstrings[0], ptokens[1])
-               : true;
-            break;
+/* *********************************************************************************
+ * Parallel parsing. Each file is parsed by a worker into its own result array,
+ * with its `.global` and `.parent` writes staged; the workers share nothing but
+ * the index of the next file to take. Once every worker is done the calling
+ * thread applies the staged writes and joins the results in file order, which
+ * leaves the tables exactly as parsing the files one after another would.
+ */
 
-         case directive_LOCAL:
-            CHECK_CURRENT;
-            GET_PARAMS(2);
-            dispatch_code = rest_test_symt_add (local, pstrings[0], ptokens[1]);
-            break;
+struct job_t {
+   const char    *filename;
+   struct parse_t p;
+   bool           ok;
+};
 
-         case directive_TEST:
-            if (!(array_push ((void ***)&ret, &nitems, current))) {
-               CLEANUP ("OOM appending to array\n");
-            }
-            GET_PARAMS(1);
-            current = rest_test_new ("", source, line_no, parent);
-            local = rest_test_symt (current);
-            if (!current || ! local) {
-               CLEANUP ("Failed to allocate new test [%s:%zu]: %s\n",
-                        source, line_no, pstrings[0]);
-            }
-            rest_test_set_name (current, pstrings[0]);
-            dispatch_code = true;
-            break;
+struct pool_t {
+   pthread_mutex_t lock;
+   struct job_t   *jobs;
+   size_t          njobs;
+   size_t          next;
+   bool            failed;
+   // When not NULL, unchanged files are loaded from here
+   rest_test_cache_t *cache;
+};
 
-         case directive_METHOD:
-            GET_PARAMS(1);
-            dispatch_code = rest_test_req_set_method (current, ptokens[0]);
-            break;
+// Parses the job's file, through the cache if there is one
+static bool parse_job (struct job_t *job, rest_test_cache_t *cache)
+{
+   rest_test_bundle_reader_t *reader = rest_test_cache_open (cache, job->filename);
+   if (reader) {
+      bool ok = parse_input (&job->p, NULL, reader, NULL);
+      rest_test_bundle_close (&reader);
+      if (ok)
+         return true;
+      // Nothing of the failed load is kept
+      parse_writes_del (&job->p);
+      parse_init (&job->p, job->p.parent, NULL, NULL, NULL);
+      job->p.staged = true;
+   }
 
-         case directive_URI:
-            GET_PARAMS(1);
-            dispatch_code = rest_test_req_set_uri (current, ptokens[0]);
-            break;
+   rest_test_lexer_t *lexer = rest_test_lexer_new_file (job->filename);
+   rest_test_bundle_t *recorder = lexer ? rest_test_cache_record (cache, job->filename) : NULL;
+   bool ret = lexer && parse_input (&job->p, lexer, NULL, recorder);
+   if (ret) {
+      rest_test_cache_store (cache, job->filename, &recorder);
+   }
+   rest_test_bundle_del (&recorder);
+   rest_test_lexer_del (&lexer);
+   return ret;
+}
 
-         case directive_HTTP_VERSION:
-            GET_PARAMS(1);
-            dispatch_code = rest_test_req_set_http_version (current, ptokens[0]);
-            break;
+static void *parse_worker (void *arg)
+{
+   struct pool_t *pool = arg;
+
+   for (;;) {
+      pthread_mutex_lock (&pool->lock);
+      // After a failure the remaining files are not worth parsing
+      size_t i = pool->failed ? pool->njobs : pool->next++;
+      pthread_mutex_unlock (&pool->lock);
+      if (i >= pool->njobs)
+         break;
 
-         case directive_HEADER:
-            GET_PARAMS(2);
-            if (!(tmp = ds_str_cat (pstrings[0], pstrings[1], NULL))) {
-               CLEANUP ("[%s:%zu] OOM concatenating header value\n", source, line_no);
-            }
-            dispatch_code = rest_test_req_set_header (current, source, line_no, tmp);
-            free (tmp);
-            tmp = NULL;
-            break;
+      struct job_t *job = &pool->jobs[i];
+      job->ok = parse_job (job, pool->cache);
 
-         case directive_BODY:
-            GET_PARAMS(1);
-            dispatch_code = rest_test_req_append_body (current, ptokens[0]);
-            break;
+      if (!job->ok) {
+         ERRORF ("Failed to parse [%s]\n", job->filename);
+         pthread_mutex_lock (&pool->lock);
+         pool->failed = true;
+         pthread_mutex_unlock (&pool->lock);
+      }
+   }
+   return NULL;
+}
 
-         case directive_ASSERT:
-            GET_PARAMS(1);
-            // TODO: Read the assert
-            break;
+// What a staged write replaced: the table's own value, or NULL if it had none
+struct undo_t {
+   rest_test_symt_t  *symt;
+   const char        *symbol;
+   rest_test_token_t *token;
+};
+
+// Applies the staged writes of every job, or none of them: if one fails, those
+// already applied are undone, latest first, so that each symbol gets back the
+// value it had before the merge.
+static bool parse_apply (struct job_t *jobs, size_t njobs)
+{
+   size_t nwrites = 0;
+   for (size_t i=0; i<njobs; i++) {
+      nwrites += jobs[i].p.nwrites;
+   }
 
-         case directive_UNKNOWN:
-            CLEANUP ("Unhandled directive in [%s:%zu]: %s\n",
-                     source, line_no, rest_test_token_value (token));
+   struct undo_t *undo = calloc (nwrites + 1, sizeof *undo);
+   if (!undo) {
+      ERRORF ("OOM recording %zu writes\n", nwrites);
+      return false;
+   }
+
+   bool error = false;
+   size_t nundo = 0;
+   for (size_t i=0; !error && i<njobs; i++) {
+      struct parse_t *p = &jobs[i].p;
+      for (size_t j=0; !error && j<p->nwrites; j++) {
+         struct write_t *w = p->writes[j];
+         const rest_test_token_t *prev = rest_test_symt_own_value (w->symt, w->symbol);
+         struct undo_t *u = &undo[nundo];
+         u->symt = w->symt;
+         u->symbol = w->symbol;
+         if ((prev && !(u->token = rest_test_token_dup (prev)))
+               || !(rest_test_symt_add (w->symt, w->symbol, w->token))) {
+            ERRORF ("[%s:%zu] Failed to set [%s]\n", rest_test_token_source (w->token),
+                    rest_test_token_line_no (w->token), w->symbol);
+            rest_test_token_del (&u->token);
+            error = true;
             break;
+         }
+         nundo++;
       }
+   }
+
+   while (nundo--) {
+      struct undo_t *u = &undo[nundo];
+      if (error && !u->token) {
+         rest_test_symt_clear (u->symt, u->symbol);
+      }
+      if (error && u->token && !(rest_test_symt_add (u->symt, u->symbol, u->token))) {
+         ERRORF ("[%s] Failed to restore [%s]\n", rest_test_symt_name (u->symt), u->symbol);
+      }
+      rest_test_token_del (&u->token);
+   }
+   free (undo);
+   return !error;
+}
+
+// Applies the staged writes and moves the tests of each job into one array
+static rest_test_t **parse_merge (struct job_t *jobs, size_t njobs)
+{
+   size_t ntests = 0;
+   for (size_t i=0; i<njobs; i++) {
+      ntests += jobs[i].p.nitems;
+   }
+
+   rest_test_t **ret = calloc (ntests + 1, sizeof *ret);
+   if (!ret) {
+      ERRORF ("OOM joining results of %zu files\n", njobs);
+      return NULL;
+   }
+
+   if (!(parse_apply (jobs, njobs))) {
+      free (ret);
+      return NULL;
+   }
 
-      if (dispatch_code != true) {
-         CLEANUP ("[%s:%zu]: dispatch on [%s] failed\n",
-                  source, line_no, rest_test_token_value (token));
+   size_t n = 0;
+   for (size_t i=0; i<njobs; i++) {
+      struct parse_t *p = &jobs[i].p;
+      for (size_t j=0; j<p->nitems; j++) {
+         ret[n++] = p->ret[j];
       }
-      rest_test_token_del (&token);
+      free (p->ret);
+      p->ret = NULL;
+      p->nitems = 0;
+   }
+   return ret;
+}
+
+/* *********************************************************************************
+ * Public functions.
+ */
+
+rest_test_t **rest_test_parse_file (rest_test_symt_t *parent, const char *filename)
+{
+   return rest_test_parse_file_arena (parent, filename, NULL);
+}
+
+rest_test_t **rest_test_parse_stream (rest_test_symt_t *parent, FILE *inf, const char *source)
+{
+   return rest_test_parse_stream_arena (parent, inf, source, NULL);
+}
+
+rest_test_t **rest_test_parse_file_arena (rest_test_symt_t *parent, const char *filename,
+                                          rest_test_arena_t *arena)
+{
+   rest_test_lexer_t *lexer = rest_test_lexer_new_file (filename);
+   if (!lexer) {
+      return NULL;
    }
+   rest_test_lexer_set_arena (lexer, arena);
+   rest_test_t **ret = parse_all (parent, lexer, NULL, arena, NULL);
+   rest_test_lexer_del (&lexer);
+
+   return ret;
+}
 
-   if (!(array_push ((void ***)&ret, &nitems, current))) {
-      CLEANUP ("OOM appending to array\n");
+rest_test_t **rest_test_parse_stream_arena (rest_test_symt_t *parent, FILE *inf,
+                                            const char *source, rest_test_arena_t *arena)
+{
+   rest_test_lexer_t *lexer = rest_test_lexer_new_stream (inf, source);
+   if (!lexer) {
+      return NULL;
    }
-   current = NULL;
+   rest_test_lexer_set_arena (lexer, arena);
+   rest_test_t **ret = parse_all (parent, lexer, NULL, arena, NULL);
+   rest_test_lexer_del (&lexer);
 
+   return ret;
+}
+
+bool rest_test_parse_compile (const char *filename, const char *bundle)
+{
+   bool error = true;
+   rest_test_lexer_t *lexer = rest_test_lexer_new_file (filename);
+   rest_test_bundle_t *recorder = rest_test_bundle_new (filename);
+   // The symbol writes are recorded, so the tables only need to absorb them
+   rest_test_symt_t *scratch = rest_test_symt_new ("compile", NULL, 8);
+   rest_test_t **rts = NULL;
+
+   if (!lexer || !recorder || !scratch) {
+      CLEANUP ("Failed to open [%s] for compiling\n", filename);
+   }
+
+   // Identify the source before it is read, so that a change made while it is
+   // being compiled makes the bundle stale rather than wrong.
+   if (!(rest_test_bundle_set_origin (recorder, filename))) {
+      goto cleanup;
+   }
+
+   if (!(rts = parse_all (scratch, lexer, NULL, NULL, recorder))) {
+      CLEANUP ("Failed to parse [%s], no bundle written\n", filename);
+   }
+
+   if (!(rest_test_bundle_write (recorder, bundle))) {
+      CLEANUP ("Failed to write bundle [%s]\n", bundle);
+   }
 
    error = false;
 cleanup:
-   free (tmp);
-   rest_test_token_del (&token);
-   rest_test_token_del (&ptokens[0]);
-   rest_test_token_del (&ptokens[1]);
-   rest_test_del (&current);
+   for (size_t i=0; rts && rts[i]; i++) {
+      rest_test_del (&rts[i]);
+   }
+   free (rts);
+   rest_test_symt_del (&scratch);
+   rest_test_bundle_del (&recorder);
+   rest_test_lexer_del (&lexer);
+   return !error;
+}
 
-   if (error) {
-      for (size_t i=0; ret && ret[i]; i++) {
-         rest_test_del (&ret[i]);
-      }
-      free (ret);
-      ret = NULL;
+rest_test_t **rest_test_parse_bundle (rest_test_symt_t *parent, const char *bundle)
+{
+   rest_test_bundle_reader_t *reader = rest_test_bundle_open (bundle);
+   if (!reader) {
+      return NULL;
+   }
+   rest_test_t **ret = rest_test_parse_reader (parent, reader);
+   rest_test_bundle_close (&reader);
+
+   return ret;
+}
+
+rest_test_t **rest_test_parse_reader (rest_test_symt_t *parent,
+                                      rest_test_bundle_reader_t *reader)
+{
+   return reader ? parse_all (parent, NULL, reader, NULL, NULL) : NULL;
+}
+
+rest_test_t **rest_test_parse_file_recorded (rest_test_symt_t *parent, const char *filename,
+                                             rest_test_bundle_t *recorder)
+{
+   rest_test_lexer_t *lexer = rest_test_lexer_new_file (filename);
+   if (!lexer) {
+      return NULL;
    }
+   rest_test_t **ret = parse_all (parent, lexer, NULL, NULL, recorder);
+   rest_test_lexer_del (&lexer);
 
    return ret;
 }
 
+bool rest_test_parse_file_each (rest_test_symt_t *parent, const char *filename,
+                                bool (*fptr) (rest_test_t *rt, void *param), void *param)
+{
+   rest_test_lexer_t *lexer = rest_test_lexer_new_file (filename);
+   if (!lexer || !fptr) {
+      rest_test_lexer_del (&lexer);
+      return false;
+   }
+   struct parse_t p;
+   parse_init (&p, parent, NULL, fptr, param);
+   bool ret = parse_input (&p, lexer, NULL, NULL);
+   rest_test_lexer_del (&lexer);
+
+   return ret;
+}
+
+bool rest_test_parse_stream_each (rest_test_symt_t *parent, FILE *inf, const char *source,
+                                  bool (*fptr) (rest_test_t *rt, void *param), void *param)
+{
+   rest_test_lexer_t *lexer = rest_test_lexer_new_incremental (inf, source);
+   if (!lexer || !fptr) {
+      rest_test_lexer_del (&lexer);
+      return false;
+   }
+   struct parse_t p;
+   parse_init (&p, parent, NULL, fptr, param);
+   bool ret = parse_input (&p, lexer, NULL, NULL);
+   rest_test_lexer_del (&lexer);
+
+   return ret;
+}
+
+rest_test_t **rest_test_parse_files (rest_test_symt_t *parent,
+                                     const char *const *filenames, size_t nfiles,
+                                     size_t nthreads)
+{
+   return rest_test_cache_parse_files (NULL, parent, filenames, nfiles, nthreads);
+}
+
+rest_test_t **rest_test_cache_parse_files (rest_test_cache_t *cache,
+                                           rest_test_symt_t *parent,
+                                           const char *const *filenames, size_t nfiles,
+                                           size_t nthreads)
+{
+   rest_test_t **ret = NULL;
+   struct pool_t pool;
+   pthread_t *threads = NULL;
+   size_t nstarted = 0;
+
+   memset (&pool, 0, sizeof pool);
+   if ((pthread_mutex_init (&pool.lock, NULL)) != 0) {
+      ERRORF ("Failed to initialise worker pool: %m\n");
+      return NULL;
+   }
+
+   if (nthreads == 0) {
+      long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+      nthreads = ncpus > 0 ? (size_t)ncpus : 1;
+   }
+   if (nthreads > nfiles)
+      nthreads = nfiles;
+
+   if (!(pool.jobs = calloc (nfiles + 1, sizeof *pool.jobs))
+         || (nthreads && !(threads = calloc (nthreads, sizeof *threads)))) {
+      CLEANUP ("OOM allocating %zu parse jobs\n", nfiles);
+   }
+   pool.njobs = nfiles;
+   pool.cache = cache;
+   for (size_t i=0; i<nfiles; i++) {
+      pool.jobs[i].filename = filenames[i];
+      parse_init (&pool.jobs[i].p, parent, NULL, NULL, NULL);
+      pool.jobs[i].p.staged = true;
+   }
+
+   // The calling thread is one of the workers. If a thread cannot be started
+   // the files are shared among those that were.
+   for (size_t i=1; i<nthreads; i++) {
+      if ((pthread_create (&threads[nstarted], NULL, parse_worker, &pool)) != 0) {
+         ERRORF ("Failed to start parse worker: %m\n");
+         break;
+      }
+      nstarted++;
+   }
+   parse_worker (&pool);
+   for (size_t i=0; i<nstarted; i++) {
+      pthread_join (threads[i], NULL);
+   }
+
+   if (pool.failed) {
+      goto cleanup;
+   }
+
+   ret = parse_merge (pool.jobs, nfiles);
+
+cleanup:
+   for (size_t i=0; pool.jobs && i<nfiles; i++) {
+      struct parse_t *p = &pool.jobs[i].p;
+      for (size_t j=0; j<p->nitems; j++) {
+         rest_test_del (&p->ret[j]);
+      }
+      free (p->ret);
+      parse_writes_del (p);
+   }
+   free (pool.jobs);
+   free (threads);
+   pthread_mutex_destroy (&pool.lock);
+   return ret;
+}
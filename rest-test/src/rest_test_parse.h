@@ -9,6 +9,73 @@ extern "C" {
    rest_test_t **rest_test_parse_file (rest_test_symt_t *parent, const char *filename);
    rest_test_t **rest_test_parse_stream (rest_test_symt_t *parent, FILE *inf, const char *source);
 
+   // Streaming parse: instead of collecting the tests into an array, each test
+   // is passed to `fptr` as soon as it is complete (when the next test starts, or
+   // at the end of the input). The callback owns the test and must delete it
+   // with rest_test_del(); returning false stops the parse. The stream variant
+   // reads the stream one token at a time, so memory stays bounded however many
+   // tests the input holds.
+   //
+   // As the tests are handed over while the parse is still running, `.global` and
+   // `.parent` writes that appear later in the input are not yet visible when a
+   // test is handed over.
+   //
+   // Returns true if the whole input was parsed and no callback stopped it.
+   bool rest_test_parse_file_each (rest_test_symt_t *parent, const char *filename,
+                                   bool (*fptr) (rest_test_t *rt, void *param), void *param);
+   bool rest_test_parse_stream_each (rest_test_symt_t *parent, FILE *inf, const char *source,
+                                     bool (*fptr) (rest_test_t *rt, void *param), void *param);
+
+   // Parse `nfiles` files on up to `nthreads` threads (0 uses one per online CPU),
+   // returning all their tests in a single array, in file order. Each file is
+   // parsed on its own, and the `.global` and `.parent` writes are applied once
+   // all the files are parsed, in file order, so the tables end up as they would
+   // after calling rest_test_parse_file() on each file in turn. The shared tables
+   // are not touched while the workers run.
+   //
+   // If any file fails to parse, NULL is returned and no writes are applied.
+   // If a write fails, or a hook refuses it, the writes already applied are
+   // undone, so the tables again hold what they held before the call; the undo
+   // is itself a series of writes, which hooks observe.
+   rest_test_t **rest_test_parse_files (rest_test_symt_t *parent,
+                                        const char *const *filenames, size_t nfiles,
+                                        size_t nthreads);
+
+   // As above, but the tests, their tokens and headers, and the returned array
+   // are all allocated from the arena: rest_test_arena_del() releases the lot,
+   // and the caller must not free the returned array.
+   rest_test_t **rest_test_parse_file_arena (rest_test_symt_t *parent, const char *filename,
+                                             rest_test_arena_t *arena);
+   rest_test_t **rest_test_parse_stream_arena (rest_test_symt_t *parent, FILE *inf,
+                                               const char *source, rest_test_arena_t *arena);
+
+   // Compile the source file into a bundle (see rest_test_bundle.h). The `.global`
+   // and `.parent` writes are recorded in the bundle rather than applied. Returns
+   // false, and writes nothing, if the source does not parse.
+   bool rest_test_parse_compile (const char *filename, const char *bundle);
+
+   // Load a compiled bundle, returning the same tests that parsing the source
+   // would, and applying its `.global` and `.parent` writes to `parent` and its
+   // topmost ancestor. Returns NULL if the bundle cannot be loaded.
+   rest_test_t **rest_test_parse_bundle (rest_test_symt_t *parent, const char *bundle);
+
+   // As rest_test_parse_bundle(), but from a bundle that is already open. The
+   // reader is consumed and must be closed by the caller.
+   rest_test_t **rest_test_parse_reader (rest_test_symt_t *parent,
+                                         rest_test_bundle_reader_t *reader);
+
+   // As rest_test_parse_file(), also recording every directive read into the
+   // bundle, so that the parse and the compile happen in a single pass.
+   rest_test_t **rest_test_parse_file_recorded (rest_test_symt_t *parent, const char *filename,
+                                                rest_test_bundle_t *recorder);
+
+   // The directives that the parser recognises, as written (".global"): the
+   // `n`th, or NULL when `n` is past the last.
+   const char *rest_test_parse_directive_name (size_t n);
+
+   // Whether `word` is exactly one of the directives
+   bool rest_test_parse_is_directive (const char *word);
+
 
 #ifdef __cplusplus
 };
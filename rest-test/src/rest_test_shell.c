@@ -0,0 +1,723 @@
+// pipe2() and O_CLOEXEC, so that a pipe is never inherited by a command
+// spawned on another thread
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include "ds_hmap.h"
+
+#include "rest_test_arena.h"
+#include "rest_test_token.h"
+#include "rest_test_symt.h"
+#include "rest_test.h"
+#include "rest_test_shell.h"
+
+#define CLEANUP(...) \
+do {\
+   ERRORF(__VA_ARGS__);\
+   goto cleanup;\
+} while (0)
+
+#define SHELL_BLOCK        (4096)
+
+// A cached result. The command is stored with it, as the key.
+struct entry_t {
+   char             *output;
+   double            stamp;      // When the command was run
+   size_t            scope;      // The test that ran it
+   char              command[];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static ds_hmap_t *cache;         // command -> struct entry_t *
+static struct entry_t **entries;
+static size_t nentries;
+static size_t size;
+
+static enum rest_test_shell_policy_t policy = rest_test_shell_ALWAYS;
+static double ttl;
+static size_t hits;
+static size_t misses;
+
+// Tests are numbered as they start, on whichever thread
+static size_t nscopes;
+static __thread size_t scope;
+static __thread const void *current;
+
+// A command started ahead of the test that will use its output. Each test
+// takes its own commands in the order that they were started.
+struct prefetch_t {
+   struct prefetch_t *next;
+   const void        *test;
+   pid_t              pid;
+   int                fd;
+   char               command[];
+};
+
+static struct prefetch_t *prefetches;
+static struct prefetch_t **prefetches_tail = &prefetches;
+static size_t nprefetched;
+
+// A shell kept running to execute commands, one per thread that runs any. It
+// reads commands from, and writes their output to, one end of a socket pair;
+// unlike a pipe, writing to a socket whose shell has died does not raise
+// SIGPIPE.
+struct coproc_t {
+   pid_t             pid;
+   int               fd;
+   size_t            slen;
+   char              sentinel[96];
+};
+
+static bool persistent;
+static pthread_once_t coproc_once = PTHREAD_ONCE_INIT;
+static pthread_key_t coproc_key;
+static bool coproc_keyed;
+
+
+static double now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int wait_status (pid_t pid)
+{
+   int wstatus = -1;
+   while ((waitpid (pid, &wstatus, 0)) < 0 && errno == EINTR)
+      ;
+   return WIFEXITED (wstatus) ? WEXITSTATUS (wstatus)
+        : WIFSIGNALED (wstatus) ? 128 + WTERMSIG (wstatus)
+        : -1;
+}
+
+static void coproc_del (void *ptr)
+{
+   struct coproc_t *coproc = ptr;
+   if (!coproc)
+      return;
+   // The shell exits when its input is closed
+   close (coproc->fd);
+   wait_status (coproc->pid);
+   free (coproc);
+}
+
+static void coproc_init (void)
+{
+   coproc_keyed = (pthread_key_create (&coproc_key, coproc_del)) == 0;
+}
+
+// Returns the calling thread's shell, starting it if necessary
+static struct coproc_t *coproc_get (void)
+{
+   extern char **environ;
+   bool error = true;
+   struct coproc_t *ret = NULL;
+   int fds[2] = { -1, -1 };
+   posix_spawn_file_actions_t actions;
+   bool actions_init = false;
+
+   pthread_once (&coproc_once, coproc_init);
+   if (!coproc_keyed) {
+      ERRORF ("Failed to create the shell key\n");
+      return NULL;
+   }
+   if ((ret = pthread_getspecific (coproc_key)))
+      return ret;
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      CLEANUP ("OOM starting shell\n");
+   }
+   ret->pid = -1;
+
+   if ((socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) != 0
+         || (errno = posix_spawn_file_actions_init (&actions)) != 0) {
+      CLEANUP ("Failed to prepare shell: %m\n");
+   }
+   actions_init = true;
+   if ((errno = posix_spawn_file_actions_adddup2 (&actions, fds[1], STDIN_FILENO)) != 0
+         || (errno = posix_spawn_file_actions_adddup2 (&actions, fds[1], STDOUT_FILENO)) != 0) {
+      CLEANUP ("Failed to prepare shell: %m\n");
+   }
+   char *argv[] = { "sh", "-s", NULL };
+   if ((errno = posix_spawn (&ret->pid, "/bin/sh", &actions, NULL, argv, environ)) != 0) {
+      ret->pid = -1;
+      CLEANUP ("Failed to start shell: %m\n");
+   }
+   ret->fd = fds[0];
+
+   // Marks the end of each command's output; nothing a command prints is
+   // expected to contain it
+   struct timespec ts;
+   clock_gettime (CLOCK_REALTIME, &ts);
+   int n = snprintf (ret->sentinel, sizeof ret->sentinel, "__rest_test_%ld_%lx_%lx__",
+                     (long)getpid (), (unsigned long)ts.tv_nsec, (unsigned long)(size_t)ret);
+   ret->slen = (size_t)n;
+
+   if ((errno = pthread_setspecific (coproc_key, ret)) != 0) {
+      CLEANUP ("Failed to store shell: %m\n");
+   }
+
+   error = false;
+cleanup:
+   if (fds[1] >= 0)
+      close (fds[1]);
+   if (actions_init)
+      posix_spawn_file_actions_destroy (&actions);
+   if (error) {
+      // Closing the shell's input ends it
+      if (fds[0] >= 0)
+         close (fds[0]);
+      if (ret && ret->pid > 0)
+         wait_status (ret->pid);
+      free (ret);
+      ret = NULL;
+   }
+   return ret;
+}
+
+// Sends the whole of `data` to the shell
+static bool coproc_send (struct coproc_t *coproc, const char *data, size_t length)
+{
+   while (length) {
+      ssize_t nbytes = send (coproc->fd, data, length, MSG_NOSIGNAL);
+      if (nbytes < 0 && errno == EINTR)
+         continue;
+      if (nbytes < 0)
+         return false;
+      data += nbytes;
+      length -= (size_t)nbytes;
+   }
+   return true;
+}
+
+// Finds the end of a command's output: a newline, the sentinel, a space, the
+// exit status and a newline at the end of the `length` bytes read so far.
+static bool coproc_done (const struct coproc_t *coproc, const char *buffer,
+                         size_t length, size_t *end, int *status)
+{
+   if (length < coproc->slen + 4 || buffer[length - 1] != '\n')
+      return false;
+
+   size_t digits = length - 1;
+   while (digits > 0 && isdigit ((unsigned char)buffer[digits - 1]))
+      digits--;
+   if (digits == length - 1 || digits < coproc->slen + 2 || buffer[digits - 1] != ' ')
+      return false;
+
+   size_t start = digits - 1 - coproc->slen;
+   if (buffer[start - 1] != '\n' || (memcmp (&buffer[start], coproc->sentinel, coproc->slen)) != 0)
+      return false;
+
+   *end = start - 1;
+   *status = atoi (&buffer[digits]);
+   return true;
+}
+
+// Runs `command` in the calling thread's shell. Each command runs in a subshell
+// of it, so that `cd`, `exit` and variables do not carry over to the next, and
+// through eval, so that a syntax error fails the command and not the shell.
+// The command's input is /dev/null: the shell's input carries the commands.
+static bool coproc_run (const char *command, char **output, int *status)
+{
+   bool error = true;
+   struct coproc_t *coproc = NULL;
+   char *frame = NULL;
+   char *buffer = NULL;
+   size_t length = 0, bufsize = 0;
+   size_t end = 0;
+   int code = -1;
+
+   *output = NULL;
+   if (status)
+      *status = -1;
+
+   if (!(coproc = coproc_get ()))
+      return false;
+
+   // ( eval 'command' ) </dev/null; printf '\n%s %d\n' sentinel $?
+   // with each ' in the command written as '\''
+   size_t clen = strlen (command);
+   size_t nquotes = 0;
+   for (size_t i=0; i<clen; i++) {
+      nquotes += command[i] == '\'';
+   }
+   size_t flen = clen + nquotes * 3 + coproc->slen + 64;
+   if (!(frame = malloc (flen))) {
+      CLEANUP ("OOM error executing [%s]\n", command);
+   }
+   char *dst = frame;
+   dst += sprintf (dst, "( eval '");
+   for (size_t i=0; i<clen; i++) {
+      if (command[i] == '\'') {
+         memcpy (dst, "'\\''", 4);
+         dst += 4;
+      } else {
+         *dst++ = command[i];
+      }
+   }
+   dst += sprintf (dst, "' ) </dev/null; printf '\\n%%s %%d\\n' %s $?\n", coproc->sentinel);
+
+   if (!(coproc_send (coproc, frame, (size_t)(dst - frame)))) {
+      CLEANUP ("Failed to send [%s] to the shell: %m\n", command);
+   }
+
+   for (;;) {
+      if (bufsize - length < SHELL_BLOCK) {
+         size_t newsize = bufsize ? bufsize * 2 : SHELL_BLOCK;
+         char *tmp = realloc (buffer, newsize);
+         if (!tmp) {
+            CLEANUP ("OOM error executing [%s]\n", command);
+         }
+         buffer = tmp;
+         bufsize = newsize;
+      }
+      ssize_t nbytes = recv (coproc->fd, &buffer[length], bufsize - length - 1, 0);
+      if (nbytes < 0 && errno == EINTR)
+         continue;
+      if (nbytes < 0) {
+         CLEANUP ("Failed reading output of [%s]: %m\n", command);
+      }
+      if (nbytes == 0) {
+         CLEANUP ("Shell exited while executing [%s]\n", command);
+      }
+      length += (size_t)nbytes;
+      if (coproc_done (coproc, buffer, length, &end, &code))
+         break;
+   }
+   buffer[end] = 0;
+
+   if (status)
+      *status = code;
+   error = code != 0;
+   coproc = NULL;
+
+cleanup:
+   if (coproc) {
+      // The shell is in an unknown state; the next command starts another
+      pthread_setspecific (coproc_key, NULL);
+      coproc_del (coproc);
+   }
+   free (frame);
+   if (error) {
+      free (buffer);
+      buffer = NULL;
+   }
+   *output = buffer;
+   return !error;
+}
+
+// Starts `command` in a shell of its own, with its output to the pipe `*fd`
+static bool spawn_start (const char *command, pid_t *pid, int *fd)
+{
+   extern char **environ;
+   bool error = true;
+   int fds[2] = { -1, -1 };
+   posix_spawn_file_actions_t actions;
+   bool actions_init = false;
+
+   *pid = -1;
+   *fd = -1;
+   if ((pipe2 (fds, O_CLOEXEC)) != 0) {
+      CLEANUP ("Failed to create pipe for [%s]: %m\n", command);
+   }
+   if ((errno = posix_spawn_file_actions_init (&actions)) != 0) {
+      CLEANUP ("Failed to prepare [%s]: %m\n", command);
+   }
+   actions_init = true;
+   if ((errno = posix_spawn_file_actions_adddup2 (&actions, fds[1], STDOUT_FILENO)) != 0) {
+      CLEANUP ("Failed to prepare [%s]: %m\n", command);
+   }
+
+   char *argv[] = { "sh", "-c", (char *)command, NULL };
+   if ((errno = posix_spawn (pid, "/bin/sh", &actions, NULL, argv, environ)) != 0) {
+      *pid = -1;
+      CLEANUP ("Failed to execute [%s]: %m\n", command);
+   }
+   *fd = fds[0];
+   fds[0] = -1;
+
+   error = false;
+cleanup:
+   if (fds[0] >= 0)
+      close (fds[0]);
+   if (fds[1] >= 0)
+      close (fds[1]);
+   if (actions_init)
+      posix_spawn_file_actions_destroy (&actions);
+   return !error;
+}
+
+// Reads the output of a command started by spawn_start() until it closes its
+// end of the pipe, and waits for it
+static bool spawn_finish (const char *command, pid_t pid, int fd, char **output, int *status)
+{
+   bool error = true;
+   char *buffer = NULL;
+   size_t length = 0, bufsize = 0;
+
+   *output = NULL;
+   if (status)
+      *status = -1;
+
+   for (;;) {
+      if (bufsize - length < SHELL_BLOCK) {
+         size_t newsize = bufsize ? bufsize * 2 : SHELL_BLOCK;
+         char *tmp = realloc (buffer, newsize);
+         if (!tmp) {
+            CLEANUP ("OOM error executing [%s]\n", command);
+         }
+         buffer = tmp;
+         bufsize = newsize;
+      }
+      ssize_t nbytes = read (fd, &buffer[length], bufsize - length - 1);
+      if (nbytes < 0 && errno == EINTR)
+         continue;
+      if (nbytes < 0) {
+         CLEANUP ("Failed reading output of [%s]: %m\n", command);
+      }
+      if (nbytes == 0)
+         break;
+      length += (size_t)nbytes;
+   }
+   buffer[length] = 0;
+
+   error = false;
+cleanup:
+   close (fd);
+   int code = wait_status (pid);
+   if (status)
+      *status = code;
+   if (code != 0)
+      error = true;
+
+   if (error) {
+      free (buffer);
+      buffer = NULL;
+   }
+   *output = buffer;
+   return !error;
+}
+
+// Runs `command` in a shell of its own
+static bool spawn_run (const char *command, char **output, int *status)
+{
+   pid_t pid;
+   int fd;
+
+   *output = NULL;
+   if (status)
+      *status = -1;
+   if (!(spawn_start (command, &pid, &fd)))
+      return false;
+   return spawn_finish (command, pid, fd, output, status);
+}
+
+bool rest_test_shell_run (const char *command, char **output, int *status)
+{
+   if (__atomic_load_n (&persistent, __ATOMIC_RELAXED))
+      return coproc_run (command, output, status);
+   return spawn_run (command, output, status);
+}
+
+void rest_test_shell_set_persistent (bool enable)
+{
+   __atomic_store_n (&persistent, enable, __ATOMIC_RELAXED);
+}
+
+void rest_test_shell_stop (void)
+{
+   pthread_once (&coproc_once, coproc_init);
+   if (!coproc_keyed)
+      return;
+   struct coproc_t *coproc = pthread_getspecific (coproc_key);
+   pthread_setspecific (coproc_key, NULL);
+   coproc_del (coproc);
+}
+
+// Returns a copy of the cached output of `command`, if the policy allows it to
+// be reused. Called with the lock held.
+static bool cache_find (const char *command, char **output)
+{
+   struct entry_t *entry = NULL;
+   if (!cache || !(ds_hmap_get_str_ptr (cache, command, (void **)&entry)))
+      return false;
+
+   if ((policy == rest_test_shell_TEST && entry->scope != scope)
+         || (policy == rest_test_shell_TTL && now () - entry->stamp >= ttl))
+      return false;
+
+   size_t length = strlen (entry->output);
+   if (!(*output = malloc (length + 1)))
+      return false;
+   memcpy (*output, entry->output, length + 1);
+   return true;
+}
+
+// Stores the output of `command`, replacing any earlier result. The cache is
+// an optimisation only, so failing to store a result is not an error. Called
+// with the lock held.
+static void cache_store (const char *command, const char *output)
+{
+   struct entry_t *entry = NULL;
+   char *copy = NULL;
+   size_t olen = strlen (output);
+
+   if (!(copy = malloc (olen + 1)))
+      return;
+   memcpy (copy, output, olen + 1);
+
+   if (!cache && !(cache = ds_hmap_new (64))) {
+      free (copy);
+      return;
+   }
+
+   if (!(ds_hmap_get_str_ptr (cache, command, (void **)&entry))) {
+      if (nentries == size) {
+         size_t newsize = size ? size * 2 : 16;
+         struct entry_t **tmp = realloc (entries, newsize * sizeof *tmp);
+         if (!tmp) {
+            free (copy);
+            return;
+         }
+         entries = tmp;
+         size = newsize;
+      }
+      size_t clen = strlen (command);
+      if (!(entry = malloc (sizeof *entry + clen + 1))) {
+         free (copy);
+         return;
+      }
+      memcpy (entry->command, command, clen + 1);
+      entry->output = NULL;
+      if (!(ds_hmap_set_str_ptr (cache, entry->command, entry))) {
+         free (entry);
+         free (copy);
+         return;
+      }
+      entries[nentries++] = entry;
+   }
+
+   free (entry->output);
+   entry->output = copy;
+   entry->stamp = now ();
+   entry->scope = scope;
+}
+
+// Removes from the queue the first command that `test` started as `command`,
+// or every command that `test` started when `command` is NULL, or every
+// command when `test` is also NULL. Called with the lock held.
+static struct prefetch_t *prefetch_take (const void *test, const char *command)
+{
+   struct prefetch_t *ret = NULL, **rtail = &ret;
+   struct prefetch_t **link = &prefetches;
+   while (*link) {
+      struct prefetch_t *prefetch = *link;
+      if ((test && prefetch->test != test)
+            || (command && (strcmp (prefetch->command, command)) != 0)) {
+         link = &prefetch->next;
+         continue;
+      }
+      *link = prefetch->next;
+      prefetch->next = NULL;
+      *rtail = prefetch;
+      rtail = &prefetch->next;
+      if (command)
+         break;
+   }
+   prefetches_tail = &prefetches;
+   while (*prefetches_tail)
+      prefetches_tail = &(*prefetches_tail)->next;
+   return ret;
+}
+
+// Waits for commands that will not be used, discarding their output
+static void prefetch_discard (struct prefetch_t *prefetch)
+{
+   while (prefetch) {
+      struct prefetch_t *next = prefetch->next;
+      char *output = NULL;
+      spawn_finish (prefetch->command, prefetch->pid, prefetch->fd, &output, NULL);
+      free (output);
+      free (prefetch);
+      prefetch = next;
+   }
+}
+
+bool rest_test_shell_prefetch (const void *test, const char *command)
+{
+   size_t clen = strlen (command);
+   struct prefetch_t *prefetch = malloc (sizeof *prefetch + clen + 1);
+   if (!prefetch)
+      return false;
+   memcpy (prefetch->command, command, clen + 1);
+   prefetch->test = test;
+   prefetch->next = NULL;
+   if (!(spawn_start (command, &prefetch->pid, &prefetch->fd))) {
+      free (prefetch);
+      return false;
+   }
+
+   pthread_mutex_lock (&lock);
+   *prefetches_tail = prefetch;
+   prefetches_tail = &prefetch->next;
+   pthread_mutex_unlock (&lock);
+   return true;
+}
+
+void rest_test_shell_prefetch_drop (const void *test)
+{
+   if (!test)
+      return;
+   pthread_mutex_lock (&lock);
+   struct prefetch_t *unused = prefetch_take (test, NULL);
+   pthread_mutex_unlock (&lock);
+   prefetch_discard (unused);
+}
+
+bool rest_test_shell_exec (const char *command, char **output, int *status)
+{
+   pthread_mutex_lock (&lock);
+   struct prefetch_t *prefetch = current && prefetches ? prefetch_take (current, command) : NULL;
+   bool caching = policy != rest_test_shell_ALWAYS;
+   bool found = !prefetch && caching && cache_find (command, output);
+   if (prefetch) {
+      nprefetched++;
+   } else if (found) {
+      hits++;
+   } else {
+      misses++;
+   }
+   pthread_mutex_unlock (&lock);
+
+   if (found) {
+      if (status)
+         *status = 0;
+      return true;
+   }
+
+   // Run without the lock; concurrent misses on one command each run it
+   bool ok = prefetch
+           ? spawn_finish (command, prefetch->pid, prefetch->fd, output, status)
+           : rest_test_shell_run (command, output, status);
+   free (prefetch);
+   if (!ok)
+      return false;
+
+   if (caching) {
+      pthread_mutex_lock (&lock);
+      cache_store (command, *output);
+      pthread_mutex_unlock (&lock);
+   }
+   return true;
+}
+
+bool rest_test_shell_set_policy (const char *name)
+{
+   static const struct {
+      const char *name;
+      enum rest_test_shell_policy_t policy;
+   } names[] = {
+      { "always", rest_test_shell_ALWAYS },
+      { "run",    rest_test_shell_RUN },
+      { "test",   rest_test_shell_TEST },
+   };
+
+   if (!name)
+      return false;
+
+   for (size_t i=0; i<sizeof names / sizeof names[0]; i++) {
+      if ((strcmp (name, names[i].name)) == 0) {
+         pthread_mutex_lock (&lock);
+         policy = names[i].policy;
+         pthread_mutex_unlock (&lock);
+         return true;
+      }
+   }
+
+   if ((strncmp (name, "ttl=", 4)) == 0) {
+      char *end = NULL;
+      double seconds = strtod (&name[4], &end);
+      if (end == &name[4] || *end || !(seconds > 0))
+         return false;
+      pthread_mutex_lock (&lock);
+      policy = rest_test_shell_TTL;
+      ttl = seconds;
+      pthread_mutex_unlock (&lock);
+      return true;
+   }
+   return false;
+}
+
+enum rest_test_shell_policy_t rest_test_shell_policy (void)
+{
+   pthread_mutex_lock (&lock);
+   enum rest_test_shell_policy_t ret = policy;
+   pthread_mutex_unlock (&lock);
+   return ret;
+}
+
+void rest_test_shell_begin_test (const void *test)
+{
+   scope = __atomic_add_fetch (&nscopes, 1, __ATOMIC_RELAXED);
+   current = test;
+}
+
+size_t rest_test_shell_hits (void)
+{
+   pthread_mutex_lock (&lock);
+   size_t ret = hits;
+   pthread_mutex_unlock (&lock);
+   return ret;
+}
+
+size_t rest_test_shell_misses (void)
+{
+   pthread_mutex_lock (&lock);
+   size_t ret = misses;
+   pthread_mutex_unlock (&lock);
+   return ret;
+}
+
+size_t rest_test_shell_prefetched (void)
+{
+   pthread_mutex_lock (&lock);
+   size_t ret = nprefetched;
+   pthread_mutex_unlock (&lock);
+   return ret;
+}
+
+void rest_test_shell_clear (void)
+{
+   pthread_mutex_lock (&lock);
+   struct prefetch_t *unused = prefetch_take (NULL, NULL);
+   nprefetched = 0;
+   for (size_t i=0; i<nentries; i++) {
+      free (entries[i]->output);
+      free (entries[i]);
+   }
+   free (entries);
+   entries = NULL;
+   nentries = 0;
+   size = 0;
+   ds_hmap_del (cache);
+   cache = NULL;
+   hits = 0;
+   misses = 0;
+   pthread_mutex_unlock (&lock);
+   prefetch_discard (unused);
+}
+
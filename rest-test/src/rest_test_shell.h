@@ -0,0 +1,93 @@
+
+#ifndef H_REST_TEST_SHELL
+#define H_REST_TEST_SHELL
+
+/* *****************************************************************************
+ * Shell commands (backtick values). A command is run with `/bin/sh -c`, its
+ * standard output is read through a pipe in large blocks and its exit status is
+ * returned separately. Standard input and standard error are the caller's.
+ *
+ * Starting a shell for every command can cost more than the request that uses
+ * its output. In persistent mode each thread instead keeps one shell running
+ * and sends it the commands. Each command still runs in a subshell, so `cd`,
+ * `exit` and variable assignments do not carry over, but it sees the
+ * environment as it was when the thread's shell started, and its standard
+ * input is /dev/null.
+ *
+ * The output of a command can be cached, keyed by the command text after
+ * interpolation, so that a symbol such as
+ *       .global token `./get-token.sh`
+ * referenced by thousands of tests is not run once per reference. The policy
+ * is process-wide:
+ *    always      every reference runs the command (the default)
+ *    run         a command is run once per process
+ *    test        a command is run once per test evaluation
+ *    ttl=N       a result is reused for N seconds
+ * A command that fails is never cached.
+ */
+
+enum rest_test_shell_policy_t {
+   rest_test_shell_ALWAYS,
+   rest_test_shell_RUN,
+   rest_test_shell_TEST,
+   rest_test_shell_TTL,
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Runs `command` and stores its output, NUL-terminated, in `output` which the
+   // caller must free. `status` receives the exit status, or 128 plus the signal
+   // number if the command was killed. Returns false if the command could not
+   // be run or did not exit with status 0; `output` is NULL on failure.
+   bool rest_test_shell_run (const char *command, char **output, int *status);
+
+   // Runs commands in one long-lived shell per thread rather than a shell per
+   // command. Off by default.
+   void rest_test_shell_set_persistent (bool enable);
+
+   // Ends the calling thread's persistent shell, if it has one. A thread's
+   // shell also ends when the thread exits.
+   void rest_test_shell_stop (void);
+
+   // As rest_test_shell_run(), but the output may come from the cache.
+   bool rest_test_shell_exec (const char *command, char **output, int *status);
+
+   // Sets the caching policy from its name (see above). Returns false if the
+   // name is not recognised, leaving the policy unchanged.
+   bool rest_test_shell_set_policy (const char *policy);
+   enum rest_test_shell_policy_t rest_test_shell_policy (void);
+
+   // Starts evaluating `test` on the calling thread: results cached under the
+   // `test` policy are not seen by later tests, and the commands prefetched for
+   // `test` are used.
+   void rest_test_shell_begin_test (const void *test);
+
+   // Starts `command` in a shell of its own for `test`, to be evaluated later,
+   // and returns without waiting for it. The next rest_test_shell_exec() of the
+   // same command text while `test` is being evaluated takes its output, rather
+   // than running the command again; commands prefetched more than once for a
+   // test are taken in the order that they were started.
+   bool rest_test_shell_prefetch (const void *test, const char *command);
+
+   // Waits for the commands prefetched for `test` and not taken, and discards
+   // their output.
+   void rest_test_shell_prefetch_drop (const void *test);
+
+   // The number of commands served from the cache, the number run when they
+   // were needed, and the number whose prefetched output was used.
+   size_t rest_test_shell_hits (void);
+   size_t rest_test_shell_misses (void);
+   size_t rest_test_shell_prefetched (void);
+
+   // Empties the cache, discards prefetched commands and zeroes the counts.
+   void rest_test_shell_clear (void);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,467 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ds_str.h"
+
+#include "rest_test_arena.h"
+#include "rest_test_token.h"
+#include "rest_test_symt.h"
+#include "rest_test_intern.h"
+#include "rest_test.h"
+#include "rest_test_state.h"
+
+#define CLEANUP(...) \
+do {\
+   ERRORF(__VA_ARGS__);\
+   goto cleanup;\
+} while (0)
+
+#define STATE_MAGIC        "RTSTATE\0"
+#define STATE_BYTEORDER    (0x01020304u)
+#define STATE_NONE         (UINT64_MAX)
+#define STATE_NO_SOURCE    (UINT32_MAX)
+
+// A value in the string pool. The value is followed by a terminator that is not
+// counted in `length`.
+struct sstring_t {
+   uint64_t offset;
+   uint64_t length;
+};
+
+struct sheader_t {
+   char              magic[8];
+   uint32_t          version;
+   uint32_t          byteorder;
+   uint64_t          ntables;
+   uint64_t          tables;     // File offset of the tables
+   uint64_t          nentries;
+   uint64_t          entries;    // File offset of the entries
+   uint64_t          nsources;
+   uint64_t          sources;    // File offset of the sources
+   uint64_t          strings;    // File offset of the string pool
+   uint64_t          nstrings;   // Length of the string pool
+};
+
+struct stable_t {
+   struct sstring_t  name;
+   uint64_t          parent;     // Index of the parent, or STATE_NONE
+   uint64_t          first;      // Index of the first entry
+   uint64_t          nentries;
+};
+
+struct sentry_t {
+   struct sstring_t  symbol;
+   uint32_t          type;
+   uint32_t          source;     // Index of the source, or STATE_NO_SOURCE
+   uint64_t          line_no;
+   struct sstring_t  value;
+};
+
+struct writer_t {
+   const rest_test_symt_t **symts;
+   struct stable_t   *tables;
+   size_t             ntables;
+   size_t             tables_size;
+   struct sentry_t   *entries;
+   size_t             nentries;
+   size_t             entries_size;
+   const char       **names;     // The source of each of `sources`
+   struct sstring_t  *sources;
+   size_t             nsources;
+   size_t             sources_size;
+   char              *strings;
+   size_t             nstrings;
+   size_t             strings_size;
+};
+
+
+/* *********************************************************************************
+ * Writing state.
+ */
+
+static bool grow (void **array, size_t *size, size_t needed, size_t elsize)
+{
+   if (needed <= *size)
+      return true;
+
+   size_t newsize = *size ? *size : 16;
+   while (newsize < needed)
+      newsize *= 2;
+
+   void *tmp = realloc (*array, newsize * elsize);
+   if (!tmp)
+      return false;
+   *array = tmp;
+   *size = newsize;
+   return true;
+}
+
+static bool pool_add (struct writer_t *w, const char *value, size_t length,
+                      struct sstring_t *dst)
+{
+   if (!(grow ((void **)&w->strings, &w->strings_size, w->nstrings + length + 1, 1)))
+      return false;
+
+   memcpy (&w->strings[w->nstrings], value, length);
+   w->strings[w->nstrings + length] = 0;
+   dst->offset = w->nstrings;
+   dst->length = length;
+   w->nstrings += length + 1;
+   return true;
+}
+
+static bool source_index (struct writer_t *w, const char *source, uint32_t *index)
+{
+   if (!source) {
+      *index = STATE_NO_SOURCE;
+      return true;
+   }
+
+   // A state file holds few distinct sources
+   for (size_t i=0; i<w->nsources; i++) {
+      if (w->names[i] == source || (strcmp (w->names[i], source)) == 0) {
+         *index = (uint32_t)i;
+         return true;
+      }
+   }
+
+   size_t size = w->sources_size;
+   if (w->nsources >= STATE_NO_SOURCE
+         || !(grow ((void **)&w->sources, &w->sources_size, w->nsources + 1, sizeof *w->sources))
+         || !(grow ((void **)&w->names, &size, w->nsources + 1, sizeof *w->names))
+         || !(pool_add (w, source, strlen (source), &w->sources[w->nsources])))
+      return false;
+
+   w->names[w->nsources] = source;
+   *index = (uint32_t)w->nsources++;
+   return true;
+}
+
+static bool entry_add (void *ctx, size_t id, const rest_test_token_t *token)
+{
+   struct writer_t *w = ctx;
+   const char *symbol = rest_test_intern_symbol_name (id);
+   size_t length = 0;
+   const char *value = rest_test_token_slice (token, &length);
+
+   if (!symbol || !value
+         || !(grow ((void **)&w->entries, &w->entries_size, w->nentries + 1, sizeof *w->entries)))
+      return false;
+
+   struct sentry_t *entry = &w->entries[w->nentries];
+   memset (entry, 0, sizeof *entry);
+   entry->type = (uint32_t)rest_test_token_type (token);
+   entry->line_no = rest_test_token_line_no (token);
+   if (!(source_index (w, rest_test_token_source (token), &entry->source))
+         || !(pool_add (w, symbol, strlen (symbol), &entry->symbol))
+         || !(pool_add (w, value, length, &entry->value)))
+      return false;
+
+   w->nentries++;
+   return true;
+}
+
+// Returns the index of `symt` in the writer, or STATE_NONE if it is not there
+static uint64_t table_index (const struct writer_t *w, const rest_test_symt_t *symt)
+{
+   for (size_t i=0; i<w->ntables; i++) {
+      if (w->symts[i] == symt)
+         return i;
+   }
+   return STATE_NONE;
+}
+
+static bool table_add (struct writer_t *w, const rest_test_symt_t *symt, uint64_t parent)
+{
+   size_t size = w->tables_size;
+   if (!(grow ((void **)&w->tables, &w->tables_size, w->ntables + 1, sizeof *w->tables))
+         || !(grow ((void **)&w->symts, &size, w->ntables + 1, sizeof *w->symts)))
+      return false;
+
+   struct stable_t *table = &w->tables[w->ntables];
+   memset (table, 0, sizeof *table);
+   table->parent = parent;
+   table->first = w->nentries;
+   const char *name = rest_test_symt_name (symt);
+   if (!(pool_add (w, name, strlen (name), &table->name))
+         || !(rest_test_symt_walk (symt, entry_add, w)))
+      return false;
+
+   table->nentries = w->nentries - table->first;
+   w->symts[w->ntables++] = symt;
+   return true;
+}
+
+// Adds the tables on the chain ending at `symt` that are not yet in the writer,
+// ancestors first
+static bool chain_add (struct writer_t *w, const rest_test_symt_t *symt)
+{
+   if (!symt)
+      return true;
+
+   uint64_t index = table_index (w, symt);
+   if (index != STATE_NONE)
+      return true;
+
+   // Chains are short; recursion keeps the parents first
+   const rest_test_symt_t *parent = rest_test_symt_parent (symt);
+   if (!(chain_add (w, parent)))
+      return false;
+
+   return table_add (w, symt, parent ? table_index (w, parent) : STATE_NONE);
+}
+
+static void writer_free (struct writer_t *w)
+{
+   free (w->symts);
+   free (w->tables);
+   free (w->entries);
+   free (w->names);
+   free (w->sources);
+   free (w->strings);
+}
+
+bool rest_test_state_save (rest_test_symt_t *const *tables, size_t ntables,
+                           const char *filename)
+{
+   bool error = true;
+   struct writer_t w;
+   char *tmpname = NULL;
+   FILE *outf = NULL;
+   int fd = -1;
+
+   memset (&w, 0, sizeof w);
+
+   if (!tables || !filename)
+      return false;
+
+   for (size_t i=0; i<ntables; i++) {
+      if (!(chain_add (&w, tables[i]))) {
+         CLEANUP ("OOM serialising symbol table [%s]\n", rest_test_symt_name (tables[i]));
+      }
+   }
+
+   struct sheader_t header;
+   memset (&header, 0, sizeof header);
+   memcpy (header.magic, STATE_MAGIC, sizeof header.magic);
+   header.version = REST_TEST_STATE_VERSION;
+   header.byteorder = STATE_BYTEORDER;
+   header.ntables = w.ntables;
+   header.tables = sizeof header;
+   header.nentries = w.nentries;
+   header.entries = header.tables + w.ntables * sizeof *w.tables;
+   header.nsources = w.nsources;
+   header.sources = header.entries + w.nentries * sizeof *w.entries;
+   header.strings = header.sources + w.nsources * sizeof *w.sources;
+   header.nstrings = w.nstrings;
+
+   if (!(tmpname = ds_str_cat (filename, ".XXXXXX", NULL))) {
+      CLEANUP ("OOM allocating temporary name for [%s]\n", filename);
+   }
+   if ((fd = mkstemp (tmpname)) < 0) {
+      CLEANUP ("Failed to create [%s]: %m\n", tmpname);
+   }
+   // The state may hold credentials, so unlike a bundle it stays readable only
+   // by the owner, as mkstemp() created it
+   if (!(outf = fdopen (fd, "wb"))) {
+      CLEANUP ("Failed to open [%s]: %m\n", tmpname);
+   }
+   fd = -1;
+
+   if ((fwrite (&header, sizeof header, 1, outf)) != 1
+         || (fwrite (w.tables, sizeof *w.tables, w.ntables, outf)) != w.ntables
+         || (fwrite (w.entries, sizeof *w.entries, w.nentries, outf)) != w.nentries
+         || (fwrite (w.sources, sizeof *w.sources, w.nsources, outf)) != w.nsources
+         || (fwrite (w.strings, 1, w.nstrings, outf)) != w.nstrings) {
+      CLEANUP ("Failed to write [%s]: %m\n", tmpname);
+   }
+
+   // The state outlives the run, so it is on disk before it replaces the old file
+   if ((fflush (outf)) != 0 || (fsync (fileno (outf))) != 0) {
+      CLEANUP ("Failed to sync [%s]: %m\n", tmpname);
+   }
+
+   int rc = fclose (outf);
+   outf = NULL;
+   if (rc != 0) {
+      CLEANUP ("Failed to write [%s]: %m\n", tmpname);
+   }
+
+   if ((rename (tmpname, filename)) != 0) {
+      CLEANUP ("Failed to rename [%s] to [%s]: %m\n", tmpname, filename);
+   }
+
+   error = false;
+cleanup:
+   if (outf)
+      fclose (outf);
+   if (fd >= 0)
+      close (fd);
+   if (error && tmpname)
+      remove (tmpname);
+   free (tmpname);
+   writer_free (&w);
+   return !error;
+}
+
+
+/* *********************************************************************************
+ * Reading state.
+ */
+
+static bool pool_valid (const struct sheader_t *header, const char *data,
+                        const struct sstring_t *s)
+{
+   return s->offset < header->nstrings
+       && s->length < header->nstrings - s->offset
+       && data[header->strings + s->offset + s->length] == 0;
+}
+
+static const char *pool_string (const struct sheader_t *header, const char *data,
+                                const struct sstring_t *s)
+{
+   return pool_valid (header, data, s) ? &data[header->strings + s->offset] : NULL;
+}
+
+// Returns true if `count` records of `size` bytes at `offset` lie within `length`
+static bool section_valid (uint64_t offset, uint64_t count, size_t size, size_t length)
+{
+   return offset <= length && count <= (length - offset) / size;
+}
+
+static bool table_load (rest_test_symt_t *symt, const rest_test_token_t *file,
+                        const struct sheader_t *header, const char *data,
+                        const struct stable_t *table, const char **sources)
+{
+   const struct sentry_t *entries = (const struct sentry_t *)&data[header->entries];
+   for (size_t i=0; i<table->nentries; i++) {
+      const struct sentry_t *entry = &entries[table->first + i];
+      const char *symbol = pool_string (header, data, &entry->symbol);
+      if (!symbol || !*symbol
+            || entry->type > token_SHELLCMD
+            || (entry->source != STATE_NO_SOURCE && entry->source >= header->nsources)
+            || !(pool_valid (header, data, &entry->value)))
+         return false;
+
+      const char *source = entry->source == STATE_NO_SOURCE ? NULL : sources[entry->source];
+      rest_test_token_t *token = rest_test_token_subslice (file,
+                                                           (enum rest_test_token_type_t)entry->type,
+                                                           header->strings + entry->value.offset,
+                                                           entry->value.length,
+                                                           source, entry->line_no);
+      bool added = token && rest_test_symt_add_id (symt, rest_test_intern_symbol (symbol), token);
+      rest_test_token_del (&token);
+      if (!added)
+         return false;
+   }
+   return true;
+}
+
+rest_test_symt_t **rest_test_state_load (const char *filename)
+{
+   bool error = true;
+   rest_test_symt_t **ret = NULL;
+   const char **sources = NULL;
+   rest_test_token_t *file = NULL;
+   size_t length = 0;
+
+   if (!filename)
+      return NULL;
+
+   if (!(file = rest_test_token_map (filename))) {
+      goto cleanup;
+   }
+   const char *data = rest_test_token_slice (file, &length);
+
+   const struct sheader_t *header = (const struct sheader_t *)data;
+   if (length < sizeof *header
+         || (memcmp (header->magic, STATE_MAGIC, sizeof header->magic)) != 0) {
+      CLEANUP ("[%s] is not a state file\n", filename);
+   }
+   if (header->version != REST_TEST_STATE_VERSION) {
+      CLEANUP ("[%s] is a version %u state file, expected version %u\n",
+               filename, header->version, REST_TEST_STATE_VERSION);
+   }
+   if (header->byteorder != STATE_BYTEORDER) {
+      CLEANUP ("[%s] was written on a host with a different byte order\n", filename);
+   }
+   if (header->tables != sizeof *header
+         || !(section_valid (header->tables, header->ntables, sizeof (struct stable_t), length))
+         || header->entries != header->tables + header->ntables * sizeof (struct stable_t)
+         || !(section_valid (header->entries, header->nentries, sizeof (struct sentry_t), length))
+         || header->sources != header->entries + header->nentries * sizeof (struct sentry_t)
+         || !(section_valid (header->sources, header->nsources, sizeof (struct sstring_t), length))
+         || header->strings != header->sources + header->nsources * sizeof (struct sstring_t)
+         || header->nstrings != length - header->strings) {
+      CLEANUP ("[%s] is truncated or corrupt\n", filename);
+   }
+
+   // Each source is interned once, rather than once per token
+   const struct sstring_t *pool_sources = (const struct sstring_t *)&data[header->sources];
+   if (!(sources = calloc (header->nsources + 1, sizeof *sources))) {
+      CLEANUP ("OOM allocating sources for [%s]\n", filename);
+   }
+   for (size_t i=0; i<header->nsources; i++) {
+      const char *source = pool_string (header, data, &pool_sources[i]);
+      if (!source) {
+         CLEANUP ("[%s] is truncated or corrupt\n", filename);
+      }
+      if (!(sources[i] = rest_test_intern_source (source))) {
+         CLEANUP ("OOM interning source [%s]\n", source);
+      }
+   }
+
+   if (!(ret = calloc (header->ntables + 1, sizeof *ret))) {
+      CLEANUP ("OOM allocating tables for [%s]\n", filename);
+   }
+
+   // A parent always precedes its children, so fixing up the parent pointer is
+   // a lookup in the tables already loaded
+   const struct stable_t *tables = (const struct stable_t *)&data[header->tables];
+   for (size_t i=0; i<header->ntables; i++) {
+      const struct stable_t *table = &tables[i];
+      const char *name = pool_string (header, data, &table->name);
+      if (!name
+            || (table->parent != STATE_NONE && table->parent >= i)
+            || table->first > header->nentries
+            || table->nentries > header->nentries - table->first) {
+         CLEANUP ("[%s] is truncated or corrupt\n", filename);
+      }
+      rest_test_symt_t *parent = table->parent == STATE_NONE ? NULL : ret[table->parent];
+      if (!(ret[i] = rest_test_symt_new (name, parent, table->nentries))) {
+         CLEANUP ("OOM creating symbol table [%s]\n", name);
+      }
+      if (!(table_load (ret[i], file, header, data, table, sources))) {
+         CLEANUP ("[%s] Failed to load symbol table [%s]\n", filename, name);
+      }
+   }
+
+   error = false;
+cleanup:
+   if (error) {
+      rest_test_state_del (&ret);
+   }
+   free (sources);
+   // The tokens hold their own references to the mapping
+   rest_test_token_del (&file);
+   return ret;
+}
+
+void rest_test_state_del (rest_test_symt_t ***tables)
+{
+   if (!tables || !*tables)
+      return;
+
+   for (size_t i=0; (*tables)[i]; i++) {
+      rest_test_symt_del (&(*tables)[i]);
+   }
+   free (*tables);
+   *tables = NULL;
+}
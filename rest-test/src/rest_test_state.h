@@ -0,0 +1,59 @@
+
+#ifndef H_REST_TEST_STATE
+#define H_REST_TEST_STATE
+
+/* *****************************************************************************
+ * Saved symbol-table state (.rts files). A state file holds one or more symbol
+ * table chains, so that values captured in one run (session ids, one-time
+ * passwords, ...) can be read back by the next without re-parsing them as text.
+ *
+ * Each table is stored once, however many of the saved chains it is on, and
+ * refers to its parent by index. Tables are stored ancestors first, so that a
+ * table's parent always precedes it. Every entry keeps the type, source and
+ * line number of its token.
+ *
+ * Like a test bundle (see rest_test_bundle.h) the file is relocatable: names and
+ * values are offsets into a NUL-terminated string pool, the file is mapped in
+ * once and the loaded tokens are sliced from the mapping without copying.
+ *
+ * Layout (all integers in host byte order, which the header records):
+ *    header      magic, version, byte-order mark, counts and offsets
+ *    tables      ntables fixed-size records: name, parent index, entry range
+ *    entries     nentries fixed-size records, grouped by table
+ *    sources     nsources pool strings; entries refer to sources by index
+ *    strings     the string pool
+ *
+ * A file with the wrong magic, version or byte order is rejected.
+ */
+
+#define REST_TEST_STATE_VERSION     (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Write the chains ending at each of the `ntables` tables to the named file.
+   // A table shared by several chains is written once. The file is written under
+   // a temporary name, synced and renamed into place, so readers never see a
+   // partial file.
+   bool rest_test_state_save (rest_test_symt_t *const *tables, size_t ntables,
+                              const char *filename);
+
+   // Load every table in the named file. Returns a NULL-terminated array of the
+   // tables, with each table's parent before it; the tables that were passed to
+   // rest_test_state_save() keep their relative order, so when a single chain is
+   // saved the last table is its leaf. Returns NULL on error. The tokens share
+   // the mapping and may outlive the array. Free the array and the tables with
+   // rest_test_state_del().
+   rest_test_symt_t **rest_test_state_load (const char *filename);
+
+   // Deletes the tables returned by rest_test_state_load(), and the array.
+   void rest_test_state_del (rest_test_symt_t ***tables);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
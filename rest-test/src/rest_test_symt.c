@@ -1,35 +1,427 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pthread.h>
 
-#include "ds_hmap.h"
 #include "ds_str.h"
 
+#include "rest_test_arena.h"
 #include "rest_test_token.h"
 #include "rest_test_symt.h"
+#include "rest_test_intern.h"
+#include "rest_test.h"
+
+/* *****************************************************************************
+ * Symbols are interned to integer ids (see rest_test_intern.h), and each table
+ * is an open-addressing table of id -> token with linear probing. A lookup hashes
+ * the symbol string once to find its id, then costs one integer probe sequence
+ * per scope. Removal shifts the following entries back, so there are no
+ * tombstones.
+ *
+ * Each table also caches what its ancestors resolve each symbol to, so that a
+ * global read from a test scope costs two probes however deep the chain is. The
+ * cache is itself an id -> token table. Every table counts the adds and clears
+ * made to it, and the cache is stamped with the sum of its ancestors' counts
+ * when it is filled; a lookup that finds the sum changed empties the cache
+ * first. Each write adds one to a single count, so the sum changes with every
+ * write to an ancestor and with no other: a write to a sibling, or to a table
+ * in another chain, leaves the cache warm. Summing walks the chain, so the
+ * cache also records a process-wide count of writes to any table, and only
+ * sums again when that has moved; a lookup with no write since the last one
+ * costs no more however deep the chain is. A table's own entries are probed
+ * before its cache, so a write to the table itself needs no invalidation
+ * either.
+ *
+ * Most test scopes hold no more than a few locals, so a new table keeps its
+ * entries in a small array inside the table itself, probed like any other, and
+ * only moves them to the heap when it outgrows it. Heap storage is reference
+ * counted, so a fork of a table shares it until either side writes.
+ *
+ * The environment is the implicit root of every chain: a snapshot of it is
+ * indexed by symbol id like any other table, and a symbol that no table holds
+ * costs one probe there. The result is cached like any other ancestor's, so
+ * an unresolved name looked up repeatedly is a single cache probe.
+ */
+
+#define SLOT_EMPTY      ((size_t)-1)
+#define MIN_SLOTS       (8)
+#define MIN_CACHE       (16)
+// Three entries fit inline at the usual load factor
+#define INLINE_SLOTS    (4)
+
+// Counts the replacements of the environment snapshot, which is the implicit
+// root of every chain
+static size_t environment_writes;
+
+// Counts the writes to every table and to the environment. Starts at 1 so that
+// a cache is never current before it is first filled.
+static size_t generation = 1;
+
+// The counts are read by lookups in descendant tables, which may be on other
+// threads than the writer
+static void writes_advance (size_t *writes)
+{
+   __atomic_add_fetch (writes, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch (&generation, 1, __ATOMIC_RELAXED);
+}
+
+struct slot_t {
+   size_t             id;
+   rest_test_token_t *token;
+};
+
+// Heap storage for slots, shared between a table and its forks
+struct block_t {
+   size_t             refs;
+   struct slot_t      slots[];
+};
+
+// An open-addressing table of id -> token; nslots is always a power of two
+struct slots_t {
+   struct slot_t     *slots;
+   // NULL while the slots are inline, or not yet allocated
+   struct block_t    *block;
+   size_t             nslots;
+   size_t             nentries;
+};
+
+// What the ancestors resolved each looked-up id to, NULL for a miss. The tokens
+// belong to the ancestors. Valid while the ancestors' writes sum to `stamp`,
+// which was last checked at `generation`.
+struct cache_t {
+   struct slots_t     resolved;
+   size_t             stamp;
+   size_t             generation;
+};
+
+// The environment snapshot, taken on the first lookup that needs it. Replaced
+// only by rest_test_symt_environment().
+static struct slots_t *environment;
+static pthread_once_t environment_once = PTHREAD_ONCE_INIT;
+
+#define ENVIRONMENT_SOURCE    "environment"
+
+extern char **environ;
 
 struct rest_test_symt_t {
    char              *name;
    rest_test_symt_t  *parent;
-   ds_hmap_t         *hmap;
+   // Allocated on the first add
+   struct slots_t     entries;
+   // Allocated on the first lookup that reaches the parent
+   struct cache_t    *cache;
+   struct slot_t      inline_slots[INLINE_SLOTS];
+   // When not NULL, the table, its name and its tokens are allocated from here
+   rest_test_arena_t *arena;
+   const struct rest_test_symt_hook_t *hook;
+   // The number of adds and clears made to the table
+   size_t             writes;
+   // The name given at creation is stored with the table, saving an allocation
+   char               name_store[];
 };
 
+static size_t slot_home (size_t id, size_t nslots)
+{
+   // Fibonacci hashing spreads the sequential ids over the table
+   uint64_t h = (uint64_t)id * UINT64_C (0x9E3779B97F4A7C15);
+   return (size_t)(h >> 32) & (nslots - 1);
+}
 
-rest_test_symt_t *rest_test_symt_new (const char *name, rest_test_symt_t *parent, size_t nbuckets)
+// SLOT_EMPTY is also the id of a name that was never interned, and would
+// match the first empty slot, so it is never found
+static struct slot_t *slots_find (const struct slots_t *table, size_t id)
+{
+   if (!table->nentries || id == SLOT_EMPTY)
+      return NULL;
+
+   size_t mask = table->nslots - 1;
+   for (size_t i=slot_home (id, table->nslots); ; i = (i + 1) & mask) {
+      if (table->slots[i].id == id)
+         return &table->slots[i];
+      if (table->slots[i].id == SLOT_EMPTY)
+         return NULL;
+   }
+}
+
+// Places an entry known not to be in the table
+static void slot_insert (struct slot_t *slots, size_t nslots, size_t id,
+                         rest_test_token_t *token)
 {
-   rest_test_symt_t *ret = calloc (1, sizeof *ret);
+   size_t i = slot_home (id, nslots);
+   while (slots[i].id != SLOT_EMPTY) {
+      i = (i + 1) & (nslots - 1);
+   }
+   slots[i].id = id;
+   slots[i].token = token;
+}
+
+static void slots_empty (struct slot_t *slots, size_t nslots)
+{
+   for (size_t i=0; i<nslots; i++) {
+      slots[i].id = SLOT_EMPTY;
+      slots[i].token = NULL;
+   }
+}
+
+static struct block_t *block_new (size_t nslots)
+{
+   struct block_t *ret = malloc (sizeof *ret + nslots * sizeof ret->slots[0]);
    if (!ret)
       return NULL;
+   ret->refs = 1;
+   slots_empty (ret->slots, nslots);
+   return ret;
+}
+
+// Moves the entries into new heap storage of `nslots` slots. The table must not
+// share its storage.
+static bool slots_resize (struct slots_t *table, size_t nslots)
+{
+   struct block_t *block = block_new (nslots);
+   if (!block)
+      return false;
+   for (size_t i=0; table->slots && i<table->nslots; i++) {
+      if (table->slots[i].id != SLOT_EMPTY) {
+         slot_insert (block->slots, nslots, table->slots[i].id, table->slots[i].token);
+      }
+   }
+   free (table->block);
+   table->block = block;
+   table->slots = block->slots;
+   table->nslots = nslots;
+   return true;
+}
 
-   ret->parent = parent;
+// Makes room for one more entry, keeping the load at or below 3/4
+static bool slots_reserve (struct slots_t *table)
+{
+   if (table->slots && (table->nentries + 1) * 4 <= table->nslots * 3)
+      return true;
+   return slots_resize (table, table->slots ? table->nslots * 2 : table->nslots);
+}
 
-   if (!(ret->name = ds_str_dup (name)) || !(ret->hmap = ds_hmap_new (nbuckets))) {
-      free (ret->name);
-      // I did not forget to free hmap here; hmap always NULL in this block
+// Empties `slot` and moves back any entries that probed past it
+static void slots_remove (struct slots_t *table, struct slot_t *slot)
+{
+   size_t mask = table->nslots - 1;
+   size_t hole = (size_t)(slot - table->slots);
+   for (size_t i = (hole + 1) & mask; table->slots[i].id != SLOT_EMPTY; i = (i + 1) & mask) {
+      size_t home = slot_home (table->slots[i].id, table->nslots);
+      // The entry may fill the hole only if the hole lies between its home
+      // slot and its current slot
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+         table->slots[hole] = table->slots[i];
+         hole = i;
+      }
+   }
+   table->slots[hole].id = SLOT_EMPTY;
+   table->slots[hole].token = NULL;
+   table->nentries--;
+}
+
+// The smallest table that holds `nentries` within the load factor
+static size_t slots_for (size_t nentries)
+{
+   size_t ret = MIN_SLOTS;
+   while (ret * 3 < nentries * 4)
+      ret *= 2;
+   return ret;
+}
+
+
+/* *********************************************************************************
+ * The environment snapshot.
+ */
+
+static void environment_del (struct slots_t **env)
+{
+   if (!env || !*env)
+      return;
+
+   for (size_t i=0; (*env)->slots && i<(*env)->nslots; i++) {
+      rest_test_token_del (&(*env)->slots[i].token);
+   }
+   free ((*env)->block);
+   free (*env);
+   *env = NULL;
+}
+
+static struct slots_t *environment_new (const char *const *envp)
+{
+   size_t nvars = 0;
+   while (envp && envp[nvars])
+      nvars++;
+
+   struct slots_t *ret = calloc (1, sizeof *ret);
+   if (!ret || !(ret->block = block_new (slots_for (nvars)))) {
       free (ret);
       return NULL;
    }
+   ret->slots = ret->block->slots;
+   ret->nslots = slots_for (nvars);
+
+   for (size_t i=0; i<nvars; i++) {
+      const char *eq = strchr (envp[i], '=');
+      if (!eq || eq == envp[i])
+         continue;
+
+      char *name = ds_str_dup (envp[i]);
+      if (name)
+         name[eq - envp[i]] = 0;
+      size_t id = name ? rest_test_intern_symbol (name) : SLOT_EMPTY;
+      free (name);
+      if (id == SLOT_EMPTY) {
+         environment_del (&ret);
+         return NULL;
+      }
+      // As with getenv(), the first of any duplicates wins
+      if (slots_find (ret, id))
+         continue;
+
+      rest_test_token_t *token = rest_test_token_new (token_STRING, eq + 1,
+                                                      ENVIRONMENT_SOURCE, 0);
+      if (!token) {
+         environment_del (&ret);
+         return NULL;
+      }
+      slot_insert (ret->slots, ret->nslots, id, token);
+      ret->nentries++;
+   }
+   return ret;
+}
+
+static void environment_init (void)
+{
+   // Without a snapshot every symbol is simply missing from the environment
+   environment = environment_new ((const char *const *)environ);
+}
+
+static rest_test_token_t *environment_value (size_t id)
+{
+   pthread_once (&environment_once, environment_init);
+   const struct slot_t *slot = environment ? slots_find (environment, id) : NULL;
+   return slot ? slot->token : NULL;
+}
+
+bool rest_test_symt_environment (const char *const *envp)
+{
+   pthread_once (&environment_once, environment_init);
+   struct slots_t *env = environment_new (envp ? envp : (const char *const *)environ);
+   if (!env)
+      return false;
+
+   environment_del (&environment);
+   environment = env;
+   writes_advance (&environment_writes);
+   return true;
+}
+
+
+static void symt_init (rest_test_symt_t *symt, rest_test_symt_t *parent, size_t nbuckets)
+{
+   symt->parent = parent;
+   if (nbuckets * 4 <= INLINE_SLOTS * 3) {
+      slots_empty (symt->inline_slots, INLINE_SLOTS);
+      symt->entries.slots = symt->inline_slots;
+      symt->entries.nslots = INLINE_SLOTS;
+   } else {
+      symt->entries.nslots = slots_for (nbuckets);
+   }
+}
+
+// Gives the table storage of its own before it is written to
+static bool symt_unshare (rest_test_symt_t *symt)
+{
+   struct slots_t *entries = &symt->entries;
+   if (!entries->block || entries->block->refs == 1)
+      return true;
+
+   struct block_t *block = block_new (entries->nslots);
+   if (!block)
+      return false;
+   for (size_t i=0; i<entries->nslots; i++) {
+      struct slot_t *slot = &entries->slots[i];
+      if (slot->id == SLOT_EMPTY)
+         continue;
+      // Slot positions depend only on the ids, so the layout is kept
+      block->slots[i].id = slot->id;
+      if (!(block->slots[i].token = rest_test_token_dup_arena (slot->token, symt->arena))) {
+         for (size_t j=0; j<i; j++) {
+            rest_test_token_del (&block->slots[j].token);
+         }
+         free (block);
+         return false;
+      }
+   }
+   entries->block->refs--;
+   entries->block = block;
+   entries->slots = block->slots;
+   return true;
+}
+
+
+rest_test_symt_t *rest_test_symt_new (const char *name, rest_test_symt_t *parent, size_t nbuckets)
+{
+   return rest_test_symt_new_arena (name, parent, nbuckets, NULL);
+}
+
+rest_test_symt_t *rest_test_symt_new_arena (const char *name,
+                                            rest_test_symt_t *parent,
+                                            size_t nbuckets,
+                                            rest_test_arena_t *arena)
+{
+   if (!name)
+      return NULL;
+
+   // Scopes are created by the million; malloc() is served from the per-thread
+   // cache, where calloc() is not.
+   size_t nlen = strlen (name) + 1;
+   rest_test_symt_t *ret = arena
+      ? rest_test_arena_alloc (arena, sizeof *ret + nlen)
+      : malloc (sizeof *ret + nlen);
+   if (!ret)
+      return NULL;
+
+   memset (ret, 0, sizeof *ret);
+   memcpy (ret->name_store, name, nlen);
+   ret->name = ret->name_store;
+   ret->arena = arena;
+   symt_init (ret, parent, nbuckets);
+   return ret;
+}
+
+rest_test_symt_t *rest_test_symt_fork (const rest_test_symt_t *symt)
+{
+   if (!symt)
+      return NULL;
+
+   rest_test_symt_t *ret = rest_test_symt_new_arena (symt->name, symt->parent, 0, symt->arena);
+   if (!ret)
+      return NULL;
+
+   const struct slots_t *entries = &symt->entries;
+   if (entries->block) {
+      entries->block->refs++;
+      ret->entries = *entries;
+      return ret;
+   }
 
+   // Inline entries are too few to be worth sharing
+   for (size_t i=0; entries->slots && i<entries->nslots; i++) {
+      if (entries->slots[i].id == SLOT_EMPTY)
+         continue;
+      ret->inline_slots[i].id = entries->slots[i].id;
+      if (!(ret->inline_slots[i].token = rest_test_token_dup_arena (entries->slots[i].token,
+                                                                     ret->arena))) {
+         rest_test_symt_del (&ret);
+         return NULL;
+      }
+      ret->entries.nentries++;
+   }
    return ret;
 }
 
@@ -38,19 +430,24 @@ void rest_test_symt_del (rest_test_symt_t **symt)
    if (!symt || !*symt)
       return;
 
-   char **keys = NULL;
-   size_t nkeys = ds_hmap_keys((*symt)->hmap, (void ***)&keys, NULL);
-   for (size_t i=0; i<nkeys; i++) {
-      rest_test_token_t *value = NULL;
-      if ((ds_hmap_get_str_ptr((*symt)->hmap, keys[i], (void **)&value))) {
-         rest_test_token_del (&value);
+   // Shared storage, and the tokens in it, belong to the last table to use it
+   struct slots_t *entries = &(*symt)->entries;
+   if (!entries->block || --entries->block->refs == 0) {
+      for (size_t i=0; entries->slots && i<entries->nslots; i++) {
+         rest_test_token_del (&entries->slots[i].token);
       }
+      free (entries->block);
+   }
+   if ((*symt)->cache) {
+      free ((*symt)->cache->resolved.block);
+      free ((*symt)->cache);
+   }
+   // Tables allocated from an arena are released with the arena
+   if (!(*symt)->arena) {
+      if ((*symt)->name != (*symt)->name_store)
+         free ((*symt)->name);
+      free (*symt);
    }
-
-   free (keys);
-   ds_hmap_del ((*symt)->hmap);
-   free ((*symt)->name);
-   free (*symt);
    *symt = NULL;
 }
 
@@ -66,15 +463,73 @@ rest_test_symt_t *rest_test_symt_parent (const rest_test_symt_t *symt)
 
 const char *rest_test_symt_set_name (rest_test_symt_t *symt, const char *name)
 {
-   char *tmp = ds_str_dup (name);
+   char *tmp = symt->arena
+      ? rest_test_arena_strdup (symt->arena, name)
+      : ds_str_dup (name);
    if (!tmp)
       return NULL;
 
-   free (symt->name);
+   if (!symt->arena && symt->name != symt->name_store) {
+      free (symt->name);
+   }
    symt->name = tmp;
    return tmp;
 }
 
+void rest_test_symt_set_hook (rest_test_symt_t *symt,
+                              const struct rest_test_symt_hook_t *hook)
+{
+   if (symt)
+      symt->hook = hook;
+}
+
+
+bool rest_test_symt_stats (const rest_test_symt_t *symt, struct rest_test_symt_stats_t *stats)
+{
+   if (!symt || !stats)
+      return false;
+
+   memset (stats, 0, sizeof *stats);
+   const struct slots_t *entries = &symt->entries;
+   stats->nentries = entries->nentries;
+   stats->nslots = entries->slots ? entries->nslots : 0;
+   stats->inline_slots = entries->slots == symt->inline_slots;
+   stats->shared = entries->block && entries->block->refs > 1;
+
+   size_t total = 0;
+   size_t mask = entries->nslots - 1;
+   for (size_t i=0; entries->slots && i<entries->nslots; i++) {
+      if (entries->slots[i].id == SLOT_EMPTY)
+         continue;
+      // A lookup of this entry examines every slot from its home to here
+      size_t probes = ((i - slot_home (entries->slots[i].id, entries->nslots)) & mask) + 1;
+      size_t bucket = probes < REST_TEST_SYMT_PROBES ? probes - 1 : REST_TEST_SYMT_PROBES - 1;
+      stats->probes[bucket]++;
+      total += probes;
+      if (probes > stats->max_probes)
+         stats->max_probes = probes;
+   }
+   stats->mean_probes = entries->nentries ? (double)total / (double)entries->nentries : 0.0;
+   return true;
+}
+
+void rest_test_symt_dump_stats (const rest_test_symt_t *symt, FILE *fout)
+{
+   struct rest_test_symt_stats_t stats;
+   if (!(rest_test_symt_stats (symt, &stats)))
+      return;
+
+   if (!fout)
+      fout = stdout;
+
+   fprintf (fout, "symbol-table [%s] entries %zu slots %zu%s%s probes mean %.2f max %zu [",
+            symt->name, stats.nentries, stats.nslots, stats.inline_slots ? " inline" : "",
+            stats.shared ? " shared" : "", stats.mean_probes, stats.max_probes);
+   for (size_t i=0; i<REST_TEST_SYMT_PROBES; i++) {
+      fprintf (fout, "%s%zu", i ? " " : "", stats.probes[i]);
+   }
+   fprintf (fout, "]\n");
+}
 
 void rest_test_symt_dump (const rest_test_symt_t *symt, FILE *fout)
 {
@@ -84,60 +539,191 @@ void rest_test_symt_dump (const rest_test_symt_t *symt, FILE *fout)
    if (!fout)
       fout = stdout;
 
-   char **keys = NULL;
-   size_t nkeys = ds_hmap_keys(symt->hmap, (void ***)&keys, NULL);
-   for (size_t i=0; i<nkeys; i++) {
-      rest_test_token_t *token = NULL;
-      if (!(ds_hmap_get_str_ptr(symt->hmap, keys[i], (void **)&token))) {
+   const struct slots_t *entries = &symt->entries;
+   for (size_t i=0; entries->slots && i<entries->nslots; i++) {
+      if (entries->slots[i].id == SLOT_EMPTY) {
          continue;
       }
-      const char *value = rest_test_token_value (token);
-      fprintf(fout, "symbol-table [%s] [%s:%s]\n", symt->name, keys[i], value);
+      const char *symbol = rest_test_intern_symbol_name (entries->slots[i].id);
+      const char *value = rest_test_token_value (entries->slots[i].token);
+      fprintf(fout, "symbol-table [%s] [%s:%s]\n", symt->name, symbol, value);
    }
+}
+
+bool rest_test_symt_walk (const rest_test_symt_t *symt,
+                          bool (*fn) (void *ctx, size_t id,
+                                      const rest_test_token_t *token),
+                          void *ctx)
+{
+   if (!symt || !fn)
+      return true;
 
-   free (keys);
+   const struct slots_t *entries = &symt->entries;
+   for (size_t i=0; entries->slots && i<entries->nslots; i++) {
+      if (entries->slots[i].id == SLOT_EMPTY)
+         continue;
+      if (!(fn (ctx, entries->slots[i].id, entries->slots[i].token)))
+         return false;
+   }
+   return true;
+}
+
+size_t rest_test_symt_count (const rest_test_symt_t *symt)
+{
+   return symt ? symt->entries.nentries : 0;
+}
+
+// The sum of the write counts of `symt`, its ancestors and the environment
+static size_t chain_writes (const rest_test_symt_t *symt)
+{
+   size_t ret = __atomic_load_n (&environment_writes, __ATOMIC_RELAXED);
+   for (; symt; symt = symt->parent) {
+      ret += __atomic_load_n (&symt->writes, __ATOMIC_RELAXED);
+   }
+   return ret;
+}
+
+size_t rest_test_symt_version (const rest_test_symt_t *symt)
+{
+   return chain_writes (symt);
+}
+
+size_t rest_test_symt_id (const char *symbol)
+{
+   return rest_test_intern_symbol (symbol);
 }
 
 bool rest_test_symt_add (rest_test_symt_t *symt,
                          const char *symbol, rest_test_token_t *token)
 {
-   if (!symt)
+   return rest_test_symt_add_id (symt, rest_test_intern_symbol (symbol), token);
+}
+
+bool rest_test_symt_add_id (rest_test_symt_t *symt, size_t id, rest_test_token_t *token)
+{
+   if (!symt || id == SLOT_EMPTY)
       return false;
 
-   enum rest_test_token_type_t type = rest_test_token_type (token);
-   const char *value = rest_test_token_value (token);
-   const char *source = rest_test_token_source (token);
-   size_t line_no = rest_test_token_line_no (token);
-   rest_test_token_t *copy = rest_test_token_new (type, value, source, line_no);
+   if (!(symt_unshare (symt)) || !(slots_reserve (&symt->entries)))
+      return false;
+
+   rest_test_token_t *copy = rest_test_token_dup_arena (token, symt->arena);
    if (!copy)
       return false;
-   rest_test_token_t *existing = NULL;
-   if ((ds_hmap_get_str_ptr (symt->hmap, symbol, (void **)&existing)))
-      rest_test_token_del (&existing);
 
-   return ds_hmap_set_str_ptr (symt->hmap, symbol, copy) != NULL;
+   if (symt->hook && !(symt->hook->fn (symt->hook->ctx, symt, id, copy))) {
+      rest_test_token_del (&copy);
+      return false;
+   }
+
+   writes_advance (&symt->writes);
+
+   struct slot_t *existing = slots_find (&symt->entries, id);
+   if (existing) {
+      rest_test_token_del (&existing->token);
+      existing->token = copy;
+      return true;
+   }
+
+   slot_insert (symt->entries.slots, symt->entries.nslots, id, copy);
+   symt->entries.nentries++;
+   return true;
 }
 
 void rest_test_symt_clear (rest_test_symt_t *symt, const char *symbol)
 {
-   rest_test_token_t *value = NULL;
-   if ((ds_hmap_get_str_ptr(symt->hmap, symbol, (void **)&value))) {
-      ds_hmap_remove_str (symt->hmap, symbol);
-      rest_test_token_del (&value);
+   if (!symt)
+      return;
+
+   size_t id = rest_test_intern_symbol_find (symbol);
+   if (id == SLOT_EMPTY || !slots_find (&symt->entries, id))
+      return;
+
+   struct slot_t *slot = NULL;
+   if (!(symt_unshare (symt)) || !(slot = slots_find (&symt->entries, id))) {
+      ERRORF ("OOM clearing [%s] from [%s]\n", symbol, symt->name);
+      return;
+   }
+   if (symt->hook) {
+      symt->hook->fn (symt->hook->ctx, symt, id, NULL);
    }
+   writes_advance (&symt->writes);
+   rest_test_token_del (&slot->token);
+   slots_remove (&symt->entries, slot);
 }
 
 
 const rest_test_token_t *rest_test_symt_value (const rest_test_symt_t *symt, const char *symbol)
 {
-   rest_test_token_t *value = NULL;
-   if (!symt)
-      return NULL;
+   // A symbol that was never interned was never added to any table, nor is it
+   // in the environment once the snapshot has interned its names
+   pthread_once (&environment_once, environment_init);
+   size_t id = rest_test_intern_symbol_find (symbol);
+   return id == SLOT_EMPTY ? NULL : rest_test_symt_value_id (symt, id);
+}
 
-   if (!(ds_hmap_get_str_ptr (symt->hmap, symbol, (void **)&value)))
-      return rest_test_symt_value (symt->parent, symbol);
+const rest_test_token_t *rest_test_symt_own_value (const rest_test_symt_t *symt,
+                                                   const char *symbol)
+{
+   size_t id = symt && symbol ? rest_test_intern_symbol_find (symbol) : SLOT_EMPTY;
+   const struct slot_t *slot = id == SLOT_EMPTY ? NULL : slots_find (&symt->entries, id);
+   return slot ? slot->token : NULL;
+}
 
-   return value;
+// Resolves `id` through the ancestors only
+static rest_test_token_t *ancestors_value (const rest_test_symt_t *symt, size_t id)
+{
+   for (symt = symt->parent; symt; symt = symt->parent) {
+      const struct slot_t *slot = slots_find (&symt->entries, id);
+      if (slot)
+         return slot->token;
+   }
+   return environment_value (id);
 }
 
+const rest_test_token_t *rest_test_symt_value_id (const rest_test_symt_t *symt, size_t id)
+{
+   if (!symt || id == SLOT_EMPTY)
+      return NULL;
+
+   const struct slot_t *slot = slots_find (&symt->entries, id);
+   if (slot)
+      return slot->token;
+   if (!symt->parent)
+      return environment_value (id);
+
+   // The cache is not part of the table's value, so filling it is allowed
+   // through a const table. It is filled without a lock, which is why a table
+   // must not be read from two threads at once.
+   rest_test_symt_t *mutable = (rest_test_symt_t *)symt;
+   if (!mutable->cache) {
+      if (!(mutable->cache = calloc (1, sizeof *mutable->cache)))
+         return ancestors_value (symt, id);
+      mutable->cache->resolved.nslots = MIN_CACHE;
+   }
+
+   struct slots_t *resolved = &mutable->cache->resolved;
+   size_t current = __atomic_load_n (&generation, __ATOMIC_RELAXED);
+   if (mutable->cache->generation != current) {
+      // Some table was written to; the cache holds unless it was an ancestor
+      size_t stamp = chain_writes (symt->parent);
+      if (mutable->cache->stamp != stamp) {
+         if (resolved->slots)
+            slots_empty (resolved->slots, resolved->nslots);
+         resolved->nentries = 0;
+         mutable->cache->stamp = stamp;
+      }
+      mutable->cache->generation = current;
+   }
+
+   if ((slot = slots_find (resolved, id)))
+      return slot->token;
 
+   rest_test_token_t *ret = ancestors_value (symt, id);
+   // Without room in the cache the lookup is merely slower
+   if ((slots_reserve (resolved))) {
+      slot_insert (resolved->slots, resolved->nslots, id, ret);
+      resolved->nentries++;
+   }
+   return ret;
+}
@@ -4,6 +4,32 @@
 
 typedef struct rest_test_symt_t rest_test_symt_t;
 
+// Number of probe-length buckets reported by rest_test_symt_stats()
+#define REST_TEST_SYMT_PROBES    (8)
+
+// The shape of a table's own entries, ignoring its ancestors.
+struct rest_test_symt_stats_t {
+   size_t   nentries;
+   size_t   nslots;
+   bool     inline_slots;  // The entries are still stored inside the table
+   bool     shared;        // The entries are shared with a fork
+   // probes[i] is the number of entries that a lookup finds after examining
+   // i + 1 slots; the last bucket counts everything longer.
+   size_t   probes[REST_TEST_SYMT_PROBES];
+   size_t   max_probes;
+   double   mean_probes;
+};
+
+// Observes the writes to a table. `fn` is called before each add, with the
+// value about to be stored, and before each clear that removes an entry, with
+// a NULL token. Returning false from an add fails the add and leaves the table
+// unchanged; the result is ignored for a clear.
+struct rest_test_symt_hook_t {
+   bool   (*fn) (void *ctx, rest_test_symt_t *symt, size_t id,
+                 const rest_test_token_t *token);
+   void    *ctx;
+};
+
 /* *****************************************************************************
  * A very simple symbol table implementation. Simply put, this is a hashmap with
  * support for a parent hashmap. When looking for a symbol, if it is not found in
@@ -11,17 +37,46 @@ typedef struct rest_test_symt_t rest_test_symt_t;
  * until a match is found or there are no more parents.
  *
  * In this way multiple scopes can be implemented.
+ *
+ * Symbol names are interned to integer ids, and the tables are keyed by id, so
+ * that a lookup hashes the name only once however many scopes it searches.
+ * Callers that look the same symbol up repeatedly can keep its id and use the
+ * _id functions, which do not hash the name at all.
+ *
+ * Each table caches the values its ancestors resolve symbols to, so reading a
+ * symbol defined far up the chain costs the same as reading a local one. An
+ * add or clear invalidates the caches of the table's descendants only, so a
+ * write to an ancestor is seen by the next lookup. As lookups fill the cache
+ * without a lock, a table must not be read from two threads at once, although
+ * its ancestors may be read through other tables on other threads.
  */
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-   // Create a new symbol table with mandatory name and mandatory bucket count.
-   // On failure NULL is returned. On success a symbol table is returned which must
+   // Create a new symbol table with mandatory name. The bucket count is only a
+   // hint of the number of entries expected: the table grows to keep lookups
+   // short however many entries are added. A table with a hint of 3 or less
+   // keeps its first entries inside the table, and allocates nothing more until
+   // it grows. On failure NULL is returned. On success a symbol table is returned which must
    // be freed using rest_test_symt_del().
    rest_test_symt_t *rest_test_symt_new (const char *name,
                                          rest_test_symt_t *parent,
                                          size_t buckets);
+   // As rest_test_symt_new(), but the table and the tokens added to it are
+   // allocated from the arena. The table must still be deleted with
+   // rest_test_symt_del() before the arena is deleted.
+   rest_test_symt_t *rest_test_symt_new_arena (const char *name,
+                                               rest_test_symt_t *parent,
+                                               size_t buckets,
+                                               rest_test_arena_t *arena);
+
+   // Returns a new table with the same name, parent, arena and entries as `symt`.
+   // The entries are not copied: the two tables share them until either one is
+   // written to, so forking a large table is cheap. Reference counts on the
+   // shared entries are not atomic, so a table and its forks belong to one
+   // thread. Delete the fork with rest_test_symt_del().
+   rest_test_symt_t *rest_test_symt_fork (const rest_test_symt_t *symt);
 
    // Deletes a symbol table returned from rest_test_symt_new()
    void rest_test_symt_del (rest_test_symt_t **symt);
@@ -33,10 +88,34 @@ extern "C" {
    // Sets the direct fields
    const char *rest_test_symt_set_name (rest_test_symt_t *symt, const char *name);
 
+   // Sets the hook that observes writes to this table, replacing any previous
+   // hook; NULL removes it. The hook must outlive the table or be removed first.
+   // Forks do not inherit the hook.
+   void rest_test_symt_set_hook (rest_test_symt_t *symt,
+                                 const struct rest_test_symt_hook_t *hook);
+
    // Dumps the symbol table to the specified file stream in a human readable
    // format. If `fout` is NULL then `stdout` is used.
    void rest_test_symt_dump (const rest_test_symt_t *symt, FILE *fout);
 
+   // Fills `stats` with the size and probe-length distribution of the table's
+   // own entries. Returns false if either argument is NULL.
+   bool rest_test_symt_stats (const rest_test_symt_t *symt, struct rest_test_symt_stats_t *stats);
+
+   // Prints the statistics above on one line, to `fout` or to `stdout` if NULL.
+   void rest_test_symt_dump_stats (const rest_test_symt_t *symt, FILE *fout);
+
+   // Calls `fn` with the id and value of each of the table's own entries, in no
+   // particular order, stopping early if `fn` returns false. The table must not
+   // be written to during the walk. Returns false if `fn` stopped the walk.
+   bool rest_test_symt_walk (const rest_test_symt_t *symt,
+                             bool (*fn) (void *ctx, size_t id,
+                                         const rest_test_token_t *token),
+                             void *ctx);
+
+   // Returns the number of the table's own entries.
+   size_t rest_test_symt_count (const rest_test_symt_t *symt);
+
    // Add a new entry to the specific symbol table. Any existing value with the same
    // symbol is removed. If an entry could not be added (for example, an
    // out-of-memory condition occurs), then false is returned. If the entry is added
@@ -44,17 +123,52 @@ extern "C" {
    bool rest_test_symt_add (rest_test_symt_t *symt,
                             const char *symbol, rest_test_token_t *token);
 
+   // Returns the id of `symbol`, interning it if necessary. Returns (size_t)-1
+   // on failure.
+   size_t rest_test_symt_id (const char *symbol);
+
+   // As rest_test_symt_add() and rest_test_symt_value(), with the symbol given
+   // by the id returned from rest_test_symt_id().
+   bool rest_test_symt_add_id (rest_test_symt_t *symt, size_t id, rest_test_token_t *token);
+   const rest_test_token_t *rest_test_symt_value_id (const rest_test_symt_t *symt, size_t id);
+
+   // Replaces the environment snapshot that lookups fall back to with the
+   // NAME=VALUE strings in `envp`, or with the current environment if `envp` is
+   // NULL. The first snapshot is taken from the environment on the first lookup,
+   // and later changes to the environment are not seen until this is called.
+   // Values are strings with the source "environment". Values previously
+   // returned from the old snapshot are freed, and this must not be called while
+   // another thread is looking symbols up. Returns false if the snapshot could
+   // not be taken, leaving the old one in place.
+   bool rest_test_symt_environment (const char *const *envp);
+
+   // Returns a number that changes whenever `symt`, one of its ancestors or the
+   // environment snapshot is written to, and with no other write, so that a
+   // result derived from lookups in `symt` can tell whether it is still current.
+   // Numbers from different tables are not comparable.
+   size_t rest_test_symt_version (const rest_test_symt_t *symt);
+
    // Removes a value from the symbol table.
    void rest_test_symt_clear (rest_test_symt_t *symt, const char *symbol);
 
    // Returns a value from the symbol table. If the symbol does not exist in the
    // specified table a recursive search of the ancestors is performed until a
-   // matching symbol is found or there are no more parents.
+   // matching symbol is found or there are no more parents. A symbol that no
+   // table in the chain holds is looked up in the environment snapshot.
    //
    // Returns the value of the symbol if the symbol exists, or NULL if the symbol
    // does not exist.
+   //
+   // The lookup fills the table's cache, so although `symt` is const, neither
+   // this nor rest_test_symt_value_id() may be called on the same table from two
+   // threads at once.
    const rest_test_token_t *rest_test_symt_value (const rest_test_symt_t *symt, const char *symbol);
 
+   // Returns the value of the symbol among the table's own entries only, or
+   // NULL if the table does not hold it, whatever its ancestors hold.
+   const rest_test_token_t *rest_test_symt_own_value (const rest_test_symt_t *symt,
+                                                      const char *symbol);
+
 #ifdef __cplusplus
 };
 #endif
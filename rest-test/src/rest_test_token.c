@@ -1,13 +1,27 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined (__AVX2__)
+#include <immintrin.h>
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "ds_str.h"
 
+#include "rest_test_arena.h"
 #include "rest_test_token.h"
 #include "rest_test_symt.h"
+#include "rest_test_intern.h"
 #include "rest_test.h"
 
 
@@ -18,11 +32,38 @@ do {\
 } while (0)
 
 
+// The bytes that token values are sliced from. A span is either a mapped file, a
+// buffer read from a stream, or a private copy of a single value (stored inline
+// and NUL-terminated). Spans are reference-counted and shared by every token
+// sliced from them, so duplicating a token never copies its value.
+//
+// The lexer owns the bytes of a writable span (a private copy-on-write mapping,
+// or a buffer it read), and terminates a value in place when the byte after it
+// is a delimiter that it has already consumed.
+struct span_t {
+   size_t   refcount;
+   rest_test_arena_t *pool;   // The arena that the span was allocated from
+   void    *mapping;
+   char    *buffer;
+   size_t   length;
+   bool     writable;
+   char     bytes[];
+};
+
 struct rest_test_token_t {
    enum rest_test_token_type_t type;
-   char *value;
-   char *source;
+   // The value is a slice of `span`. Slices of a private span are terminated,
+   // as are most that the lexer makes of a writable span. For any other, a
+   // terminated copy is made in `cstr` the first time that the value is asked
+   // for as a C string; the copy is the token's own, so a duplicate that
+   // shares the span makes its own.
+   struct span_t *span;
+   const char *value;
+   size_t length;
+   char *cstr;
+   const char *source;     // interned
    size_t line_no;
+   bool pooled;            // Allocated from an arena
 };
 
 static const struct {
@@ -62,377 +103,960 @@ enum rest_test_token_type_t rest_test_token_type_type (const char *s)
 
 
 
+/* *********************************************************************************
+ * Spans
+ */
+
+// Creates a private span with room for `length` bytes and a terminator. When
+// `arena` is not NULL the span is allocated from it.
+static struct span_t *span_new (rest_test_arena_t *arena, size_t length)
+{
+   struct span_t *ret = arena
+      ? rest_test_arena_alloc (arena, sizeof *ret + length + 1)
+      : malloc (sizeof *ret + length + 1);
+   if (!ret)
+      return NULL;
+
+   ret->refcount = 1;
+   ret->pool = arena;
+   ret->mapping = NULL;
+   ret->buffer = NULL;
+   ret->length = length;
+   ret->writable = false;
+   ret->bytes[length] = 0;
+   return ret;
+}
+
+// Creates a span over a mapping or a heap buffer, taking ownership of it.
+static struct span_t *span_wrap (void *mapping, char *buffer, size_t length)
+{
+   struct span_t *ret = malloc (sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   ret->refcount = 1;
+   ret->pool = NULL;
+   ret->mapping = mapping;
+   ret->buffer = buffer;
+   ret->length = length;
+   ret->writable = false;
+   return ret;
+}
+
+static struct span_t *span_ref (struct span_t *span)
+{
+   if (span)
+      span->refcount++;
+   return span;
+}
+
+static void span_unref (struct span_t **span)
+{
+   if (!span || !*span)
+      return;
+
+   if (--(*span)->refcount == 0) {
+      if ((*span)->mapping) {
+         munmap ((*span)->mapping, (*span)->length);
+      }
+      free ((*span)->buffer);
+      if (!(*span)->pool) {
+         free (*span);
+      }
+   }
+   *span = NULL;
+}
+
+static bool span_private (const struct span_t *span)
+{
+   return !span->mapping && !span->buffer;
+}
+
+static const char *span_data (const struct span_t *span)
+{
+   return span->mapping ? span->mapping
+        : span->buffer  ? span->buffer
+        : span->bytes;
+}
+
+// Maps the file into memory, returning a span over it. Empty and special files
+// cannot be mapped, for which NULL is returned with `*fd` left open; on other
+// errors `*fd` is closed. A writable span is a private mapping, so writes to it
+// copy the pages that they touch and never reach the file.
+static struct span_t *span_map (const char *filename, int *fd, bool writable)
+{
+   struct stat sb;
+
+   if ((*fd = open (filename, O_RDONLY)) < 0)
+      return NULL;
+
+   if ((fstat (*fd, &sb)) != 0 || !S_ISREG (sb.st_mode) || sb.st_size == 0)
+      return NULL;
+
+   void *mapping = mmap (NULL, (size_t)sb.st_size, PROT_READ | (writable ? PROT_WRITE : 0),
+                         MAP_PRIVATE, *fd, 0);
+   close (*fd);
+   *fd = -1;
+   if (mapping == MAP_FAILED) {
+      ERRORF ("Failed to map [%s]: %m\n", filename);
+      return NULL;
+   }
+   posix_madvise (mapping, (size_t)sb.st_size, POSIX_MADV_SEQUENTIAL);
+
+   struct span_t *span = span_wrap (mapping, NULL, (size_t)sb.st_size);
+   if (!span) {
+      munmap (mapping, (size_t)sb.st_size);
+   } else {
+      span->writable = writable;
+   }
+   return span;
+}
+
+
+
+
 void rest_test_token_del (rest_test_token_t **token)
 {
    if (!token || !*token)
       return;
 
-   free ((*token)->value);
-   free ((*token)->source);
-   free ((*token));
+   span_unref (&(*token)->span);
+   free ((*token)->cstr);
+   // Tokens allocated from an arena are released with the arena
+   if (!(*token)->pooled) {
+      free ((*token));
+   }
    *token = NULL;
 }
 
-rest_test_token_t *rest_test_token_new (enum rest_test_token_type_t type,
-                                        const char *value,
-                                        const char *source,
-                                        size_t line_no)
+// The `source` must already be interned: the lexer interns its source once, so
+// that producing a token never touches the process-wide table of sources.
+static rest_test_token_t *token_alloc (rest_test_arena_t *arena,
+                                       enum rest_test_token_type_t type,
+                                       const char *source,
+                                       size_t line_no)
 {
-   rest_test_token_t *ret = calloc (1, sizeof *ret);
-   if (!ret) {
+   rest_test_token_t *ret = arena
+      ? rest_test_arena_alloc (arena, sizeof *ret)
+      : calloc (1, sizeof *ret);
+   if (!ret)
       return NULL;
-   }
 
    ret->type = type;
+   ret->pooled = arena != NULL;
+   ret->source = source;
    ret->line_no = line_no;
-   ret->value = ds_str_dup (value);
-   ret->source = ds_str_dup (source);
+   return ret;
+}
 
-   if (!ret->value || !ret->source) {
-      rest_test_token_del (&ret);
+// Takes over the caller's reference to the private `span`, which is released
+// on failure.
+static rest_test_token_t *token_adopt (rest_test_arena_t *arena,
+                                       enum rest_test_token_type_t type,
+                                       struct span_t *span,
+                                       const char *source,
+                                       size_t line_no)
+{
+   rest_test_token_t *ret = token_alloc (arena, type, source, line_no);
+   if (!ret) {
+      span_unref (&span);
       return NULL;
    }
 
+   ret->span = span;
+   ret->value = span->bytes;
+   ret->length = span->length;
    return ret;
 }
 
-static int readchar (FILE *inf, size_t *line_no)
+// Creates a token whose value is the `length` bytes at `value`. When `span` is
+// not NULL the bytes belong to it, and the token references the span instead of
+// copying them.
+static rest_test_token_t *token_slice (rest_test_arena_t *arena,
+                                       enum rest_test_token_type_t type,
+                                       struct span_t *span,
+                                       const char *value, size_t length,
+                                       const char *source,
+                                       size_t line_no)
 {
-   int ret = fgetc (inf);
-   if (ret == '\n')
-      (*line_no) = (*line_no) + 1;
+   if (!span) {
+      struct span_t *copy = span_new (arena, length);
+      if (!copy)
+         return NULL;
+      memcpy (copy->bytes, value, length);
+      return token_adopt (arena, type, copy, source, line_no);
+   }
+
+   rest_test_token_t *ret = token_alloc (arena, type, source, line_no);
+   if (!ret)
+      return NULL;
 
+   ret->span = span_ref (span);
+   ret->value = value;
+   ret->length = length;
    return ret;
 }
 
-static int unreadchar (int c, FILE *inf, size_t *line_no)
+rest_test_token_t *rest_test_token_new (enum rest_test_token_type_t type,
+                                        const char *value,
+                                        const char *source,
+                                        size_t line_no)
 {
-   if (c == '\n')
-      (*line_no) = (*line_no) - 1;
+   const char *isource = rest_test_intern_source (source);
+   if (!value || !isource)
+      return NULL;
 
-   return ungetc (c, inf);
+   return token_slice (NULL, type, NULL, value, strlen (value), isource, line_no);
 }
 
-static char *read_directive (FILE *inf, size_t *line_no)
+/* *********************************************************************************
+ * The span lexer. lex_span() finds the boundaries of the next token by scanning
+ * the span, and only then builds the value with a single allocation at its final
+ * size.
+ *
+ * Leading whitespace and comments are always consumed, even when no token
+ * follows. When the span ends before the token does, and more input may still
+ * follow (`at_eof` is false), lex_INCOMPLETE is returned and `await` is set to the
+ * byte that must arrive before lexing again is worthwhile (or AWAIT_ANY).
+ */
+
+enum lex_status_t {
+   lex_TOKEN,
+   lex_EOF,
+   lex_ERROR,
+   lex_INCOMPLETE,
+};
+
+#define AWAIT_ANY       (-1)
+
+// Initial buffer size used by the stream wrappers; doubled as needed.
+#define LEX_CHUNK       (512)
+
+// A stream that is lexed one token at a time. Only the current token is held,
+// and the stream is read no further than the byte after its end, which is
+// pushed back. Runs of bytes up to the byte that the lexer awaits are read in
+// bulk from the stream's own buffer; other bytes are read singly.
+struct stream_t {
+   FILE    *inf;
+   char    *buffer;
+   size_t   size;
+   size_t   length;
+   char    *run;          // getdelim()'s buffer
+   size_t   run_size;
+};
+
+struct rest_test_lexer_t {
+   const char  *source;    // interned
+   const char  *data;
+   size_t       length;
+   size_t       offset;
+   size_t       line_no;
+
+   // The owner of `data`, which tokens are sliced from. When NULL the data
+   // belongs to the caller and tokens get their own copies of their values.
+   struct span_t *span;
+
+   // When not NULL, tokens are allocated from this arena
+   rest_test_arena_t *arena;
+
+   // When its stream is not NULL, tokens are read from it one at a time
+   // instead; its buffers are kept from one token to the next
+   struct stream_t stream;
+};
+
+/* *********************************************************************************
+ * Character classes. Every byte is classified with a single table lookup; bytes
+ * outside of ASCII belong to no class. Whitespace is that of the C locale.
+ */
+#define CC_SPACE        (1u << 0)
+#define CC_STOP         (1u << 1)   // Ends a run of ordinary string bytes
+#define CC_DIRECTIVE    (1u << 2)   // Continues a directive
+#define CC_SYMBOL       (1u << 3)   // Starts or continues a symbol or integer
+#define CC_DEC          (1u << 4)
+#define CC_OCT          (1u << 5)
+#define CC_HEX          (1u << 6)
+
+#define SPC    (CC_SPACE)
+#define STP    (CC_STOP)
+#define DIR    (CC_DIRECTIVE)
+#define SYM    (CC_SYMBOL)
+#define ALP    (CC_SYMBOL | CC_DIRECTIVE)
+#define HEX    (ALP | CC_HEX)
+#define DEC    (ALP | CC_DEC | CC_HEX)
+#define OCT    (DEC | CC_OCT)
+static const unsigned char cclass[256] = {
+   ['\t'] = SPC, ['\v'] = SPC, ['\f'] = SPC, ['\r'] = SPC, [' '] = SPC,
+   ['\n'] = SPC | STP,
+   ['\''] = STP, ['"'] = STP, ['`'] = STP, ['\\'] = STP,
+   ['.'] = DIR, ['-'] = DIR,
+   ['_'] = SYM | DIR,
+   ['0'] = OCT, ['1'] = OCT, ['2'] = OCT, ['3'] = OCT, ['4'] = OCT, ['5'] = OCT,
+   ['6'] = OCT, ['7'] = OCT,
+   ['8'] = DEC, ['9'] = DEC,
+   ['a'] = HEX, ['b'] = HEX, ['c'] = HEX, ['d'] = HEX, ['e'] = HEX, ['f'] = HEX,
+   ['A'] = HEX, ['B'] = HEX, ['C'] = HEX, ['D'] = HEX, ['E'] = HEX, ['F'] = HEX,
+   ['g'] = ALP, ['h'] = ALP, ['i'] = ALP, ['j'] = ALP, ['k'] = ALP, ['l'] = ALP,
+   ['m'] = ALP, ['n'] = ALP, ['o'] = ALP, ['p'] = ALP, ['q'] = ALP, ['r'] = ALP,
+   ['s'] = ALP, ['t'] = ALP, ['u'] = ALP, ['v'] = ALP, ['w'] = ALP, ['x'] = ALP,
+   ['y'] = ALP, ['z'] = ALP,
+   ['G'] = ALP, ['H'] = ALP, ['I'] = ALP, ['J'] = ALP, ['K'] = ALP, ['L'] = ALP,
+   ['M'] = ALP, ['N'] = ALP, ['O'] = ALP, ['P'] = ALP, ['Q'] = ALP, ['R'] = ALP,
+   ['S'] = ALP, ['T'] = ALP, ['U'] = ALP, ['V'] = ALP, ['W'] = ALP, ['X'] = ALP,
+   ['Y'] = ALP, ['Z'] = ALP,
+};
+#undef SPC
+#undef STP
+#undef DIR
+#undef SYM
+#undef ALP
+#undef HEX
+#undef DEC
+#undef OCT
+
+#define CCLASS(c, cc)      ((cclass[(unsigned char)(c)] & (cc)) != 0)
+
+// Returns the offset of the first byte at or after span[pos] that ends a run of
+// ordinary string bytes (a quote, backtick, backslash or newline), or `length`
+// when there is none. With SSE2 or AVX2 available the run is skipped a vector at
+// a time; the remaining bytes are classified with the table.
+static size_t skip_plain (const char *span, size_t length, size_t pos)
 {
-   char *ret = NULL;
-   int c;
+#if defined (__AVX2__)
+   const __m256i squote = _mm256_set1_epi8 ('\''),
+                 dquote = _mm256_set1_epi8 ('"'),
+                 bquote = _mm256_set1_epi8 ('`'),
+                 bslash = _mm256_set1_epi8 ('\\'),
+                 eol    = _mm256_set1_epi8 ('\n');
+   while (length - pos >= 32) {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)&span[pos]);
+      __m256i m = _mm256_or_si256 (
+                     _mm256_or_si256 (_mm256_cmpeq_epi8 (v, squote),
+                                      _mm256_cmpeq_epi8 (v, dquote)),
+                     _mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, bquote),
+                                                       _mm256_cmpeq_epi8 (v, bslash)),
+                                      _mm256_cmpeq_epi8 (v, eol)));
+      uint32_t mask = (uint32_t)_mm256_movemask_epi8 (m);
+      if (mask)
+         return pos + (size_t)__builtin_ctz (mask);
+      pos += 32;
+   }
+#elif defined (__SSE2__)
+   const __m128i squote = _mm_set1_epi8 ('\''),
+                 dquote = _mm_set1_epi8 ('"'),
+                 bquote = _mm_set1_epi8 ('`'),
+                 bslash = _mm_set1_epi8 ('\\'),
+                 eol    = _mm_set1_epi8 ('\n');
+   while (length - pos >= 16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)&span[pos]);
+      __m128i m = _mm_or_si128 (
+                     _mm_or_si128 (_mm_cmpeq_epi8 (v, squote),
+                                   _mm_cmpeq_epi8 (v, dquote)),
+                     _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, bquote),
+                                                 _mm_cmpeq_epi8 (v, bslash)),
+                                   _mm_cmpeq_epi8 (v, eol)));
+      uint32_t mask = (uint32_t)_mm_movemask_epi8 (m);
+      if (mask)
+         return pos + (size_t)__builtin_ctz (mask);
+      pos += 16;
+   }
+#endif
+   while (pos < length && !CCLASS (span[pos], CC_STOP))
+      pos++;
+   return pos;
+}
 
-   while ((c = readchar (inf, line_no)) != EOF) {
-      char tmp[2] = { (char)c, 0 };
-      if (c == '.' || c == '-' || c == '_' || isalnum (c)) {
-         if (!(ds_str_append (&ret, tmp, NULL))) {
-            ERRORF ("Failed to allocate directive\n");
-            free (ret);
-            return NULL;
-         }
-      } else {
-         unreadchar (c, inf, line_no);
-         break;
+// Finds the closing delimiter of the string whose opening delimiter is at
+// span[pos]. On success `end` is set to the offset of the closing delimiter,
+// `nescapes` to the number of escape characters and `nlines` to the number of
+// newlines within the string.
+static enum lex_status_t scan_string (const char *span, size_t length, size_t pos,
+                                      bool at_eof, size_t *end,
+                                      size_t *nescapes, size_t *nlines, int *await)
+{
+   char delim = span[pos];
+
+   *nescapes = 0;
+   *nlines = 0;
+   for (size_t i=pos + 1; (i = skip_plain (span, length, i)) < length; i++) {
+      if (span[i] == delim) {
+         *end = i;
+         return lex_TOKEN;
+      }
+      if (span[i] == '\\') {
+         if (++i == length)
+            break;
+         (*nescapes)++;
+      }
+      if (span[i] == '\n') {
+         (*nlines)++;
       }
    }
 
-   return ret;
+   if (at_eof)
+      return lex_ERROR;
+
+   *await = (unsigned char)delim;
+   return lex_INCOMPLETE;
 }
 
-static char *read_string (FILE *inf, size_t *line_no)
+// Copies the string contents in span[start..end) to dst, removing the escape
+// characters. Returns the position in dst after the last character copied.
+static char *copy_string (char *dst, const char *span, size_t start, size_t end)
 {
-   bool error = true;
-   int delim = readchar (inf, line_no); // Swallow the first '"' or '\'' character
-   char *ret = ds_str_dup ("");
-
-   if (!ret) {
-      CLEANUP ("Failed to allocate initial string\n");
+   while (start < end) {
+      const char *escape = memchr (&span[start], '\\', end - start);
+      size_t run = escape ? (size_t)(escape - &span[start]) : end - start;
+      memcpy (dst, &span[start], run);
+      dst += run;
+      start += run;
+      if (escape) {
+         *dst++ = span[start + 1];
+         start += 2;
+      }
    }
+   return dst;
+}
+
+// When `shared` is not NULL, `span` lies within it and token values that need no
+// unescaping are sliced from it rather than copied. When `arena` is not NULL the
+// token is allocated from it.
+static enum lex_status_t lex_span (const char *span, size_t length, bool at_eof,
+                                   struct span_t *shared, rest_test_arena_t *arena,
+                                   const char *source, size_t *line_no,
+                                   size_t *consumed, int *await,
+                                   rest_test_token_t **token)
+{
+   size_t lines = *line_no;
+   size_t pos = 0;
 
-   int c;
-   while ((c = readchar (inf, line_no)) != EOF) {
-      if (c == delim)
+   *token = NULL;
+   *consumed = 0;
+   *await = AWAIT_ANY;
+
+   // Skip whitespace and comments
+   while (pos < length) {
+      int c = (unsigned char)span[pos];
+      if (c == '#') {
+         const char *eol = memchr (&span[pos], '\n', length - pos);
+         if (!eol) {
+            if (!at_eof) {
+               *await = '\n';
+               return lex_INCOMPLETE;
+            }
+            pos = length;
+            break;
+         }
+         pos = (size_t)(eol - span);
+         continue;
+      }
+      if (!CCLASS (c, CC_SPACE))
          break;
+      if (c == '\n')
+         lines++;
+      pos++;
+   }
+
+   *consumed = pos;
+   *line_no = lines;
 
-      if (c == '\\') {
-         if ((c = readchar (inf, line_no)) == EOF) {
-            CLEANUP ("Unexpected EOF after escape character '\\'\n");
+   if (pos == length) {
+      return at_eof ? lex_EOF : lex_INCOMPLETE;
+   }
+
+   size_t start = pos;
+   int c = (unsigned char)span[pos];
+   enum rest_test_token_type_t type = token_UNKNOWN;
+   size_t vstart = pos;
+   size_t vlen = 0;
+
+   if (c == '\'' || c == '"' || c == '`') {
+      // First pass: find the end of the (possibly concatenated) string and the
+      // final length of the value.
+      type = c == '`' ? token_SHELLCMD : token_STRING;
+      size_t total = 0;
+      size_t npieces = 0;
+      size_t end = 0;
+      bool escaped = false;
+      for (;;) {
+         size_t nescapes, nlines;
+         enum lex_status_t rc = scan_string (span, length, pos, at_eof,
+                                             &end, &nescapes, &nlines, await);
+         if (rc == lex_INCOMPLETE)
+            return rc;
+         if (rc == lex_ERROR) {
+            ERRORF ("[%s:%zu] Unterminated string\n", source, lines);
+            return lex_ERROR;
+         }
+         total += end - pos - 1 - nescapes;
+         lines += nlines;
+         escaped = escaped || nescapes;
+         npieces++;
+         vstart = pos + 1;
+         pos = end + 1;
+
+         // Only adjacent double-quoted and backticked strings are concatenated
+         if (c == '\'')
+            break;
+
+         while (pos < length && CCLASS (span[pos], CC_SPACE)) {
+            if (span[pos] == '\n')
+               lines++;
+            pos++;
          }
+         if (pos == length && !at_eof)
+            return lex_INCOMPLETE;
+         if (pos == length || span[pos] != c)
+            break;
       }
-      char tmp[2] = { (char)c, 0 };
-      if (!(ds_str_append (&ret, tmp, NULL))) {
-         CLEANUP ("Failed to allocate string\n");
+
+      if (npieces == 1 && !escaped) {
+         // The value is exactly the bytes between the delimiters
+         vlen = end - vstart;
+      } else {
+         // Second pass: copy the contents of each string into a value of the
+         // final size.
+         struct span_t *value = span_new (arena, total);
+         if (!value) {
+            ERRORF ("[%s:%zu] Failed to allocate string\n", source, lines);
+            return lex_ERROR;
+         }
+         char *dst = value->bytes;
+         size_t i = start;
+         while (i < pos) {
+            size_t nescapes, nlines;
+            scan_string (span, length, i, true, &end, &nescapes, &nlines, await);
+            dst = copy_string (dst, span, i + 1, end);
+            i = end + 1;
+            while (i < pos && CCLASS (span[i], CC_SPACE))
+               i++;
+         }
+         if (!(*token = token_adopt (arena, type, value, source, lines))) {
+            ERRORF ("[%s:%zu] OOM allocating token\n", source, lines);
+            return lex_ERROR;
+         }
+      }
+   } else {
+      if (c == ';') {
+         type = token_ASSERT_END;
+         vlen = 1;
+         pos++;
+      } else if (c == '.') {
+         type = token_DIRECTIVE;
+         while (pos < length && CCLASS (span[pos], CC_DIRECTIVE))
+            pos++;
+         if (pos == length && !at_eof)
+            return lex_INCOMPLETE;
+         vlen = pos - vstart;
+      } else if (CCLASS (c, CC_SYMBOL)) {
+         // Integers and symbols both end at whitespace, which is consumed
+         int base = 0;
+         if (CCLASS (c, CC_DEC)) {
+            type = token_INTEGER;
+            base = 10;
+            if (c == '0') {
+               base = 8;
+               pos++;
+               if (pos < length && (span[pos] == 'x' || span[pos] == 'X')) {
+                  base = 16;
+                  pos++;
+               }
+            }
+         } else {
+            type = token_SYMBOL;
+         }
+
+         unsigned valid = base == 16 ? CC_HEX
+                        : base == 8  ? CC_OCT
+                        : base == 10 ? CC_DEC
+                        : CC_SYMBOL;
+         int ch;
+         for (; pos < length && !CCLASS (ch = (unsigned char)span[pos], CC_SPACE); pos++) {
+            if (!CCLASS (ch, valid)) {
+               ERRORF ("[%s:%zu] Unexpected character in %s: '%c'\n",
+                        source, lines, rest_test_token_type_string (type), ch);
+               return lex_ERROR;
+            }
+         }
+         if (pos == length && !at_eof)
+            return lex_INCOMPLETE;
+         vlen = pos - vstart;
+         if (pos < length) {
+            if (span[pos] == '\n')
+               lines++;
+            pos++;
+         }
+      } else {
+         ERRORF ("Unexpected character encountered in [%s:%zu]: '%c'\n",
+                  source, lines, c);
+         return lex_ERROR;
       }
-   }
 
-   if (c != delim) {
-      CLEANUP ("Unterminated string\n");
    }
 
-   error = false;
-cleanup:
-   if (error) {
-      free (ret);
-      ret = NULL;
+   if (!*token) {
+      if (!(*token = token_slice (arena, type, shared, &span[vstart], vlen,
+                                  source, lines))) {
+         ERRORF ("[%s:%zu] OOM allocating token\n", source, lines);
+         return lex_ERROR;
+      }
+      // The closing delimiter of a string, or the whitespace after a symbol or
+      // integer, has been consumed and is never read again, so it can become
+      // the value's terminator
+      if (shared && shared->writable && vstart + vlen < pos)
+         ((char *)span)[vstart + vlen] = 0;
    }
 
-   return ret;
+   *consumed = pos;
+   *line_no = lines;
+   return lex_TOKEN;
 }
 
-static bool isodigit (int c)
+static bool buffer_reserve (char **buffer, size_t *size, size_t needed)
 {
-   static const char *odigits = "01234567";
-   return strchr (odigits, c) == NULL ? false : true;
+   if (needed <= *size)
+      return true;
+
+   size_t newsize = *size ? *size : LEX_CHUNK;
+   while (newsize < needed)
+      newsize *= 2;
+
+   char *tmp = realloc (*buffer, newsize);
+   if (!tmp)
+      return false;
+
+   *buffer = tmp;
+   *size = newsize;
+   return true;
 }
 
-static char *read_octhex (FILE *inf, size_t *line_no)
+static void stream_clear (struct stream_t *stream)
 {
-   bool error = true;
-   int c = readchar (inf, line_no);
-   char *ret = NULL;
-   char tmp[2] = { (char)c, 0 };
-   bool ishex = false;
+   free (stream->buffer);
+   free (stream->run);
+   stream->buffer = stream->run = NULL;
+   stream->size = stream->run_size = stream->length = 0;
+}
 
-   if (!(ds_str_append (&ret, tmp, NULL))) {
-      CLEANUP ("Failed to allocate initial digit for integer\n");
+// Appends the bytes up to and including the next `await` byte, or the next
+// byte when the lexer will take any. Returns the number of bytes appended, 0
+// at EOF or -1 on error.
+static ssize_t stream_read (struct stream_t *stream, int await,
+                            const char *source, size_t line_no)
+{
+   const char *data;
+   ssize_t n;
+   char c;
+
+   if (await == AWAIT_ANY) {
+      int ch = getc (stream->inf);
+      c = (char)ch;
+      data = &c;
+      n = ch == EOF ? -1 : 1;
+   } else {
+      n = getdelim (&stream->run, &stream->run_size, await, stream->inf);
+      data = stream->run;
    }
-   if ((c = readchar (inf, line_no)) == EOF) {
-      return ret;
+   if (n < 0) {
+      if (!(ferror (stream->inf)))
+         return 0;
+      ERRORF ("Error reading [%s:%zu]: %m\n", source, line_no);
+      return -1;
    }
-   if (c  == 'x' || c  == 'X') {
-      ishex = true;
+
+   if (!(buffer_reserve (&stream->buffer, &stream->size, stream->length + (size_t)n))) {
+      ERRORF ("[%s:%zu] OOM reading stream\n", source, line_no);
+      return -1;
    }
-   tmp[0] = (char)c;
-   if (!(ds_str_append (&ret, tmp, NULL))) {
-      CLEANUP ("Failed to allocate second digit for integer\n");
+   memcpy (&stream->buffer[stream->length], data, (size_t)n);
+   stream->length += (size_t)n;
+   return n;
+}
+
+// Whether lexing the token again, after it last needed more input, can give
+// another result: not when the delimiter just read is escaped, and not when the
+// byte just read continues a run of whitespace, or of a symbol or directive,
+// which the lexer would still need the end of. Without this, each escaped quote
+// in a string would lex the string again from its start.
+static bool stream_relex (const struct stream_t *stream, int await)
+{
+   const char *buffer = stream->buffer;
+   size_t last = stream->length - 1;
+   if (await == '\n')
+      return true;
+   if (await != AWAIT_ANY) {
+      // The delimiter is escaped by an odd number of backslashes before it
+      size_t i = last;
+      while (i > 0 && buffer[i - 1] == '\\')
+         i--;
+      return buffer[last] != await || (last - i) % 2 == 0;
    }
+   if (!last)
+      return true;
+   return !(CCLASS (buffer[last], CC_SPACE) && CCLASS (buffer[last - 1], CC_SPACE))
+       && !(CCLASS (buffer[last], CC_SYMBOL | CC_DIRECTIVE)
+            && CCLASS (buffer[last - 1], CC_SYMBOL | CC_DIRECTIVE));
+}
 
-   while ((c = readchar (inf, line_no)) != EOF) {
-      if (isspace (c)) {
-         break;
-      }
-      if (ishex && !(isxdigit (c))) {
-         CLEANUP ("Unexpected xdigit '%c'\n", c);
-      }
-      if (!ishex && !(isodigit (c))) {
-         CLEANUP ("Unexpected odigit '%c'\n", c);
-      }
-      tmp[0] = (char)c;
-      if (!(ds_str_append (&ret, tmp, NULL))) {
-         CLEANUP ("Failed to allocate string for oct-or-hex '%c'\n", c);
+static rest_test_token_t *stream_next (struct stream_t *stream,
+                                       const char *source, size_t *line_no)
+{
+   rest_test_token_t *ret = NULL;
+   enum lex_status_t status = lex_INCOMPLETE;
+   size_t consumed = 0;
+   int await = AWAIT_ANY;
+   bool at_eof = false;
+
+   stream->length = 0;
+   while (status == lex_INCOMPLETE) {
+      ssize_t n = stream_read (stream, await, source, *line_no);
+      if (n < 0)
+         return NULL;
+      at_eof = n == 0;
+      if (!at_eof && !(stream_relex (stream, await)))
+         continue;
+      status = lex_span (stream->buffer, stream->length, at_eof, NULL, NULL,
+                         source, line_no, &consumed, &await, &ret);
+      // Whatever was skipped need not be lexed again
+      if (status == lex_INCOMPLETE && consumed) {
+         memmove (stream->buffer, &stream->buffer[consumed], stream->length - consumed);
+         stream->length -= consumed;
       }
    }
 
-   error = false;
-cleanup:
-   if (error) {
-      free (ret);
-      ret = NULL;
+   if (status == lex_TOKEN && consumed < stream->length) {
+      ungetc ((unsigned char)stream->buffer[consumed], stream->inf);
    }
+   return ret;
+}
 
+static rest_test_token_t *token_next (FILE *inf, const char *source, size_t *line_no)
+{
+   struct stream_t stream = { .inf = inf };
+   rest_test_token_t *ret = stream_next (&stream, source, line_no);
+   stream_clear (&stream);
    return ret;
 }
 
-static char *read_integer (FILE *inf, size_t *line_no)
+rest_test_token_t *rest_test_token_next (FILE *inf,
+                                         const char *source,
+                                         size_t *line_no)
 {
-   bool error = true;
-   char *ret = NULL;
-   int c;
+   const char *isource = rest_test_intern_source (source);
+   if (!inf || !line_no || !isource)
+      return NULL;
+
+   return token_next (inf, isource, line_no);
+}
 
-   while ((c = readchar (inf, line_no)) != EOF) {
-      char tmp[2] = { (char)c, 0 };
-      if (isspace (c)) {
-         break;
-      }
-      if (!(isdigit (c))) {
-         CLEANUP ("Unexpected digit '%c'\n", c);
-      }
-      if (!(ds_str_append (&ret, tmp, NULL))) {
-         CLEANUP ("Failed to allocate string for integer\n");
-      }
-   }
 
-   error = false;
-cleanup:
-   if (error) {
+/* *********************************************************************************
+ * Lexer objects
+ */
+
+static rest_test_lexer_t *lexer_alloc (const char *source)
+{
+   rest_test_lexer_t *ret = calloc (1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   if (!(ret->source = rest_test_intern_source (source))) {
       free (ret);
-      ret = NULL;
+      return NULL;
    }
 
+   ret->line_no = 1;
+   return ret;
+}
+
+rest_test_lexer_t *rest_test_lexer_new (const char *buffer, size_t length,
+                                        const char *source)
+{
+   rest_test_lexer_t *ret = lexer_alloc (source);
+   if (!ret)
+      return NULL;
+
+   ret->data = buffer;
+   ret->length = buffer ? length : 0;
    return ret;
 }
 
-static char *read_symbol (FILE *inf, size_t *line_no)
+rest_test_lexer_t *rest_test_lexer_new_file (const char *filename)
 {
-   bool error = true;
-   char *ret = NULL;
-   int c;
+   rest_test_lexer_t *ret = NULL;
+   int fd = -1;
 
-   while ((c = readchar (inf, line_no)) != EOF) {
-      char tmp[2] = { (char)c, 0 };
-      if (isspace (c)) {
-         break;
-      }
-      if (isalnum (c) || c == '_') {
-         if (!(ds_str_append (&ret, tmp, NULL))) {
-            CLEANUP ("Failed to allocate string for symbol\n");
-         }
-      } else {
-         CLEANUP ("Unexpected character in symbol '%c'\n", c);
+   struct span_t *span = span_map (filename, &fd, true);
+   if (!span && fd < 0)
+      return NULL;
+
+   // Empty files and special files cannot be mapped, so they are read instead
+   if (!span) {
+      FILE *inf = fdopen (fd, "r");
+      if (!inf) {
+         close (fd);
+         return NULL;
       }
+      ret = rest_test_lexer_new_stream (inf, filename);
+      fclose (inf);
+      return ret;
    }
 
-   error = false;
-cleanup:
-   if (error) {
-      free (ret);
-      ret = NULL;
+   if (!(ret = lexer_alloc (filename))) {
+      span_unref (&span);
+      return NULL;
    }
 
+   ret->span = span;
+   ret->data = span->mapping;
+   ret->length = span->length;
    return ret;
 }
 
-
-rest_test_token_t *rest_test_token_next (FILE *inf,
-                                         const char *source,
-                                         size_t *line_no)
+rest_test_lexer_t *rest_test_lexer_new_stream (FILE *inf, const char *source)
 {
-   bool error = true;
-   int c;
-   rest_test_token_t *ret = NULL;
-   enum rest_test_token_type_t type = token_UNKNOWN;
-   char *value = NULL;
-
-   while ((c = readchar (inf, line_no)) != EOF) {
-      if (isspace (c)) {
-         continue;
-      }
+   char *buffer = NULL;
+   size_t size = 0, length = 0;
 
-      unreadchar (c, inf, line_no);
+   if (!inf)
+      return NULL;
 
-      if (c == '#') {
-         do {
-            c = readchar (inf, line_no);
-         } while (c != EOF && c != '\n');
-         continue;
+   while (!feof (inf)) {
+      if (!(buffer_reserve (&buffer, &size, length + LEX_CHUNK))) {
+         ERRORF ("[%s] OOM reading stream\n", source);
+         free (buffer);
+         return NULL;
+      }
+      length += fread (&buffer[length], 1, size - length, inf);
+      if (ferror (inf)) {
+         ERRORF ("Error reading [%s]: %m\n", source);
+         free (buffer);
+         return NULL;
       }
+   }
 
+   struct span_t *span = span_wrap (NULL, buffer, length);
+   if (!span) {
+      free (buffer);
+      return NULL;
+   }
+   span->writable = true;
 
-      if (c == ';') {
-         char tmp[2] = { ';', 0 };
-         type = token_ASSERT_END;
-         if (!(value = ds_str_dup (tmp))) {
-            CLEANUP ("[%s:%zu] Failed to read assert-end\n", source, *line_no);
-         }
+   rest_test_lexer_t *ret = lexer_alloc (source);
+   if (!ret) {
+      span_unref (&span);
+      return NULL;
+   }
 
-      }
+   ret->span = span;
+   ret->data = buffer;
+   ret->length = length;
+   return ret;
+}
 
-      if (c == '.') {
-         type = token_DIRECTIVE;
-         if (!(value = read_directive (inf, line_no))) {
-            CLEANUP ("[%s:%zu] Failed to read directive\n", source, *line_no);
-         }
-         break;
-      }
+void rest_test_lexer_del (rest_test_lexer_t **lexer)
+{
+   if (!lexer || !*lexer)
+      return;
 
-      if (c == '\'') {
-         type = token_STRING;
-         if (!(value = read_string (inf, line_no))) {
-            CLEANUP ("[%s:%zu] Failed to read string\n", source, *line_no);
-         }
-         // ERRORF ("Returning [%s:%s]\n", rest_test_token_type_string (type), value);
-         break;
-      }
+   // Tokens sliced from the span keep it alive after the lexer is gone
+   span_unref (&(*lexer)->span);
+   stream_clear (&(*lexer)->stream);
+   free (*lexer);
+   *lexer = NULL;
+}
 
-      if (c == '"' || c =='`') {
-         int delim = c;
-         value = NULL;
-         type = delim == '"' ? token_STRING : token_SHELLCMD;
-         while (c == delim) {
-            char *tmp = read_string (inf, line_no);
-            if (!tmp) {
-               CLEANUP ("[%s:%zu] Failed to read string\n", source, *line_no);
-            }
-            if (!(ds_str_append (&value, tmp, NULL))) {
-               free (tmp);
-               CLEANUP ("[%s:%zu] Failed to append string\n", source, *line_no);
-            }
-            free (tmp);
-            while ((c = readchar (inf, line_no)) != EOF) {
-               if (isspace (c)) {
-                  continue;
-               }
-               break;
-            }
-            unreadchar (c, inf, line_no);
-         }
-         // ERRORF ("Returning [%s:%s]\n", rest_test_token_type_string (type), value);
-         break;
-      }
+rest_test_lexer_t *rest_test_lexer_new_incremental (FILE *inf, const char *source)
+{
+   if (!inf)
+      return NULL;
 
-      if (c == '0') {
-         type = token_INTEGER;
-         if (!(value = read_octhex (inf, line_no))) {
-            CLEANUP ("[%s:%zu] Failed to read octhex\n", source, *line_no);
-         }
-         break;
-      }
+   rest_test_lexer_t *ret = lexer_alloc (source);
+   if (ret)
+      ret->stream.inf = inf;
+   return ret;
+}
 
-      if (isdigit (c)) {
-         type = token_INTEGER;
-         if (!(value = read_integer (inf, line_no))) {
-            CLEANUP ("[%s:%zu] Failed to read integer\n", source, *line_no);
-         }
-         break;
-      }
+rest_test_token_t *rest_test_lexer_next (rest_test_lexer_t *lexer)
+{
+   if (!lexer)
+      return NULL;
 
-      if (isalpha (c) || c == '_') {
-         type = token_SYMBOL;
-         if (!(value = read_symbol (inf, line_no))) {
-            CLEANUP ("[%s:%zu] Failed to read symbol\n", source, *line_no);
-         }
-         break;
-      }
+   if (lexer->stream.inf)
+      return stream_next (&lexer->stream, lexer->source, &lexer->line_no);
 
-      CLEANUP ("Unexpected character encountered in [%s:%zu]: '%c'\n",
-               source, *line_no, c);
+   rest_test_token_t *ret = NULL;
+   size_t consumed = 0;
+   int await;
+   enum lex_status_t status = lex_span (&lexer->data[lexer->offset],
+                                        lexer->length - lexer->offset,
+                                        true, lexer->span, lexer->arena,
+                                        lexer->source, &lexer->line_no,
+                                        &consumed, &await, &ret);
+   lexer->offset += consumed;
+   if (status == lex_ERROR) {
+      // Stop at the first error
+      lexer->offset = lexer->length;
    }
 
-   if (ferror (inf)) {
-      CLEANUP ("Error reading [%s:%zu]: %m\n", source, *line_no);
-   }
+   return ret;
+}
 
-   if (value) {
-      ret = rest_test_token_new (type, value, source, *line_no);
-   }
+void rest_test_lexer_set_arena (rest_test_lexer_t *lexer, rest_test_arena_t *arena)
+{
+   if (lexer)
+      lexer->arena = arena;
+}
 
-   error = false;
-cleanup:
-   free (value);
-   if (error) {
-      rest_test_token_del (&ret);
-   }
+const char *rest_test_lexer_source (const rest_test_lexer_t *lexer)
+{
+   return lexer ? lexer->source : NULL;
+}
 
-   return ret;
+size_t rest_test_lexer_line_no (const rest_test_lexer_t *lexer)
+{
+   return lexer ? lexer->line_no : (size_t)-1;
 }
 
 rest_test_token_t *rest_test_token_dup (const rest_test_token_t *src)
 {
-   return src
-      ? rest_test_token_new (src->type, src->value, src->source, src->line_no)
-      : NULL;
+   return rest_test_token_dup_arena (src, NULL);
+}
+
+rest_test_token_t *rest_test_token_dup_arena (const rest_test_token_t *src,
+                                              rest_test_arena_t *arena)
+{
+   if (!src)
+      return NULL;
+
+   // The copy shares the span of the source, so the value is never copied;
+   // unless the span belongs to an arena that may not live as long as the copy.
+   struct span_t *span = src->span;
+   if (span && span->pool && span->pool != arena)
+      span = NULL;
+   return token_slice (arena, src->type, span, src->value, src->length,
+                       src->source, src->line_no);
+}
+
+// Replaces the value of the token with a private span. Changed values are never
+// allocated from an arena, as the arena would keep every previous value.
+static void token_replace (rest_test_token_t *token, struct span_t *span)
+{
+   span_unref (&token->span);
+   free (token->cstr);
+   token->cstr = NULL;
+   token->span = span;
+   token->value = span->bytes;
+   token->length = span->length;
 }
 
 bool rest_test_token_append (rest_test_token_t *existing, const rest_test_token_t *new)
 {
-   const char *curstr = existing->value ? existing->value : "";
-   const char *newstr = new->value ? new->value : "";
-   size_t cursize = existing->value ? strlen (existing->value) : 0;
-   size_t newsize = new->value ? strlen (new->value) : 0;
-   size_t size = cursize + newsize + 1;
-   char *newval = malloc (size);
-   if (!newval)
+   struct span_t *span = span_new (NULL, existing->length + new->length);
+   if (!span)
       return false;
-   strcpy (newval, curstr);
-   strcat (newval, newstr);
-   free (existing->value);
-   existing->value = newval;
+   memcpy (span->bytes, existing->value, existing->length);
+   memcpy (&span->bytes[existing->length], new->value, new->length);
+   token_replace (existing, span);
    return true;
 }
 
@@ -444,6 +1068,67 @@ enum rest_test_token_type_t rest_test_token_type (const rest_test_token_t *token
 
 const char *rest_test_token_value (const rest_test_token_t *token)
 {
+   if (!token)
+      return NULL;
+
+   if (span_private (token->span))
+      return token->value;
+
+   // Slices that are already followed by a terminator need no copy
+   const char *end = span_data (token->span) + token->span->length;
+   if (token->value + token->length < end && token->value[token->length] == 0)
+      return token->value;
+
+   // Making the terminated copy does not change the value, so the token is still
+   // logically const.
+   if (!token->cstr) {
+      rest_test_token_t *writable = (rest_test_token_t *)token;
+      if (!(writable->cstr = malloc (token->length + 1))) {
+         ERRORF ("[%s:%zu] OOM error terminating value\n", token->source, token->line_no);
+         return NULL;
+      }
+      memcpy (writable->cstr, token->value, token->length);
+      writable->cstr[token->length] = 0;
+   }
+
+   return token->cstr;
+}
+
+rest_test_token_t *rest_test_token_map (const char *filename)
+{
+   int fd = -1;
+   struct span_t *span = span_map (filename, &fd, false);
+   if (!span) {
+      if (fd >= 0) {
+         ERRORF ("Cannot map [%s]: empty or not a regular file\n", filename);
+         close (fd);
+      }
+      return NULL;
+   }
+   const char *isource = rest_test_intern_source (filename);
+   rest_test_token_t *ret = isource
+      ? token_slice (NULL, token_STRING, span, span_data (span), span->length, isource, 1)
+      : NULL;
+   span_unref (&span);
+   return ret;
+}
+
+rest_test_token_t *rest_test_token_subslice (const rest_test_token_t *src,
+                                             enum rest_test_token_type_t type,
+                                             size_t offset, size_t length,
+                                             const char *source, size_t line_no)
+{
+   const char *isource = rest_test_intern_source (source);
+   if (!src || !isource || offset > src->length || length > src->length - offset)
+      return NULL;
+   return token_slice (NULL, type, src->span, &src->value[offset], length,
+                       isource, line_no);
+}
+
+const char *rest_test_token_slice (const rest_test_token_t *token, size_t *length)
+{
+   if (length)
+      *length = token ? token->length : 0;
    return token ? token->value : NULL;
 }
 
@@ -461,17 +1146,15 @@ bool rest_test_token_set_value (rest_test_token_t *token, const char *value)
 {
    if (!token || !value)
       return false;
-   char *tmp = ds_str_dup (value);
-   if (!tmp) {
+   size_t length = strlen (value);
+   struct span_t *span = span_new (NULL, length);
+   if (!span) {
       ERRORF ("[%s:%zu] OOM error allocating new value [%s] for token [%s]\n",
-               token->source, token->line_no, value, token->value);
+               token->source, token->line_no, value, rest_test_token_value (token));
       return false;
    }
-   free (token->value);
-   token->value = tmp;
+   memcpy (span->bytes, value, length);
+   token_replace (token, span);
    return true;
 }
 
-
-
-
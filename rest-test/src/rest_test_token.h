@@ -15,6 +15,14 @@ enum rest_test_token_type_t {
 
 typedef struct rest_test_token_t rest_test_token_t;
 
+/* *****************************************************************************
+ * The lexer works over a span of memory: a file is mapped in with mmap(), a
+ * stream is read into a buffer in bulk and a caller-supplied buffer is used
+ * as-is. Token boundaries are found by scanning the span, and each token value
+ * is allocated exactly once at its final size.
+ */
+typedef struct rest_test_lexer_t rest_test_lexer_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -28,16 +36,70 @@ extern "C" {
                                            size_t line_no);
    void rest_test_token_del (rest_test_token_t **token);
 
+   // Reads the next token from the stream. This is a wrapper around the span
+   // lexer: the stream is read no further than the byte after the token, which
+   // is returned to it, so it can be seekable or not. String contents are read
+   // in bulk, up to each delimiter, from the stream's own buffer.
+   // Returns NULL on EOF or error.
    rest_test_token_t *rest_test_token_next (FILE *inf,
                                             const char *source,
                                             size_t *line_no);
 
+   // Create a lexer over the caller's buffer. The buffer is not copied and must
+   // remain valid until the lexer is deleted. It need not be NUL-terminated.
+   rest_test_lexer_t *rest_test_lexer_new (const char *buffer, size_t length,
+                                           const char *source);
+   // Create a lexer over the contents of a file, mapped into memory.
+   rest_test_lexer_t *rest_test_lexer_new_file (const char *filename);
+   // Create a lexer over the remaining contents of a stream, read in bulk.
+   rest_test_lexer_t *rest_test_lexer_new_stream (FILE *inf, const char *source);
+   // Create a lexer that reads the stream one token at a time, so that only the
+   // current token is held in memory. The stream must remain open until the
+   // lexer is deleted. Tokens are never allocated from an arena.
+   rest_test_lexer_t *rest_test_lexer_new_incremental (FILE *inf, const char *source);
+   void rest_test_lexer_del (rest_test_lexer_t **lexer);
+
+   // Allocate all further tokens from the arena. Tokens allocated from an arena
+   // may still be passed to rest_test_token_del(), which then only releases the
+   // resources that the arena does not own.
+   void rest_test_lexer_set_arena (rest_test_lexer_t *lexer, rest_test_arena_t *arena);
+
+   // Returns the next token in the span, or NULL on EOF or error.
+   rest_test_token_t *rest_test_lexer_next (rest_test_lexer_t *lexer);
+
+   const char *rest_test_lexer_source (const rest_test_lexer_t *lexer);
+   size_t rest_test_lexer_line_no (const rest_test_lexer_t *lexer);
+
+   // Tokens share their values; a duplicate only gets its own copy of the value
+   // when the value is changed.
    rest_test_token_t *rest_test_token_dup (const rest_test_token_t *src);
+   // As rest_test_token_dup(), but the copy is allocated from the arena.
+   rest_test_token_t *rest_test_token_dup_arena (const rest_test_token_t *src,
+                                                 rest_test_arena_t *arena);
 
    bool rest_test_token_append (rest_test_token_t *existing, const rest_test_token_t *new);
 
    enum rest_test_token_type_t rest_test_token_type (const rest_test_token_t *token);
+   // Returns the value as a NUL-terminated string. The lexer terminates most
+   // values that it slices from a file in place. Any other slice is copied on
+   // first use, into the token, so that this call modifies a const token and
+   // two threads must not make it on the same token at once; each duplicate
+   // makes its own copy. rest_test_token_slice() reads the value in place.
    const char *rest_test_token_value (const rest_test_token_t *token);
+   // Returns the value without copying it. The value is NOT necessarily
+   // NUL-terminated; its length is returned in `length`.
+   const char *rest_test_token_slice (const rest_test_token_t *token, size_t *length);
+   // Maps the file into memory and returns a token whose value is the entire
+   // contents of the file. Returns NULL if the file cannot be mapped.
+   rest_test_token_t *rest_test_token_map (const char *filename);
+   // Returns a token whose value is the `length` bytes at `offset` in the value of
+   // `src`. The value is shared, not copied. Returns NULL if the range does not lie
+   // within the value of `src`.
+   rest_test_token_t *rest_test_token_subslice (const rest_test_token_t *src,
+                                                enum rest_test_token_type_t type,
+                                                size_t offset, size_t length,
+                                                const char *source, size_t line_no);
+
    const char *rest_test_token_source (const rest_test_token_t *token);
    size_t rest_test_token_line_no (const rest_test_token_t *token);
 